@@ -0,0 +1,533 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 MNX Cloud, Inc.
+ */
+
+/*
+ * Request latency histograms from haproxy's access log.
+ *
+ * haproxy logs every request, in the JSON format generated by
+ * lib/lb_manager.js, to rsyslog over UDP syslog. The per-request timers in
+ * those lines never make it into the metrics: the stats socket only has
+ * averages over the last 1024 requests. With the access log sink enabled, we
+ * add a second "log" target to the haproxy configuration pointing at a UDP
+ * socket of our own (rsyslog still gets every line, so nothing changes on
+ * disk), and turn each line into observations in Prometheus histograms:
+ *
+ *   - loadbalancer_request_duration_seconds{backend, route, code}, the total
+ *     time (%Ta), with the route being the second component of the path
+ *     (e.g. "stor" in /:login/stor/...) and the code the status class
+ *   - loadbalancer_request_phase_duration_seconds{backend, phase}, the time
+ *     spent queued (%Tw), connecting (%Tc) and waiting for the response
+ *     headers (%Tr)
+ *   - loadbalancer_request_queue_duration_seconds{backend, class}, the time
+ *     spent queued by priority class, with request priorities (see
+ *     priorityLines() in lib/lb_manager.js)
+ *
+ * With access log sampling (see logSamplingLines() in lib/lb_manager.js), each
+ * line carries the number of requests it stands for in "sample_rate", and is
+ * observed with that weight.
+ *
+ * We see a lot of these lines, so parseLine() picks the fields it needs out of
+ * the datagram without decoding or JSON-parsing the whole thing, relying on
+ * the field order of the generated format. Lines it doesn't recognize are
+ * JSON-parsed instead.
+ *
+ * haproxy also sends its own messages (such as server state changes) to the
+ * same targets. Those are emitted as 'message' events, with the datagram.
+ *
+ * node v6 can't bind unix datagram sockets, so we listen on UDP on the
+ * loopback address.
+ *
+ *   +---------+  listening  +-----------+
+ *   | binding | ----------> | listening |
+ *   +---------+             +-----------+
+ *     ^    |                      |
+ *     |    | error                | error
+ *     |    v                      |
+ *   +-------+                     |
+ *   | error | <-------------------+
+ *   +-------+
+ *     timeout (RETRY_TIMEOUT)
+ */
+
+/*jsl:ignore*/
+'use strict';
+/*jsl:end*/
+
+const mod_assert = require('assert-plus');
+const mod_dgram = require('dgram');
+const mod_jsprim = require('jsprim');
+const mod_util = require('util');
+const FSM = require('mooremachine').FSM;
+
+const LOOPBACK = '127.0.0.1';
+const RETRY_TIMEOUT = 5000;
+
+const DEFAULTS = {
+    port: 10514,
+    /* seconds */
+    buckets: [ 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30,
+        60, 120 ]
+};
+
+/*
+ * The second component of Manta paths (/:login/<route>/...) that we keep as a
+ * label; anything else is "other".
+ */
+const ROUTES = [ 'stor', 'public', 'jobs', 'reports', 'uploads', 'buckets' ];
+const PHASES = [ 'queue', 'connect', 'response' ];
+
+const CH_QUOTE = 0x22;
+const CH_SLASH = 0x2f;
+const CH_QMARK = 0x3f;
+const CH_MINUS = 0x2d;
+const CH_0 = 0x30;
+const CH_9 = 0x39;
+const CH_BRACE = 0x7b;
+
+const KEY_URL = Buffer.from('"url":"');
+const KEY_STATUS = Buffer.from('"statusCode":');
+const KEY_TIMERS = Buffer.from('"timers":{"req":');
+const KEY_QUEUED = Buffer.from('"queued":');
+const KEY_CONN = Buffer.from('"server_conn":');
+const KEY_RES = Buffer.from('"res":');
+const KEY_TOTAL = Buffer.from('"total":');
+const KEY_BACKEND = Buffer.from('"backend":"');
+const KEY_PRIORITY_CLASS = Buffer.from('"priority_class":"');
+const KEY_SAMPLE_RATE = Buffer.from('"sample_rate":"');
+
+/*
+ * Parses the (possibly negative) integer at buf[pos], storing it in
+ * res.value and the position after it in res.end. Returns false if there is
+ * no integer there.
+ */
+function intAt(buf, pos, res) {
+    var neg = false;
+    var value = 0;
+    var i = pos;
+
+    if (buf[i] === CH_MINUS) {
+        neg = true;
+        i++;
+    }
+    var start = i;
+    while (i < buf.length && buf[i] >= CH_0 && buf[i] <= CH_9) {
+        value = value * 10 + (buf[i] - CH_0);
+        i++;
+    }
+    if (i === start)
+        return (false);
+
+    res.value = neg ? -value : value;
+    res.end = i;
+    return (true);
+}
+
+/*
+ * Returns true if the key is at buf[pos].
+ */
+function keyAt(buf, pos, key) {
+    if (pos + key.length > buf.length)
+        return (false);
+    return (buf.compare(key, 0, key.length, pos, pos + key.length) === 0);
+}
+
+/*
+ * Returns the route label for a request path.
+ */
+function routeOf(url) {
+    var parts = url.split('?')[0].split('/');
+    if (parts.length > 2 && ROUTES.indexOf(parts[2]) !== -1)
+        return (parts[2]);
+    return ('other');
+}
+
+/*
+ * Returns the weight of a line given its "sample_rate", which is missing
+ * without sampling, and "-" for requests rejected before haproxy got to the
+ * sampling rules.
+ */
+function weightOf(rate) {
+    var weight = parseInt(rate, 10);
+    return ((weight >= 1) ? weight : 1);
+}
+
+/*
+ * Returns the class label for a line's "priority_class", or null if the line
+ * has none (without request priorities).
+ */
+function classOf(prio) {
+    if (prio === undefined)
+        return (null);
+    var cls = parseInt(prio, 10);
+    return (isNaN(cls) ? null : String(cls));
+}
+
+/*
+ * Returns the status class label for an HTTP status code.
+ */
+function codeClass(status) {
+    if (status >= 100 && status < 600)
+        return (Math.floor(status / 100) + 'xx');
+    return ('other');
+}
+
+/*
+ * Returns the route from the path starting at buf[pos], only decoding its
+ * second component.
+ */
+function routeAt(buf, pos) {
+    if (buf[pos] !== CH_SLASH)
+        return ('other');
+
+    var i = pos + 1;
+    while (i < buf.length && buf[i] !== CH_SLASH && buf[i] !== CH_QUOTE &&
+        buf[i] !== CH_QMARK)
+        i++;
+    if (buf[i] !== CH_SLASH)
+        return ('other');
+
+    var start = ++i;
+    while (i < buf.length && buf[i] !== CH_SLASH && buf[i] !== CH_QUOTE &&
+        buf[i] !== CH_QMARK)
+        i++;
+    var route = buf.toString('latin1', start, i);
+    return ((ROUTES.indexOf(route) !== -1) ? route : 'other');
+}
+
+function parseJSON(buf, pos) {
+    var obj;
+    try {
+        obj = JSON.parse(buf.toString('utf8', pos));
+    } catch (e) {
+        return (null);
+    }
+    if (typeof (obj) !== 'object' || obj === null || !obj.res ||
+        !obj.timers || typeof (obj.backend) !== 'string')
+        return (null);
+
+    return ({
+        backend: obj.backend,
+        route: routeOf((obj.req && typeof (obj.req.url) === 'string') ?
+            obj.req.url : ''),
+        status: obj.res.statusCode,
+        queued: obj.timers.queued,
+        connect: obj.timers.server_conn,
+        response: obj.timers.res,
+        total: obj.timers.total,
+        priorityClass: classOf(obj.priority_class),
+        weight: weightOf(obj.sample_rate)
+    });
+}
+
+/*
+ * Parses a syslog datagram carrying an access log line into:
+ *
+ *   { backend, route, status, queued, connect, response, total,
+ *     priorityClass, weight }
+ *
+ * with the timers in ms (-1 if the request never got to that phase), and the
+ * priority class as a string (or null). Returns null if the datagram isn't an
+ * access log line.
+ */
+function parseLine(buf) {
+    mod_assert.buffer(buf, 'buf');
+
+    var start = buf.indexOf(CH_BRACE);
+    if (start === -1)
+        return (null);
+
+    var n = { value: 0, end: 0 };
+    var line = {};
+    var pos;
+
+    pos = buf.indexOf(KEY_URL, start);
+    if (pos === -1)
+        return (parseJSON(buf, start));
+    line.route = routeAt(buf, pos + KEY_URL.length);
+
+    pos = buf.indexOf(KEY_STATUS, pos);
+    if (pos === -1 || !intAt(buf, pos + KEY_STATUS.length, n))
+        return (parseJSON(buf, start));
+    line.status = n.value;
+
+    /* The timers follow each other, separated by commas. */
+    pos = buf.indexOf(KEY_TIMERS, n.end);
+    if (pos === -1 || !intAt(buf, pos + KEY_TIMERS.length, n) ||
+        !keyAt(buf, n.end + 1, KEY_QUEUED) ||
+        !intAt(buf, n.end + 1 + KEY_QUEUED.length, n))
+        return (parseJSON(buf, start));
+    line.queued = n.value;
+
+    if (!keyAt(buf, n.end + 1, KEY_CONN) ||
+        !intAt(buf, n.end + 1 + KEY_CONN.length, n))
+        return (parseJSON(buf, start));
+    line.connect = n.value;
+
+    if (!keyAt(buf, n.end + 1, KEY_RES) ||
+        !intAt(buf, n.end + 1 + KEY_RES.length, n))
+        return (parseJSON(buf, start));
+    line.response = n.value;
+
+    if (!keyAt(buf, n.end + 1, KEY_TOTAL) ||
+        !intAt(buf, n.end + 1 + KEY_TOTAL.length, n))
+        return (parseJSON(buf, start));
+    line.total = n.value;
+
+    pos = buf.indexOf(KEY_BACKEND, n.end);
+    if (pos === -1)
+        return (parseJSON(buf, start));
+    pos += KEY_BACKEND.length;
+    var end = buf.indexOf(CH_QUOTE, pos);
+    if (end === -1)
+        return (parseJSON(buf, start));
+    line.backend = buf.toString('latin1', pos, end);
+
+    line.priorityClass = null;
+    pos = buf.indexOf(KEY_PRIORITY_CLASS, end);
+    if (pos !== -1 && intAt(buf, pos + KEY_PRIORITY_CLASS.length, n))
+        line.priorityClass = String(n.value);
+
+    line.weight = 1;
+    pos = buf.indexOf(KEY_SAMPLE_RATE, end);
+    if (pos !== -1 && intAt(buf, pos + KEY_SAMPLE_RATE.length, n))
+        line.weight = weightOf(n.value);
+
+    return (line);
+}
+
+/*
+ * A set of Prometheus histograms with the same buckets, keyed by label values.
+ */
+function Histograms(buckets) {
+    mod_assert.arrayOfNumber(buckets, 'buckets');
+    this.h_buckets = buckets;
+    this.h_series = {};
+    this.h_keys = [];
+}
+
+/*
+ * Records an observation standing for "weight" (default 1) observations of
+ * the same value.
+ */
+Histograms.prototype.observe = function (labels, value, weight) {
+    if (weight === undefined)
+        weight = 1;
+
+    var key = JSON.stringify(labels);
+    var series = this.h_series[key];
+    if (series === undefined) {
+        series = {
+            labels: labels,
+            counts: this.h_buckets.map(function () { return (0); }),
+            sum: 0,
+            count: 0
+        };
+        this.h_series[key] = series;
+        this.h_keys.push(key);
+    }
+
+    for (var i = 0; i < this.h_buckets.length; i++) {
+        if (value <= this.h_buckets[i]) {
+            series.counts[i] += weight;
+            break;
+        }
+    }
+    series.sum += value * weight;
+    series.count += weight;
+};
+
+/*
+ * Returns the series of a collector family of type "histogram": cumulative
+ * "_bucket" series, then "_sum" and "_count", for each set of labels.
+ */
+Histograms.prototype.metrics = function () {
+    var self = this;
+    var metrics = [];
+
+    self.h_keys.forEach(function (key) {
+        var series = self.h_series[key];
+        var cumulative = 0;
+        self.h_buckets.forEach(function (le, i) {
+            cumulative += series.counts[i];
+            metrics.push({ suffix: '_bucket',
+                labels: mod_jsprim.mergeObjects(series.labels,
+                    { le: String(le) }),
+                value: cumulative });
+        });
+        metrics.push({ suffix: '_bucket',
+            labels: mod_jsprim.mergeObjects(series.labels, { le: '+Inf' }),
+            value: series.count });
+        metrics.push({ suffix: '_sum', labels: series.labels,
+            value: series.sum });
+        metrics.push({ suffix: '_count', labels: series.labels,
+            value: series.count });
+    });
+
+    return (metrics);
+};
+
+/*
+ * Options:
+ * - log, a Bunyan logger
+ * - config, the "accessLog" section of the muppet configuration; see DEFAULTS
+ *   above for the settings and their defaults
+ */
+function AccessLogSinkFSM(opts) {
+    mod_assert.object(opts, 'opts');
+    mod_assert.object(opts.log, 'opts.log');
+    mod_assert.optionalObject(opts.config, 'opts.config');
+
+    var config = opts.config || {};
+    var cfg = {};
+    Object.keys(DEFAULTS).forEach(function (key) {
+        cfg[key] = (config[key] !== undefined) ? config[key] : DEFAULTS[key];
+    });
+    mod_assert.number(cfg.port, 'config.port');
+    mod_assert.arrayOfNumber(cfg.buckets, 'config.buckets');
+
+    this.al_cfg = cfg;
+    this.al_log = opts.log;
+    this.al_sock = null;
+
+    this.al_requests = new Histograms(cfg.buckets);
+    this.al_phases = new Histograms(cfg.buckets);
+    this.al_queues = new Histograms(cfg.buckets);
+    this.al_lines = 0;
+    this.al_errors = 0;
+
+    FSM.call(this, 'binding');
+}
+mod_util.inherits(AccessLogSinkFSM, FSM);
+
+/*
+ * The address to give haproxy as a "log" target.
+ */
+AccessLogSinkFSM.prototype.address = function () {
+    return (LOOPBACK + ':' + this.al_cfg.port);
+};
+
+AccessLogSinkFSM.prototype.state_binding = function (S) {
+    var self = this;
+
+    self.al_sock = mod_dgram.createSocket('udp4');
+    S.on(self.al_sock, 'listening', function () {
+        self.al_log.info({ address: self.address() },
+            'listening for haproxy access log');
+        S.gotoState('listening');
+    });
+    S.on(self.al_sock, 'error', function (err) {
+        self.al_log.error(err, 'failed to bind access log socket');
+        S.gotoState('error');
+    });
+    self.al_sock.bind(self.al_cfg.port, LOOPBACK);
+};
+
+AccessLogSinkFSM.prototype.state_listening = function (S) {
+    var self = this;
+
+    S.on(self.al_sock, 'message', function (msg) {
+        self._observe(msg);
+    });
+    S.on(self.al_sock, 'error', function (err) {
+        self.al_log.error(err, 'access log socket error');
+        S.gotoState('error');
+    });
+};
+
+AccessLogSinkFSM.prototype.state_error = function (S) {
+    this.al_sock.close();
+    this.al_sock = null;
+    S.gotoStateTimeout(RETRY_TIMEOUT, 'binding');
+};
+
+AccessLogSinkFSM.prototype._observe = function (msg) {
+    var line = parseLine(msg);
+    if (line === null) {
+        /* haproxy's own messages, e.g. for lib/server_events.js */
+        if (msg.indexOf(CH_BRACE) === -1)
+            this.emit('message', msg);
+        else
+            this.al_errors++;
+        return;
+    }
+    this.al_lines++;
+
+    if (line.total >= 0) {
+        this.al_requests.observe({
+            backend: line.backend,
+            route: line.route,
+            code: codeClass(line.status)
+        }, line.total / 1000, line.weight);
+    }
+    var timers = [ line.queued, line.connect, line.response ];
+    for (var i = 0; i < PHASES.length; i++) {
+        if (timers[i] >= 0) {
+            this.al_phases.observe({ backend: line.backend,
+                phase: PHASES[i] }, timers[i] / 1000, line.weight);
+        }
+    }
+    if (line.priorityClass !== null && line.queued >= 0) {
+        this.al_queues.observe({ backend: line.backend,
+            'class': line.priorityClass }, line.queued / 1000, line.weight);
+    }
+};
+
+/*
+ * Returns a metrics exporter collector (see lib/metrics_exporter.js).
+ */
+AccessLogSinkFSM.prototype.collector = function () {
+    var self = this;
+
+    return (function _collectAccessLog() {
+        return ([
+            {
+                name: 'loadbalancer_request_duration_seconds',
+                type: 'histogram',
+                desc: 'Total request time (%Ta) from the access log.',
+                metrics: self.al_requests.metrics()
+            },
+            {
+                name: 'loadbalancer_request_phase_duration_seconds',
+                type: 'histogram',
+                desc: 'Time spent queued (%Tw), connecting (%Tc) and ' +
+                    'waiting for the response (%Tr), from the access log.',
+                metrics: self.al_phases.metrics()
+            },
+            {
+                name: 'loadbalancer_request_queue_duration_seconds',
+                type: 'histogram',
+                desc: 'Time spent queued (%Tw) by request priority class, ' +
+                    'from the access log.',
+                metrics: self.al_queues.metrics()
+            },
+            {
+                name: 'loadbalancer_access_log_lines_total',
+                type: 'counter',
+                desc: 'Total number of access log lines received.',
+                metrics: [ { labels: {}, value: self.al_lines } ]
+            },
+            {
+                name: 'loadbalancer_access_log_errors_total',
+                type: 'counter',
+                desc: 'Total number of unparseable access log lines.',
+                metrics: [ { labels: {}, value: self.al_errors } ]
+            }
+        ]);
+    });
+};
+
+module.exports = {
+    AccessLogSinkFSM: AccessLogSinkFSM,
+    // for testing
+    Histograms: Histograms,
+    codeClass: codeClass,
+    parseLine: parseLine,
+    routeOf: routeOf
+};
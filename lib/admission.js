@@ -0,0 +1,455 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 MNX Cloud, Inc.
+ */
+
+/*
+ * Adaptive admission control for the public frontends.
+ *
+ * When backend capacity drops (a ZK glitch, a deploy), haproxy would otherwise
+ * keep accepting everything and let requests pile up in the backend queues
+ * until clients time out. Instead, we watch the backend queues and the share
+ * of healthy servers via the stats socket, and shrink what the public
+ * frontends admit while the backends are struggling:
+ *
+ *   - the frontends' maxconn ("set maxconn frontend")
+ *   - the frontends' new session rates, which they look up in a map file that
+ *     we change with "set map" (see admissionLines() in lib/lb_manager.js)
+ *
+ * Requests that are admitted then see bounded queueing. As capacity returns,
+ * we restore the limits gradually.
+ *
+ * The controller keeps an "admission level" for each frontend, between
+ * minLevel and 1, the fraction of the configured limits that the frontend
+ * currently admits. Each frontend only looks at the backends it sends requests
+ * to (see FRONTEND_BACKENDS), so that losing the buckets-api servers doesn't
+ * throttle http_external, which only serves webapi. On each check:
+ *
+ *   - if any of its backends' queue (qcur) or average queue time (qtime) is
+ *     over its threshold, the frontend is overloaded and its level is
+ *     decreased multiplicatively (level * decrease)
+ *   - otherwise, the level is increased additively (level + increase)
+ *   - in both cases, the level is capped at the lowest fraction of healthy
+ *     servers among its backends, so that losing half the servers halves
+ *     what we admit right away
+ *
+ * http_internal is deliberately left alone: internal Manta traffic is not
+ * what we want to shed.
+ *
+ *      +---------+  timeout (interval)  +----------+
+ *      |         | -------------------> |          |
+ *      | waiting |                      | checking |
+ *      |         | <------------------- |          |
+ *      +---------+   applied or error   +----------+
+ */
+
+/*jsl:ignore*/
+'use strict';
+/*jsl:end*/
+
+const mod_assert = require('assert-plus');
+const mod_util = require('util');
+const mod_vasync = require('vasync');
+const FSM = require('mooremachine').FSM;
+
+const lib_lbman = require('./lb_manager');
+
+const HAPROXY_BACKEND = '1';
+const HAPROXY_SERVER = '2';
+
+const DEFAULTS = {
+    interval: 5000,                 /* ms */
+    frontends: [ 'https', 'http_external' ],
+    queueThreshold: 100,            /* requests */
+    qtimeThreshold: 500,            /* ms */
+    minLevel: 0.1,
+    decrease: 0.75,
+    increase: 0.1,
+    sessionRate: 0,                 /* per frontend, 0 = unlimited */
+    minSessionRate: 100             /* new sessions/sec */
+};
+
+/*
+ * The backends each public frontend sends requests to (see
+ * etc/haproxy.cfg.in), along with their streaming backends. A frontend not
+ * listed here is judged by all of the backends.
+ */
+const FRONTEND_BACKENDS = {
+    'https': [ 'secure_api', 'buckets_api' ],
+    'http_external': [ 'insecure_api' ]
+};
+
+/*
+ * Given the output of lib_hasock.allStats() and a frontend's current admission
+ * level, returns its new level along with the reasons for it:
+ *
+ *   {
+ *       level: <new admission level>,
+ *       overloaded: <true if a queue threshold was exceeded>,
+ *       capacity: <lowest fraction of healthy servers in a backend>,
+ *       reasons: [ { backend: ..., reason: 'queue'|'qtime'|'capacity' } ]
+ *   }
+ *
+ * Only the backends in opts.backends (if given) and their streaming backends
+ * are considered.
+ */
+function evaluate(stats, level, opts) {
+    mod_assert.array(stats, 'stats');
+    mod_assert.number(level, 'level');
+    mod_assert.object(opts, 'opts');
+    mod_assert.optionalArrayOfString(opts.backends, 'opts.backends');
+
+    var reasons = [];
+    var overloaded = false;
+    var capacity = 1;
+    var servers = {};
+
+    function ours(pxname) {
+        if (opts.backends === undefined)
+            return (true);
+        if (lib_lbman.isStreamingBackend(pxname))
+            pxname = pxname.slice(0, pxname.lastIndexOf('_'));
+        return (opts.backends.indexOf(pxname) !== -1);
+    }
+
+    stats.forEach(function (stat) {
+        if (stat.type !== HAPROXY_SERVER || stat.status === 'MAINT' ||
+            !ours(stat.pxname)) {
+            return;
+        }
+        if (servers[stat.pxname] === undefined)
+            servers[stat.pxname] = { total: 0, up: 0 };
+        servers[stat.pxname].total++;
+        if (/^UP/.test(stat.status))
+            servers[stat.pxname].up++;
+    });
+
+    stats.forEach(function (stat) {
+        if (stat.type !== HAPROXY_BACKEND || !ours(stat.pxname))
+            return;
+
+        var qcur = parseInt(stat.qcur || '0', 10);
+        var qtime = parseInt(stat.qtime || '0', 10);
+        if (qcur > opts.queueThreshold) {
+            overloaded = true;
+            reasons.push({ backend: stat.pxname, reason: 'queue' });
+        } else if (qcur > 0 && qtime > opts.qtimeThreshold) {
+            overloaded = true;
+            reasons.push({ backend: stat.pxname, reason: 'qtime' });
+        }
+
+        var srvs = servers[stat.pxname];
+        if (srvs !== undefined && srvs.total > 0) {
+            var healthy = srvs.up / srvs.total;
+            if (healthy < 1) {
+                reasons.push({ backend: stat.pxname, reason: 'capacity' });
+            }
+            capacity = Math.min(capacity, healthy);
+        }
+    });
+
+    var newLevel;
+    if (overloaded) {
+        newLevel = level * opts.decrease;
+    } else {
+        newLevel = level + opts.increase;
+    }
+    newLevel = Math.min(newLevel, 1, Math.max(capacity, opts.minLevel));
+    newLevel = Math.max(newLevel, opts.minLevel);
+
+    return ({
+        level: newLevel,
+        overloaded: overloaded,
+        capacity: capacity,
+        reasons: reasons
+    });
+}
+
+/*
+ * Options:
+ * - haSock, the lib/haproxy_sock.js module
+ * - stats, the StatsPollerFSM (see lib/stats_poller.js)
+ * - log, a Bunyan logger
+ * - maxconn, the configured per-frontend maxconn (from lib/tuning.js)
+ * - mapFile, the map of new session rate limits the generated haproxy config
+ *   refers to; lib/lb_manager.js writes it at each reload, from mapLimits()
+ * - config, the "admission" section of the muppet configuration; see
+ *   DEFAULTS above for the settings and their defaults
+ */
+function AdmissionControllerFSM(opts) {
+    mod_assert.object(opts, 'opts');
+    mod_assert.object(opts.haSock, 'opts.haSock');
+    mod_assert.object(opts.stats, 'opts.stats');
+    mod_assert.object(opts.log, 'opts.log');
+    mod_assert.number(opts.maxconn, 'opts.maxconn');
+    mod_assert.string(opts.mapFile, 'opts.mapFile');
+    mod_assert.optionalObject(opts.config, 'opts.config');
+
+    var config = opts.config || {};
+    var cfg = {};
+    Object.keys(DEFAULTS).forEach(function (key) {
+        cfg[key] = (config[key] !== undefined) ? config[key] : DEFAULTS[key];
+    });
+    mod_assert.arrayOfString(cfg.frontends, 'config.frontends');
+    mod_assert.ok(cfg.minLevel > 0 && cfg.minLevel <= 1,
+        'config.minLevel must be in (0, 1]');
+    mod_assert.ok(cfg.decrease > 0 && cfg.decrease < 1,
+        'config.decrease must be in (0, 1)');
+
+    this.ac_cfg = cfg;
+    this.ac_haSock = opts.haSock;
+    this.ac_stats = opts.stats;
+    this.ac_log = opts.log;
+    this.ac_maxconn = opts.maxconn;
+    this.ac_mapFile = opts.mapFile;
+
+    /* frontend => admission level */
+    this.ac_levels = {};
+    /* frontend => the last evaluate() result */
+    this.ac_last = {};
+    /* frontend => new session rate limit, 0 for none */
+    this.ac_rateLimit = {};
+    /* frontend => new session rate before we started shedding */
+    this.ac_baseRate = {};
+    this.ac_frontendMaxconn = {};
+    this.ac_adjustments = { decrease: 0, increase: 0 };
+    this.ac_errors = 0;
+
+    cfg.frontends.forEach(function (fe) {
+        this.ac_levels[fe] = 1;
+    }, this);
+
+    FSM.call(this, 'waiting');
+}
+mod_util.inherits(AdmissionControllerFSM, FSM);
+
+AdmissionControllerFSM.prototype.state_waiting = function (S) {
+    S.gotoStateTimeout(this.ac_cfg.interval, 'checking');
+};
+
+AdmissionControllerFSM.prototype.state_checking = function (S) {
+    var self = this;
+    var log = this.ac_log;
+    var cfg = this.ac_cfg;
+
+    var statopts = { maxAge: cfg.interval };
+    self.ac_stats.snapshot(statopts, S.callback(function (err, snap) {
+        if (err) {
+            log.warn(err, 'admission control: failed to fetch stats');
+            self.ac_errors++;
+            S.gotoState('waiting');
+            return;
+        }
+
+        var stats = snap.stats;
+        cfg.frontends.forEach(function (fe) {
+            var level = self.ac_levels[fe];
+            var res = evaluate(stats, level, {
+                queueThreshold: cfg.queueThreshold,
+                qtimeThreshold: cfg.qtimeThreshold,
+                minLevel: cfg.minLevel,
+                decrease: cfg.decrease,
+                increase: cfg.increase,
+                backends: FRONTEND_BACKENDS[fe]
+            });
+            if (res.level < level) {
+                self.ac_adjustments.decrease++;
+                log.warn({ frontend: fe, level: res.level, previous: level,
+                    reasons: res.reasons },
+                    'admission control: shedding load');
+            } else if (res.level > level) {
+                self.ac_adjustments.increase++;
+                log.info({ frontend: fe, level: res.level, previous: level,
+                    reasons: res.reasons },
+                    'admission control: restoring admission');
+            }
+            self.ac_levels[fe] = res.level;
+            self.ac_last[fe] = res;
+        });
+
+        self._apply(stats, S.callback(function (err2) {
+            if (err2) {
+                log.warn(err2, 'admission control: failed to apply limits');
+                self.ac_errors++;
+            }
+            S.gotoState('waiting');
+        }));
+    }));
+};
+
+/*
+ * Pushes the limits for the frontends' current levels into haproxy. We compare
+ * against the frontends' current limits (slim) rather than what we last set,
+ * so that the limits get re-applied to the new worker after a reload.
+ */
+AdmissionControllerFSM.prototype._apply = function (stats, cb) {
+    var self = this;
+    var log = this.ac_log;
+    var cfg = this.ac_cfg;
+
+    var changes = [];
+
+    stats.forEach(function (stat) {
+        if (stat.svname !== 'FRONTEND' ||
+            cfg.frontends.indexOf(stat.pxname) === -1) {
+            return;
+        }
+        var fe = stat.pxname;
+        var level = self.ac_levels[fe];
+        var maxconn = Math.max(1, Math.round(self.ac_maxconn * level));
+        self.ac_frontendMaxconn[fe] = maxconn;
+        if (stat.slim !== String(maxconn)) {
+            changes.push(function (_, next) {
+                self.ac_haSock.setFrontendMaxconn({
+                    log: log,
+                    frontend: fe,
+                    maxconn: maxconn
+                }, next);
+            });
+        }
+
+        /*
+         * While shedding, the new session rate is limited to the given
+         * fraction of the configured rate or, if that is unlimited, of the
+         * rate the frontend saw before we started shedding: the rate we see
+         * now is held down by our own limit. We can't read the limit back
+         * from "show stat", and a reload resets it, so we always re-apply it
+         * while shedding.
+         */
+        var rate = cfg.sessionRate;
+        if (level < 1) {
+            if (self.ac_baseRate[fe] === undefined) {
+                self.ac_baseRate[fe] = (cfg.sessionRate > 0) ?
+                    cfg.sessionRate : parseInt(stat.rate || '0', 10);
+            }
+            rate = Math.max(cfg.minSessionRate,
+                Math.round(self.ac_baseRate[fe] * level));
+        } else {
+            delete (self.ac_baseRate[fe]);
+        }
+        if (level < 1 || rate !== self.ac_rateLimit[fe]) {
+            changes.push(function (_, next) {
+                self.ac_haSock.setMapEntry({
+                    log: log,
+                    map: self.ac_mapFile,
+                    key: fe,
+                    value: String(rate)
+                }, next);
+            });
+        }
+        self.ac_rateLimit[fe] = rate;
+    });
+
+    mod_vasync.pipeline({ funcs: changes }, function (err) {
+        cb(err);
+    });
+};
+
+/*
+ * Returns the contents of the map file with the unrestricted limits, which is
+ * what haproxy starts out with at each reload.
+ */
+AdmissionControllerFSM.prototype.mapLimits = function () {
+    var cfg = this.ac_cfg;
+
+    return (cfg.frontends.map(function (fe) {
+        return (fe + ' ' + cfg.sessionRate + '\n');
+    }).join(''));
+};
+
+/*
+ * Returns a metrics exporter collector (see lib/metrics_exporter.js) for the
+ * controller's state.
+ */
+AdmissionControllerFSM.prototype.collector = function () {
+    var self = this;
+
+    function perFrontend(value) {
+        return (Object.keys(self.ac_levels).map(function (fe) {
+            return ({ labels: { name: fe }, value: value(fe) });
+        }));
+    }
+
+    return (function _collectAdmission() {
+        var last = self.ac_last;
+        return ([
+            {
+                name: 'loadbalancer_admission_level',
+                type: 'gauge',
+                desc: 'Fraction of the configured frontend limits ' +
+                    'currently admitted.',
+                metrics: perFrontend(function (fe) {
+                    return (self.ac_levels[fe]);
+                })
+            },
+            {
+                name: 'loadbalancer_admission_overloaded',
+                type: 'gauge',
+                desc: 'Whether a queue threshold of one of the frontend\'s ' +
+                    'backends was exceeded at the last check ' +
+                    '(1 = overloaded).',
+                metrics: perFrontend(function (fe) {
+                    return ((last[fe] !== undefined &&
+                        last[fe].overloaded) ? 1 : 0);
+                })
+            },
+            {
+                name: 'loadbalancer_admission_backend_capacity',
+                type: 'gauge',
+                desc: 'Lowest fraction of healthy servers in one of the ' +
+                    'frontend\'s backends at the last check.',
+                metrics: perFrontend(function (fe) {
+                    return ((last[fe] !== undefined) ?
+                        last[fe].capacity : 1);
+                })
+            },
+            {
+                name: 'loadbalancer_admission_frontend_max_connections',
+                type: 'gauge',
+                desc: 'Frontend maxconn set by admission control.',
+                metrics: Object.keys(self.ac_frontendMaxconn).map(
+                    function (fe) {
+                    return ({ labels: { name: fe },
+                        value: self.ac_frontendMaxconn[fe] });
+                })
+            },
+            {
+                name: 'loadbalancer_admission_session_rate_limit',
+                type: 'gauge',
+                desc: 'Frontend new session rate limit set by admission ' +
+                    'control (0 = unlimited).',
+                metrics: Object.keys(self.ac_rateLimit).map(function (fe) {
+                    return ({ labels: { name: fe },
+                        value: self.ac_rateLimit[fe] });
+                })
+            },
+            {
+                name: 'loadbalancer_admission_adjustments_total',
+                type: 'counter',
+                desc: 'Total number of admission level changes.',
+                metrics: Object.keys(self.ac_adjustments).map(function (dir) {
+                    return ({ labels: { direction: dir },
+                        value: self.ac_adjustments[dir] });
+                })
+            },
+            {
+                name: 'loadbalancer_admission_errors_total',
+                type: 'counter',
+                desc: 'Total number of failed admission control checks.',
+                metrics: [ { labels: {}, value: self.ac_errors } ]
+            }
+        ]);
+    });
+};
+
+module.exports = {
+    AdmissionControllerFSM: AdmissionControllerFSM,
+    // for testing
+    FRONTEND_BACKENDS: FRONTEND_BACKENDS,
+    evaluate: evaluate
+};
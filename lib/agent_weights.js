@@ -0,0 +1,191 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 MNX Cloud, Inc.
+ */
+
+/*
+ * Server weights, as reported by their agents.
+ *
+ * With agent checks (see agentParams() in lib/lb_manager.js), each server's
+ * agent tells haproxy what share of its configured weight it wants. Servers
+ * are configured with a weight of 100, so the current weight in "show stat"
+ * is the percentage the agent last reported (or 0 while draining).
+ *
+ * We keep the servers with an agent from each stats snapshot (see
+ * lib/stats_poller.js), and export their weight and whether their agent last
+ * answered, per server even when the haproxy server metrics are aggregated
+ * by backend.
+ *
+ * The servers of the streaming backends (see streamingBackend() in
+ * lib/lb_manager.js) track the state of the agent checked ones, including
+ * "drain", but not their weight. When given the haproxy socket, we copy the
+ * weights over from each snapshot, so that a server its agent has turned down
+ * gets as little of the streaming traffic, a snapshot (or a reload) later.
+ */
+
+/*jsl:ignore*/
+'use strict';
+/*jsl:end*/
+
+const mod_assert = require('assert-plus');
+const mod_vasync = require('vasync');
+
+const lib_lbman = require('./lb_manager');
+
+const TYPE_SERVER = '2';
+
+/*
+ * Returns true if the "agent_status" of a server (e.g. "L7OK", or "* L7OK"
+ * while a check is in progress) is a success.
+ */
+function agentOk(status) {
+    return (/^(\* )?L[4-7]OK/.test(status));
+}
+
+/*
+ * Returns the servers of the streaming backends whose weight differs from
+ * that of the agent checked server they track, with the weight they should
+ * have: [ { backend, server, weight } ].
+ */
+function streamWeights(stats) {
+    mod_assert.arrayOfObject(stats, 'stats');
+
+    var agentWeights = {};
+    stats.forEach(function (stat) {
+        if (stat.type === TYPE_SERVER && stat.agent_status)
+            agentWeights[stat.pxname + '/' + stat.svname] = stat.weight;
+    });
+
+    var changes = [];
+    stats.forEach(function (stat) {
+        if (stat.type !== TYPE_SERVER ||
+            !lib_lbman.isStreamingBackend(stat.pxname)) {
+            return;
+        }
+        var tracked = stat.pxname.slice(0, stat.pxname.lastIndexOf('_')) +
+            '/' + stat.svname;
+        var weight = agentWeights[tracked];
+        if (weight === undefined || weight === stat.weight)
+            return;
+        changes.push({
+            backend: stat.pxname,
+            server: stat.svname,
+            weight: parseInt(weight, 10)
+        });
+    });
+    return (changes);
+}
+
+/*
+ * Options:
+ * - log, a Bunyan logger
+ * - haSock (optional), the lib/haproxy_sock.js module, to have the streaming
+ *   backends' servers follow the agents' weights
+ */
+function AgentWeights(opts) {
+    mod_assert.object(opts, 'opts');
+    mod_assert.object(opts.log, 'opts.log');
+    mod_assert.optionalObject(opts.haSock, 'opts.haSock');
+
+    this.aw_log = opts.log;
+    this.aw_haSock = opts.haSock || null;
+    /* [ { backend, server, weight, up } ] */
+    this.aw_servers = [];
+    /* Whether we're still applying the previous snapshot's weights. */
+    this.aw_updating = false;
+}
+
+/*
+ * Takes the servers with an agent from a stats snapshot.
+ */
+AgentWeights.prototype.poll = function (snapshot) {
+    mod_assert.object(snapshot, 'snapshot');
+    mod_assert.arrayOfObject(snapshot.stats, 'snapshot.stats');
+
+    var servers = [];
+    snapshot.stats.forEach(function (stat) {
+        if (stat.type !== TYPE_SERVER || !stat.agent_status)
+            return;
+        servers.push({
+            backend: stat.pxname,
+            server: stat.svname,
+            weight: parseInt(stat.weight || '0', 10),
+            up: agentOk(stat.agent_status)
+        });
+    });
+    this.aw_servers = servers;
+
+    if (this.aw_haSock !== null && !this.aw_updating)
+        this._updateStreamWeights(streamWeights(snapshot.stats));
+};
+
+AgentWeights.prototype._updateStreamWeights = function (changes) {
+    var self = this;
+    var log = this.aw_log;
+    var haSock = this.aw_haSock;
+
+    if (changes.length === 0)
+        return;
+
+    log.debug({ changes: changes }, 'updating streaming server weights');
+    this.aw_updating = true;
+    mod_vasync.forEachPipeline({
+        inputs: changes,
+        func: function (change, next) {
+            haSock.setServerWeight({
+                backend: change.backend,
+                server: change.server,
+                weight: change.weight,
+                log: log
+            }, next);
+        }
+    }, function (err) {
+        if (err)
+            log.warn(err, 'failed to update streaming server weights');
+        self.aw_updating = false;
+    });
+};
+
+/*
+ * Returns a metrics exporter collector (see lib/metrics_exporter.js).
+ */
+AgentWeights.prototype.collector = function () {
+    var self = this;
+
+    return (function _collectAgentWeights() {
+        return ([
+            {
+                name: 'loadbalancer_server_agent_weight',
+                type: 'gauge',
+                desc: 'Current weight of the server, in percent of its ' +
+                    'configured weight, as set by its agent.',
+                metrics: self.aw_servers.map(function (s) {
+                    return ({ labels: { backend: s.backend,
+                        server: s.server }, value: s.weight });
+                })
+            },
+            {
+                name: 'loadbalancer_server_agent_up',
+                type: 'gauge',
+                desc: 'Whether the server\'s agent answered its last check ' +
+                    '(1 = yes, 0 = no).',
+                metrics: self.aw_servers.map(function (s) {
+                    return ({ labels: { backend: s.backend,
+                        server: s.server }, value: s.up ? 1 : 0 });
+                })
+            }
+        ]);
+    });
+};
+
+module.exports = {
+    AgentWeights: AgentWeights,
+    // for testing
+    agentOk: agentOk,
+    streamWeights: streamWeights
+};
@@ -6,6 +6,7 @@
 
 /*
  * Copyright 2020 Joyent, Inc.
+ * Copyright 2026 MNX Cloud, Inc.
  */
 
 /*
@@ -22,7 +23,9 @@
  * "reload" haproxy via lb_manager.js.
  *
  * We also make sure the haproxy configuration is what we expect every
- * BESTATE_DOUBLECHECK ms.
+ * BESTATE_DOUBLECHECK ms, or, when we follow haproxy's server state change log
+ * lines (see lib/server_events.js), as soon as one suggests it isn't, with a
+ * less frequent periodic check as a safety net.
  */
 
 /*jsl:ignore*/
@@ -47,11 +50,28 @@ const lib_watch = require('./watch');
  */
 const lib_hasock = require('./haproxy_sock');
 const lib_metrics = require('./metrics_exporter');
+const lib_tuning = require('./tuning');
+const lib_admission = require('./admission');
+const lib_drain = require('./drain');
+const lib_registration = require('./registration');
+const lib_threads = require('./threads');
+const lib_pools = require('./pools');
+const lib_recorder = require('./recorder');
+const lib_self = require('./self_metrics');
+const lib_statspoller = require('./stats_poller');
+const lib_accesslog = require('./access_log');
+const lib_srvevents = require('./server_events');
+const lib_agentweights = require('./agent_weights');
+const lib_denylist = require('./deny_list');
 
 const MDATA_TIMEOUT = 30000;
 const SETUP_RETRY_TIMEOUT = 30000;
 const BESTATE_DOUBLECHECK = 30000;
+/* With server state change events, the periodic check is just a safety net. */
+const BESTATE_SAFETY_NET = 300000;
 const MAX_DIRTY_TIME = 6*3600*1000;
+const DENY_MAP_FILE = '/opt/smartdc/muppet/etc/deny.map';
+const ADMISSION_MAP_FILE = '/opt/smartdc/muppet/etc/admission.map';
 
 function AppFSM(cfg) {
     this.a_log = cfg.log;
@@ -68,12 +88,174 @@ function AppFSM(cfg) {
     this.a_lastCleanTime = 0;
     this.a_servers = {};
     this.a_haproxyCfg = cfg.haproxy;
+    this.a_tuning = lib_tuning.computeTuning(cfg.haproxy);
+    this.a_log.info({ tuning: this.a_tuning },
+        'computed haproxy connection budget');
 
     this.a_reloadCmd = cfg.reload;
+    this.a_removalCfg = cfg.removal;
+    /* Removal decisions, across ServerWatcherFSMs */
+    this.a_removals = {};
+
+    /* Everything that needs "show stat" or "show info" goes through this. */
+    this.a_stats = new lib_statspoller.StatsPollerFSM({
+        haSock: lib_hasock,
+        log: this.a_log.child({ component: 'StatsPollerFSM' }),
+        config: cfg.statsPoller
+    });
+
+    this.a_admission = null;
+    if (cfg.admission && cfg.admission.enabled) {
+        this.a_admission = new lib_admission.AdmissionControllerFSM({
+            haSock: lib_hasock,
+            stats: this.a_stats,
+            log: this.a_log.child({ component: 'AdmissionControllerFSM' }),
+            maxconn: this.a_tuning.frontendMaxconn,
+            mapFile: ADMISSION_MAP_FILE,
+            config: cfg.admission
+        });
+    }
+
+    this.a_loadReportCfg = cfg.loadReport || {};
+    this.a_loadReporter = null;
+    this.a_metricsExporter = null;
+
+    this.a_drainCfg = cfg.drain || {};
+    this.a_drain = new lib_drain.DrainFSM({
+        haSock: lib_hasock,
+        stats: this.a_stats,
+        log: this.a_log.child({ component: 'DrainFSM' }),
+        config: this.a_drainCfg
+    });
+
+    this.a_nsf = null;
+    this.a_selfMetrics = new lib_self.SelfMetrics({
+        log: this.a_log,
+        queues: {
+            reload: lib_lbman.reloadQueueDepth,
+            haproxy_sock: lib_hasock.queueDepth
+        }
+    });
+    this.a_accessLog = null;
+    if (cfg.accessLog && cfg.accessLog.enabled) {
+        this.a_accessLog = new lib_accesslog.AccessLogSinkFSM({
+            log: this.a_log.child({ component: 'AccessLogSinkFSM' }),
+            config: cfg.accessLog
+        });
+    }
+
+    this.a_serverStates = null;
+    this.a_doublecheckInterval = BESTATE_DOUBLECHECK;
+    if (cfg.serverEvents && cfg.serverEvents.enabled) {
+        if (this.a_accessLog === null) {
+            this.a_log.warn('server state events need the access log ' +
+                'sink (accessLog.enabled); ignoring serverEvents');
+        } else {
+            this.a_serverStates = new lib_srvevents.ServerStateTracker({
+                log: this.a_log.child({ component: 'ServerStateTracker' })
+            });
+            this.a_accessLog.on('message', this.a_serverStates.message.bind(
+                this.a_serverStates));
+            this.a_stats.on('stats', this.a_serverStates.poll.bind(
+                this.a_serverStates));
+            this.a_doublecheckInterval =
+                cfg.serverEvents.doublecheckInterval || BESTATE_SAFETY_NET;
+        }
+    }
+
+    this.a_agentWeights = null;
+    var agentCheck = (cfg.haproxy && cfg.haproxy.agentCheck) || {};
+    if (Object.keys(agentCheck).some(function (kind) {
+        return (agentCheck[kind] && agentCheck[kind].enabled);
+    })) {
+        this.a_agentWeights = new lib_agentweights.AgentWeights({
+            log: this.a_log.child({ component: 'AgentWeights' }),
+            haSock: lib_hasock
+        });
+        this.a_stats.on('stats', this.a_agentWeights.poll.bind(
+            this.a_agentWeights));
+    }
+
+    this.a_denyList = null;
+    if (cfg.denyList && cfg.denyList.enabled) {
+        this.a_denyList = new lib_denylist.DenyListFSM({
+            haSock: lib_hasock,
+            log: this.a_log.child({ component: 'DenyListFSM' }),
+            mapFile: DENY_MAP_FILE,
+            config: cfg.denyList
+        });
+    }
+
+    this.a_recorder = null;
+    if (cfg.recorder && cfg.recorder.enabled) {
+        this.a_recorder = new lib_recorder.FlightRecorderFSM({
+            haSock: lib_hasock,
+            log: this.a_log.child({ component: 'FlightRecorderFSM' }),
+            config: cfg.recorder
+        });
+        this.a_recorder.track('DrainFSM', this.a_drain);
+        if (this.a_admission !== null) {
+            this.a_recorder.track('AdmissionControllerFSM',
+                this.a_admission);
+        }
+    }
 
     if (cfg.metricsPort) {
         cfg.haSock = lib_hasock;
+        cfg.statsPoller = this.a_stats;
+        cfg.serverAddress = this.serverAddress.bind(this);
         this.a_metricsExporter = lib_metrics.createMetricsExporter(cfg);
+        this.a_metricsExporter.addCollector(
+            lib_tuning.tuningCollector(this.a_tuning));
+        this.a_metricsExporter.addCollector(this.a_stats.collector());
+        this.a_metricsExporter.addCollector(
+            lib_watch.removalCollector(this.a_removals));
+        this.a_metricsExporter.addCollector(this.a_drain.collector());
+        this.a_selfMetrics.start();
+        this.a_metricsExporter.addCollector(this.a_selfMetrics.collector());
+        if (this.a_admission !== null) {
+            this.a_metricsExporter.addCollector(
+                this.a_admission.collector());
+        }
+        if (cfg.threadStats && cfg.threadStats.enabled) {
+            this.a_threadStats = new lib_threads.ThreadStatsFSM({
+                haSock: lib_hasock,
+                log: this.a_log.child({ component: 'ThreadStatsFSM' }),
+                interval: cfg.threadStats.interval
+            });
+            this.a_metricsExporter.addCollector(
+                this.a_threadStats.collector());
+        }
+        if (cfg.poolStats && cfg.poolStats.enabled) {
+            this.a_poolStats = new lib_pools.PoolStatsFSM({
+                haSock: lib_hasock,
+                log: this.a_log.child({ component: 'PoolStatsFSM' }),
+                interval: cfg.poolStats.interval,
+                maxPools: cfg.poolStats.maxPools
+            });
+            this.a_metricsExporter.addCollector(
+                this.a_poolStats.collector());
+        }
+        if (this.a_recorder !== null) {
+            this.a_metricsExporter.addCollector(
+                this.a_recorder.collector());
+        }
+        if (this.a_accessLog !== null) {
+            this.a_metricsExporter.addCollector(
+                this.a_accessLog.collector());
+        }
+        if (this.a_serverStates !== null) {
+            this.a_metricsExporter.addCollector(
+                this.a_serverStates.collector());
+        }
+        if (this.a_agentWeights !== null) {
+            this.a_metricsExporter.addCollector(
+                this.a_agentWeights.collector());
+        }
+        if (this.a_denyList !== null) {
+            this.a_metricsExporter.addCollector(
+                this.a_denyList.collector());
+        }
         this.a_metricsExporter.start(function (err) {
             if (err) {
                 cfg.log.fatal(err, 'failed to start metrics server');
@@ -83,9 +265,93 @@ function AppFSM(cfg) {
     }
 
     FSM.call(this, 'getips');
+
+    this.a_selfMetrics.trackState('AppFSM', this);
+    this.a_selfMetrics.trackState('StatsPollerFSM', this.a_stats);
+    if (this.a_denyList !== null)
+        this.a_selfMetrics.trackState('DenyListFSM', this.a_denyList);
+    if (this.a_recorder !== null)
+        this.a_recorder.track('AppFSM', this);
 }
 mod_util.inherits(AppFSM, FSM);
 
+/*
+ * Returns the address (ip:port) of the server with the given haproxy name
+ * (svname), if we know of it.
+ */
+AppFSM.prototype.serverAddress = function (svname) {
+    var server = lib_lbman.lookupSvname(this.a_servers, svname);
+    if (server === undefined)
+        return (undefined);
+    return (server.address + ':' + svname.split(':')[1]);
+};
+
+/*
+ * Dumps the flight recorder (see lib/recorder.js) to disk, along with the
+ * recent changes to the set of backend servers. Options are as for
+ * FlightRecorderFSM.prototype.dump(); the callback is optional.
+ */
+AppFSM.prototype.dumpRecorder = function (opts, cb) {
+    mod_assert.object(opts, 'opts');
+    mod_assert.optionalFunc(cb, 'callback');
+    var log = this.a_log;
+
+    if (this.a_recorder === null) {
+        log.info('flight recorder is not enabled');
+        if (cb)
+            setImmediate(cb, null, null);
+        return;
+    }
+
+    this.a_recorder.dump({
+        reason: opts.reason,
+        auto: opts.auto,
+        error: opts.error,
+        extra: {
+            state: this.getState(),
+            serverHistory: (this.a_nsf !== null) ?
+                this.a_nsf.sw_serverHistory : []
+        }
+    }, function (err, file) {
+        if (cb)
+            cb(err, file);
+    });
+};
+
+/*
+ * Drains this instance ahead of shutdown (see lib/drain.js), calling cb once
+ * haproxy can be stopped. While draining, we stop reloading haproxy.
+ */
+AppFSM.prototype.drain = function (cb) {
+    mod_assert.func(cb, 'callback');
+    var self = this;
+
+    if (this.a_drainCfg.enabled === false) {
+        setImmediate(cb);
+        return;
+    }
+    this.a_drain.on('done', function () {
+        cb();
+    });
+    if (this.a_drain.isDraining())
+        return;
+
+    /*
+     * The load reporter must not restore our registration behind the drain's
+     * back, so let it finish what it's doing first.
+     */
+    var reporter = this.a_loadReporter;
+    if (reporter === null || reporter.isInState('stopped')) {
+        this.a_drain.drain();
+        return;
+    }
+    reporter.on('stateChanged', function (st) {
+        if (st === 'stopped')
+            self.a_drain.drain();
+    });
+    reporter.stop();
+};
+
 /*
  * Uses mdata-get or our configuration JSON to figure out which of our NIC IP
  * addresses are "untrusted" or "public" -- where we should be listening for
@@ -184,8 +450,30 @@ AppFSM.prototype.state_zksetup = function (S) {
     this.a_zk = new mod_zkstream.Client(opts);
     this.a_nsf = new lib_watch.ServerWatcherFSM({
         zk: this.a_zk,
-        log: this.a_log
+        log: this.a_log,
+        stats: this.a_stats,
+        removal: this.a_removalCfg,
+        removals: this.a_removals
     });
+    this.a_selfMetrics.trackState('ServerWatcherFSM', this.a_nsf);
+    if (this.a_recorder !== null)
+        this.a_recorder.track('ServerWatcherFSM', this.a_nsf);
+
+    if (this.a_loadReportCfg.enabled && this.a_loadReporter === null) {
+        this.a_loadReporter = new lib_registration.LoadReporterFSM({
+            stats: this.a_stats,
+            zk: this.a_zk,
+            log: this.a_log.child({ component: 'LoadReporterFSM' }),
+            config: this.a_loadReportCfg,
+            drain: this.a_drain
+        });
+        if (this.a_metricsExporter !== null) {
+            this.a_metricsExporter.addCollector(
+                this.a_loadReporter.collector());
+        }
+        if (this.a_recorder !== null)
+            this.a_recorder.track('LoadReporterFSM', this.a_loadReporter);
+    }
 
     S.on(this.a_zk, 'session', function () {
         S.gotoState('watch');
@@ -261,28 +549,37 @@ AppFSM.prototype.state_running = function (S) {
  *
  * Note this runs in running.clean and running.dirty states only.
  */
-AppFSM.prototype.doublecheck = function (S) {
+AppFSM.prototype.doublecheck = function (S, fresh) {
     var self = this;
     var log = self.a_log;
 
     if (Object.keys(self.a_servers).length === 0 || lib_lbman.reloading())
         return;
 
-    const statopts = {
-        log: self.a_log.child({ component: 'haproxy_sock' })
-    };
+    /*
+     * Stats from the last poll will do, unless a server state change event
+     * suggests something changed since: we invalidate them whenever we change
+     * haproxy's server state ourselves.
+     */
+    const statopts = { maxAge: fresh ? 0 : self.a_stats.interval() };
     log.trace('doing periodic double-check of haproxy servers');
-    lib_hasock.serverStats(statopts, S.callback(function (err, srvs) {
+    self.a_stats.snapshot(statopts, S.callback(function (err, snap) {
         if (err) {
             log.error(err, 'failed to check server state with ' +
                 'haproxy control socket during periodic check');
+            self.a_selfMetrics.incr('doublechecks', 'error');
             S.gotoState('running.dirty');
             return;
         }
-        var res = checkStats(self.a_servers, srvs);
+        var res = checkStats(self.a_servers,
+            lib_statspoller.serverStats(snap.stats));
         if (res.wrong.length > 0 || res.reload) {
             log.warn(res, 'haproxy server state was out of sync during ' +
                 'periodic check');
+            self.a_selfMetrics.incr('doublechecks', 'out_of_sync');
+            res.wrong.forEach(function (srv) {
+                self.a_selfMetrics.incr('outOfSync', srv.reason);
+            });
 
             if (res.reload) {
                 S.gotoState('running.reload');
@@ -291,10 +588,35 @@ AppFSM.prototype.doublecheck = function (S) {
                 }
         } else {
             log.trace('periodic check ok');
+            self.a_selfMetrics.incr('doublechecks', 'ok');
         }
     }));
 };
 
+/*
+ * Sets up the periodic double-check and, if we follow server state change
+ * events, an immediate one whenever an event doesn't match what we expect.
+ * Part of running.clean and running.dirty.
+ */
+AppFSM.prototype.watchServers = function (S) {
+    var self = this;
+
+    S.interval(this.a_doublecheckInterval, function () {
+        self.doublecheck(S);
+    });
+
+    if (this.a_serverStates === null)
+        return;
+    S.on(this.a_serverStates, 'serverEvent', function (ev) {
+        var reason = checkEvent(self.a_servers, ev);
+        if (reason === null)
+            return;
+        self.a_log.info({ event: ev, reason: reason },
+            'server state event out of sync; checking haproxy servers');
+        self.doublecheck(S, true);
+    });
+};
+
 AppFSM.prototype.state_running.clean = function (S) {
     var self = this;
     this.a_lastCleanTime = Date.now();
@@ -312,9 +634,7 @@ AppFSM.prototype.state_running.clean = function (S) {
         self.a_lastCleanTime = Date.now();
     });
 
-    S.interval(BESTATE_DOUBLECHECK, function () {
-        self.doublecheck(S);
-    });
+    this.watchServers(S);
 };
 
 /*
@@ -329,6 +649,15 @@ AppFSM.prototype.state_running.reload = function (S) {
     var self = this;
     var log = this.a_log;
 
+    /*
+     * A reload would start a new worker accepting connections on the
+     * frontends we disabled.
+     */
+    if (self.a_drain.isDraining()) {
+        log.info('draining, not reloading haproxy');
+        return;
+    }
+
     /*
      * We're going to reload, so disabled servers will be going away altogether.
      */
@@ -346,18 +675,36 @@ AppFSM.prototype.state_running.reload = function (S) {
         trustedIP: self.a_trustedIP,
         untrustedIPs: self.a_untrustedIPs,
         haproxy: self.a_haproxyCfg,
+        tuning: self.a_tuning,
+        logSink: (self.a_accessLog !== null) ?
+            self.a_accessLog.address() : undefined,
+        prometheusBind: (self.a_metricsExporter !== null) ?
+            self.a_metricsExporter.haproxyExporterAddress() : undefined,
+        denyMap: (self.a_denyList !== null) ? DENY_MAP_FILE : undefined,
+        admissionMap: (self.a_admission !== null) ?
+            ADMISSION_MAP_FILE : undefined,
+        admissionLimits: (self.a_admission !== null) ?
+            self.a_admission.mapLimits() : undefined,
         servers: servers,
         log: self.a_log.child({ component: 'lb_manager' }),
         reload: self.a_reloadCmd
     };
 
     lib_lbman.reload(opts, S.callback(function (err) {
+        self.a_stats.invalidate();
         if (err) {
             log.error(err, 'lb reload failed');
+            self.a_selfMetrics.incr('reloads', 'error');
+            self.dumpRecorder({
+                reason: 'reload-failed',
+                auto: true,
+                error: err
+            });
             S.gotoState('running.dirty');
             return;
         }
         log.info({ servers: servers }, 'lb config reloaded');
+        self.a_selfMetrics.incr('reloads', 'ok');
 
         S.gotoState('running.clean');
     }));
@@ -398,24 +745,50 @@ AppFSM.prototype.state_running.dirty = function (S) {
         }
     });
 
-    S.interval(BESTATE_DOUBLECHECK, function () {
-        self.doublecheck(S);
-    });
+    this.watchServers(S);
+
+    /*
+     * We need the servers' state as of now, not the last poll, to decide
+     * what to change.
+     */
+    self.a_stats.snapshot({ maxAge: 0 }, S.callback(function (err, snap) {
+        if (err) {
+            log.error(err, 'failed to fetch server state from haproxy ' +
+                'control socket; falling back to new config');
+            self.a_selfMetrics.incr('syncs', 'error');
+            S.gotoState('running.reload');
+            return;
+        }
+        self.sync(S, lib_statspoller.serverStats(snap.stats));
+    }));
+};
+
+/*
+ * Applies our idea of which servers are enabled to haproxy using the control
+ * socket, given its current server stats. Part of running.dirty.
+ */
+AppFSM.prototype.sync = function (S, stats) {
+    var self = this;
+    var log = this.a_log;
 
     const syncopts = {
         log: self.a_log.child({ component: 'haproxy_sock' }),
-        servers: self.a_servers
+        servers: self.a_servers,
+        stats: stats
     };
 
     lib_hasock.syncServerState(syncopts, S.callback(function (err) {
+        self.a_stats.invalidate();
         if (err) {
             log.error(err, 'failed to sync server state with ' +
                 'haproxy control socket; falling back to new config');
+            self.a_selfMetrics.incr('syncs', 'error');
             S.gotoState('running.reload');
             return;
         }
         log.info({ servers: self.a_servers },
             'lb updated using control socket');
+        self.a_selfMetrics.incr('syncs', 'ok');
         /*
          * If we changed to a state where no servers are disabled then we're
          * back to being "clean" with respect to the config file.
@@ -467,8 +840,11 @@ function checkStats(servers, stats) {
             return;
         }
         /*
-         * Finally check that our enabled state is correct.
+         * Finally check that our enabled state is correct. The streaming
+         * backends' servers follow the state of the ones they track.
          */
+        if (lib_lbman.isStreamingBackend(srv.pxname))
+            return;
         if (server.enabled && srv.status === 'MAINT') {
             wrong.push(srv);
             srv.reason = 'want-enabled';
@@ -484,8 +860,32 @@ function checkStats(servers, stats) {
     return ({ wrong: wrong, reload: reload });
 }
 
+/*
+ * Matches a server state change event (see lib/server_events.js) against our
+ * idea of the servers, like checkStats() does for the stats. Returns the
+ * reason it doesn't match, or null if it does.
+ */
+function checkEvent(servers, ev) {
+    var server = lib_lbman.lookupSvname(servers, ev.server);
+
+    /*
+     * This may also be an old worker, still running after a reload, logging
+     * about a server we've since removed.
+     */
+    if (server === undefined)
+        return ('no-server');
+    if (lib_lbman.isStreamingBackend(ev.backend))
+        return (null);
+    if (server.enabled && ev.state === 'maint')
+        return ('want-enabled');
+    if (!server.enabled && ev.state !== 'maint')
+        return ('want-disabled');
+    return (null);
+}
+
 module.exports = {
     AppFSM: AppFSM,
     // for testing
+    checkEvent: checkEvent,
     checkStats: checkStats
 };
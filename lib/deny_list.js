@@ -0,0 +1,325 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 MNX Cloud, Inc.
+ */
+
+/*
+ * A list of client addresses to reject, applied without reloading haproxy.
+ *
+ * The deny list is a file of IP addresses and CIDR blocks, one per line, with
+ * "#" comments. The public frontends look up each client address in a map
+ * file (see denyLines() in lib/lb_manager.js), whose keys and values are both
+ * the deny list entries, and reject the connection if it matches.
+ *
+ * The DenyListFSM reads the deny list every interval ms. When it has changed,
+ * it rewrites the map file, so that a reload picks it up, and then brings
+ * haproxy's copy of the map in line with "add map" and "del map" on the
+ * control socket. haproxy also counts the rejected connections by entry in a
+ * stick table, which we read back to export hits per entry.
+ *
+ *      +---------+  timeout (interval)  +---------+
+ *      |         | -------------------> |         |
+ *      | waiting |                      | reading |
+ *      |         | <---+                |         |
+ *      +---------+     |                +---------+
+ *                      |                     |
+ *                      |    done or error    |
+ *                      +---- syncing <-------+
+ */
+
+/*jsl:ignore*/
+'use strict';
+/*jsl:end*/
+
+const mod_assert = require('assert-plus');
+const mod_fs = require('fs');
+const mod_net = require('net');
+const mod_util = require('util');
+const mod_vasync = require('vasync');
+const FSM = require('mooremachine').FSM;
+
+const lib_lbman = require('./lb_manager');
+
+const DEFAULTS = {
+    file: '/opt/smartdc/muppet/etc/deny.list',
+    interval: 5000                  /* ms */
+};
+
+/*
+ * Returns the entry (an address or CIDR block) on a line of the deny list,
+ * null if there is none, or an Error if it's not a valid entry.
+ */
+function parseEntry(line) {
+    var entry = line.replace(/#.*$/, '').trim();
+    if (entry === '')
+        return (null);
+
+    var parts = entry.split('/');
+    var family = mod_net.isIP(parts[0]);
+    var valid = (family !== 0 && parts.length <= 2);
+    if (valid && parts.length === 2) {
+        var len = (family === 4) ? 32 : 128;
+        valid = /^\d+$/.test(parts[1]) && parseInt(parts[1], 10) <= len;
+    }
+    if (!valid)
+        return (new Error('invalid deny list entry: ' + entry));
+    return (entry);
+}
+
+/*
+ * Parses the contents of the deny list into { entries, errors }: the sorted,
+ * unique entries, and an Error for each invalid line (which is skipped).
+ */
+function parseDenyList(str) {
+    mod_assert.string(str, 'str');
+
+    var entries = {};
+    var errors = [];
+    str.split('\n').forEach(function (line) {
+        var entry = parseEntry(line);
+        if (entry instanceof Error)
+            errors.push(entry);
+        else if (entry !== null)
+            entries[entry] = true;
+    });
+    return ({ entries: Object.keys(entries).sort(), errors: errors });
+}
+
+/*
+ * Returns the map file contents for a list of entries.
+ */
+function mapContents(entries) {
+    mod_assert.arrayOfString(entries, 'entries');
+    return (entries.map(function (entry) {
+        return (entry + ' ' + entry + '\n');
+    }).join(''));
+}
+
+/*
+ * Options:
+ * - haSock, the lib/haproxy_sock.js module
+ * - log, a Bunyan logger
+ * - mapFile, the map file the generated haproxy config refers to
+ * - config (optional), the "denyList" section of the muppet configuration;
+ *   see DEFAULTS above for the settings and their defaults
+ */
+function DenyListFSM(opts) {
+    mod_assert.object(opts, 'opts');
+    mod_assert.object(opts.haSock, 'opts.haSock');
+    mod_assert.object(opts.log, 'opts.log');
+    mod_assert.string(opts.mapFile, 'opts.mapFile');
+    mod_assert.optionalObject(opts.config, 'opts.config');
+
+    var config = opts.config || {};
+    var cfg = {};
+    Object.keys(DEFAULTS).forEach(function (key) {
+        cfg[key] = (config[key] !== undefined) ? config[key] : DEFAULTS[key];
+    });
+    mod_assert.string(cfg.file, 'config.file');
+    mod_assert.number(cfg.interval, 'config.interval');
+
+    this.dl_cfg = cfg;
+    this.dl_haSock = opts.haSock;
+    this.dl_log = opts.log;
+    this.dl_mapFile = opts.mapFile;
+
+    /* The entries last read from the deny list, or null before then. */
+    this.dl_entries = null;
+    /* entry => connections rejected */
+    this.dl_hits = {};
+    this.dl_updates = { add: 0, del: 0 };
+    this.dl_errors = 0;
+
+    /* haproxy won't start if the map file is missing. */
+    mod_fs.writeFileSync(this.dl_mapFile, '', { flag: 'a' });
+
+    FSM.call(this, 'reading');
+}
+mod_util.inherits(DenyListFSM, FSM);
+
+DenyListFSM.prototype.state_waiting = function (S) {
+    S.gotoStateTimeout(this.dl_cfg.interval, 'reading');
+};
+
+DenyListFSM.prototype.state_reading = function (S) {
+    var self = this;
+    var log = this.dl_log;
+
+    mod_fs.readFile(this.dl_cfg.file, 'utf8', S.callback(function (err, str) {
+        if (err && err.code !== 'ENOENT') {
+            log.warn(err, 'failed to read deny list');
+            self.dl_errors++;
+            S.gotoState('waiting');
+            return;
+        }
+
+        var res = parseDenyList(err ? '' : str);
+        var changed = (self.dl_entries === null ||
+            self.dl_entries.join(',') !== res.entries.join(','));
+        if (!changed) {
+            S.gotoState('syncing');
+            return;
+        }
+
+        res.errors.forEach(function (e) {
+            log.warn(e, 'skipping deny list entry');
+        });
+        log.info({ entries: res.entries.length }, 'deny list changed');
+
+        var tmp = self.dl_mapFile + '.tmp';
+        mod_fs.writeFile(tmp, mapContents(res.entries), 'utf8',
+            S.callback(function (wErr) {
+            if (!wErr) {
+                mod_fs.rename(tmp, self.dl_mapFile, S.callback(onWrite));
+                return;
+            }
+            onWrite(wErr);
+        }));
+
+        function onWrite(wErr) {
+            if (wErr) {
+                log.warn(wErr, 'failed to write deny list map file');
+                self.dl_errors++;
+                S.gotoState('waiting');
+                return;
+            }
+            self.dl_entries = res.entries;
+            S.gotoState('syncing');
+        }
+    }));
+};
+
+DenyListFSM.prototype.state_syncing = function (S) {
+    var self = this;
+    var log = this.dl_log;
+    var haSock = this.dl_haSock;
+    var map = this.dl_mapFile;
+
+    function applyChanges(_, cb) {
+        haSock.showMap({ map: map, log: log }, function (err, current) {
+            if (err) {
+                cb(err);
+                return;
+            }
+
+            var want = {};
+            self.dl_entries.forEach(function (entry) {
+                want[entry] = true;
+            });
+            var have = {};
+            current.forEach(function (e) {
+                have[e.key] = true;
+            });
+
+            var ops = [];
+            Object.keys(have).forEach(function (key) {
+                if (!want[key])
+                    ops.push({ op: 'del', key: key });
+            });
+            self.dl_entries.forEach(function (entry) {
+                if (!have[entry])
+                    ops.push({ op: 'add', key: entry });
+            });
+
+            mod_vasync.forEachPipeline({
+                inputs: ops,
+                func: function applyOne(op, opCb) {
+                    var cmd = (op.op === 'add') ? 'addMapEntry' :
+                        'delMapEntry';
+                    haSock[cmd]({ map: map, key: op.key, value: op.key,
+                        log: log }, function (opErr) {
+                        if (!opErr)
+                            self.dl_updates[op.op]++;
+                        opCb(opErr);
+                    });
+                }
+            }, function (pErr) {
+                cb(pErr);
+            });
+        });
+    }
+
+    function readHits(_, cb) {
+        haSock.showTable({ table: lib_lbman.DENY_TABLE, log: log },
+            function (err, entries) {
+            if (err) {
+                cb(err);
+                return;
+            }
+            var hits = {};
+            entries.forEach(function (e) {
+                if (e.data.conn_cnt !== undefined)
+                    hits[e.key] = e.data.conn_cnt;
+            });
+            self.dl_hits = hits;
+            cb();
+        });
+    }
+
+    mod_vasync.pipeline({
+        funcs: [ applyChanges, readHits ]
+    }, S.callback(function (err) {
+        if (err) {
+            log.warn(err, 'failed to sync deny list with haproxy');
+            self.dl_errors++;
+        }
+        S.gotoState('waiting');
+    }));
+};
+
+/*
+ * Returns a metrics exporter collector (see lib/metrics_exporter.js).
+ */
+DenyListFSM.prototype.collector = function () {
+    var self = this;
+
+    return (function _collectDenyList() {
+        return ([
+            {
+                name: 'loadbalancer_deny_list_entries',
+                type: 'gauge',
+                desc: 'Number of entries in the deny list.',
+                metrics: [ { labels: {}, value: (self.dl_entries === null) ?
+                    0 : self.dl_entries.length } ]
+            },
+            {
+                name: 'loadbalancer_deny_list_hits_total',
+                type: 'counter',
+                desc: 'Total number of connections rejected by each deny ' +
+                    'list entry (since it last got a hit, for up to 24h).',
+                metrics: Object.keys(self.dl_hits).sort().map(function (e) {
+                    return ({ labels: { entry: e }, value: self.dl_hits[e] });
+                })
+            },
+            {
+                name: 'loadbalancer_deny_list_updates_total',
+                type: 'counter',
+                desc: 'Total number of deny list entries added to or ' +
+                    'removed from haproxy without a reload.',
+                metrics: Object.keys(self.dl_updates).map(function (op) {
+                    return ({ labels: { op: op },
+                        value: self.dl_updates[op] });
+                })
+            },
+            {
+                name: 'loadbalancer_deny_list_errors_total',
+                type: 'counter',
+                desc: 'Total number of failures to read the deny list or ' +
+                    'apply it to haproxy.',
+                metrics: [ { labels: {}, value: self.dl_errors } ]
+            }
+        ]);
+    });
+};
+
+module.exports = {
+    DenyListFSM: DenyListFSM,
+    // for testing
+    mapContents: mapContents,
+    parseDenyList: parseDenyList
+};
@@ -0,0 +1,339 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 MNX Cloud, Inc.
+ */
+
+/*
+ * Graceful drain of this load balancer instance.
+ *
+ * When the zone is stopped or upgraded, clients keep resolving this instance
+ * via DNS for as long as the registrar's record TTL. Killing haproxy straight
+ * away resets all of their connections. Instead, on shutdown we:
+ *
+ *   - withdraw our registration, by disabling registrar (which removes its
+ *     ZooKeeper nodes on the way out)
+ *   - wait for the DNS TTL, so that clients stop picking this instance for
+ *     new connections
+ *   - disable the frontends, so that haproxy stops accepting new connections
+ *     while established ones carry on
+ *   - wait for the in-flight connections to finish, up to a deadline
+ *
+ * and then emit 'done', after which muppet exits and SMF can stop haproxy.
+ * Muppet does not reload haproxy while draining, since a new worker would
+ * start accepting connections again.
+ *
+ * Nothing else re-enables registrar, so if muppet is started again after a
+ * drain without the zone rebooting, we do it when we start, and the instance
+ * comes back into service (muppet's first reload replaces the worker whose
+ * frontends were disabled). We only do so if it was the drain that disabled
+ * registrar, as recorded by its marker file (see lib/registration.js), and
+ * not, say, an operator.
+ *
+ * The in-flight connections are counted from the frontends' "scur" in the
+ * current worker; connections held by old workers lingering after a reload
+ * are not included (they are bounded by mworker-max-reloads anyway).
+ *
+ *   +-----------+
+ *   | restoring |
+ *   +-----------+
+ *         |
+ *         | ok or error
+ *         v
+ *   +------+  drainAsserted  +-------------+  ok or error  +---------+
+ *   | idle | --------------> | withdrawing | ------------> | waitdns |
+ *   +------+                 +-------------+               +---------+
+ *                                                               |
+ *                                                    timeout    | dnsTtl
+ *                                                               v
+ *   +------+  scur = 0 or    +---------+      ok or error  +-----------+
+ *   | done | <-------------- | waiting | <---------------- | disabling |
+ *   +------+  deadline       +---------+                   +-----------+
+ */
+
+/*jsl:ignore*/
+'use strict';
+/*jsl:end*/
+
+const mod_assert = require('assert-plus');
+const mod_util = require('util');
+const mod_vasync = require('vasync');
+const FSM = require('mooremachine').FSM;
+
+const lib_registration = require('./registration');
+
+const HAPROXY_FRONTEND = '0';
+const STATS_FRONTEND = 'stats_http';
+const POLL_INTERVAL = 1000;
+
+const DEFAULTS = {
+    registrarFmri: lib_registration.REGISTRAR_FMRI,
+    markerFile: '/var/run/muppet-drain-withdrawn',
+    dnsTtl: 60000,                  /* ms, matches the registrar record TTL */
+    deadline: 180000                /* ms */
+};
+
+const STATES = [ 'restoring', 'idle', 'withdrawing', 'waitdns', 'disabling',
+    'waiting', 'done' ];
+
+/*
+ * Returns the names of the frontends to drain and the number of connections
+ * still established on them, from the output of lib_hasock.allStats().
+ */
+function frontendConns(stats) {
+    mod_assert.array(stats, 'stats');
+
+    var frontends = [];
+    var conns = 0;
+    stats.forEach(function (stat) {
+        if (stat.type !== HAPROXY_FRONTEND || stat.pxname === STATS_FRONTEND)
+            return;
+        if (frontends.indexOf(stat.pxname) === -1)
+            frontends.push(stat.pxname);
+        conns += parseInt(stat.scur || '0', 10);
+    });
+
+    return ({ frontends: frontends, conns: conns });
+}
+
+/*
+ * Options:
+ * - haSock, the lib/haproxy_sock.js module
+ * - stats, the StatsPollerFSM (see lib/stats_poller.js)
+ * - log, a Bunyan logger
+ * - config, the "drain" section of the muppet configuration; see DEFAULTS
+ *   above for the settings and their defaults
+ */
+function DrainFSM(opts) {
+    mod_assert.object(opts, 'opts');
+    mod_assert.object(opts.haSock, 'opts.haSock');
+    mod_assert.object(opts.stats, 'opts.stats');
+    mod_assert.object(opts.log, 'opts.log');
+    mod_assert.optionalObject(opts.config, 'opts.config');
+
+    var config = opts.config || {};
+    var cfg = {};
+    Object.keys(DEFAULTS).forEach(function (key) {
+        cfg[key] = (config[key] !== undefined) ? config[key] : DEFAULTS[key];
+    });
+    mod_assert.string(cfg.registrarFmri, 'config.registrarFmri');
+    mod_assert.string(cfg.markerFile, 'config.markerFile');
+    mod_assert.number(cfg.dnsTtl, 'config.dnsTtl');
+    mod_assert.number(cfg.deadline, 'config.deadline');
+
+    this.d_cfg = cfg;
+    this.d_haSock = opts.haSock;
+    this.d_stats = opts.stats;
+    this.d_log = opts.log;
+
+    this.d_startTime = null;
+    this.d_frontends = [];
+    this.d_conns = null;
+    this.d_initialConns = null;
+    this.d_timedOut = false;
+    /* Whether drain() has been called. */
+    this.d_asserted = false;
+
+    FSM.call(this, 'restoring');
+}
+mod_util.inherits(DrainFSM, FSM);
+
+/*
+ * Starts draining; 'done' is emitted once it's safe to stop haproxy.
+ */
+DrainFSM.prototype.drain = function () {
+    this.d_asserted = true;
+    this.emit('drainAsserted');
+};
+
+DrainFSM.prototype.state_restoring = function (S) {
+    var cfg = this.d_cfg;
+    var log = this.d_log;
+
+    function restore(ours) {
+        if (!ours) {
+            S.gotoState('idle');
+            return;
+        }
+        lib_registration.setRegistrar({
+            enabled: true,
+            fmri: cfg.registrarFmri,
+            marker: cfg.markerFile,
+            log: log
+        }, S.callback(function (err) {
+            if (err)
+                log.error(err, 'failed to restore registration');
+            S.gotoState('idle');
+        }));
+    }
+
+    lib_registration.markedWithdrawn(cfg.markerFile, S.callback(restore));
+};
+
+DrainFSM.prototype.state_idle = function (S) {
+    var self = this;
+
+    function start() {
+        self.d_startTime = Date.now();
+        self.d_log.info({ config: self.d_cfg }, 'draining load balancer');
+        S.gotoState('withdrawing');
+    }
+
+    if (this.d_asserted) {
+        S.immediate(start);
+        return;
+    }
+    S.on(this, 'drainAsserted', start);
+};
+
+DrainFSM.prototype.state_withdrawing = function (S) {
+    var log = this.d_log;
+
+    lib_registration.setRegistrar({
+        enabled: false,
+        fmri: this.d_cfg.registrarFmri,
+        marker: this.d_cfg.markerFile,
+        log: log
+    }, S.callback(function (err) {
+        /*
+         * If we can't withdraw, clients keep coming until the frontends are
+         * disabled, but we still want to let in-flight requests finish.
+         */
+        if (err)
+            log.error(err, 'failed to withdraw registration');
+        S.gotoState('waitdns');
+    }));
+};
+
+DrainFSM.prototype.state_waitdns = function (S) {
+    this.d_log.info('waiting %d ms for DNS records to expire',
+        this.d_cfg.dnsTtl);
+    S.gotoStateTimeout(this.d_cfg.dnsTtl, 'disabling');
+};
+
+DrainFSM.prototype.state_disabling = function (S) {
+    var self = this;
+    var log = this.d_log;
+
+    var statopts = { maxAge: POLL_INTERVAL };
+    self.d_stats.snapshot(statopts, S.callback(function (err, snap) {
+        if (err) {
+            log.error(err, 'failed to list frontends to disable');
+            S.gotoState('waiting');
+            return;
+        }
+
+        var fc = frontendConns(snap.stats);
+        self.d_frontends = fc.frontends;
+        self.d_conns = fc.conns;
+        self.d_initialConns = fc.conns;
+
+        log.info({ frontends: fc.frontends, conns: fc.conns },
+            'disabling frontends');
+        mod_vasync.forEachPipeline({
+            inputs: fc.frontends,
+            func: function (frontend, next) {
+                self.d_haSock.disableFrontend({
+                    log: log,
+                    frontend: frontend
+                }, next);
+            }
+        }, S.callback(function (err2) {
+            if (err2)
+                log.error(err2, 'failed to disable frontends');
+            S.gotoState('waiting');
+        }));
+    }));
+};
+
+DrainFSM.prototype.state_waiting = function (S) {
+    var self = this;
+    var log = this.d_log;
+
+    S.timeout(this.d_cfg.deadline, function () {
+        log.warn({ conns: self.d_conns },
+            'drain deadline reached with connections still open');
+        self.d_timedOut = true;
+        S.gotoState('done');
+    });
+
+    S.interval(POLL_INTERVAL, function () {
+        var statopts = { maxAge: POLL_INTERVAL };
+        self.d_stats.snapshot(statopts, S.callback(function (err, snap) {
+            if (err) {
+                log.warn(err, 'failed to count in-flight connections');
+                return;
+            }
+            self.d_conns = frontendConns(snap.stats).conns;
+            log.debug({ conns: self.d_conns }, 'draining');
+            if (self.d_conns === 0)
+                S.gotoState('done');
+        }));
+    });
+};
+
+DrainFSM.prototype.state_done = function (S) {
+    this.d_log.info({
+        elapsed: Date.now() - this.d_startTime,
+        conns: this.d_conns,
+        timedOut: this.d_timedOut
+    }, 'drain complete');
+    this.emit('done');
+};
+
+DrainFSM.prototype.isDraining = function () {
+    return (this.d_asserted);
+};
+
+/*
+ * Returns a metrics exporter collector (see lib/metrics_exporter.js) for the
+ * drain's progress.
+ */
+DrainFSM.prototype.collector = function () {
+    var self = this;
+
+    return (function _collectDrain() {
+        var state = self.getState();
+        var elapsed = (self.d_startTime === null) ? 0 :
+            (Date.now() - self.d_startTime) / 1000;
+
+        return ([
+            {
+                name: 'loadbalancer_drain_state',
+                type: 'gauge',
+                desc: 'Current drain state (1 for the current state).',
+                metrics: STATES.map(function (st) {
+                    return ({ labels: { state: st },
+                        value: (st === state) ? 1 : 0 });
+                })
+            },
+            {
+                name: 'loadbalancer_drain_elapsed_seconds',
+                type: 'gauge',
+                desc: 'Seconds since the drain started.',
+                metrics: [ { labels: {}, value: elapsed } ]
+            },
+            {
+                name: 'loadbalancer_drain_connections',
+                type: 'gauge',
+                desc: 'Connections still established on the drained ' +
+                    'frontends, at the start of the wait and now.',
+                metrics: (self.d_conns === null) ? [] : [
+                    { labels: { when: 'initial' },
+                        value: self.d_initialConns },
+                    { labels: { when: 'current' }, value: self.d_conns }
+                ]
+            }
+        ]);
+    });
+};
+
+module.exports = {
+    DrainFSM: DrainFSM,
+    // for testing
+    frontendConns: frontendConns
+};
@@ -6,6 +6,7 @@
 
 /*
  * Copyright 2020 Joyent, Inc.
+ * Copyright 2026 MNX Cloud, Inc.
  */
 
 /*jsl:ignore*/
@@ -29,9 +30,22 @@ const HAPROXY_SOCK_PATH_TEST = '/tmp/haproxy.test';
 const CONNECT_TIMEOUT = 3000;
 const COMMAND_TIMEOUT = 30000;
 
-/* Stats commands */
+/*
+ * Stats commands. The type mask is 1 (frontends) | 2 (backends) | 4 (servers)
+ * | 8 (listeners, with "option socket-stats").
+ */
 const HAPROXY_SERVER_STATS_COMMAND = 'show stat -1 4 -1';
-const HAPROXY_ALL_STATS_COMMAND = 'show stat -1 7 -1';
+const HAPROXY_ALL_STATS_COMMAND = 'show stat -1 15 -1';
+const HAPROXY_PROXY_STATS_COMMAND = 'show stat -1 3 -1';
+const HAPROXY_INFO_COMMAND = 'show info';
+/*
+ * Both of the above in one round trip, for the metrics exporter: the CLI runs
+ * ';'-separated commands in order on the same connection.
+ */
+const HAPROXY_INFO_STATS_COMMAND = HAPROXY_INFO_COMMAND + ';' +
+    HAPROXY_ALL_STATS_COMMAND;
+/* "show" commands whose output is parsed by the caller (see showRaw()) */
+const RAW_SHOW_COMMANDS = [ 'activity', 'threads', 'profiling', 'pools' ];
 
 function HaproxyCmdFSM(opts) {
     mod_assert.string(opts.command, 'opts.command');
@@ -194,12 +208,212 @@ function disconnectServer(opts, cb) {
     });
 }
 
+/*
+ * Runs a command for which haproxy replies with nothing on success.
+ */
+function silentCommand(command, opts, cb) {
+    var fsm = new HaproxyCmdFSM({
+        command: command,
+        log: opts.log
+    });
+    fsm.on('result', function (output) {
+        if (/[^\s]/.test(output)) {
+            cb(new VError('haproxy returned unexpected output: %j', output));
+        } else {
+            cb(null);
+        }
+    });
+    fsm.on('error', function (err) {
+        cb(err);
+    });
+}
+
+function setFrontendMaxconn(opts, cb) {
+    mod_assert.object(opts, 'options');
+    mod_assert.func(cb, 'callback');
+    mod_assert.string(opts.frontend, 'opts.frontend');
+    mod_assert.number(opts.maxconn, 'opts.maxconn');
+    mod_assert.object(opts.log, 'opts.log');
+
+    silentCommand(mod_util.format('set maxconn frontend %s %d',
+        opts.frontend, opts.maxconn), opts, cb);
+}
+
+/*
+ * Sets a server's current weight (until the next reload).
+ */
+function setServerWeight(opts, cb) {
+    mod_assert.object(opts, 'options');
+    mod_assert.func(cb, 'callback');
+    mod_assert.string(opts.backend, 'opts.backend');
+    mod_assert.string(opts.server, 'opts.server');
+    mod_assert.number(opts.weight, 'opts.weight');
+    mod_assert.object(opts.log, 'opts.log');
+
+    silentCommand(mod_util.format('set weight %s/%s %d', opts.backend,
+        opts.server, opts.weight), opts, cb);
+}
+
+/*
+ * Stops the frontend from accepting new connections; established connections
+ * are left alone.
+ */
+function disableFrontend(opts, cb) {
+    mod_assert.object(opts, 'options');
+    mod_assert.func(cb, 'callback');
+    mod_assert.string(opts.frontend, 'opts.frontend');
+    mod_assert.object(opts.log, 'opts.log');
+
+    silentCommand(mod_util.format('disable frontend %s', opts.frontend),
+        opts, cb);
+}
+
+/*
+ * Adds an entry to a map file loaded by haproxy (changing it only in memory;
+ * the file itself is left alone).
+ */
+function addMapEntry(opts, cb) {
+    mod_assert.object(opts, 'options');
+    mod_assert.func(cb, 'callback');
+    mod_assert.string(opts.map, 'opts.map');
+    mod_assert.string(opts.key, 'opts.key');
+    mod_assert.string(opts.value, 'opts.value');
+    mod_assert.object(opts.log, 'opts.log');
+
+    silentCommand(mod_util.format('add map %s %s %s', opts.map, opts.key,
+        opts.value), opts, cb);
+}
+
+/*
+ * Changes the value of an existing entry of a map file loaded by haproxy
+ * (again only in memory).
+ */
+function setMapEntry(opts, cb) {
+    mod_assert.object(opts, 'options');
+    mod_assert.func(cb, 'callback');
+    mod_assert.string(opts.map, 'opts.map');
+    mod_assert.string(opts.key, 'opts.key');
+    mod_assert.string(opts.value, 'opts.value');
+    mod_assert.object(opts.log, 'opts.log');
+
+    silentCommand(mod_util.format('set map %s %s %s', opts.map, opts.key,
+        opts.value), opts, cb);
+}
+
+/*
+ * Removes all entries for a key from a map file loaded by haproxy.
+ */
+function delMapEntry(opts, cb) {
+    mod_assert.object(opts, 'options');
+    mod_assert.func(cb, 'callback');
+    mod_assert.string(opts.map, 'opts.map');
+    mod_assert.string(opts.key, 'opts.key');
+    mod_assert.object(opts.log, 'opts.log');
+
+    silentCommand(mod_util.format('del map %s %s', opts.map, opts.key),
+        opts, cb);
+}
+
+/*
+ * Parses "show map" output, one "<id> <key> <value>" line per entry (the id
+ * being the entry's address, e.g. "0x55d6e9d4a1c0"), into [ { key, value } ].
+ */
+function parseMap(output) {
+    var entries = [];
+    output.split('\n').forEach(function (line) {
+        var m = /^(0x)?[0-9a-f]+ (\S+) (.*)$/.exec(line);
+        if (m !== null)
+            entries.push({ key: m[2], value: m[3] });
+    });
+    return (entries);
+}
+
+/*
+ * Parses "show table <name>" output, a "# table: ..." heading followed by one
+ * "<id>: key=<key> use=<n> exp=<ms> <data>=<value> ..." line per entry, into
+ * [ { key, data: { <data>: <value> } } ].
+ */
+function parseTable(output) {
+    var entries = [];
+    output.split('\n').forEach(function (line) {
+        var m = /^0x[0-9a-f]+: key=(\S+)(.*)$/.exec(line);
+        if (m === null)
+            return;
+        var data = {};
+        m[2].trim().split(/\s+/).forEach(function (field) {
+            var kv = field.split('=');
+            if (kv.length === 2 && kv[0] !== 'use' && kv[0] !== 'exp')
+                data[kv[0]] = parseInt(kv[1], 10);
+        });
+        entries.push({ key: m[1], data: data });
+    });
+    return (entries);
+}
+
+/*
+ * Calls back with the entries of a map file loaded by haproxy (see
+ * parseMap()).
+ */
+function showMap(opts, cb) {
+    mod_assert.object(opts, 'options');
+    mod_assert.func(cb, 'callback');
+    mod_assert.string(opts.map, 'opts.map');
+    mod_assert.object(opts.log, 'opts.log');
+
+    var fsm = new HaproxyCmdFSM({
+        command: 'show map ' + opts.map,
+        log: opts.log
+    });
+    fsm.on('result', function (output) {
+        if (/^Unknown map/.test(output)) {
+            cb(new VError('haproxy returned unexpected output: %j', output));
+            return;
+        }
+        cb(null, parseMap(output));
+    });
+    fsm.on('error', function (err) {
+        cb(err);
+    });
+}
+
+/*
+ * Calls back with the entries of a stick table (see parseTable()).
+ */
+function showTable(opts, cb) {
+    mod_assert.object(opts, 'options');
+    mod_assert.func(cb, 'callback');
+    mod_assert.string(opts.table, 'opts.table');
+    mod_assert.object(opts.log, 'opts.log');
+
+    var fsm = new HaproxyCmdFSM({
+        command: 'show table ' + opts.table,
+        log: opts.log
+    });
+    fsm.on('result', function (output) {
+        if (!/^# table: /.test(output)) {
+            cb(new VError('haproxy returned unexpected output: %j', output));
+            return;
+        }
+        cb(null, parseTable(output));
+    });
+    fsm.on('error', function (err) {
+        cb(err);
+    });
+}
+
 function serverStats(opts, cb) {
     statsCommon(opts, HAPROXY_SERVER_STATS_COMMAND, cb);
 }
 function allStats(opts, cb) {
     statsCommon(opts, HAPROXY_ALL_STATS_COMMAND, cb);
 }
+/*
+ * Frontends and backends only: much cheaper than allStats() with many
+ * servers, for callers that sample frequently.
+ */
+function proxyStats(opts, cb) {
+    statsCommon(opts, HAPROXY_PROXY_STATS_COMMAND, cb);
+}
 
 function statsCommon(opts, cmd, cb) {
     mod_assert.object(opts, 'options');
@@ -225,24 +439,11 @@ function statsCommon(opts, cmd, cb) {
             return;
         }
 
-        var lines = output.split('\n');
-        if (!/^#/.test(lines[0])) {
+        var objs = parseStats(output);
+        if (objs === null) {
             cb(new VError('haproxy returned unexpected output: %j', output));
             return;
         }
-        var headings = lines[0].slice(2).split(',');
-        var objs = [];
-        lines.slice(1).forEach(function (line) {
-            var parts = line.split(',');
-            if (parts.length < headings.length)
-                return;
-            var obj = {};
-            for (var i = 0; i < parts.length; ++i) {
-                if (parts[i].length > 0)
-                    obj[headings[i]] = parts[i];
-            }
-            objs.push(obj);
-        });
         cb(null, objs);
     });
     fsm.on('error', function (err) {
@@ -250,10 +451,163 @@ function statsCommon(opts, cmd, cb) {
     });
 }
 
+/*
+ * Parses "show stat" CSV output into an array of objects keyed by the column
+ * headings. Returns null if the output isn't "show stat" output.
+ */
+function parseStats(output) {
+    var lines = output.split('\n');
+    if (!/^#/.test(lines[0]))
+        return (null);
+    var headings = lines[0].slice(2).split(',');
+    var objs = [];
+    lines.slice(1).forEach(function (line) {
+        var parts = line.split(',');
+        if (parts.length < headings.length)
+            return;
+        var obj = {};
+        for (var i = 0; i < parts.length; ++i) {
+            if (parts[i].length > 0)
+                obj[headings[i]] = parts[i];
+        }
+        objs.push(obj);
+    });
+    return (objs);
+}
+
+/*
+ * Parses "show info" output, which is one "Name: value" pair per line, into
+ * an object keyed by name. Values are left as strings.
+ */
+function parseInfo(output) {
+    var info = {};
+    output.split('\n').forEach(function (line) {
+        var idx = line.indexOf(':');
+        if (idx <= 0)
+            return;
+        info[line.slice(0, idx)] = line.slice(idx + 1).trim();
+    });
+    return (info);
+}
+
+function showInfo(opts, cb) {
+    mod_assert.object(opts, 'options');
+    mod_assert.func(cb, 'callback');
+    mod_assert.object(opts.log, 'opts.log');
+
+    var fsm = new HaproxyCmdFSM({
+        command: HAPROXY_INFO_COMMAND,
+        log: opts.log
+    });
+    fsm.on('result', function (output) {
+        /* See statsCommon() for OS-8159. */
+        if (output.length === 0 && !opts.retrying) {
+            opts.retrying = true;
+            opts.log.info('got empty reply from haproxy; retrying');
+            showInfo(opts, cb);
+            return;
+        }
+
+        var info = parseInfo(output);
+        if (info.Pid === undefined) {
+            cb(new VError('haproxy returned unexpected output: %j', output));
+            return;
+        }
+        cb(null, info);
+    });
+    fsm.on('error', function (err) {
+        cb(err);
+    });
+}
+
+/*
+ * Runs "show <what>" for diagnostic output which the caller parses itself,
+ * calling back with (err, output).
+ */
+function showRaw(opts, cb) {
+    mod_assert.object(opts, 'options');
+    mod_assert.func(cb, 'callback');
+    mod_assert.string(opts.what, 'opts.what');
+    mod_assert.ok(RAW_SHOW_COMMANDS.indexOf(opts.what) !== -1,
+        'opts.what must be one of ' + RAW_SHOW_COMMANDS.join(', '));
+    mod_assert.object(opts.log, 'opts.log');
+
+    var fsm = new HaproxyCmdFSM({
+        command: 'show ' + opts.what,
+        log: opts.log
+    });
+    fsm.on('result', function (output) {
+        /* See statsCommon() for OS-8159. */
+        if (output.length === 0 && !opts.retrying) {
+            opts.retrying = true;
+            opts.log.info('got empty reply from haproxy; retrying');
+            showRaw(opts, cb);
+            return;
+        }
+        cb(null, output);
+    });
+    fsm.on('error', function (err) {
+        cb(err);
+    });
+}
+
+/*
+ * Splits the output of HAPROXY_INFO_STATS_COMMAND, which is the "show info"
+ * output followed by the "show stat" output (starting at its "# " heading
+ * line), and parses both. Returns null if either part is missing.
+ */
+function parseInfoAndStats(output) {
+    var idx = output.indexOf('\n# ');
+    if (idx === -1)
+        return (null);
+    var info = parseInfo(output.slice(0, idx));
+    var stats = parseStats(output.slice(idx + 1));
+    if (info.Pid === undefined || stats === null)
+        return (null);
+    return ({ info: info, stats: stats });
+}
+
+/*
+ * Fetches both "show info" and all stats (as allStats() does), calling back
+ * with (err, info, stats).
+ */
+function infoAndStats(opts, cb) {
+    mod_assert.object(opts, 'options');
+    mod_assert.func(cb, 'callback');
+    mod_assert.object(opts.log, 'opts.log');
+
+    var fsm = new HaproxyCmdFSM({
+        command: HAPROXY_INFO_STATS_COMMAND,
+        log: opts.log
+    });
+    fsm.on('result', function (output) {
+        /* See statsCommon() for OS-8159. */
+        if (output.length === 0 && !opts.retrying) {
+            opts.retrying = true;
+            opts.log.info('got empty reply from haproxy; retrying');
+            infoAndStats(opts, cb);
+            return;
+        }
+
+        var res = parseInfoAndStats(output);
+        if (res === null) {
+            cb(new VError('haproxy returned unexpected output: %j', output));
+            return;
+        }
+        cb(null, res.info, res.stats);
+    });
+    fsm.on('error', function (err) {
+        cb(err);
+    });
+}
+
 /*
  * The "opt.servers" argument is an object where each key corresponds to the
  * 'svname' of an haproxy server name (<pxname/<svname>).
  *
+ * If given, "opts.stats" is the current output of serverStats() (e.g. from
+ * lib/stats_poller.js), and we don't fetch it again.
+ *
  * See lib/lb_manager.js for an explanation of haproxy configuration.
  */
 function syncServerState(opts, cb) {
@@ -261,10 +615,17 @@ function syncServerState(opts, cb) {
     mod_assert.func(cb, 'callback');
     mod_assert.object(opts.servers, 'opts.servers');
     mod_assert.object(opts.log, 'opts.log');
+    mod_assert.optionalArrayOfObject(opts.stats, 'opts.stats');
 
     var servers = opts.servers;
 
-    serverStats({ log: opts.log }, function (err, stats) {
+    if (opts.stats !== undefined) {
+        setImmediate(_sync, null, opts.stats);
+    } else {
+        serverStats({ log: opts.log }, _sync);
+    }
+
+    function _sync(err, stats) {
         var toDisable = [];
         var toEnable = [];
 
@@ -288,6 +649,10 @@ function syncServerState(opts, cb) {
                 return;
             }
 
+            /* These follow the state of the servers they track. */
+            if (lib_lbman.isStreamingBackend(stat.pxname))
+                return;
+
             if (!server.enabled && stat.status !== 'MAINT') {
                 toDisable.push({
                     log: opts.log,
@@ -359,7 +724,7 @@ function syncServerState(opts, cb) {
                 });
             });
         });
-    });
+    }
 }
 
 /*
@@ -374,8 +739,9 @@ var queue = mod_vasync.queue(function (task, qcb) {
     mod_assert.object(task.opts, 'task.opts');
     mod_assert.func(task.cb, 'task.cb');
 
-    task.func(task.opts, function _cb(err, data) {
-        task.cb(err, data);
+    /* Pass all results through: infoAndStats() calls back with two. */
+    task.func(task.opts, function _cb() {
+        task.cb.apply(null, arguments);
         qcb();
     });
 }, 1);
@@ -393,15 +759,45 @@ function serialize(func) {
     });
 }
 
+/* Commands running or waiting to run. */
+function queueDepth() {
+    return (queue.npending + queue.length());
+}
+
 
 module.exports = {
     /* Exported for testing */
+    parseInfo: parseInfo,
+    parseInfoAndStats: parseInfoAndStats,
+    parseMap: parseMap,
+    parseTable: parseTable,
     disableServer: serialize(disableServer),
     enableServer: serialize(enableServer),
     disconnectServer: serialize(disconnectServer),
     /* Used by app.js */
     serverStats: serialize(serverStats),
     syncServerState: serialize(syncServerState),
-    /* Used by metric_exporter.js */
-    allStats: serialize(allStats)
+    /* Used by stats_poller.js and metric_exporter.js */
+    allStats: serialize(allStats),
+    infoAndStats: serialize(infoAndStats),
+    /* Used by threads.js */
+    showRaw: serialize(showRaw),
+    /* Used by registration.js */
+    showInfo: serialize(showInfo),
+    /* Used by admission.js */
+    setFrontendMaxconn: serialize(setFrontendMaxconn),
+    setMapEntry: serialize(setMapEntry),
+    /* Used by drain.js */
+    disableFrontend: serialize(disableFrontend),
+    /* Used by agent_weights.js */
+    setServerWeight: serialize(setServerWeight),
+    /* Used by recorder.js */
+    proxyStats: serialize(proxyStats),
+    /* Used by deny_list.js */
+    addMapEntry: serialize(addMapEntry),
+    delMapEntry: serialize(delMapEntry),
+    showMap: serialize(showMap),
+    showTable: serialize(showTable),
+    /* Used by self_metrics.js */
+    queueDepth: queueDepth
 };
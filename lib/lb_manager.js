@@ -6,6 +6,7 @@
 
 /*
  * Copyright 2021 Joyent, Inc.
+ * Copyright 2026 MNX Cloud, Inc.
  */
 
 /*
@@ -63,6 +64,8 @@ const once = require('once');
 const vasync = require('vasync');
 const jsprim = require('jsprim');
 
+const lib_tuning = require('./tuning');
+
 ///--- Globals
 
 const CFG_FILE = path.resolve(__dirname, '../etc/haproxy.cfg');
@@ -74,16 +77,717 @@ const RELOAD = '/usr/sbin/svcadm refresh ' + HAPROXY_FMRI;
 var HTTP_FRONTEND = '';
 HTTP_FRONTEND += 'frontend http_external\n';
 HTTP_FRONTEND += '        default_backend insecure_api\n';
+HTTP_FRONTEND += '%(frontend_deny)s';
+HTTP_FRONTEND += '%(frontend_admission)s';
+HTTP_FRONTEND += '%(frontend_protection)s';
+HTTP_FRONTEND += '%(frontend_tracing)s';
 HTTP_FRONTEND += '        # Protect against CVE-2021-40346\n';
 /*JSSTYLED*/
 HTTP_FRONTEND += '        http-request  deny if { req.hdr_cnt(content-length) gt 1 }\n';
 /*JSSTYLED*/
 HTTP_FRONTEND += '        http-response deny if { res.hdr_cnt(content-length) gt 1 }\n';
+HTTP_FRONTEND += '%(frontend_priority)s';
+HTTP_FRONTEND += '%(frontend_logging)s';
+HTTP_FRONTEND += '%(frontend_streaming)s';
+
+/*
+ * haproxy's built-in Prometheus exporter, which needs haproxy built with
+ * HAPROXY_PROMETHEUS (see tools/mk/Makefile.haproxy.targ). Scrapes aren't
+ * logged.
+ */
+var PROMETHEUS_FRONTEND = '';
+PROMETHEUS_FRONTEND += '\nfrontend prometheus\n';
+PROMETHEUS_FRONTEND += '        no log\n';
+/*JSSTYLED*/
+PROMETHEUS_FRONTEND += '        http-request use-service prometheus-exporter if { path /metrics }\n';
+PROMETHEUS_FRONTEND += '        bind %(bind)s\n';
+
+const SSL_CERT_FILE = '/opt/smartdc/muppet/etc/ssl.pem';
+
+/*
+ * The stick table counting connections rejected by the deny list, by deny
+ * list entry; long enough for IPv6 CIDRs.
+ */
+var DENY_BACKEND = '';
+DENY_BACKEND += '\nbackend %(table)s\n';
+/*JSSTYLED*/
+DENY_BACKEND += '        stick-table type string len 64 size 100k expire 24h store conn_cnt\n';
+const DENY_TABLE = 'deny_list';
+
+/*
+ * The stick table counting sessions admitted by each public frontend, for
+ * the new session rate limits set by admission control.
+ */
+var ADMISSION_BACKEND = '';
+ADMISSION_BACKEND += '\nbackend %(table)s\n';
+/*JSSTYLED*/
+ADMISSION_BACKEND += '        stick-table type string len 32 size 16 expire 10s store gpc0_rate(1s)\n';
+const ADMISSION_TABLE = 'admission';
+
+const SPLICE_OPTIONS = {
+    'auto': [ 'option splice-auto' ],
+    'request': [ 'option splice-request' ],
+    'response': [ 'option splice-response' ],
+    'all': [ 'option splice-request', 'option splice-response' ]
+};
 
-const HTTP_BIND_LINE = '        bind %s:80\n';
+const PROTECTION_RATE_PERIOD = 10000;   /* ms */
+const PROTECTION_EXPIRE = 30000;        /* ms */
+const PROTECTION_TABLE_SIZE = '1m';
+
+const LOG_SLOW_THRESHOLD = 1000;        /* ms */
+
+/* the range of "http-request set-priority-class" */
+const PRIORITY_CLASS_MAX = 2047;
+
+const STREAMING_UPLOAD_SIZE = 1048576;  /* bytes */
+/* appended to a backend's name for its streaming backend */
+const STREAM_SUFFIX = '_stream';
+
+/*
+ * haproxy's own example: unique across load balancers (by frontend address)
+ * and their processes, but longer than a UUID.
+ */
+const UNIQUE_ID_FORMAT = '%{+X}o\\ %ci:%cp_%fi:%fp_%Ts_%rt:%pid';
+/* a UUID, and room for the longest unique id (IPv6 addresses in hex) */
+const REQUEST_ID_LEN = 36;
+const UNIQUE_ID_LEN = 128;
+/* which frontends get a Server-Timing header */
+const SERVER_TIMING = [ 'internal', 'all' ];
+
+const AGENT_KINDS = [ 'webapi', 'buckets-api' ];
+const AGENT_INTERVAL = 5000;            /* ms */
+/* so that agents' percentages map to whole weights */
+const AGENT_WEIGHT = 100;
 
 var reload_queue = vasync.queue(function (f, cb) { f(cb); }, 1);
 
+/*
+ * Validates the optional listener profile ("haproxy.listener" in the muppet
+ * configuration), which tunes the public and internal bind lines:
+ *
+ * - backlog, the listen(2) backlog for each bind socket
+ * - tfo, enable TCP Fast Open
+ * - deferAccept, only accept connections once data has arrived
+ * - shards, the number of bind sockets per address, each served by its own
+ *   subset of the haproxy threads
+ * - maxaccept, the global tune.maxaccept
+ *
+ * Returns an Error describing the first problem found, or null.
+ */
+function checkListenerProfile(listener, nbthread) {
+    assert.object(listener, 'listener');
+    assert.number(nbthread, 'nbthread');
+
+    if (listener.backlog !== undefined && (!Number.isInteger(
+        listener.backlog) || listener.backlog < 1)) {
+        return (new Error('listener backlog must be a positive integer'));
+    }
+    if (listener.tfo !== undefined && typeof (listener.tfo) !== 'boolean')
+        return (new Error('listener tfo must be a boolean'));
+    if (listener.deferAccept !== undefined &&
+        typeof (listener.deferAccept) !== 'boolean') {
+        return (new Error('listener deferAccept must be a boolean'));
+    }
+    if (listener.shards !== undefined && (!Number.isInteger(
+        listener.shards) || listener.shards < 1 ||
+        listener.shards > nbthread)) {
+        return (new Error('listener shards must be an integer between 1 ' +
+            'and nbthread (' + nbthread + ')'));
+    }
+    if (listener.maxaccept !== undefined && (!Number.isInteger(
+        listener.maxaccept) || listener.maxaccept < -1 ||
+        listener.maxaccept === 0)) {
+        return (new Error('listener maxaccept must be -1 or a positive ' +
+            'integer'));
+    }
+    return (null);
+}
+
+/*
+ * Validates the optional zero-copy forwarding settings in the haproxy
+ * configuration:
+ *
+ * - splice, one of 'auto', 'request', 'response' or 'all', to have haproxy
+ *   forward data between sockets using splice(2) where the platform supports
+ *   it (see the linux-glibc build in tools/mk/Makefile.haproxy.targ)
+ * - maxpipes, the global limit on pipes used for splicing
+ * - pipesize, the size of each pipe (tune.pipesize)
+ *
+ * Returns an Error describing the first problem found, or null.
+ */
+function checkSpliceOptions(hacfg) {
+    assert.object(hacfg, 'hacfg');
+
+    if (hacfg.splice !== undefined &&
+        !SPLICE_OPTIONS.hasOwnProperty(hacfg.splice)) {
+        return (new Error('splice must be one of: ' +
+            Object.keys(SPLICE_OPTIONS).join(', ')));
+    }
+    if (hacfg.maxpipes !== undefined && (!Number.isInteger(hacfg.maxpipes) ||
+        hacfg.maxpipes < 1)) {
+        return (new Error('maxpipes must be a positive integer'));
+    }
+    if (hacfg.pipesize !== undefined && (!Number.isInteger(hacfg.pipesize) ||
+        hacfg.pipesize < 4096)) {
+        return (new Error('pipesize must be an integer of at least 4096'));
+    }
+    return (null);
+}
+
+/*
+ * Validates the optional slow-client and connection-abuse protection profile
+ * ("haproxy.protection" in the muppet configuration), which applies to the
+ * public frontends (https and http_external):
+ *
+ * - httpRequestTimeout, ms allowed for a client to send the complete request
+ *   headers ("timeout http-request"); this is what defeats slowloris-style
+ *   clients, which otherwise only run into "timeout client"
+ * - keepAliveTimeout, ms an idle keep-alive connection is kept open waiting
+ *   for the next request ("timeout http-keep-alive")
+ * - connLimit, the maximum number of concurrent connections per source IP
+ * - connRateLimit, the maximum number of new connections per source IP over
+ *   ratePeriod ms (default 10s)
+ * - tableSize, the number of source IPs tracked (default 1m)
+ *
+ * Returns an Error describing the first problem found, or null.
+ */
+function checkProtectionProfile(protection) {
+    assert.object(protection, 'protection');
+
+    var positive = [ 'httpRequestTimeout', 'keepAliveTimeout', 'connLimit',
+        'connRateLimit', 'ratePeriod' ];
+    for (var i = 0; i < positive.length; i++) {
+        var val = protection[positive[i]];
+        if (val !== undefined && (!Number.isInteger(val) || val < 1)) {
+            return (new Error('protection ' + positive[i] +
+                ' must be a positive integer'));
+        }
+    }
+    if (protection.tableSize !== undefined &&
+        !/^[0-9]+[kmg]?$/.test(protection.tableSize)) {
+        return (new Error('protection tableSize must be a number with an ' +
+            'optional k, m or g suffix'));
+    }
+    return (null);
+}
+
+/*
+ * Generates the protection rules for a public frontend. Each frontend gets its
+ * own stick table, tracking each source IP's concurrent connections and
+ * connection rate, so that we can reject connections from abusive sources
+ * before they cost us a TLS handshake or a slot towards maxconn.
+ *
+ * Rejected connections are counted by haproxy as denied connections ("dcon")
+ * on the frontend and listener.
+ */
+function protectionLines(protection) {
+    var lines = '';
+
+    if (protection.httpRequestTimeout !== undefined) {
+        lines += sprintf('        timeout http-request %dms\n',
+            protection.httpRequestTimeout);
+    }
+    if (protection.keepAliveTimeout !== undefined) {
+        lines += sprintf('        timeout http-keep-alive %dms\n',
+            protection.keepAliveTimeout);
+    }
+
+    if (protection.connLimit === undefined &&
+        protection.connRateLimit === undefined) {
+        return (lines);
+    }
+
+    var period = protection.ratePeriod || PROTECTION_RATE_PERIOD;
+    var expire = Math.max(2 * period, PROTECTION_EXPIRE);
+    lines += sprintf('        stick-table type ipv6 size %s expire %dms ' +
+        'store conn_cur,conn_rate(%dms)\n',
+        protection.tableSize || PROTECTION_TABLE_SIZE, expire, period);
+    lines += '        tcp-request connection track-sc0 src\n';
+    if (protection.connLimit !== undefined) {
+        lines += sprintf('        tcp-request connection reject if ' +
+            '{ sc0_conn_cur gt %d }\n', protection.connLimit);
+    }
+    if (protection.connRateLimit !== undefined) {
+        lines += sprintf('        tcp-request connection reject if ' +
+            '{ sc0_conn_rate gt %d }\n', protection.connRateLimit);
+    }
+
+    return (lines);
+}
+
+/*
+ * Validates the optional access log sampling settings ("haproxy.logSampling"
+ * in the muppet configuration):
+ *
+ * - rate, log only one in this many successful (status below 400), fast
+ *   requests; 1 (the default) logs everything
+ * - slowThreshold, ms from the request headers to the response headers
+ *   above which a request is always logged (default 1000)
+ *
+ * Returns an Error describing the first problem found, or null.
+ */
+function checkLogSampling(sampling) {
+    assert.object(sampling, 'sampling');
+
+    var positive = [ 'rate', 'slowThreshold' ];
+    for (var i = 0; i < positive.length; i++) {
+        var val = sampling[positive[i]];
+        if (val !== undefined && (!Number.isInteger(val) || val < 1)) {
+            return (new Error('logSampling ' + positive[i] +
+                ' must be a positive integer'));
+        }
+    }
+    return (null);
+}
+
+/*
+ * Generates the access log sampling rules for a frontend. Every request starts
+ * out with a sampling rate of 1; once the response headers arrive, successful
+ * responses that took less than slowThreshold get the configured rate instead,
+ * and all but one in "rate" of those are silenced. Errors, slow requests and
+ * responses generated by haproxy itself (which skip the http-response rules)
+ * are always logged. The rate ends up in the "sample_rate" field of each line,
+ * so that counts can be reweighted.
+ *
+ * haproxy 2.0 has no fetch for the request timers, so we time the request
+ * ourselves, in microseconds, from date and date_us.
+ *
+ * These have to come after any other http-response rules, so that responses
+ * they deny are still logged.
+ */
+function logSamplingLines(sampling) {
+    if (sampling.rate === undefined || sampling.rate === 1)
+        return ('');
+
+    var slow = (sampling.slowThreshold || LOG_SLOW_THRESHOLD) * 1000;
+    var lines = '';
+    lines += '        http-request set-var(txn.log_rate) int(1)\n';
+    lines += '        http-request set-var(txn.log_us) date_us\n';
+    lines += '        http-request set-var(txn.log_start) ' +
+        'date,mul(1000000),add(txn.log_us)\n';
+    lines += '        http-response set-var(txn.log_us) date_us\n';
+    lines += '        http-response set-var(txn.log_elapsed) ' +
+        'date,mul(1000000),add(txn.log_us),sub(txn.log_start)\n';
+    lines += sprintf('        http-response set-var(txn.log_rate) int(%d) ' +
+        'if { status lt 400 } { var(txn.log_elapsed) -m int lt %d }\n',
+        sampling.rate, slow);
+    lines += sprintf('        http-response set-log-level silent ' +
+        'if { var(txn.log_rate) -m int gt 1 } !{ rand(%d) eq 0 }\n',
+        sampling.rate);
+
+    return (lines);
+}
+
+/*
+ * Validates the optional request priority settings ("haproxy.priority" in the
+ * muppet configuration):
+ *
+ * - internal, the priority class of requests on http_internal (default 0)
+ * - external, the priority class of requests on the public frontends, https
+ *   and http_external (default 0)
+ * - methods, an object mapping HTTP methods to an offset added to the
+ *   frontend's class for requests with that method
+ * - serverMaxconn, the maximum number of concurrent requests haproxy sends to
+ *   each server; further requests wait in the backend queue
+ * - queueTimeout, ms a request may wait in the backend queue (haproxy's
+ *   default is the connect timeout)
+ *
+ * Returns an Error describing the first problem found, or null.
+ */
+function checkPriority(priority) {
+    assert.object(priority, 'priority');
+
+    function classErr(what) {
+        return (new Error(sprintf('priority %s must be an integer between ' +
+            '-%d and %d', what, PRIORITY_CLASS_MAX, PRIORITY_CLASS_MAX)));
+    }
+    function isClass(val) {
+        return (Number.isInteger(val) && val >= -PRIORITY_CLASS_MAX &&
+            val <= PRIORITY_CLASS_MAX);
+    }
+
+    var bases = [ 'internal', 'external' ];
+    for (var i = 0; i < bases.length; i++) {
+        var base = priority[bases[i]];
+        if (base !== undefined && !isClass(base))
+            return (classErr(bases[i]));
+    }
+
+    var methods = priority.methods || {};
+    if (typeof (methods) !== 'object' || Array.isArray(methods))
+        return (new Error('priority methods must be an object'));
+    var names = Object.keys(methods);
+    for (var j = 0; j < names.length; j++) {
+        if (!/^[A-Z]+$/.test(names[j])) {
+            return (new Error('priority methods: bad method "' +
+                names[j] + '"'));
+        }
+        var offset = methods[names[j]];
+        if (!Number.isInteger(offset) ||
+            !isClass((priority.internal || 0) + offset) ||
+            !isClass((priority.external || 0) + offset))
+            return (classErr('for ' + names[j]));
+    }
+
+    var positive = [ 'serverMaxconn', 'queueTimeout' ];
+    for (var k = 0; k < positive.length; k++) {
+        var val = priority[positive[k]];
+        if (val !== undefined && (!Number.isInteger(val) || val < 1)) {
+            return (new Error('priority ' + positive[k] +
+                ' must be a positive integer'));
+        }
+    }
+    return (null);
+}
+
+/*
+ * Generates the request priority rules for a frontend whose requests are of
+ * class "base", with the per-method offsets applied on top.
+ *
+ * When all of a backend's servers are at their maxconn, haproxy queues
+ * requests in the backend, and dequeues them by class first (lowest first),
+ * then by arrival. This lets internal Manta traffic, and whichever methods are
+ * latency-sensitive, get ahead of a surge of external requests. Without a
+ * server maxconn nothing is queued, and the classes make no difference.
+ *
+ * Returns no rules if every class is haproxy's default of 0.
+ */
+function priorityLines(priority, base) {
+    var methods = priority.methods || {};
+    var lines = '';
+
+    if (base !== 0)
+        lines += sprintf('        http-request set-priority-class int(%d)\n',
+            base);
+    Object.keys(methods).forEach(function (method) {
+        if (methods[method] === 0)
+            return;
+        lines += sprintf('        http-request set-priority-class int(%d) ' +
+            'if { method %s }\n', base + methods[method], method);
+    });
+
+    return (lines);
+}
+
+/*
+ * Validates the optional streaming transfer settings ("haproxy.streaming" in
+ * the muppet configuration):
+ *
+ * - enabled, whether to send streaming transfers to their own backends
+ * - uploadSize, PUT requests with at least this many bytes, or with a chunked
+ *   body of unknown size, are streaming (default 1 MiB)
+ * - downloadPaths, an array of regular expressions; GET requests for paths
+ *   matching any of them are streaming
+ * - maxconn, the maximum number of concurrent streaming requests haproxy sends
+ *   to each server
+ *
+ * Returns an Error describing the first problem found, or null.
+ */
+function checkStreaming(streaming) {
+    assert.object(streaming, 'streaming');
+
+    var positive = [ 'uploadSize', 'maxconn' ];
+    for (var i = 0; i < positive.length; i++) {
+        var val = streaming[positive[i]];
+        if (val !== undefined && (!Number.isInteger(val) || val < 1)) {
+            return (new Error('streaming ' + positive[i] +
+                ' must be a positive integer'));
+        }
+    }
+
+    var paths = streaming.downloadPaths || [];
+    if (!Array.isArray(paths))
+        return (new Error('streaming downloadPaths must be an array'));
+    for (var j = 0; j < paths.length; j++) {
+        /* haproxy splits arguments on whitespace */
+        if (typeof (paths[j]) !== 'string' || paths[j].length === 0 ||
+            /\s/.test(paths[j])) {
+            return (new Error('streaming downloadPaths: bad pattern "' +
+                paths[j] + '"'));
+        }
+        try {
+            new RegExp(paths[j]);
+        } catch (e) {
+            return (new Error('streaming downloadPaths: bad pattern "' +
+                paths[j] + '": ' + e.message));
+        }
+    }
+    return (null);
+}
+
+/*
+ * Generates the rules sending a frontend's streaming transfers to "backend".
+ *
+ * Multi-gigabyte uploads and downloads hold on to a connection for minutes.
+ * Under "balance leastconn", a server busy with a few of those looks as loaded
+ * as one busy with as many short metadata requests, and with a server maxconn,
+ * metadata requests end up queued behind them. Giving streaming transfers their
+ * own backends, with the same servers, keeps the two apart: each backend
+ * balances and queues its own requests, with its own maxconn.
+ *
+ * GET requests don't say how much they will transfer, so downloads are only
+ * recognized by path.
+ *
+ * These have to come after any other use_backend rules that take precedence
+ * (e.g. for buckets-api).
+ */
+function streamingLines(streaming, backend) {
+    if (!streaming.enabled)
+        return ('');
+
+    var lines = '';
+    lines += '        acl acl_stream_put method PUT\n';
+    lines += '        acl acl_stream_chunked ' +
+        'req.hdr(transfer-encoding) -m sub -i chunked\n';
+    lines += sprintf('        acl acl_stream_size ' +
+        'req.hdr_val(content-length) ge %d\n',
+        streaming.uploadSize || STREAMING_UPLOAD_SIZE);
+    var cond = 'acl_stream_put acl_stream_size || ' +
+        'acl_stream_put acl_stream_chunked';
+    if (streaming.downloadPaths !== undefined &&
+        streaming.downloadPaths.length > 0) {
+        lines += '        acl acl_stream_path path_reg ' +
+            streaming.downloadPaths.join(' ') + '\n';
+        cond += ' || METH_GET acl_stream_path';
+    }
+    lines += sprintf('        use_backend %s if %s\n', backend, cond);
+
+    return (lines);
+}
+
+/*
+ * Whether a backend is one of the streaming backends (see streamingBackend()),
+ * whose servers' state follows another backend's: their status then reads
+ * "MAINT (via <backend>/<server>)", and they can't be enabled or disabled on
+ * their own.
+ */
+function isStreamingBackend(pxname) {
+    return (pxname.length > STREAM_SUFFIX.length &&
+        pxname.slice(-STREAM_SUFFIX.length) === STREAM_SUFFIX);
+}
+
+/*
+ * Generates a backend for streaming transfers, with the same servers as the
+ * backend it shadows. Its servers track the state of the other backend's
+ * rather than running health checks of their own. Tracking doesn't carry
+ * weights over, so the servers of agent checked kinds get the same configured
+ * weight, and muppet copies the weights their agents set (see
+ * lib/agent_weights.js).
+ */
+function streamingBackend(name, servers, streaming) {
+    var lines = '\nbackend ' + name + STREAM_SUFFIX + '\n';
+    servers.forEach(function (server) {
+        lines += sprintf('        server %s %s track %s/%s', server.name,
+            server.address, name, server.name);
+        if (server.weight !== undefined)
+            lines += ' weight ' + server.weight;
+        if (streaming.maxconn !== undefined)
+            lines += ' maxconn ' + streaming.maxconn;
+        lines += '\n';
+    });
+    return (lines);
+}
+
+/*
+ * Validates the optional request tracing settings ("haproxy.tracing" in the
+ * muppet configuration):
+ *
+ * - requestId, whether to generate an x-request-id for requests without one
+ * - serverTiming, which frontends add a Server-Timing header to responses:
+ *   "internal" (http_internal only) or "all"
+ *
+ * Returns an Error describing the first problem found, or null.
+ */
+function checkTracing(tracing) {
+    assert.object(tracing, 'tracing');
+
+    if (tracing.requestId !== undefined &&
+        typeof (tracing.requestId) !== 'boolean') {
+        return (new Error('tracing requestId must be a boolean'));
+    }
+    if (tracing.serverTiming !== undefined &&
+        SERVER_TIMING.indexOf(tracing.serverTiming) === -1) {
+        return (new Error('tracing serverTiming must be one of: ' +
+            SERVER_TIMING.join(', ')));
+    }
+    return (null);
+}
+
+/*
+ * Generates the request tracing rules for a frontend.
+ *
+ * Requests without an x-request-id get haproxy's unique id (see
+ * UNIQUE_ID_FORMAT), which is forwarded to the backend and logged, so that
+ * they can be followed through Manta like any other. This has to come before
+ * the rule capturing the header for the log.
+ *
+ * With "timing", responses get a Server-Timing header telling the client how
+ * long the request was queued in haproxy (%Tw), how long connecting to the
+ * server took (%Tc) and how long the server took to respond (%Tr), in ms.
+ * It's added alongside any the server sent. This tells clients about our
+ * internals, so it can be limited to http_internal.
+ */
+function tracingLines(tracing, timing) {
+    var lines = '';
+
+    if (tracing.requestId) {
+        lines += '        http-request set-header x-request-id ' +
+            '%[unique-id] unless { req.hdr(x-request-id) -m found }\n';
+    }
+    if (timing) {
+        lines += '        http-response add-header Server-Timing ' +
+            'lb-queue;dur=%Tw,lb-connect;dur=%Tc,backend;dur=%Tr\n';
+    }
+
+    return (lines);
+}
+
+/*
+ * Validates the optional agent check settings ("haproxy.agentCheck" in the
+ * muppet configuration), an object with settings for each kind of backend
+ * server ("webapi" or "buckets-api"):
+ *
+ * - enabled, whether to run agent checks against servers of this kind
+ * - port (optional), the agent port for servers whose registration doesn't
+ *   advertise one
+ * - interval, ms between agent checks (default 5s)
+ *
+ * Returns an Error describing the first problem found, or null.
+ */
+function checkAgentCheck(agentCheck) {
+    assert.object(agentCheck, 'agentCheck');
+
+    var kinds = Object.keys(agentCheck);
+    for (var i = 0; i < kinds.length; i++) {
+        var kind = kinds[i];
+        var kcfg = agentCheck[kind];
+        if (AGENT_KINDS.indexOf(kind) === -1)
+            return (new Error('agentCheck: unknown kind "' + kind + '"'));
+        if (typeof (kcfg) !== 'object' || kcfg === null)
+            return (new Error('agentCheck ' + kind + ' must be an object'));
+        if (kcfg.enabled !== undefined && typeof (kcfg.enabled) !== 'boolean')
+            return (new Error('agentCheck ' + kind + ' enabled must be a ' +
+                'boolean'));
+        if (kcfg.interval !== undefined &&
+            (!Number.isInteger(kcfg.interval) || kcfg.interval < 1)) {
+            return (new Error('agentCheck ' + kind + ' interval must be a ' +
+                'positive integer'));
+        }
+        if (kcfg.port !== undefined && (!Number.isInteger(kcfg.port) ||
+            kcfg.port < 1 || kcfg.port > 65535)) {
+            return (new Error('agentCheck ' + kind + ' port must be a ' +
+                'port number'));
+        }
+    }
+    return (null);
+}
+
+/*
+ * Returns the agent check parameters for a server's lines, if agent checks
+ * are enabled for its kind and we know its agent port. Servers of that kind
+ * whose agent port we don't know still get the same weight, so as not to get
+ * a hundredth of the share of those that do.
+ *
+ * The agent is a TCP service on the server, which haproxy connects to every
+ * interval and reads one line from: a weight in percent of the configured
+ * weight (e.g. "50%"), and/or a state ("ready", "drain", "maint", "up" or
+ * "down"). This lets a server shed load gradually, rather than going from all
+ * to nothing by failing its /ping health check. Servers get a weight of
+ * AGENT_WEIGHT, as percentages of haproxy's default weight of 1 would round to
+ * either 0 or 1.
+ *
+ * muppet owns servers' maintenance state (see syncServerState() in
+ * lib/haproxy_sock.js), so it undoes an agent's "maint"; agents should use
+ * "drain" or a weight of "0%" instead.
+ */
+function agentParams(agentCheck, server) {
+    var kcfg = agentCheck[server.kind];
+    if (kcfg === undefined || !kcfg.enabled)
+        return ('');
+
+    var port = (server.agentPort !== undefined) ? server.agentPort :
+        kcfg.port;
+    if (port === undefined)
+        return (sprintf(' weight %d', AGENT_WEIGHT));
+
+    return (sprintf(' weight %d agent-check agent-port %d agent-inter %dms',
+        AGENT_WEIGHT, port, kcfg.interval || AGENT_INTERVAL));
+}
+
+/*
+ * Generates the deny list rules for a public frontend. Connections from
+ * addresses matching an entry of the deny list map (see lib/deny_list.js) are
+ * rejected before anything else, and counted by entry in DENY_TABLE, which
+ * the map's values (the entries themselves) are the keys of.
+ *
+ * muppet changes the map at runtime, so entries take effect without a reload.
+ */
+function denyLines(denyMap) {
+    var lines = '';
+    lines += sprintf('        acl acl_denied src,map_ip(%s) -m found\n',
+        denyMap);
+    lines += sprintf('        tcp-request connection track-sc1 ' +
+        'src,map_ip(%s) table %s if acl_denied\n', denyMap, DENY_TABLE);
+    lines += '        tcp-request connection reject if acl_denied\n';
+    return (lines);
+}
+
+/*
+ * Generates the new session rate limit rules for a public frontend. The limit
+ * for each frontend is in the admission map (keyed by frontend name, 0 or
+ * missing for no limit), which admission control (see lib/admission.js)
+ * changes at runtime. Admitted sessions are counted in ADMISSION_TABLE, and
+ * new sessions are rejected while that rate is at the limit; rejected ones
+ * aren't counted, so that we keep admitting up to the limit under any load.
+ */
+function admissionLines(admissionMap) {
+    var lines = '';
+    lines += sprintf('        tcp-request session set-var(sess.adm_limit) ' +
+        'fe_name,map_str_int(%s,0)\n', admissionMap);
+    lines += sprintf('        tcp-request session track-sc2 fe_name ' +
+        'table %s if { var(sess.adm_limit) -m int gt 0 }\n', ADMISSION_TABLE);
+    lines += '        tcp-request session reject if ' +
+        '{ var(sess.adm_limit) -m int gt 0 } ' +
+        '{ sc2_gpc0_rate,sub(sess.adm_limit) ge 0 }\n';
+    lines += '        tcp-request session sc-inc-gpc0(2) if ' +
+        '{ var(sess.adm_limit) -m int gt 0 }\n';
+    return (lines);
+}
+
+/*
+ * Generates the bind lines for one address of a frontend. With more than one
+ * shard, we emit one bind line per shard, and haproxy opens a separate
+ * (SO_REUSEPORT) socket for each, so accepts are spread over the threads
+ * rather than all threads contending on a single socket.
+ *
+ * Each bind gets a name so that its stats (see "option socket-stats") can be
+ * told apart.
+ */
+function bindLines(bind, name, listener, nbthread) {
+    var params = '';
+    if (listener.backlog !== undefined)
+        params += ' backlog ' + listener.backlog;
+    if (listener.tfo)
+        params += ' tfo';
+    if (listener.deferAccept)
+        params += ' defer-accept';
+
+    var shards = listener.shards || 1;
+    var lines = '';
+    for (var i = 0; i < shards; i++) {
+        var shardParams = ' name ' + name + '-' + i + params;
+        if (shards > 1) {
+            var first = Math.floor(i * nbthread / shards) + 1;
+            var last = Math.floor((i + 1) * nbthread / shards);
+            shardParams += ' process 1/' + first +
+                (last > first ? '-' + last : '');
+        }
+        lines += '        bind ' + bind + shardParams + '\n';
+    }
+    return (lines);
+}
+
 /*
  * Generate a haproxy configuration file using the provided parameters.
  *
@@ -91,6 +795,17 @@ var reload_queue = vasync.queue(function (f, cb) { f(cb); }, 1);
  * - trustedIP, an address on the Manta network that is considered preauthorized
  * - untrustedIPs, an array of addresses that external traffic comes in over
  * - servers, an array of backend server addresses to forward requests to
+ * - tuning (optional), connection and buffer budget from lib/tuning.js;
+ *   computed from the haproxy options if not given
+ * - sslCertFile (optional), the certificate for the https frontend; the
+ *   empty string disables TLS (for testing)
+ * - logSink (optional), the address of a second syslog target for the access
+ *   log (see lib/access_log.js)
+ * - prometheusBind (optional), the address for haproxy's Prometheus exporter
+ *   to listen on (see lib/metrics_exporter.js)
+ * - denyMap (optional), the deny list map file (see lib/deny_list.js)
+ * - admissionMap (optional), the map of new session rate limits by public
+ *   frontend (see lib/admission.js)
  * - configFile, the config file to write out
  * - configTemplate, the config template string
  * - log, a Bunyan logger
@@ -100,6 +815,24 @@ function writeHaproxyConfig(opts, cb) {
     assert.arrayOfString(opts.untrustedIPs, 'options.untrustedIPs');
     assert.number(opts.haproxy.nbthread, 'options.haproxy.nbthread');
     assert.object(opts.servers, 'servers');
+    assert.optionalObject(opts.tuning, 'options.tuning');
+    assert.optionalObject(opts.haproxy.listener, 'options.haproxy.listener');
+    assert.optionalObject(opts.haproxy.protection,
+        'options.haproxy.protection');
+    assert.optionalBool(opts.haproxy.profiling, 'options.haproxy.profiling');
+    assert.optionalObject(opts.haproxy.logSampling,
+        'options.haproxy.logSampling');
+    assert.optionalObject(opts.haproxy.priority, 'options.haproxy.priority');
+    assert.optionalObject(opts.haproxy.streaming,
+        'options.haproxy.streaming');
+    assert.optionalObject(opts.haproxy.tracing, 'options.haproxy.tracing');
+    assert.optionalObject(opts.haproxy.agentCheck,
+        'options.haproxy.agentCheck');
+    assert.optionalString(opts.sslCertFile, 'options.sslCertFile');
+    assert.optionalString(opts.logSink, 'options.logSink');
+    assert.optionalString(opts.prometheusBind, 'options.prometheusBind');
+    assert.optionalString(opts.denyMap, 'options.denyMap');
+    assert.optionalString(opts.admissionMap, 'options.admissionMap');
     assert.string(opts.configFile, 'options.configFile');
     assert.string(opts.configTemplate, 'options.configTemplate');
     assert.object(opts.log, 'options.log');
@@ -112,6 +845,58 @@ function writeHaproxyConfig(opts, cb) {
         return (cb(new Error('Haproxy config error: No servers given')));
     }
 
+    const nbthread = opts.haproxy.nbthread;
+    const listener = opts.haproxy.listener || {};
+    const listenerErr = checkListenerProfile(listener, nbthread);
+    if (listenerErr !== null) {
+        return (cb(new Error('Haproxy config error: ' + listenerErr.message)));
+    }
+    const protection = opts.haproxy.protection || {};
+    const protectionErr = checkProtectionProfile(protection);
+    if (protectionErr !== null) {
+        return (cb(new Error('Haproxy config error: ' +
+            protectionErr.message)));
+    }
+    const spliceErr = checkSpliceOptions(opts.haproxy);
+    if (spliceErr !== null) {
+        return (cb(new Error('Haproxy config error: ' + spliceErr.message)));
+    }
+    const logSampling = opts.haproxy.logSampling || {};
+    const logSamplingErr = checkLogSampling(logSampling);
+    if (logSamplingErr !== null) {
+        return (cb(new Error('Haproxy config error: ' +
+            logSamplingErr.message)));
+    }
+    const frontendLogging = logSamplingLines(logSampling);
+    const priority = opts.haproxy.priority || {};
+    const priorityErr = checkPriority(priority);
+    if (priorityErr !== null) {
+        return (cb(new Error('Haproxy config error: ' + priorityErr.message)));
+    }
+    const frontendPriority = priorityLines(priority, priority.external || 0);
+    const internalPriority = priorityLines(priority, priority.internal || 0);
+    const streaming = opts.haproxy.streaming || {};
+    const streamingErr = checkStreaming(streaming);
+    if (streamingErr !== null) {
+        return (cb(new Error('Haproxy config error: ' +
+            streamingErr.message)));
+    }
+    const tracing = opts.haproxy.tracing || {};
+    const tracingErr = checkTracing(tracing);
+    if (tracingErr !== null) {
+        return (cb(new Error('Haproxy config error: ' + tracingErr.message)));
+    }
+    const agentCheck = opts.haproxy.agentCheck || {};
+    const agentCheckErr = checkAgentCheck(agentCheck);
+    if (agentCheckErr !== null) {
+        return (cb(new Error('Haproxy config error: ' +
+            agentCheckErr.message)));
+    }
+    const frontendTracing = tracingLines(tracing,
+        tracing.serverTiming === 'all');
+    const internalTracing = tracingLines(tracing,
+        tracing.serverTiming !== undefined);
+
     /*
      * Our log format is fixed, but the necessary escaping would make it close
      * to impossible to read - and comment on - so we do it here.
@@ -122,8 +907,16 @@ function writeHaproxyConfig(opts, cb) {
      * This is the least ugly way I could figure out to generate the correct
      * line, which needs to escape double quotes, but only when the field is
      * a string.
+     *
+     * With sampling, "sample_rate" is the number of requests each line stands
+     * for (see logSamplingLines()). It is a string, as it is "-" for requests
+     * haproxy rejects before the http-request rules run. It comes last, as
+     * lib/access_log.js relies on the order of the fields before it.
+     *
+     * With request priorities, "priority_class" is the class the request was
+     * queued with (see priorityLines()).
      */
-    const logFormat = '\"' + JSON.stringify({
+    var logFields = {
         msg: 'handled: %ST',
         req: {
             method: '%HM',
@@ -156,7 +949,12 @@ function writeHaproxyConfig(opts, cb) {
         name: 'haproxy',
         level: bunyan.INFO,
         v: 0
-    })
+    };
+    if (frontendPriority.length > 0 || internalPriority.length > 0)
+        logFields.priority_class = '%[prio_class]';
+    if (frontendLogging.length > 0)
+        logFields.sample_rate = '%[var(txn.log_rate)]';
+    const logFormat = '\"' + JSON.stringify(logFields)
         // JSSTYLED
         .replace(/1,/, '%{+Q}HU,')
         .replace(/2/, '%ST')
@@ -175,10 +973,18 @@ function writeHaproxyConfig(opts, cb) {
     var sslWebapiServers = '';
     var clearWebapiServers = '';
     var bucketsServers = '';
+    var sslStreamServers = [];
+    var clearStreamServers = [];
+
+    var serverParams = '';
+    if (priority.serverMaxconn !== undefined)
+        serverParams += ' maxconn ' + priority.serverMaxconn;
 
     for (var name in opts.servers) {
-        const sstr =
-            '        server %s:%s %s:%s check inter 30s slowstart 10s\n';
+        const agent = agentParams(agentCheck, opts.servers[name]);
+        const sstr = '        server %s:%s %s:%s check inter 30s ' +
+            'slowstart 10s' + serverParams + agent + '\n';
+        const weight = (agent === '') ? undefined : AGENT_WEIGHT;
         if (opts.servers[name].kind === 'buckets-api') {
             opts.servers[name].ports.forEach(function (port) {
                 bucketsServers += sprintf(sstr, name, port,
@@ -189,25 +995,141 @@ function writeHaproxyConfig(opts, cb) {
                 opts.servers[name].address, '80');
             clearWebapiServers += sprintf(sstr, name, '81',
                 opts.servers[name].address, '81');
+            sslStreamServers.push({ name: name + ':80',
+                address: opts.servers[name].address + ':80',
+                weight: weight });
+            clearStreamServers.push({ name: name + ':81',
+                address: opts.servers[name].address + ':81',
+                weight: weight });
         }
     }
 
+    var streamingBackends = '';
+    if (streaming.enabled) {
+        streamingBackends += streamingBackend('secure_api', sslStreamServers,
+            streaming);
+        streamingBackends += streamingBackend('insecure_api',
+            clearStreamServers, streaming);
+    }
+    const secureStreaming = streamingLines(streaming, 'secure_api_stream');
+
+    const frontendProtection = protectionLines(protection);
+
+    var frontendDeny = '';
+    var denyBackend = '';
+    if (opts.denyMap !== undefined) {
+        frontendDeny = denyLines(opts.denyMap);
+        denyBackend = sprintf(DENY_BACKEND, { 'table': DENY_TABLE });
+    }
+
+    var frontendAdmission = '';
+    var admissionBackend = '';
+    if (opts.admissionMap !== undefined) {
+        frontendAdmission = admissionLines(opts.admissionMap);
+        admissionBackend = sprintf(ADMISSION_BACKEND,
+            { 'table': ADMISSION_TABLE });
+    }
+
     var externalFrontends = '';
     if (opts.untrustedIPs.length > 0) {
-        externalFrontends += HTTP_FRONTEND;
-        opts.untrustedIPs.forEach(function (ip) {
-            externalFrontends += sprintf(HTTP_BIND_LINE, ip);
+        externalFrontends += sprintf(HTTP_FRONTEND, {
+            'frontend_deny': frontendDeny,
+            'frontend_admission': frontendAdmission,
+            'frontend_protection': frontendProtection,
+            'frontend_tracing': frontendTracing,
+            'frontend_priority': frontendPriority,
+            'frontend_logging': frontendLogging,
+            'frontend_streaming': streamingLines(streaming,
+                'insecure_api_stream')
+        });
+        opts.untrustedIPs.forEach(function (ip, i) {
+            externalFrontends += bindLines(ip + ':80', 'http_external-' + i,
+                listener, nbthread);
         });
     }
 
+    const sslCertFile = (opts.sslCertFile !== undefined) ?
+        opts.sslCertFile : SSL_CERT_FILE;
+    const httpsBinds = bindLines('*:443' + ((sslCertFile.length > 0) ?
+        ' ssl crt ' + sslCertFile : ''), 'https', listener, nbthread);
+    const internalBinds = bindLines(opts.trustedIP + ':80', 'http_internal',
+        listener, nbthread);
+
+    var globalOptions = '';
+    if (listener.maxaccept !== undefined)
+        globalOptions += '        tune.maxaccept ' + listener.maxaccept + '\n';
+    if (opts.haproxy.maxpipes !== undefined) {
+        globalOptions += sprintf('        maxpipes %d\n',
+            opts.haproxy.maxpipes);
+    }
+    if (opts.haproxy.pipesize !== undefined) {
+        globalOptions += sprintf('        tune.pipesize %d\n',
+            opts.haproxy.pipesize);
+    }
+
+    /* per-task CPU accounting, for "show profiling" (see lib/threads.js) */
+    if (opts.haproxy.profiling)
+        globalOptions += '        profiling.tasks on\n';
+
+    /* rsyslog still gets every line from the "log" line in the template */
+    if (opts.logSink !== undefined) {
+        globalOptions += sprintf('        log %s len 4096 local0\n',
+            opts.logSink);
+    }
+
+    var prometheusFrontend = '';
+    if (opts.prometheusBind !== undefined) {
+        prometheusFrontend = sprintf(PROMETHEUS_FRONTEND,
+            { 'bind': opts.prometheusBind });
+    }
+
+    var defaultsOptions = '';
+    if (opts.haproxy.splice !== undefined) {
+        SPLICE_OPTIONS[opts.haproxy.splice].forEach(function (opt) {
+            defaultsOptions += '        ' + opt + '\n';
+        });
+    }
+    if (tracing.requestId) {
+        defaultsOptions += '        unique-id-format ' + UNIQUE_ID_FORMAT +
+            '\n';
+    }
+    if (priority.queueTimeout !== undefined) {
+        defaultsOptions += sprintf('        timeout queue %dms\n',
+            priority.queueTimeout);
+    }
+
+    const tuning = opts.tuning || lib_tuning.computeTuning(opts.haproxy);
+
     const str = sprintf(opts.configTemplate, {
         'hostname': os.hostname(),
-        'nbthread': opts.haproxy.nbthread,
+        'nbthread': nbthread,
+        'global_options': globalOptions,
+        'defaults_options': defaultsOptions,
+        'maxconn': tuning.maxconn,
+        'frontend_maxconn': tuning.frontendMaxconn,
+        'bufsize': tuning.bufsize,
+        'maxrewrite': tuning.maxrewrite,
         'log_format': logFormat,
         'bucket_servers': bucketsServers,
         'webapi_secure_servers': sslWebapiServers,
         'webapi_insecure_servers': clearWebapiServers,
+        'streaming_backends': streamingBackends,
+        'secure_streaming': secureStreaming,
         'insecure_frontend': externalFrontends,
+        'frontend_deny': frontendDeny,
+        'deny_backend': denyBackend,
+        'frontend_admission': frontendAdmission,
+        'admission_backend': admissionBackend,
+        'frontend_protection': frontendProtection,
+        'frontend_tracing': frontendTracing,
+        'internal_tracing': internalTracing,
+        'request_id_len': tracing.requestId ? UNIQUE_ID_LEN : REQUEST_ID_LEN,
+        'frontend_priority': frontendPriority,
+        'internal_priority': internalPriority,
+        'frontend_logging': frontendLogging,
+        'https_binds': httpsBinds,
+        'internal_binds': internalBinds,
+        'prometheus_frontend': prometheusFrontend,
         'trusted_ip': opts.trustedIP
         });
 
@@ -215,6 +1137,34 @@ function writeHaproxyConfig(opts, cb) {
     return (fs.writeFile(opts.configFile, str, 'utf8', cb));
 }
 
+/*
+ * Writes out the admission control map (opts.admissionMap) with the limits the
+ * new haproxy worker is to start with (opts.admissionLimits, see
+ * lib/admission.js). haproxy only reads the map when it loads its config, and
+ * won't start if it's missing.
+ */
+function writeAdmissionMap(opts, cb) {
+    assert.optionalString(opts.admissionMap, 'options.admissionMap');
+    assert.object(opts.log, 'options.log');
+    assert.func(cb, 'callback');
+
+    if (opts.admissionMap === undefined) {
+        setImmediate(cb);
+        return;
+    }
+    assert.string(opts.admissionLimits, 'options.admissionLimits');
+
+    const tmp = opts.admissionMap + '.tmp';
+    opts.log.debug('Writing admission map file: %s', opts.admissionMap);
+    fs.writeFile(tmp, opts.admissionLimits, 'utf8', function (err) {
+        if (err) {
+            cb(err);
+            return;
+        }
+        fs.rename(tmp, opts.admissionMap, cb);
+    });
+}
+
 /*
  * Note: this is just "fire and forget" of the opts.reload command (default
  * is `svcadm refresh`). Assumes that the full config validation code
@@ -313,9 +1263,16 @@ function checkHaproxyConfig(opts, cb) {
  * - trustedIP, an address on the Manta network that is considered preauthorized
  * - untrustedIPs, an array of addresses that external traffic comes in over
  * - servers, backend server addresses to forward requests to
+ * - tuning (optional), connection and buffer budget from lib/tuning.js
+ * - logSink (optional), a second syslog target for the access log
+ * - prometheusBind (optional), the address for haproxy's Prometheus exporter
+ * - denyMap (optional), the deny list map file
+ * - admissionMap (optional), the admission control map file
+ * - admissionLimits (optional), the contents to write to admissionMap
  * - reload (optional), the command to run to reload HAProxy config
  * - configTemplate (optional), the haproxy config template
  * - configFile (optional), the haproxy output file
+ * - sslCertFile (optional), the https certificate, '' to disable TLS
  * - log, a Bunyan logger
  */
 function reload(opts, cb) {
@@ -330,6 +1287,7 @@ function reload(opts, cb) {
     assert.optionalString(opts.configTemplate, 'options.configTemplate');
     assert.optionalString(opts.configFile, 'options.configFile');
     assert.optionalString(opts.reload, 'options.reload');
+    assert.optionalString(opts.sslCertFile, 'options.sslCertFile');
 
     opts.log.debug({servers: opts.servers}, 'reload requested');
 
@@ -346,6 +1304,7 @@ function reload(opts, cb) {
          * Kick off the reload pipeline.
          *
          * - Generate a temporary config file with writeHaproxyConfig.
+         * - Write the admission control map the config refers to.
          * - Check the temporary config with checkHaproxyConfig
          * - Rename temporary file to final file once check passes
          * - Tell haproxy to reload with the known-good config file
@@ -363,6 +1322,7 @@ function reload(opts, cb) {
 
         vasync.pipeline({ arg: opts, funcs: [
             writeHaproxyConfig,
+            writeAdmissionMap,
             checkHaproxyConfig,
             function finalRenameConfig(arg, callback) {
                 arg.log.debug('Renaming haproxy config file: %s to %s',
@@ -390,6 +1350,11 @@ function reloading() {
     return (reload_queue.npending > 0);
 }
 
+/* Reloads running or waiting to run. */
+function reloadQueueDepth() {
+    return (reload_queue.npending + reload_queue.length());
+}
+
 /*
  * servers is indexed by the bare zone UUID, whereas we populate the haproxy
  * config 'svname' with a :portnum suffix.
@@ -403,8 +1368,20 @@ function lookupSvname(servers, svname) {
 module.exports = {
     reload: reload,
     reloading: reloading,
+    reloadQueueDepth: reloadQueueDepth,
     lookupSvname: lookupSvname,
+    isStreamingBackend: isStreamingBackend,
+    checkListenerProfile: checkListenerProfile,
+    DENY_TABLE: DENY_TABLE,
     // Below only exported for testing
+    checkAgentCheck: checkAgentCheck,
     checkHaproxyConfig: checkHaproxyConfig,
+    checkProtectionProfile: checkProtectionProfile,
+    checkSpliceOptions: checkSpliceOptions,
+    checkStreaming: checkStreaming,
+    checkTracing: checkTracing,
+    checkLogSampling: checkLogSampling,
+    checkPriority: checkPriority,
+    writeAdmissionMap: writeAdmissionMap,
     writeHaproxyConfig: writeHaproxyConfig
 };
@@ -6,21 +6,54 @@
 
 /*
  * Copyright 2020 Joyent, Inc.
+ * Copyright 2026 MNX Cloud, Inc.
  */
 
 
 const mod_assert = require('assert-plus');
+const mod_http = require('http');
 const mod_jsprim = require('jsprim');
-const mod_restify = require('restify');
 const mod_os = require('os');
+const mod_querystring = require('querystring');
+const mod_url = require('url');
 const mod_util = require('util');
+const mod_zlib = require('zlib');
 
 const HAPROXY_FRONTEND = '0';
 const HAPROXY_BACKEND = '1';
 const HAPROXY_SERVER = '2';
+const HAPROXY_LISTENER = '3';
 
 const HOSTNAME = mod_os.hostname();
 
+const SERVER_NAME = 'muppet-metrics-exporter';
+const METRICS_PATH = '/metrics';
+const CONTENT_TYPE = 'text/plain; version=0.0.4';
+/*
+ * The exposition format compresses very well even at the fastest level, and
+ * we'd rather not spend the CPU on the last few percent.
+ */
+const GZIP_LEVEL = 1;
+const GZIP_MIN_BYTES = 1024;
+/* Longer than any scrape interval, so that scrapers can reuse connections. */
+const KEEPALIVE_TIMEOUT = 300000;   /* ms */
+
+/*
+ * haproxy's built-in Prometheus exporter (the "prometheus-exporter" service),
+ * which we can scrape instead of rendering "show stat" ourselves:
+ *
+ * - 'proxy' passes its output through as is, with its own metric names
+ * - 'compat' renames its metrics to ours (see PROMEX_NAMES)
+ */
+const PROMEX_MODES = [ 'proxy', 'compat' ];
+const PROMEX_PATH = '/metrics';
+const PROMEX_DEFAULT_PORT = 8405;
+const PROMEX_TIMEOUT = 10000;       /* ms */
+/*JSSTYLED*/
+const PROMEX_LINE_RE = /^([a-zA-Z_:][a-zA-Z0-9_:]*)(?:\{(.*)\})? (\S+)/;
+/*JSSTYLED*/
+const PROMEX_LABEL_RE = /([a-zA-Z_][a-zA-Z0-9_]*)="((?:[^"\\]|\\.)*)"/g;
+
 /*
  * Helper functiions
  */
@@ -32,6 +65,15 @@ function msToSec(ms) {
     return ((ms / 1000).toString());
 }
 
+function mbToBytes(mb) {
+    return ((mb * 1024 * 1024).toString());
+}
+
+/* haproxy's exporter reports the server status as a number; 1 is UP. */
+function promexIsUp(status) {
+    return ((Number(status) === 1) ? '1' : '0');
+}
+
 function haproxyComponentName(comp) {
     var componentName;
     switch (comp) {
@@ -44,6 +86,9 @@ function haproxyComponentName(comp) {
         case '2':
             componentName = 'server';
         break;
+        case '3':
+            componentName = 'listener';
+        break;
         default :
             componentName = 'unknown';
         break;
@@ -54,6 +99,9 @@ function haproxyComponentName(comp) {
 /*
  * All haproxy metrics go in this array. We are trying to stay close
  * to the official HAProxy exporter by using the exact metric names.
+ *
+ * When server metrics are aggregated to backend level, their values are
+ * summed per backend, except for those with "aggregate: 'max'".
  */
 const HAPROXY_METRICS = [
     // Frontend Metrics
@@ -113,6 +161,14 @@ const HAPROXY_METRICS = [
         desc: 'Total of requests denied for security.',
         stats: [ { statName: 'dreq' } ]
     },
+    {
+        name: 'connections_denied_total',
+        type: 'counter',
+        hpComponent: HAPROXY_FRONTEND,
+        labels: { name: 'pxname' },
+        desc: 'Total of connections denied by tcp-request connection rules.',
+        stats: [ { statName: 'dcon' } ]
+    },
     {
         name: 'request_errors_total',
         type: 'counter',
@@ -500,6 +556,7 @@ const HAPROXY_METRICS = [
         name: 'max_queue',
         type: 'gauge',
         hpComponent: HAPROXY_SERVER,
+        aggregate: 'max',
         labels: { name: 'pxname', address: 'addr' },
         desc: 'Maximum observed number of ' +
             'queued requests assigned to this server.',
@@ -517,6 +574,7 @@ const HAPROXY_METRICS = [
         name: 'max_sessions',
         type: 'gauge',
         hpComponent: HAPROXY_SERVER,
+        aggregate: 'max',
         labels: { name: 'pxname', address: 'addr' },
         desc: 'Maximum observed number of active sessions.',
         stats: [ { statName: 'smax' } ]
@@ -644,6 +702,7 @@ const HAPROXY_METRICS = [
         name: 'max_session_rate',
         type: 'gauge',
         hpComponent: HAPROXY_SERVER,
+        aggregate: 'max',
         labels: { name: 'pxname', address: 'addr' },
         desc: 'Maximum observed number of sessions per second.',
         stats: [ { statName: 'rate_max' } ]
@@ -652,6 +711,7 @@ const HAPROXY_METRICS = [
         name: 'check_duration_milliseconds',
         type: 'gauge',
         hpComponent: HAPROXY_SERVER,
+        aggregate: 'max',
         labels: { name: 'pxname', address: 'addr' },
         desc: 'Previously run health check duration, in milliseconds.',
         stats: [ { statName: 'check_duration' } ]
@@ -704,10 +764,510 @@ const HAPROXY_METRICS = [
         labels: { name: 'pxname', address: 'addr' },
         desc: 'Total number of data transfers aborted by the server.',
         stats: [ { statName: 'srv_abrt' } ]
+    },
+    // Listener (bind line) Metrics
+    {
+        name: 'current_sessions',
+        type: 'gauge',
+        hpComponent: HAPROXY_LISTENER,
+        labels: { name: 'pxname', listener: 'svname' },
+        desc: 'Current number of active sessions.',
+        stats: [ { statName: 'scur' } ]
+    },
+    {
+        name: 'limit_sessions',
+        type: 'gauge',
+        hpComponent: HAPROXY_LISTENER,
+        labels: { name: 'pxname', listener: 'svname' },
+        desc: 'Configured session limit.',
+        stats: [ { statName: 'slim' } ]
+    },
+    {
+        name: 'sessions_total',
+        type: 'counter',
+        hpComponent: HAPROXY_LISTENER,
+        labels: { name: 'pxname', listener: 'svname' },
+        desc: 'Total number of sessions accepted on this listener.',
+        stats: [ { statName: 'stot' } ]
+    },
+    {
+        name: 'connections_denied_total',
+        type: 'counter',
+        hpComponent: HAPROXY_LISTENER,
+        labels: { name: 'pxname', listener: 'svname' },
+        desc: 'Total of connections denied by tcp-request connection rules.',
+        stats: [ { statName: 'dcon' } ]
+    },
+    {
+        name: 'request_errors_total',
+        type: 'counter',
+        hpComponent: HAPROXY_LISTENER,
+        labels: { name: 'pxname', listener: 'svname' },
+        desc: 'Total of request errors.',
+        stats: [ { statName: 'ereq' } ]
+    }
+];
+
+
+/*
+ * Process-wide metrics from "show info", named after the official exporter's
+ * "haproxy_process_*" metrics, as loadbalancer_process_<name>. Each is taken
+ * from the given "show info" field.
+ */
+const HAPROXY_INFO_METRICS = [
+    {
+        name: 'idle_time_percent',
+        type: 'gauge',
+        desc: 'Percentage of the last second the process was idle ' +
+            '(the best saturation signal).',
+        field: 'Idle_pct'
+    },
+    {
+        name: 'nbthread',
+        type: 'gauge',
+        desc: 'Configured number of threads.',
+        field: 'Nbthread'
+    },
+    {
+        name: 'uptime_seconds',
+        type: 'gauge',
+        desc: 'Time since the process started, in seconds.',
+        field: 'Uptime_sec'
+    },
+    {
+        name: 'max_connections',
+        type: 'gauge',
+        desc: 'Configured maximum number of concurrent connections.',
+        field: 'Maxconn'
+    },
+    {
+        name: 'hard_max_connections',
+        type: 'gauge',
+        desc: 'Initial maximum number of concurrent connections.',
+        field: 'Hard_maxconn'
+    },
+    {
+        name: 'current_connections',
+        type: 'gauge',
+        desc: 'Current number of active connections.',
+        field: 'CurrConns'
+    },
+    {
+        name: 'connections_total',
+        type: 'counter',
+        desc: 'Total number of connections.',
+        field: 'CumConns'
+    },
+    {
+        name: 'requests_total',
+        type: 'counter',
+        desc: 'Total number of requests.',
+        field: 'CumReq'
+    },
+    {
+        name: 'max_sockets',
+        type: 'gauge',
+        desc: 'Maximum number of open sockets.',
+        field: 'Maxsock'
+    },
+    {
+        name: 'current_ssl_connections',
+        type: 'gauge',
+        desc: 'Current number of active SSL connections.',
+        field: 'CurrSslConns'
+    },
+    {
+        name: 'ssl_connections_total',
+        type: 'counter',
+        desc: 'Total number of SSL connections.',
+        field: 'CumSslConns'
+    },
+    {
+        name: 'current_connection_rate',
+        type: 'gauge',
+        desc: 'Current number of connections per second over last ' +
+            'elapsed second.',
+        field: 'ConnRate'
+    },
+    {
+        name: 'limit_connection_rate',
+        type: 'gauge',
+        desc: 'Configured maximum number of connections per second.',
+        field: 'ConnRateLimit'
+    },
+    {
+        name: 'max_connection_rate',
+        type: 'gauge',
+        desc: 'Maximum observed number of connections per second.',
+        field: 'MaxConnRate'
+    },
+    {
+        name: 'current_session_rate',
+        type: 'gauge',
+        desc: 'Current number of sessions per second over last elapsed ' +
+            'second.',
+        field: 'SessRate'
+    },
+    {
+        name: 'limit_session_rate',
+        type: 'gauge',
+        desc: 'Configured maximum number of sessions per second.',
+        field: 'SessRateLimit'
+    },
+    {
+        name: 'max_session_rate',
+        type: 'gauge',
+        desc: 'Maximum observed number of sessions per second.',
+        field: 'MaxSessRate'
+    },
+    {
+        name: 'current_ssl_rate',
+        type: 'gauge',
+        desc: 'Current number of SSL sessions per second over last ' +
+            'elapsed second.',
+        field: 'SslRate'
+    },
+    {
+        name: 'current_frontend_ssl_key_rate',
+        type: 'gauge',
+        desc: 'Current frontend SSL key computations per second over ' +
+            'last elapsed second.',
+        field: 'SslFrontendKeyRate'
+    },
+    {
+        name: 'current_run_queue',
+        type: 'gauge',
+        desc: 'Current number of tasks in the run-queue.',
+        field: 'Run_queue'
+    },
+    {
+        name: 'current_tasks',
+        type: 'gauge',
+        desc: 'Current number of tasks.',
+        field: 'Tasks'
+    },
+    {
+        name: 'jobs',
+        type: 'gauge',
+        desc: 'Current number of active jobs (listeners, sessions, ' +
+            'open devices).',
+        field: 'Jobs'
+    },
+    {
+        name: 'listeners',
+        type: 'gauge',
+        desc: 'Current number of active listeners.',
+        field: 'Listeners'
+    },
+    {
+        name: 'stopping',
+        type: 'gauge',
+        desc: 'Non-zero means stopping in progress.',
+        field: 'Stopping'
+    },
+    {
+        name: 'max_memory_bytes',
+        type: 'gauge',
+        desc: 'Per-process memory limit (in bytes); 0=unset.',
+        field: 'Memmax_MB',
+        modifier: mbToBytes
+    },
+    {
+        name: 'pool_allocated_bytes',
+        type: 'gauge',
+        desc: 'Total amount of memory allocated in pools (in bytes).',
+        field: 'PoolAlloc_MB',
+        modifier: mbToBytes
+    },
+    {
+        name: 'pool_used_bytes',
+        type: 'gauge',
+        desc: 'Total amount of memory used in pools (in bytes).',
+        field: 'PoolUsed_MB',
+        modifier: mbToBytes
+    },
+    {
+        name: 'pool_failures_total',
+        type: 'counter',
+        desc: 'Total number of failed pool allocations.',
+        field: 'PoolFailed'
+    },
+    {
+        name: 'max_pipes',
+        type: 'gauge',
+        desc: 'Configured maximum number of pipes.',
+        field: 'Maxpipes'
+    },
+    {
+        name: 'pipes_used_total',
+        type: 'gauge',
+        desc: 'Number of pipes in use.',
+        field: 'PipesUsed'
+    },
+    {
+        name: 'pipes_free_total',
+        type: 'gauge',
+        desc: 'Number of pipes unused.',
+        field: 'PipesFree'
+    },
+    {
+        name: 'dropped_logs_total',
+        type: 'counter',
+        desc: 'Total number of dropped logs.',
+        field: 'DroppedLogs'
     }
 ];
 
+/*
+ * The metrics that haproxy's own exporter names differently, by our name (the
+ * rest are named haproxy_<component>_<name> there), and how to convert its
+ * values where they differ.
+ */
+const PROMEX_NAMES = {
+    connections_denied_total: { name: 'denied_connections_total' },
+    up: { name: 'status', modifier: promexIsUp },
+    current_server: { name: 'active_servers' },
+    server_selected_total: { name: 'loadbalanced_total' },
+    compressor_bytes_in_total: { name: 'http_comp_bytes_in_total' },
+    compressor_bytes_out_total: { name: 'http_comp_bytes_out_total' },
+    compressor_bytes_bypassed_total: { name: 'http_comp_bytes_bypassed_total' },
+    http_responses_compressed_total: { name: 'http_comp_responses_total' },
+    transfers_aborted_by_client_total: { name: 'client_aborts_total' },
+    transfers_aborted_by_server_total: { name: 'server_aborts_total' }
+};
+
+/*
+ * The compatibility mapping from the names of haproxy's exporter to our metric
+ * families.
+ */
+const PROMEX_COMPAT = (function () {
+    var compat = {};
+
+    HAPROXY_METRICS.forEach(function (metric) {
+        var componentName = haproxyComponentName(metric.hpComponent);
+        var rename = PROMEX_NAMES[metric.name] || {};
+        compat['haproxy_' + componentName + '_' +
+            (rename.name || metric.name)] = {
+            name: mod_util.format('loadbalancer_%s_%s', componentName,
+                metric.name),
+            type: metric.type,
+            desc: metric.desc,
+            component: componentName,
+            aggregate: metric.aggregate,
+            modifier: rename.modifier
+        };
+    });
+    HAPROXY_INFO_METRICS.forEach(function (metric) {
+        compat['haproxy_process_' + metric.name] = {
+            name: 'loadbalancer_process_' + metric.name,
+            type: metric.type,
+            desc: metric.desc,
+            component: 'process'
+        };
+    });
+
+    return (compat);
+})();
+
+/*
+ * Returns true if the metric family name matches the pattern: either the
+ * exact name, or a prefix followed by '*'.
+ */
+function matchFamily(pattern, name) {
+    if (pattern.endsWith('*'))
+        return (name.startsWith(pattern.slice(0, -1)));
+    return (name === pattern);
+}
+
+/*
+ * Returns a function that decides whether to render a metric family, given:
+ *
+ * - collect, the "collect[]" query parameters: if any, only families in those
+ *   groups (the part of the name after "loadbalancer_", e.g. "frontend" or
+ *   "process") are rendered
+ * - allow, patterns (see matchFamily()) of the families to render, or empty
+ *   for all
+ * - deny, patterns of the families not to render
+ */
+function familyFilter(collect, allow, deny) {
+    mod_assert.arrayOfString(collect, 'collect');
+    mod_assert.arrayOfString(allow, 'allow');
+    mod_assert.arrayOfString(deny, 'deny');
 
+    return (function _selected(name) {
+        if (collect.length > 0 && !collect.some(function (c) {
+            return (name.startsWith('loadbalancer_' + c + '_'));
+        })) {
+            return (false);
+        }
+        if (allow.length > 0 && !allow.some(function (p) {
+            return (matchFamily(p, name));
+        })) {
+            return (false);
+        }
+        return (!deny.some(function (p) {
+            return (matchFamily(p, name));
+        }));
+    });
+}
+
+/*
+ * Aggregates server series to backend level by dropping their "address"
+ * label and combining the values of series that are then identical, either by
+ * summing them or, with how === 'max', by taking the maximum.
+ */
+function aggregateServers(labels, values, how) {
+    mod_assert.arrayOfObject(labels, 'labels');
+    mod_assert.arrayOfString(values, 'values');
+    mod_assert.optionalString(how, 'how');
+
+    var keys = [];
+    var byKey = {};
+    labels.forEach(function (l, i) {
+        var agg = mod_jsprim.deepCopy(l);
+        delete (agg.address);
+        var key = JSON.stringify(agg);
+        var value = Number(values[i]);
+
+        if (byKey[key] === undefined) {
+            keys.push(key);
+            byKey[key] = { labels: agg, value: value };
+        } else if (how === 'max') {
+            byKey[key].value = Math.max(byKey[key].value, value);
+        } else {
+            byKey[key].value += value;
+        }
+    });
+
+    return ({
+        labels: keys.map(function (k) { return (byKey[k].labels); }),
+        values: keys.map(function (k) { return (String(byKey[k].value)); })
+    });
+}
+
+/*
+ * Translates the output of haproxy's exporter to our metric families (see
+ * PROMEX_COMPAT), skipping anything we don't have a name for. Options:
+ *
+ * - selected, a function deciding whether to render a family (see
+ *   familyFilter())
+ * - aggregateServers, render server metrics per backend
+ * - serverAddress, a function returning the address of a server given its
+ *   name, or undefined if it isn't known (in which case we use the name)
+ */
+function translatePromex(text, opts) {
+    mod_assert.string(text, 'text');
+    mod_assert.object(opts, 'opts');
+    mod_assert.func(opts.selected, 'opts.selected');
+    mod_assert.bool(opts.aggregateServers, 'opts.aggregateServers');
+    mod_assert.func(opts.serverAddress, 'opts.serverAddress');
+
+    var names = [];
+    var families = {};
+
+    text.split('\n').forEach(function (line) {
+        var m = PROMEX_LINE_RE.exec(line);
+        if (m === null)
+            return;
+        var compat = PROMEX_COMPAT[m[1]];
+        if (compat === undefined || !opts.selected(compat.name))
+            return;
+
+        var labels = { 'component': compat.component, 'inst_id': HOSTNAME };
+        var promexLabels = {};
+        var l;
+        PROMEX_LABEL_RE.lastIndex = 0;
+        while ((l = PROMEX_LABEL_RE.exec(m[2] || '')) !== null)
+            promexLabels[l[1]] = l[2];
+        if (promexLabels.proxy !== undefined)
+            labels.name = promexLabels.proxy;
+        if (promexLabels.server !== undefined) {
+            labels.address = opts.serverAddress(promexLabels.server) ||
+                promexLabels.server;
+        }
+        Object.keys(promexLabels).forEach(function (key) {
+            if (key !== 'proxy' && key !== 'server')
+                labels[key] = promexLabels[key];
+        });
+
+        var family = families[compat.name];
+        if (family === undefined) {
+            family = { compat: compat, labels: [], values: [] };
+            families[compat.name] = family;
+            names.push(compat.name);
+        }
+        family.labels.push(labels);
+        family.values.push(compat.modifier ? compat.modifier(m[3]) : m[3]);
+    });
+
+    return (names.map(function (name) {
+        var family = families[name];
+        var labels = family.labels;
+        var values = family.values;
+
+        if (opts.aggregateServers && family.compat.component === 'server') {
+            var agg = aggregateServers(labels, values,
+                family.compat.aggregate);
+            labels = agg.labels;
+            values = agg.values;
+        }
+
+        return (createMetricString({
+            metricName: name,
+            metricType: family.compat.type,
+            metricDocString: family.compat.desc,
+            metricLabels: labels,
+            metricValues: values
+        }));
+    }).join(''));
+}
+
+/*
+ * Returns the values of a query parameter that may be repeated, with or
+ * without a "[]" suffix.
+ */
+function queryList(query, name) {
+    var values = [].concat(query[name + '[]'] || [], query[name] || []);
+    return (values.filter(function (v) { return (v !== ''); }));
+}
+
+/*
+ * Returns true if the Accept-Encoding header allows a gzip response.
+ */
+function acceptsGzip(header) {
+    if (typeof (header) !== 'string')
+        return (false);
+
+    return (header.split(',').some(function (coding) {
+        var params = coding.split(';');
+        if (params[0].trim().toLowerCase() !== 'gzip')
+            return (false);
+        return (!params.slice(1).some(function (param) {
+            return (/^\s*q=0(\.0*)?\s*$/.test(param));
+        }));
+    }));
+}
+
+/*
+ * Options:
+ * - log, a Bunyan logger
+ * - haSock, the lib/haproxy_sock.js module
+ * - statsPoller (optional), the StatsPollerFSM (see lib/stats_poller.js) to
+ *   get stats from, rather than asking haSock on every scrape
+ * - adminIPS, the first of which we listen on
+ * - metricsPort, the port we listen on
+ * - metrics (optional), the "metrics" section of the muppet configuration:
+ *     - allow, deny (optional), patterns (see matchFamily()) of the metric
+ *       families to render or not
+ *     - aggregateServers (optional), render server metrics per backend
+ *       rather than per server
+ *     - haproxyExporter (optional), one of PROMEX_MODES, to scrape haproxy's
+ *       built-in exporter rather than the stats socket
+ *     - haproxyExporterPort (optional), the port haproxy's exporter listens on,
+ *       on the same address as us
+ * - serverAddress (optional), a function returning the address of a server
+ *   given its haproxy name, for haproxyExporter 'compat'
+ */
 function MetricsExporter(opts) {
     mod_assert.object(opts, 'opts');
     mod_assert.object(opts.log, 'opts.log');
@@ -715,64 +1275,181 @@ function MetricsExporter(opts) {
     mod_assert.arrayOfString(opts.adminIPS, 'opts.adminIPS');
     mod_assert.number(opts.metricsPort, 'opts.metricsPort');
     mod_assert.ok(opts.adminIPS.length > 0, 'opts.adminIPS.length > 0');
+    mod_assert.optionalObject(opts.metrics, 'opts.metrics');
 
+    var metricsCfg = opts.metrics || {};
+    mod_assert.optionalArrayOfString(metricsCfg.allow, 'metrics.allow');
+    mod_assert.optionalArrayOfString(metricsCfg.deny, 'metrics.deny');
+    mod_assert.optionalBool(metricsCfg.aggregateServers,
+        'metrics.aggregateServers');
+    mod_assert.optionalString(metricsCfg.haproxyExporter,
+        'metrics.haproxyExporter');
+    mod_assert.optionalNumber(metricsCfg.haproxyExporterPort,
+        'metrics.haproxyExporterPort');
+    mod_assert.optionalFunc(opts.serverAddress, 'opts.serverAddress');
+    mod_assert.optionalObject(opts.statsPoller, 'opts.statsPoller');
+    if (metricsCfg.haproxyExporter !== undefined) {
+        mod_assert.ok(PROMEX_MODES.indexOf(metricsCfg.haproxyExporter) !== -1,
+            'metrics.haproxyExporter must be one of: ' +
+            PROMEX_MODES.join(', '));
+    }
 
     var self = this;
     self.log =  opts.log.child({component: 'metrics-exporter'});
     self.haSock = opts.haSock;
+    self.statsPoller = opts.statsPoller || null;
+    self.collectors = [];
+    self.allow = metricsCfg.allow || [];
+    self.deny = metricsCfg.deny || [];
+    self.aggregateServers = metricsCfg.aggregateServers || false;
+    self.serverAddress = opts.serverAddress || function () {
+        return (undefined);
+    };
 
-    self.server = mod_restify.createServer({
-        name: 'muppet-metrics-exporter',
-        log: self.log,
-        handleUncaughtExceptions: false,
-        handleUpgrades: false
-    });
+    self.address = opts.adminIPS[0];
+    self.port = opts.metricsPort;
 
-    self.server.use(function _addStandardRespHeaders(req, res, next) {
-        res.on('header', function onHeader() {
-            var now = Date.now();
-            res.header('Date', new Date());
-            res.header('Server', self.server.name);
-            res.header('x-request-id', req.getId());
-            var t = now - req.time();
-            res.header('x-response-time', t);
-            res.header('x-server-name', HOSTNAME);
+    self.promex = null;
+    if (metricsCfg.haproxyExporter !== undefined) {
+        self.promex = {
+            mode: metricsCfg.haproxyExporter,
+            host: self.address,
+            port: metricsCfg.haproxyExporterPort || PROMEX_DEFAULT_PORT,
+            agent: new mod_http.Agent({ keepAlive: true, maxSockets: 1 })
+        };
+    }
+
+    /*
+     * We serve a single route, so a plain http server does: connections are
+     * kept alive between scrapes (we always send a Content-Length), and
+     * the body is gzipped when the scraper accepts it.
+     */
+    self.server = mod_http.createServer(function (req, res) {
+        self._handleRequest(req, res);
+    });
+    /*
+     * Node 6 has no server.keepAliveTimeout (added in Node 8): an idle
+     * connection between scrapes is only closed by the socket inactivity
+     * timeout, which is what keeps it open for reuse.
+     */
+    self.server.timeout = KEEPALIVE_TIMEOUT;
+    self.sockets = [];
+    self.server.on('connection', function (sock) {
+        self.sockets.push(sock);
+        sock.on('close', function () {
+            self.sockets.splice(self.sockets.indexOf(sock), 1);
         });
-        req.metricExporter = self;
-        next();
     });
+}
 
-    self.server.use(mod_restify.plugins.requestLogger());
-
-    self.server.on('after', function audit(req, res, route, err) {
-        // Successful GET res bodies are uninteresting and *big*.
-        var body = !(req.method === 'GET' &&
-            Math.floor(res.statusCode / 100) === 2);
-
-        mod_restify.plugins.auditLogger({
-            log: req.log.child({
-                route: route && route.name,
-                action: req.query.action
-            }, true),
-            event: 'after',
-            body: body
-        })(req, res, route, err);
+MetricsExporter.prototype._handleRequest = function (req, res) {
+    var self = this;
+    var start = Date.now();
+    var url = mod_url.parse(req.url);
+
+    function _respond(code, body, headers) {
+        var latency = Date.now() - start;
+        headers['Content-Type'] = CONTENT_TYPE;
+        headers['Content-Length'] = Buffer.byteLength(body);
+        headers['Server'] = SERVER_NAME;
+        headers['x-server-name'] = HOSTNAME;
+        headers['x-response-time'] = latency;
+
+        res.writeHead(code, headers);
+        res.end((req.method === 'HEAD') ? undefined : body);
+
+        self.log.debug({
+            method: req.method,
+            url: req.url,
+            statusCode: code,
+            bytes: headers['Content-Length'],
+            latency: latency
+        }, 'handled request');
+    }
+
+    if (url.pathname !== METRICS_PATH) {
+        _respond(404, 'not found\n', {});
+        return;
+    }
+    if (req.method !== 'GET' && req.method !== 'HEAD') {
+        _respond(405, 'method not allowed\n', { 'Allow': 'GET, HEAD' });
+        return;
+    }
+
+    var query = mod_querystring.parse(url.query || '');
+    renderMetrics(self, query, function (err, metricsString) {
+        if (err) {
+            _respond(500, err.message + '\n', {});
+            return;
+        }
+
+        if (!acceptsGzip(req.headers['accept-encoding']) ||
+            metricsString.length < GZIP_MIN_BYTES) {
+            _respond(200, metricsString, {});
+            return;
+        }
+
+        mod_zlib.gzip(metricsString, { level: GZIP_LEVEL },
+            function (err2, gzipped) {
+            if (err2) {
+                self.log.warn(err2, 'failed to compress metrics');
+                _respond(200, metricsString, {});
+                return;
+            }
+            _respond(200, gzipped, {
+                'Content-Encoding': 'gzip',
+                'Vary': 'Accept-Encoding'
+            });
+        });
     });
+};
 
-    // Register /metrics handler
-    self.server.get('/metrics', getMetricsHandler);
-    self.address = opts.adminIPS[0];
-    self.port = opts.metricsPort;
-}
+/*
+ * Registers a function that returns additional, non-haproxy metrics to be
+ * rendered on every scrape. The function is called synchronously and must
+ * return an array of metric families of the form:
+ *
+ *   {
+ *       name: 'loadbalancer_...',
+ *       type: 'gauge' | 'counter' | 'histogram',
+ *       desc: '...',
+ *       metrics: [ { labels: { ... }, value: <number> }, ... ]
+ *   }
+ *
+ * The series of a histogram also have a "suffix" ('_bucket', '_sum' or
+ * '_count') appended to the family name.
+ *
+ * Every series gets the same "inst_id" label as the haproxy metrics.
+ */
+MetricsExporter.prototype.addCollector = function (collector) {
+    mod_assert.func(collector, 'collector');
+    this.collectors.push(collector);
+};
 
 MetricsExporter.prototype.start = function (cb) {
     mod_assert.optionalFunc(cb);
     this.server.listen(this.port, this.address, cb);
 };
 
+/*
+ * The address haproxy's exporter should listen on (see writeHaproxyConfig() in
+ * lib/lb_manager.js), or undefined if we don't use it.
+ */
+MetricsExporter.prototype.haproxyExporterAddress = function () {
+    if (this.promex === null)
+        return (undefined);
+    return (this.promex.host + ':' + this.promex.port);
+};
+
 MetricsExporter.prototype.close = function (cb) {
     mod_assert.optionalFunc(cb);
     this.server.close(cb);
+    if (this.promex !== null)
+        this.promex.agent.destroy();
+    /* Don't wait for idle keep-alive connections to time out. */
+    this.sockets.forEach(function (sock) {
+        sock.destroy();
+    });
 };
 
 function createMetricString(opts) {
@@ -782,6 +1459,8 @@ function createMetricString(opts) {
     mod_assert.string(opts.metricDocString, 'opts.metricDocString');
     mod_assert.arrayOfObject(opts.metricLabels, 'opts.metricLabels');
     mod_assert.arrayOfString(opts.metricValues, 'opts.metricValues');
+    mod_assert.optionalArrayOfString(opts.metricSuffixes,
+        'opts.metricSuffixes');
     mod_assert.ok(opts.metricLabels.length === opts.metricValues.length,
         'opts.metricLabels.length === opts.metricValues.length');
 
@@ -791,7 +1470,10 @@ function createMetricString(opts) {
 
     for (var i = 0; i < opts.metricLabels.length; i++) {
         metricString += '\n';
-        metricString += (opts.metricName + '{');
+        metricString += opts.metricName;
+        if (opts.metricSuffixes)
+            metricString += opts.metricSuffixes[i];
+        metricString += '{';
 
         var firstLabel = true;
         Object.keys(opts.metricLabels[i]).forEach(function (key) {
@@ -817,13 +1499,192 @@ function createMetricString(opts) {
     return (metricString + '\n');
 }
 
-function getMetricsHandler(req, res, next) {
+function collectorsString(collectors, selected) {
+    var str = '';
+
+    collectors.forEach(function (collector) {
+        collector().forEach(function (family) {
+            if (family.metrics.length === 0 || !selected(family.name))
+                return;
+
+            str += createMetricString({
+                metricName: family.name,
+                metricType: family.type,
+                metricDocString: family.desc,
+                metricLabels: family.metrics.map(function (m) {
+                    return (mod_jsprim.mergeObjects({ 'inst_id': HOSTNAME },
+                        m.labels));
+                }),
+                metricValues: family.metrics.map(function (m) {
+                    return (String(m.value));
+                }),
+                metricSuffixes: (family.type !== 'histogram') ? undefined :
+                    family.metrics.map(function (m) { return (m.suffix); })
+            });
+        });
+    });
+
+    return (str);
+}
+
+function infoString(info, selected) {
+    var str = '';
 
-    req.metricExporter.haSock.allStats({ log: req.metricExporter.log },
-       function _gotSrvStats(err, allStats) {
+    HAPROXY_INFO_METRICS.forEach(function _buildInfoMetric(metric) {
+        var metricName = 'loadbalancer_process_' + metric.name;
+        var value = info[metric.field];
+        if (value === undefined || value === '' || !selected(metricName))
+            return;
+        if (metric.modifier)
+            value = metric.modifier(value);
+
+        str += createMetricString({
+            metricName: metricName,
+            metricType: metric.type,
+            metricDocString: metric.desc,
+            metricLabels: [ { 'component': 'process', 'inst_id': HOSTNAME } ],
+            metricValues: [ value ]
+        });
+    });
+
+    return (str);
+}
+
+/*
+ * Fetches the output of haproxy's exporter.
+ */
+function fetchPromex(exporter, cb) {
+    var promex = exporter.promex;
+    var done = false;
+
+    function _done(err, body) {
+        if (done)
+            return;
+        done = true;
+        cb(err, body);
+    }
+
+    var req = mod_http.get({
+        host: promex.host,
+        port: promex.port,
+        path: PROMEX_PATH,
+        agent: promex.agent
+    }, function (res) {
+        var bufs = [];
+        res.on('data', function (chunk) {
+            bufs.push(chunk);
+        });
+        res.on('end', function () {
+            if (res.statusCode !== 200) {
+                _done(new Error('haproxy exporter returned ' +
+                    res.statusCode));
+                return;
+            }
+            _done(null, Buffer.concat(bufs).toString('utf8'));
+        });
+    });
+    req.setTimeout(PROMEX_TIMEOUT, function () {
+        req.abort();
+        _done(new Error('timed out scraping haproxy exporter'));
+    });
+    req.on('error', function (err) {
+        _done(err);
+    });
+}
+
+/*
+ * Calls back with haproxy's "show info" and "show stat", from the stats poller
+ * if we have one. Stats as old as its polling interval are good enough for a
+ * scrape, and this saves each scrape costing a round trip to haproxy.
+ *
+ * When the scrape selects no server or listener families (e.g.
+ * collect[]=frontend), we instead ask haproxy for just the frontend and
+ * backend rows, which is much cheaper with many servers, and for "show info"
+ * only if a process family is selected.
+ */
+function fetchStats(exporter, needs, cb) {
+    var poller = exporter.statsPoller;
+    var log = exporter.log;
+
+    if (!needs.rows) {
+        exporter.haSock.proxyStats({ log: log }, function (err, stats) {
+            if (err) {
+                cb(err);
+                return;
+            }
+            if (!needs.info) {
+                cb(null, {}, stats);
+                return;
+            }
+            exporter.haSock.showInfo({ log: log }, function (err2, info) {
+                if (err2) {
+                    cb(err2);
+                    return;
+                }
+                cb(null, info, stats);
+            });
+        });
+        return;
+    }
+
+    if (poller === null) {
+        exporter.haSock.infoAndStats({ log: exporter.log }, cb);
+        return;
+    }
+
+    poller.snapshot({ maxAge: poller.interval() }, function (err, snap) {
+        if (err) {
+            cb(err);
+            return;
+        }
+        cb(null, snap.info, snap.stats);
+    });
+}
+
+/*
+ * Renders the metrics selected by the (parsed) query string, calling back with
+ * the exposition format text.
+ */
+function renderMetrics(exporter, query, cb) {
+    var selected = familyFilter(queryList(query, 'collect'), exporter.allow,
+        exporter.deny);
+
+    if (exporter.promex !== null) {
+        fetchPromex(exporter, function (err, text) {
+            if (err) {
+                exporter.log.error(err);
+                cb(err);
+                return;
+            }
+
+            var metricsString = (exporter.promex.mode === 'proxy') ? text :
+                translatePromex(text, {
+                    selected: selected,
+                    aggregateServers: exporter.aggregateServers,
+                    serverAddress: exporter.serverAddress
+                });
+            metricsString += collectorsString(exporter.collectors, selected);
+            cb(null, metricsString);
+        });
+        return;
+    }
+
+    var needs = {
+        rows: HAPROXY_METRICS.some(function (metric) {
+            return ((metric.hpComponent === HAPROXY_SERVER ||
+                metric.hpComponent === HAPROXY_LISTENER) &&
+                selected(mod_util.format('loadbalancer_%s_%s',
+                haproxyComponentName(metric.hpComponent), metric.name)));
+        }),
+        info: HAPROXY_INFO_METRICS.some(function (metric) {
+            return (selected('loadbalancer_process_' + metric.name));
+        })
+    };
+
+    fetchStats(exporter, needs, function _gotSrvStats(err, info, allStats) {
         if (err) {
-            req.metricExporter.log.error(err);
-            next(err);
+            exporter.log.error(err);
+            cb(err);
             return;
         }
 
@@ -833,6 +1694,11 @@ function getMetricsHandler(req, res, next) {
             var metricLabels = [];
             var metricValues = [];
             var componentName = haproxyComponentName(metric.hpComponent);
+            var metricName = mod_util.format('loadbalancer_%s_%s',
+                componentName, metric.name);
+
+            if (!selected(metricName))
+                return;
 
             /*
              * Filter out stats not related to this metric. This
@@ -872,8 +1738,13 @@ function getMetricsHandler(req, res, next) {
                 return;
             }
 
-            var metricName = mod_util.format('loadbalancer_%s_%s',
-                componentName, metric.name);
+            if (exporter.aggregateServers &&
+                metric.hpComponent === HAPROXY_SERVER) {
+                var agg = aggregateServers(metricLabels, metricValues,
+                    metric.aggregate);
+                metricLabels = agg.labels;
+                metricValues = agg.values;
+            }
 
             var metricOpts = {
                 metricName: metricName,
@@ -886,9 +1757,10 @@ function getMetricsHandler(req, res, next) {
             metricsString += createMetricString(metricOpts);
         });
 
-        res.header('content-type', 'text/plain');
-        res.send(metricsString);
-        next();
+        metricsString += infoString(info, selected);
+        metricsString += collectorsString(exporter.collectors, selected);
+
+        cb(null, metricsString);
     });
 }
 
@@ -897,5 +1769,10 @@ function createMetricsExporter(opts) {
 }
 
 module.exports = {
-    createMetricsExporter: createMetricsExporter
+    createMetricsExporter: createMetricsExporter,
+    // for testing
+    acceptsGzip: acceptsGzip,
+    aggregateServers: aggregateServers,
+    familyFilter: familyFilter,
+    translatePromex: translatePromex
 };
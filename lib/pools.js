@@ -0,0 +1,265 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 MNX Cloud, Inc.
+ */
+
+/*
+ * Memory pool and buffer usage.
+ *
+ * haproxy allocates most of its memory from fixed-size object pools, which
+ * grow during reload storms (old workers hang on to theirs) and large
+ * transfers, and are only returned to the system on SIGQUIT. The
+ * PoolStatsFSM periodically samples "show pools" through the stats socket
+ * and exports, for each pool, the bytes allocated and used and the number of
+ * failed allocations, along with the totals. The "buffer" pool (tune.bufsize
+ * objects) is also exported as buffer counts.
+ *
+ * Like lib/threads.js, sampling happens on its own interval rather than on
+ * every scrape, and the collector exports the last sample. To bound
+ * cardinality, only the maxPools largest pools (by bytes allocated) are
+ * exported by name; the rest are summed into pool="other".
+ *
+ *      +---------+  timeout (interval)  +----------+
+ *      |         | -------------------> |          |
+ *      | waiting |                      | sampling |
+ *      |         | <------------------- |          |
+ *      +---------+    done or error     +----------+
+ */
+
+/*jsl:ignore*/
+'use strict';
+/*jsl:end*/
+
+const mod_assert = require('assert-plus');
+const mod_util = require('util');
+const FSM = require('mooremachine').FSM;
+
+const DEFAULT_INTERVAL = 30000;     /* ms */
+const DEFAULT_MAX_POOLS = 20;
+const BUFFER_POOL = 'buffer';
+const OTHER_POOLS = 'other';
+/*JSSTYLED*/
+const POOL_RE = /Pool (\S+) \(([0-9]+) bytes\) : ([0-9]+) allocated \(([0-9]+) bytes\), ([0-9]+) used.*?([0-9]+) failures/;
+
+/*
+ * Parses "show pools" into:
+ *
+ *   {
+ *       pools: [ { name, size, allocated, allocatedBytes, used, failures } ],
+ *       allocatedBytes: <total>,
+ *       usedBytes: <total>
+ *   }
+ *
+ * The per-pool line looks like this (newer versions add fields between
+ * "used" and "failures"):
+ *
+ *   - Pool buffer (16384 bytes) : 5 allocated (81920 bytes), 3 used,
+ *     0 failures, 1 users, @0x5c5900 [SHARED]
+ */
+function parsePools(output) {
+    mod_assert.string(output, 'output');
+
+    var res = { pools: [], allocatedBytes: 0, usedBytes: 0 };
+
+    output.split('\n').forEach(function (line) {
+        var m = POOL_RE.exec(line);
+        if (m === null)
+            return;
+
+        var pool = {
+            name: m[1],
+            size: parseInt(m[2], 10),
+            allocated: parseInt(m[3], 10),
+            allocatedBytes: parseInt(m[4], 10),
+            used: parseInt(m[5], 10),
+            failures: parseInt(m[6], 10)
+        };
+        res.pools.push(pool);
+        res.allocatedBytes += pool.allocatedBytes;
+        res.usedBytes += pool.used * pool.size;
+    });
+
+    return (res);
+}
+
+/*
+ * Keeps the maxPools largest pools by bytes allocated and sums the rest into a
+ * single "other" pool.
+ */
+function topPools(pools, maxPools) {
+    mod_assert.array(pools, 'pools');
+    mod_assert.number(maxPools, 'maxPools');
+
+    var sorted = pools.slice().sort(function (a, b) {
+        return (b.allocatedBytes - a.allocatedBytes);
+    });
+    if (sorted.length <= maxPools)
+        return (sorted);
+
+    var top = sorted.slice(0, maxPools);
+    var other = { name: OTHER_POOLS, allocatedBytes: 0, usedBytes: 0,
+        failures: 0 };
+    sorted.slice(maxPools).forEach(function (p) {
+        other.allocatedBytes += p.allocatedBytes;
+        other.usedBytes += p.used * p.size;
+        other.failures += p.failures;
+    });
+    top.push(other);
+    return (top);
+}
+
+function usedBytes(pool) {
+    return ((pool.usedBytes !== undefined) ? pool.usedBytes :
+        pool.used * pool.size);
+}
+
+/*
+ * Options:
+ * - haSock, the lib/haproxy_sock.js module
+ * - log, a Bunyan logger
+ * - interval (optional), the sampling interval in ms
+ * - maxPools (optional), the number of pools to export by name
+ */
+function PoolStatsFSM(opts) {
+    mod_assert.object(opts, 'opts');
+    mod_assert.object(opts.haSock, 'opts.haSock');
+    mod_assert.object(opts.log, 'opts.log');
+    mod_assert.optionalNumber(opts.interval, 'opts.interval');
+    mod_assert.optionalNumber(opts.maxPools, 'opts.maxPools');
+
+    this.ps_haSock = opts.haSock;
+    this.ps_log = opts.log;
+    this.ps_interval = opts.interval || DEFAULT_INTERVAL;
+    this.ps_maxPools = opts.maxPools || DEFAULT_MAX_POOLS;
+
+    this.ps_sample = null;
+    this.ps_errors = 0;
+
+    FSM.call(this, 'waiting');
+}
+mod_util.inherits(PoolStatsFSM, FSM);
+
+PoolStatsFSM.prototype.state_waiting = function (S) {
+    S.gotoStateTimeout(this.ps_interval, 'sampling');
+};
+
+PoolStatsFSM.prototype.state_sampling = function (S) {
+    var self = this;
+    var log = this.ps_log;
+
+    self.ps_haSock.showRaw({ log: log, what: 'pools' },
+        S.callback(function (err, output) {
+        if (err) {
+            log.warn(err, 'failed to sample haproxy memory pools');
+            self.ps_errors++;
+            S.gotoState('waiting');
+            return;
+        }
+
+        var sample = parsePools(output);
+        if (sample.pools.length === 0) {
+            log.warn({ output: output }, 'no pools found in "show pools"');
+            self.ps_errors++;
+        } else {
+            self.ps_sample = sample;
+        }
+        S.gotoState('waiting');
+    }));
+};
+
+/*
+ * Returns a metrics exporter collector (see lib/metrics_exporter.js) for the
+ * last sample.
+ */
+PoolStatsFSM.prototype.collector = function () {
+    var self = this;
+
+    return (function _collectPools() {
+        var families = [
+            {
+                name: 'loadbalancer_pool_sample_errors_total',
+                type: 'counter',
+                desc: 'Total number of failed memory pool samples.',
+                metrics: [ { labels: {}, value: self.ps_errors } ]
+            }
+        ];
+
+        var sample = self.ps_sample;
+        if (sample === null)
+            return (families);
+
+        var pools = topPools(sample.pools, self.ps_maxPools);
+        var buffers = sample.pools.filter(function (p) {
+            return (p.name === BUFFER_POOL);
+        });
+
+        families.push({
+            name: 'loadbalancer_pool_allocated_bytes',
+            type: 'gauge',
+            desc: 'Memory allocated in the pool, in bytes.',
+            metrics: pools.map(function (p) {
+                return ({ labels: { pool: p.name },
+                    value: p.allocatedBytes });
+            })
+        });
+        families.push({
+            name: 'loadbalancer_pool_used_bytes',
+            type: 'gauge',
+            desc: 'Memory in use in the pool, in bytes.',
+            metrics: pools.map(function (p) {
+                return ({ labels: { pool: p.name }, value: usedBytes(p) });
+            })
+        });
+        families.push({
+            name: 'loadbalancer_pool_failures_total',
+            type: 'counter',
+            desc: 'Total number of failed allocations from the pool.',
+            metrics: pools.map(function (p) {
+                return ({ labels: { pool: p.name }, value: p.failures });
+            })
+        });
+        families.push({
+            name: 'loadbalancer_pools_allocated_bytes',
+            type: 'gauge',
+            desc: 'Memory allocated in all pools, in bytes.',
+            metrics: [ { labels: {}, value: sample.allocatedBytes } ]
+        });
+        families.push({
+            name: 'loadbalancer_pools_used_bytes',
+            type: 'gauge',
+            desc: 'Memory in use in all pools, in bytes.',
+            metrics: [ { labels: {}, value: sample.usedBytes } ]
+        });
+        families.push({
+            name: 'loadbalancer_buffers_allocated',
+            type: 'gauge',
+            desc: 'Number of buffers (tune.bufsize) allocated.',
+            metrics: buffers.map(function (p) {
+                return ({ labels: { size: String(p.size) },
+                    value: p.allocated });
+            })
+        });
+        families.push({
+            name: 'loadbalancer_buffers_used',
+            type: 'gauge',
+            desc: 'Number of buffers (tune.bufsize) in use.',
+            metrics: buffers.map(function (p) {
+                return ({ labels: { size: String(p.size) }, value: p.used });
+            })
+        });
+
+        return (families);
+    });
+};
+
+module.exports = {
+    PoolStatsFSM: PoolStatsFSM,
+    // for testing
+    parsePools: parsePools,
+    topPools: topPools
+};
@@ -0,0 +1,477 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 MNX Cloud, Inc.
+ */
+
+/*
+ * High-resolution stats sampling and an in-memory flight recorder.
+ *
+ * Prometheus scrapes /metrics every minute or so, which hides short bursts:
+ * a frontend that hits its session limit for five seconds looks fine in a
+ * 60-second gauge. The FlightRecorderFSM samples the frontend and backend
+ * rows of "show stat" (which stays cheap however many servers there are) at
+ * a much shorter interval into a fixed-size ring buffer, and its collector
+ * exports the median, 90th and 99th percentiles and maximum of each sampled
+ * stat over the last window (quantile="1" is the maximum).
+ *
+ * The buffer, along with the most recent state transitions of the FSMs we're
+ * asked to track and whatever else the caller passes in (e.g. the server
+ * watcher's recent diffs), can be dumped as JSON to disk for post-incident
+ * analysis. Dumps requested on demand are always written; automatic ones
+ * (e.g. on a failed reload) at most once per minDumpInterval. Only the newest
+ * maxDumps dumps are kept in dumpDir; older ones are removed after each dump.
+ *
+ *      +---------+  timeout (interval)  +----------+
+ *      |         | -------------------> |          |
+ *      | waiting |                      | sampling |
+ *      |         | <------------------- |          |
+ *      +---------+    done or error     +----------+
+ */
+
+/*jsl:ignore*/
+'use strict';
+/*jsl:end*/
+
+const mod_assert = require('assert-plus');
+const mod_fs = require('fs');
+const mod_os = require('os');
+const mod_path = require('path');
+const mod_util = require('util');
+const mod_vasync = require('vasync');
+const FSM = require('mooremachine').FSM;
+
+const COMPONENTS = { '0': 'frontend', '1': 'backend' };
+const SAMPLE_STATS = [ 'scur', 'rate', 'qcur' ];
+const QUANTILES = [ 0.5, 0.9, 0.99, 1 ];
+
+const DEFAULTS = {
+    interval: 1000,                 /* ms */
+    size: 900,                      /* samples; 15 minutes at the default */
+    window: 60000,                  /* ms */
+    maxTransitions: 200,
+    dumpDir: '/var/tmp',
+    maxDumps: 20,                   /* dumps kept in dumpDir */
+    minDumpInterval: 60000          /* ms, between automatic dumps */
+};
+
+/* Dump file names sort by the time they were written. */
+const DUMP_FILE_RE = /^muppet-recorder-.*\.json$/;
+
+/*
+ * The sampled stats exported per window; the names follow the haproxy
+ * metrics in lib/metrics_exporter.js, with a "_window" suffix.
+ */
+const WINDOW_METRICS = [
+    {
+        component: 'frontend',
+        stat: 'scur',
+        name: 'current_sessions',
+        desc: 'Current number of active sessions'
+    },
+    {
+        component: 'frontend',
+        stat: 'rate',
+        name: 'current_session_rate',
+        desc: 'Current number of sessions per second'
+    },
+    {
+        component: 'backend',
+        stat: 'scur',
+        name: 'current_sessions',
+        desc: 'Current number of active sessions'
+    },
+    {
+        component: 'backend',
+        stat: 'qcur',
+        name: 'current_queue',
+        desc: 'Current number of queued requests'
+    }
+];
+
+/*
+ * A fixed-size buffer that overwrites its oldest item once full.
+ */
+function Ring(size) {
+    mod_assert.number(size, 'size');
+    mod_assert.ok(size > 0, 'size > 0');
+
+    this.r_size = size;
+    this.r_items = [];
+    this.r_next = 0;
+}
+
+Ring.prototype.push = function (item) {
+    if (this.r_items.length < this.r_size)
+        this.r_items.push(item);
+    else
+        this.r_items[this.r_next] = item;
+    this.r_next = (this.r_next + 1) % this.r_size;
+};
+
+Ring.prototype.length = function () {
+    return (this.r_items.length);
+};
+
+/* Returns the items, oldest first. */
+Ring.prototype.toArray = function () {
+    if (this.r_items.length < this.r_size)
+        return (this.r_items.slice());
+    return (this.r_items.slice(this.r_next).concat(
+        this.r_items.slice(0, this.r_next)));
+};
+
+/*
+ * Turns the output of lib_hasock.proxyStats() into a sample of the form:
+ *
+ *   {
+ *       time: <ms since the epoch>,
+ *       frontend: { <pxname>: { scur, rate } },
+ *       backend: { <pxname>: { scur, rate, qcur } }
+ *   }
+ *
+ * Stats that haproxy leaves empty for the row's type are omitted.
+ */
+function sampleFromStats(stats, time) {
+    mod_assert.array(stats, 'stats');
+    mod_assert.number(time, 'time');
+
+    var sample = { time: time, frontend: {}, backend: {} };
+    stats.forEach(function (stat) {
+        var component = COMPONENTS[stat.type];
+        if (component === undefined)
+            return;
+
+        var values = {};
+        SAMPLE_STATS.forEach(function (name) {
+            if (stat[name] !== undefined && stat[name] !== '')
+                values[name] = parseInt(stat[name], 10);
+        });
+        sample[component][stat.pxname] = values;
+    });
+
+    return (sample);
+}
+
+/*
+ * Nearest-rank quantile of an array of numbers sorted in ascending order.
+ */
+function quantile(sorted, q) {
+    mod_assert.array(sorted, 'sorted');
+    mod_assert.number(q, 'q');
+
+    if (sorted.length === 0)
+        return (NaN);
+    var rank = Math.ceil(q * sorted.length);
+    return (sorted[Math.min(Math.max(rank, 1), sorted.length) - 1]);
+}
+
+/*
+ * Summarizes the samples taken after "since" into:
+ *
+ *   {
+ *       <component>: {
+ *           <pxname>: { <stat>: { '0.5': ..., '0.9': ..., '0.99': ...,
+ *               '1': ... } }
+ *       }
+ *   }
+ */
+function windowSummary(samples, since) {
+    mod_assert.array(samples, 'samples');
+    mod_assert.number(since, 'since');
+
+    var values = {};
+    samples.forEach(function (sample) {
+        if (sample.time <= since)
+            return;
+        Object.keys(COMPONENTS).forEach(function (type) {
+            var component = COMPONENTS[type];
+            var proxies = sample[component];
+            Object.keys(proxies).forEach(function (pxname) {
+                Object.keys(proxies[pxname]).forEach(function (stat) {
+                    if (!values[component])
+                        values[component] = {};
+                    if (!values[component][pxname])
+                        values[component][pxname] = {};
+                    if (!values[component][pxname][stat])
+                        values[component][pxname][stat] = [];
+                    values[component][pxname][stat].push(
+                        proxies[pxname][stat]);
+                });
+            });
+        });
+    });
+
+    Object.keys(values).forEach(function (component) {
+        Object.keys(values[component]).forEach(function (pxname) {
+            var stats = values[component][pxname];
+            Object.keys(stats).forEach(function (stat) {
+                var sorted = stats[stat].sort(function (a, b) {
+                    return (a - b);
+                });
+                var summary = {};
+                QUANTILES.forEach(function (q) {
+                    summary[String(q)] = quantile(sorted, q);
+                });
+                stats[stat] = summary;
+            });
+        });
+    });
+
+    return (values);
+}
+
+/*
+ * Options:
+ * - haSock, the lib/haproxy_sock.js module
+ * - log, a Bunyan logger
+ * - config, the "recorder" section of the muppet configuration; see DEFAULTS
+ *   above for the settings and their defaults
+ */
+function FlightRecorderFSM(opts) {
+    mod_assert.object(opts, 'opts');
+    mod_assert.object(opts.haSock, 'opts.haSock');
+    mod_assert.object(opts.log, 'opts.log');
+    mod_assert.optionalObject(opts.config, 'opts.config');
+
+    var config = opts.config || {};
+    var cfg = {};
+    Object.keys(DEFAULTS).forEach(function (key) {
+        cfg[key] = (config[key] !== undefined) ? config[key] : DEFAULTS[key];
+    });
+    mod_assert.number(cfg.interval, 'config.interval');
+    mod_assert.number(cfg.size, 'config.size');
+    mod_assert.number(cfg.window, 'config.window');
+    mod_assert.number(cfg.maxTransitions, 'config.maxTransitions');
+    mod_assert.string(cfg.dumpDir, 'config.dumpDir');
+    mod_assert.ok(Number.isInteger(cfg.maxDumps) && cfg.maxDumps > 0,
+        'config.maxDumps must be a positive integer');
+    mod_assert.number(cfg.minDumpInterval, 'config.minDumpInterval');
+
+    this.fr_cfg = cfg;
+    this.fr_haSock = opts.haSock;
+    this.fr_log = opts.log;
+
+    this.fr_samples = new Ring(cfg.size);
+    this.fr_transitions = new Ring(cfg.maxTransitions);
+    this.fr_errors = 0;
+    this.fr_dumps = 0;
+    this.fr_lastDump = 0;
+
+    FSM.call(this, 'waiting');
+}
+mod_util.inherits(FlightRecorderFSM, FSM);
+
+FlightRecorderFSM.prototype.state_waiting = function (S) {
+    S.gotoStateTimeout(this.fr_cfg.interval, 'sampling');
+};
+
+FlightRecorderFSM.prototype.state_sampling = function (S) {
+    var self = this;
+    var log = this.fr_log;
+
+    self.fr_haSock.proxyStats({ log: log }, S.callback(function (err, stats) {
+        if (err) {
+            log.warn(err, 'failed to sample haproxy stats');
+            self.fr_errors++;
+            S.gotoState('waiting');
+            return;
+        }
+
+        self.fr_samples.push(sampleFromStats(stats, Date.now()));
+        S.gotoState('waiting');
+    }));
+};
+
+/*
+ * Records the state transitions of the given FSM, to be included in dumps.
+ */
+FlightRecorderFSM.prototype.track = function (name, fsm) {
+    mod_assert.string(name, 'name');
+    mod_assert.object(fsm, 'fsm');
+    var self = this;
+
+    fsm.on('stateChanged', function (state) {
+        self.fr_transitions.push({
+            time: new Date().toISOString(),
+            fsm: name,
+            state: state
+        });
+    });
+};
+
+/*
+ * Writes the recorder's contents to a JSON file in dumpDir, calling back with
+ * the file's path (or null if an automatic dump was skipped).
+ *
+ * Options:
+ * - reason, a short string included in the file name
+ * - auto (optional), true if not explicitly requested by an operator
+ * - error (optional), the error that prompted the dump
+ * - extra (optional), an object of additional state to include
+ */
+FlightRecorderFSM.prototype.dump = function (opts, cb) {
+    mod_assert.object(opts, 'opts');
+    mod_assert.string(opts.reason, 'opts.reason');
+    mod_assert.optionalBool(opts.auto, 'opts.auto');
+    mod_assert.optionalObject(opts.error, 'opts.error');
+    mod_assert.optionalObject(opts.extra, 'opts.extra');
+    mod_assert.func(cb, 'callback');
+    var self = this;
+    var log = this.fr_log;
+    var now = Date.now();
+
+    if (opts.auto && now - self.fr_lastDump < self.fr_cfg.minDumpInterval) {
+        log.info({ reason: opts.reason }, 'skipping flight recorder dump');
+        setImmediate(cb, null, null);
+        return;
+    }
+    self.fr_lastDump = now;
+
+    var record = {
+        reason: opts.reason,
+        time: new Date(now).toISOString(),
+        hostname: mod_os.hostname(),
+        error: opts.error ? String(opts.error) : undefined,
+        interval: self.fr_cfg.interval,
+        samples: self.fr_samples.toArray(),
+        transitions: self.fr_transitions.toArray(),
+        extra: opts.extra
+    };
+    var file = mod_path.join(self.fr_cfg.dumpDir, mod_util.format(
+        'muppet-recorder-%s-%s.json', new Date(now).toISOString().replace(
+        /[:.]/g, '-'), opts.reason));
+
+    mod_fs.writeFile(file, JSON.stringify(record), function (err) {
+        if (err) {
+            log.error(err, 'failed to write flight recorder dump');
+            cb(err);
+            return;
+        }
+        self.fr_dumps++;
+        log.info({ file: file, reason: opts.reason,
+            samples: record.samples.length }, 'wrote flight recorder dump');
+        self._prune(function () {
+            cb(null, file);
+        });
+    });
+};
+
+/*
+ * Removes all but the newest maxDumps dumps from dumpDir. Failures are only
+ * logged: they shouldn't fail the dump that was just written.
+ */
+FlightRecorderFSM.prototype._prune = function (cb) {
+    var log = this.fr_log;
+    var dir = this.fr_cfg.dumpDir;
+    var maxDumps = this.fr_cfg.maxDumps;
+
+    mod_fs.readdir(dir, function (err, files) {
+        if (err) {
+            log.warn(err, 'failed to list flight recorder dumps');
+            cb();
+            return;
+        }
+
+        var old = files.filter(function (name) {
+            return (DUMP_FILE_RE.test(name));
+        }).sort().slice(0, -maxDumps);
+
+        mod_vasync.forEachPipeline({
+            inputs: old,
+            func: function (name, next) {
+                var file = mod_path.join(dir, name);
+                mod_fs.unlink(file, function (err2) {
+                    if (err2 && err2.code !== 'ENOENT') {
+                        log.warn(err2,
+                            'failed to remove flight recorder dump');
+                    } else {
+                        log.info({ file: file },
+                            'removed old flight recorder dump');
+                    }
+                    next();
+                });
+            }
+        }, function () {
+            cb();
+        });
+    });
+};
+
+/*
+ * Returns a metrics exporter collector (see lib/metrics_exporter.js) for the
+ * last window of samples.
+ */
+FlightRecorderFSM.prototype.collector = function () {
+    var self = this;
+
+    return (function _collectRecorder() {
+        var families = [
+            {
+                name: 'loadbalancer_recorder_samples',
+                type: 'gauge',
+                desc: 'Number of samples in the flight recorder.',
+                metrics: [ { labels: {}, value: self.fr_samples.length() } ]
+            },
+            {
+                name: 'loadbalancer_recorder_sample_errors_total',
+                type: 'counter',
+                desc: 'Total number of failed flight recorder samples.',
+                metrics: [ { labels: {}, value: self.fr_errors } ]
+            },
+            {
+                name: 'loadbalancer_recorder_dumps_total',
+                type: 'counter',
+                desc: 'Total number of flight recorder dumps written.',
+                metrics: [ { labels: {}, value: self.fr_dumps } ]
+            }
+        ];
+
+        var summary = windowSummary(self.fr_samples.toArray(),
+            Date.now() - self.fr_cfg.window);
+
+        WINDOW_METRICS.forEach(function (metric) {
+            var proxies = summary[metric.component] || {};
+            var metrics = [];
+            Object.keys(proxies).forEach(function (pxname) {
+                var quantiles = proxies[pxname][metric.stat];
+                if (quantiles === undefined)
+                    return;
+                QUANTILES.forEach(function (q) {
+                    metrics.push({
+                        labels: {
+                            component: metric.component,
+                            name: pxname,
+                            quantile: String(q)
+                        },
+                        value: quantiles[String(q)]
+                    });
+                });
+            });
+
+            families.push({
+                name: mod_util.format('loadbalancer_%s_%s_window',
+                    metric.component, metric.name),
+                type: 'gauge',
+                desc: metric.desc + ', quantiles over the last ' +
+                    (self.fr_cfg.window / 1000) + ' seconds of samples.',
+                metrics: metrics
+            });
+        });
+
+        return (families);
+    });
+};
+
+module.exports = {
+    FlightRecorderFSM: FlightRecorderFSM,
+    // for testing
+    Ring: Ring,
+    quantile: quantile,
+    sampleFromStats: sampleFromStats,
+    windowSummary: windowSummary
+};
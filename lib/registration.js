@@ -0,0 +1,618 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 MNX Cloud, Inc.
+ */
+
+/*
+ * Management of this load balancer's own registration.
+ *
+ * Registrar publishes a ZooKeeper node for each load balancer, from which
+ * binder serves DNS: clients pick a load balancer blind to how busy it is. The
+ * LoadReporterFSM periodically reads haproxy's "show info" and:
+ *
+ *   - publishes the current load into our own registration node, as a "load"
+ *     object alongside what registrar wrote:
+ *
+ *         "load": {
+ *             "sessions": <CurrConns>,
+ *             "maxconn": <Maxconn>,
+ *             "idle_pct": <Idle_pct>,
+ *             "weight": <1-100, our remaining headroom>,
+ *             "time": <ISO 8601 timestamp>
+ *         }
+ *
+ *   - optionally ("withdraw" in the configuration) withdraws the registration
+ *     while we're overloaded and restores it once we've recovered.
+ *
+ * We're overloaded when haproxy's idle time drops below withdrawIdlePct, or
+ * its connections exceed withdrawUtilization of maxconn. We've recovered when
+ * idle time is back above rejoinIdlePct and connections below
+ * rejoinUtilization. Either has to hold for holdChecks consecutive checks
+ * before we act. The gap between the two sets of thresholds, and the hold,
+ * keep us from flapping in and out of DNS.
+ *
+ * We only withdraw if at least minPeers other load balancers are registered,
+ * so that an overloaded tier can't withdraw itself entirely.
+ *
+ * Binder doesn't weight its answers, so "weight" is informational for now,
+ * for tooling and for resolvers which can make use of it.
+ *
+ * The registration is withdrawn and restored by disabling and enabling
+ * registrar (temporarily), which removes and re-creates its nodes. Draining
+ * (lib/drain.js) does the same, after stopping the LoadReporterFSM.
+ *
+ * Registrar may also be disabled by an operator, whose choice we must not
+ * undo. So whenever we disable registrar, we leave a marker file behind until
+ * we enable it again, and when we start we read registrar's SMF state along
+ * with the marker: if it's disabled and the marker is there, we withdrew, and
+ * rejoin once the load allows it; if it's disabled without the marker, we
+ * leave registrar alone until muppet restarts. The markers live in /var/run,
+ * which like registrar's temporary disabling doesn't survive a reboot. We
+ * read the state once a drain's own restore (see lib/drain.js) is done.
+ */
+
+/*jsl:ignore*/
+'use strict';
+/*jsl:end*/
+
+const mod_assert = require('assert-plus');
+const mod_forkexec = require('forkexec');
+const mod_fs = require('fs');
+const mod_os = require('os');
+const mod_util = require('util');
+const mod_vasync = require('vasync');
+const VError = require('verror');
+const FSM = require('mooremachine').FSM;
+
+const REGISTRAR_FMRI = 'svc:/manta/registrar:default';
+
+const DEFAULTS = {
+    interval: 10000,                /* ms */
+    name: null,                     /* defaults to os.hostname() */
+    withdraw: false,
+    withdrawIdlePct: 10,
+    rejoinIdlePct: 30,
+    withdrawUtilization: 0.9,
+    rejoinUtilization: 0.7,
+    holdChecks: 3,
+    minPeers: 2,
+    markerFile: '/var/run/muppet-load-withdrawn'
+};
+
+/*
+ * Enables or disables registrar (temporarily, so that a reboot restores it),
+ * waiting for the change to take effect. A marker file, if given, records
+ * that we disabled registrar: it's created before disabling registrar, and
+ * removed once it's enabled again.
+ */
+function setRegistrar(opts, cb) {
+    mod_assert.object(opts, 'opts');
+    mod_assert.bool(opts.enabled, 'opts.enabled');
+    mod_assert.optionalString(opts.fmri, 'opts.fmri');
+    mod_assert.optionalString(opts.marker, 'opts.marker');
+    mod_assert.object(opts.log, 'opts.log');
+    mod_assert.func(cb, 'callback');
+
+    const args = [ '/usr/sbin/svcadm', opts.enabled ? 'enable' : 'disable',
+        '-s', '-t', opts.fmri || REGISTRAR_FMRI ];
+
+    function svcadm(_, next) {
+        opts.log.info({ cmd: args }, opts.enabled ?
+            'restoring registration' : 'withdrawing registration');
+        mod_forkexec.forkExecWait({
+            argv: args
+        }, function (err) {
+            next(err ? new VError(err, 'failed to %s registrar',
+                opts.enabled ? 'enable' : 'disable') : null);
+        });
+    }
+
+    function mark(_, next) {
+        mod_fs.writeFile(opts.marker, '', function (err) {
+            next(err ? new VError(err, 'failed to create %s',
+                opts.marker) : null);
+        });
+    }
+
+    function unmark(_, next) {
+        mod_fs.unlink(opts.marker, function (err) {
+            next((err && err.code !== 'ENOENT') ? new VError(err,
+                'failed to remove %s', opts.marker) : null);
+        });
+    }
+
+    var funcs = [ svcadm ];
+    if (opts.marker !== undefined) {
+        if (opts.enabled)
+            funcs.push(unmark);
+        else
+            funcs.unshift(mark);
+    }
+
+    mod_vasync.pipeline({
+        funcs: funcs
+    }, function (err) {
+        cb(err || null);
+    });
+}
+
+/*
+ * Calls cb with whether the marker file is there, i.e. whether we disabled
+ * registrar and haven't enabled it since.
+ */
+function markedWithdrawn(marker, cb) {
+    mod_assert.string(marker, 'marker');
+    mod_assert.func(cb, 'callback');
+
+    mod_fs.stat(marker, function (err) {
+        cb(!err);
+    });
+}
+
+/*
+ * Parses the output of "svcs -H -o state,nstate" for registrar, returning
+ * whether it is (or is about to be) enabled, or null if the output makes no
+ * sense.
+ */
+function parseRegistrarState(str) {
+    mod_assert.string(str, 'str');
+
+    var fields = str.trim().split(/\s+/);
+    if (fields.length !== 2 || fields[0] === '')
+        return (null);
+    var state = (fields[1] === '-') ? fields[0] : fields[1];
+    return (state !== 'disabled');
+}
+
+/*
+ * Reads registrar's SMF state, calling cb with whether it is enabled.
+ */
+function registrarEnabled(opts, cb) {
+    mod_assert.object(opts, 'opts');
+    mod_assert.optionalString(opts.fmri, 'opts.fmri');
+    mod_assert.object(opts.log, 'opts.log');
+    mod_assert.func(cb, 'callback');
+
+    const args = [ '/usr/bin/svcs', '-H', '-o', 'state,nstate',
+        opts.fmri || REGISTRAR_FMRI ];
+
+    opts.log.debug({ cmd: args }, 'reading registrar state');
+    mod_forkexec.forkExecWait({
+        argv: args
+    }, function (err, info) {
+        if (err) {
+            cb(new VError(err, 'failed to read registrar state'));
+            return;
+        }
+        var enabled = parseRegistrarState(info.stdout);
+        if (enabled === null) {
+            cb(new VError('unexpected registrar state: "%s"',
+                info.stdout.trim()));
+            return;
+        }
+        cb(null, enabled);
+    });
+}
+
+/*
+ * Returns our starting state ({ withdrawn, streak }, as for nextState()),
+ * given whether registrar is currently enabled and whether we had disabled it
+ * (see markedWithdrawn()), or null if someone else disabled it, in which case
+ * we leave it alone.
+ */
+function initialState(enabled, ours) {
+    mod_assert.bool(enabled, 'enabled');
+    mod_assert.bool(ours, 'ours');
+
+    if (!enabled && !ours)
+        return (null);
+    return ({ withdrawn: !enabled, streak: 0 });
+}
+
+/*
+ * Summarizes haproxy's "show info" (see lib/stats_poller.js) into the load
+ * object we publish.
+ */
+function loadFromInfo(info) {
+    mod_assert.object(info, 'info');
+
+    var sessions = parseInt(info.CurrConns || '0', 10);
+    var maxconn = parseInt(info.Maxconn || '0', 10);
+    var idlePct = parseInt(info.Idle_pct || '100', 10);
+    var utilization = (maxconn > 0) ? sessions / maxconn : 0;
+    var headroom = Math.min(idlePct / 100, 1 - utilization);
+
+    return ({
+        sessions: sessions,
+        maxconn: maxconn,
+        idle_pct: idlePct,
+        utilization: utilization,
+        weight: Math.max(1, Math.min(100, Math.round(headroom * 100)))
+    });
+}
+
+/*
+ * Given the load from loadFromInfo() and the previous state
+ * ({ withdrawn: <bool>, streak: <consecutive checks past the threshold> }),
+ * returns the next state.
+ */
+function nextState(load, state, cfg) {
+    mod_assert.object(load, 'load');
+    mod_assert.object(state, 'state');
+    mod_assert.object(cfg, 'cfg');
+
+    var past;
+    if (state.withdrawn) {
+        past = load.idle_pct >= cfg.rejoinIdlePct &&
+            load.utilization <= cfg.rejoinUtilization;
+    } else {
+        past = load.idle_pct < cfg.withdrawIdlePct ||
+            load.utilization > cfg.withdrawUtilization;
+    }
+
+    if (!past)
+        return ({ withdrawn: state.withdrawn, streak: 0 });
+    if (state.streak + 1 >= cfg.holdChecks)
+        return ({ withdrawn: !state.withdrawn, streak: 0 });
+    return ({ withdrawn: state.withdrawn, streak: state.streak + 1 });
+}
+
+/*
+ * Options:
+ * - stats, the StatsPollerFSM (see lib/stats_poller.js)
+ * - zk, a connected zkstream client
+ * - log, a Bunyan logger
+ * - config, the "loadReport" section of the muppet configuration, which
+ *   must include the load balancers' "serviceName" (as given to registrar);
+ *   see DEFAULTS above for the other settings and their defaults
+ * - drain (optional), the DrainFSM (see lib/drain.js), whose restore of the
+ *   registration we wait for before looking at registrar
+ */
+function LoadReporterFSM(opts) {
+    mod_assert.object(opts, 'opts');
+    mod_assert.object(opts.stats, 'opts.stats');
+    mod_assert.object(opts.zk, 'opts.zk');
+    mod_assert.object(opts.log, 'opts.log');
+    mod_assert.object(opts.config, 'opts.config');
+    mod_assert.string(opts.config.serviceName, 'config.serviceName');
+    mod_assert.optionalObject(opts.drain, 'opts.drain');
+
+    var cfg = {};
+    Object.keys(DEFAULTS).forEach(function (key) {
+        cfg[key] = (opts.config[key] !== undefined) ?
+            opts.config[key] : DEFAULTS[key];
+    });
+    mod_assert.ok(cfg.rejoinIdlePct >= cfg.withdrawIdlePct,
+        'config.rejoinIdlePct must be at least config.withdrawIdlePct');
+    mod_assert.ok(cfg.rejoinUtilization <= cfg.withdrawUtilization,
+        'config.rejoinUtilization must be at most config.withdrawUtilization');
+
+    this.lr_cfg = cfg;
+    this.lr_stats = opts.stats;
+    this.lr_zk = opts.zk;
+    this.lr_log = opts.log;
+    this.lr_drain = opts.drain || null;
+    this.lr_dir = '/' + opts.config.serviceName.split('.').reverse().join('/');
+    this.lr_path = this.lr_dir + '/' + (cfg.name || mod_os.hostname());
+
+    this.lr_load = null;
+    this.lr_state = { withdrawn: false, streak: 0 };
+    /* false if someone else disabled registrar */
+    this.lr_managed = true;
+    this.lr_withdrawals = 0;
+    this.lr_errors = 0;
+
+    FSM.call(this, 'starting');
+}
+mod_util.inherits(LoadReporterFSM, FSM);
+
+/*
+ * Stops reporting for good, e.g. because we're about to drain.
+ */
+LoadReporterFSM.prototype.stop = function () {
+    this.emit('stopAsserted');
+};
+
+LoadReporterFSM.prototype.state_starting = function (S) {
+    var drain = this.lr_drain;
+
+    S.on(this, 'stopAsserted', function () {
+        S.gotoState('stopped');
+    });
+    if (drain === null || !drain.isInState('restoring')) {
+        S.gotoState('reconciling');
+        return;
+    }
+    S.on(drain, 'stateChanged', function () {
+        S.gotoState('reconciling');
+    });
+};
+
+LoadReporterFSM.prototype.state_reconciling = function (S) {
+    var self = this;
+    var log = this.lr_log;
+    var stopped = false;
+
+    S.on(this, 'stopAsserted', function () {
+        stopped = true;
+    });
+
+    markedWithdrawn(this.lr_cfg.markerFile, S.callback(function (ours) {
+        registrarEnabled({ log: log }, S.callback(function (err, enabled) {
+            if (err) {
+                log.warn(err, 'load report: assuming we are registered');
+                self.lr_errors++;
+                S.gotoState(stopped ? 'stopped' : 'waiting');
+                return;
+            }
+            var state = initialState(enabled, ours);
+            if (state === null) {
+                log.warn('registrar was disabled outside of muppet, ' +
+                    'leaving it alone');
+                self.lr_managed = false;
+            } else {
+                self.lr_state = state;
+                if (state.withdrawn)
+                    log.info('registration was withdrawn for load');
+            }
+            S.gotoState(stopped ? 'stopped' : 'waiting');
+        }));
+    }));
+};
+
+LoadReporterFSM.prototype.state_waiting = function (S) {
+    S.on(this, 'stopAsserted', function () {
+        S.gotoState('stopped');
+    });
+    S.gotoStateTimeout(this.lr_cfg.interval, 'checking');
+};
+
+LoadReporterFSM.prototype.state_checking = function (S) {
+    var self = this;
+    var log = this.lr_log;
+    var cfg = this.lr_cfg;
+    var stopped = false;
+
+    S.on(this, 'stopAsserted', function () {
+        /* Finish what we're doing, but don't flip registrar after this. */
+        stopped = true;
+    });
+
+    var statopts = { maxAge: cfg.interval };
+    self.lr_stats.snapshot(statopts, S.callback(function (err, snap) {
+        if (err) {
+            log.warn(err, 'load report: failed to read haproxy info');
+            self.lr_errors++;
+            S.gotoState(stopped ? 'stopped' : 'waiting');
+            return;
+        }
+
+        var load = loadFromInfo(snap.info);
+        self.lr_load = load;
+
+        /*
+         * If withdrawing was turned off while we were withdrawn, rejoin
+         * right away.
+         */
+        var next;
+        if (!self.lr_managed)
+            next = self.lr_state;
+        else if (cfg.withdraw)
+            next = nextState(load, self.lr_state, cfg);
+        else
+            next = { withdrawn: false, streak: 0 };
+
+        mod_vasync.pipeline({ funcs: [
+            function checkPeers(_, cb) {
+                if (next.withdrawn === self.lr_state.withdrawn ||
+                    !next.withdrawn) {
+                    cb();
+                    return;
+                }
+                self._countPeers(function (err2, peers) {
+                    if (err2) {
+                        cb(err2);
+                        return;
+                    }
+                    if (peers < cfg.minPeers) {
+                        log.warn({ load: load, peers: peers },
+                            'overloaded, but too few other load ' +
+                            'balancers registered to withdraw');
+                        next = { withdrawn: false, streak: 0 };
+                    }
+                    cb();
+                });
+            },
+            function flip(_, cb) {
+                if (next.withdrawn === self.lr_state.withdrawn || stopped) {
+                    cb();
+                    return;
+                }
+                log.warn({ load: load, withdrawn: next.withdrawn },
+                    next.withdrawn ? 'overloaded, withdrawing registration' :
+                    'recovered, restoring registration');
+                setRegistrar({
+                    enabled: !next.withdrawn,
+                    marker: cfg.markerFile,
+                    log: log
+                }, function (err2) {
+                    if (!err2 && next.withdrawn)
+                        self.lr_withdrawals++;
+                    cb(err2);
+                });
+            },
+            function publish(_, cb) {
+                if (next.withdrawn) {
+                    cb();
+                    return;
+                }
+                self._publish(load, cb);
+            }
+        ]}, S.callback(function (err2) {
+            if (err2) {
+                log.warn(err2, 'load report failed');
+                self.lr_errors++;
+            } else {
+                self.lr_state = next;
+            }
+            S.gotoState(stopped ? 'stopped' : 'waiting');
+        }));
+    }));
+};
+
+LoadReporterFSM.prototype.state_stopped = function (S) {
+    this.lr_log.info('load reporting stopped');
+};
+
+/*
+ * Counts the other load balancers currently registered alongside us.
+ */
+LoadReporterFSM.prototype._countPeers = function (cb) {
+    var self = this;
+    var zk = this.lr_zk;
+
+    zk.list(self.lr_dir, function (err, nodes) {
+        if (err) {
+            cb(new VError(err, 'failed to list %s', self.lr_dir));
+            return;
+        }
+        var peers = 0;
+        mod_vasync.forEachParallel({
+            inputs: nodes,
+            func: function (node, next) {
+                var path = self.lr_dir + '/' + node;
+                if (path === self.lr_path) {
+                    next();
+                    return;
+                }
+                zk.get(path, function (err2, json) {
+                    /* Nodes may come and go under us. */
+                    if (err2) {
+                        next();
+                        return;
+                    }
+                    try {
+                        var obj = JSON.parse(json.toString('utf-8'));
+                    } catch (e) {
+                        next();
+                        return;
+                    }
+                    if (obj !== null && obj.type === 'load_balancer')
+                        peers++;
+                    next();
+                });
+            }
+        }, function () {
+            cb(null, peers);
+        });
+    });
+};
+
+/*
+ * Writes the load into our registration node. The write is conditional on the
+ * node's version, so that if registrar re-registers at the same time, we
+ * don't overwrite its update (we'll just publish again next time).
+ */
+LoadReporterFSM.prototype._publish = function (load, cb) {
+    var self = this;
+    var zk = this.lr_zk;
+    var path = this.lr_path;
+
+    zk.get(path, function (err, json, stat) {
+        if (err && err.name === 'ZKError' && err.code === 'NO_NODE') {
+            self.lr_log.debug({ path: path },
+                'not registered (yet), not publishing load');
+            cb();
+            return;
+        } else if (err) {
+            cb(new VError(err, 'failed to read %s', path));
+            return;
+        }
+
+        try {
+            var obj = JSON.parse(json.toString('utf-8'));
+        } catch (e) {
+            cb(new VError(e, 'invalid JSON in %s', path));
+            return;
+        }
+
+        obj.load = {
+            sessions: load.sessions,
+            maxconn: load.maxconn,
+            idle_pct: load.idle_pct,
+            weight: load.weight,
+            time: new Date().toISOString()
+        };
+        var data = Buffer.from(JSON.stringify(obj), 'utf-8');
+        zk.set(path, data, stat.version, function (err2) {
+            if (err2 && err2.name === 'ZKError' &&
+                err2.code === 'BAD_VERSION') {
+                self.lr_log.debug({ path: path },
+                    'registration changed under us, publishing next time');
+                cb();
+                return;
+            }
+            cb(err2 ? new VError(err2, 'failed to write %s', path) : null);
+        });
+    });
+};
+
+/*
+ * Returns a metrics exporter collector (see lib/metrics_exporter.js) for the
+ * load we report.
+ */
+LoadReporterFSM.prototype.collector = function () {
+    var self = this;
+
+    return (function _collectLoadReport() {
+        var families = [
+            {
+                name: 'loadbalancer_registration_withdrawn',
+                type: 'gauge',
+                desc: 'Whether the registration is withdrawn because of ' +
+                    'load (1 = withdrawn).',
+                metrics: [ { labels: {},
+                    value: self.lr_state.withdrawn ? 1 : 0 } ]
+            },
+            {
+                name: 'loadbalancer_registration_withdrawals_total',
+                type: 'counter',
+                desc: 'Total number of times the registration was withdrawn ' +
+                    'because of load.',
+                metrics: [ { labels: {}, value: self.lr_withdrawals } ]
+            },
+            {
+                name: 'loadbalancer_registration_errors_total',
+                type: 'counter',
+                desc: 'Total number of failed load reports.',
+                metrics: [ { labels: {}, value: self.lr_errors } ]
+            }
+        ];
+        if (self.lr_load !== null) {
+            families.push({
+                name: 'loadbalancer_registration_weight',
+                type: 'gauge',
+                desc: 'Weight published in the registration (1-100).',
+                metrics: [ { labels: {}, value: self.lr_load.weight } ]
+            });
+        }
+        return (families);
+    });
+};
+
+module.exports = {
+    REGISTRAR_FMRI: REGISTRAR_FMRI,
+    markedWithdrawn: markedWithdrawn,
+    setRegistrar: setRegistrar,
+    LoadReporterFSM: LoadReporterFSM,
+    // for testing
+    initialState: initialState,
+    loadFromInfo: loadFromInfo,
+    nextState: nextState,
+    parseRegistrarState: parseRegistrarState
+};
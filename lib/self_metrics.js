@@ -0,0 +1,307 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 MNX Cloud, Inc.
+ */
+
+/*
+ * Metrics about muppet itself, as opposed to haproxy.
+ *
+ * When load balancers are slow to converge on a new set of backend servers,
+ * the problem may be muppet rather than haproxy or ZooKeeper: a busy event
+ * loop, a growing heap, a state machine stuck somewhere, or a pile-up of
+ * reloads or socket commands. SelfMetrics exports:
+ *
+ *   - event loop lag, measured as the delay of a periodic timer (garbage
+ *     collection pauses show up here too; node v6 has no GC observer)
+ *   - CPU time, resident set size and V8 heap usage
+ *   - time spent in and transitions into each state of the FSMs it tracks
+ *   - counters of reloads, control socket syncs and periodic double-checks,
+ *     incremented by lib/app.js
+ *   - the depth of the reload and haproxy control socket queues
+ *
+ * all named loadbalancer_muppet_*.
+ */
+
+/*jsl:ignore*/
+'use strict';
+/*jsl:end*/
+
+const mod_assert = require('assert-plus');
+const mod_v8 = require('v8');
+
+const LAG_INTERVAL = 500;           /* ms */
+const LAG_SAMPLES = 120;            /* a minute's worth */
+
+/*
+ * The counters lib/app.js can increment, and the label each one takes.
+ */
+const COUNTERS = {
+    reloads: {
+        label: 'result',
+        name: 'loadbalancer_muppet_reloads_total',
+        desc: 'Total number of haproxy reloads, by result.'
+    },
+    syncs: {
+        label: 'result',
+        name: 'loadbalancer_muppet_socket_syncs_total',
+        desc: 'Total number of server state changes applied using the ' +
+            'haproxy control socket, by result.'
+    },
+    doublechecks: {
+        label: 'result',
+        name: 'loadbalancer_muppet_doublechecks_total',
+        desc: 'Total number of periodic checks of the haproxy server ' +
+            'state, by result.'
+    },
+    outOfSync: {
+        label: 'reason',
+        name: 'loadbalancer_muppet_out_of_sync_servers_total',
+        desc: 'Total number of servers found out of sync by periodic ' +
+            'checks, by reason.'
+    }
+};
+
+/*
+ * Returns the total time spent in each state, given the running totals and
+ * the current state and when it was entered.
+ */
+function stateTimes(totals, state, since, now) {
+    mod_assert.object(totals, 'totals');
+    mod_assert.string(state, 'state');
+    mod_assert.number(since, 'since');
+    mod_assert.number(now, 'now');
+
+    var times = {};
+    Object.keys(totals).forEach(function (st) {
+        times[st] = totals[st];
+    });
+    times[state] = (times[state] || 0) + (now - since);
+    return (times);
+}
+
+/*
+ * Options:
+ * - log, a Bunyan logger
+ * - queues (optional), an object mapping queue names to functions returning
+ *   their current depth
+ */
+function SelfMetrics(opts) {
+    mod_assert.object(opts, 'opts');
+    mod_assert.object(opts.log, 'opts.log');
+    mod_assert.optionalObject(opts.queues, 'opts.queues');
+
+    this.sm_log = opts.log;
+    this.sm_queues = opts.queues || {};
+
+    this.sm_lags = [];
+    this.sm_timer = null;
+    this.sm_fsms = {};
+    this.sm_counters = {};
+    Object.keys(COUNTERS).forEach(function (counter) {
+        this.sm_counters[counter] = {};
+    }, this);
+}
+
+/*
+ * Starts measuring event loop lag.
+ */
+SelfMetrics.prototype.start = function () {
+    var self = this;
+    var expected = Date.now() + LAG_INTERVAL;
+
+    mod_assert.strictEqual(this.sm_timer, null, 'already started');
+    this.sm_timer = setInterval(function () {
+        var now = Date.now();
+        self.sm_lags.push(Math.max(0, now - expected));
+        if (self.sm_lags.length > LAG_SAMPLES)
+            self.sm_lags.shift();
+        expected = now + LAG_INTERVAL;
+    }, LAG_INTERVAL);
+    this.sm_timer.unref();
+};
+
+SelfMetrics.prototype.stop = function () {
+    if (this.sm_timer !== null) {
+        clearInterval(this.sm_timer);
+        this.sm_timer = null;
+    }
+};
+
+/*
+ * Accounts for the time the FSM spends in each of its states, under the given
+ * name. Tracking a new FSM under the same name (e.g. a new ServerWatcherFSM
+ * for a new ZooKeeper session) carries on the same totals.
+ */
+SelfMetrics.prototype.trackState = function (name, fsm) {
+    mod_assert.string(name, 'name');
+    mod_assert.object(fsm, 'fsm');
+
+    var now = Date.now();
+    var entry = this.sm_fsms[name];
+    if (entry === undefined) {
+        entry = { totals: {}, transitions: {} };
+        this.sm_fsms[name] = entry;
+    } else {
+        entry.totals = stateTimes(entry.totals, entry.state, entry.since,
+            now);
+    }
+    entry.fsm = fsm;
+    entry.state = fsm.getState();
+    entry.since = now;
+
+    fsm.on('stateChanged', function (state) {
+        if (entry.fsm !== fsm)
+            return;
+        var t = Date.now();
+        entry.totals = stateTimes(entry.totals, entry.state, entry.since, t);
+        entry.transitions[state] = (entry.transitions[state] || 0) + 1;
+        entry.state = state;
+        entry.since = t;
+    });
+};
+
+/*
+ * Increments one of the COUNTERS above, for the given label value.
+ */
+SelfMetrics.prototype.incr = function (counter, label) {
+    mod_assert.string(counter, 'counter');
+    mod_assert.string(label, 'label');
+    mod_assert.object(this.sm_counters[counter], 'unknown counter');
+
+    var values = this.sm_counters[counter];
+    values[label] = (values[label] || 0) + 1;
+};
+
+/*
+ * Returns a metrics exporter collector (see lib/metrics_exporter.js).
+ */
+SelfMetrics.prototype.collector = function () {
+    var self = this;
+
+    return (function _collectSelf() {
+        var now = Date.now();
+        var lags = self.sm_lags;
+        var mem = process.memoryUsage();
+        var heap = mod_v8.getHeapStatistics();
+        var cpu = process.cpuUsage();
+
+        var families = [
+            {
+                name: 'loadbalancer_muppet_event_loop_lag_seconds',
+                type: 'gauge',
+                desc: 'Event loop lag, most recently and at most over the ' +
+                    'last minute.',
+                metrics: (lags.length === 0) ? [] : [
+                    { labels: { stat: 'last' },
+                        value: lags[lags.length - 1] / 1000 },
+                    { labels: { stat: 'max' },
+                        value: Math.max.apply(null, lags) / 1000 }
+                ]
+            },
+            {
+                name: 'loadbalancer_muppet_cpu_seconds_total',
+                type: 'counter',
+                desc: 'CPU time used by muppet.',
+                metrics: [
+                    { labels: { mode: 'user' }, value: cpu.user / 1e6 },
+                    { labels: { mode: 'system' }, value: cpu.system / 1e6 }
+                ]
+            },
+            {
+                name: 'loadbalancer_muppet_resident_memory_bytes',
+                type: 'gauge',
+                desc: 'Resident set size of muppet.',
+                metrics: [ { labels: {}, value: mem.rss } ]
+            },
+            {
+                name: 'loadbalancer_muppet_heap_bytes',
+                type: 'gauge',
+                desc: 'V8 heap size, usage and limit.',
+                metrics: [
+                    { labels: { stat: 'total' },
+                        value: heap.total_heap_size },
+                    { labels: { stat: 'used' }, value: heap.used_heap_size },
+                    { labels: { stat: 'limit' },
+                        value: heap.heap_size_limit }
+                ]
+            }
+        ];
+
+        var stateMetrics = [];
+        var transitionMetrics = [];
+        var currentMetrics = [];
+        Object.keys(self.sm_fsms).forEach(function (name) {
+            var entry = self.sm_fsms[name];
+            var times = stateTimes(entry.totals, entry.state, entry.since,
+                now);
+            Object.keys(times).forEach(function (state) {
+                stateMetrics.push({ labels: { fsm: name, state: state },
+                    value: times[state] / 1000 });
+            });
+            Object.keys(entry.transitions).forEach(function (state) {
+                transitionMetrics.push({
+                    labels: { fsm: name, state: state },
+                    value: entry.transitions[state]
+                });
+            });
+            currentMetrics.push({ labels: { fsm: name, state: entry.state },
+                value: (now - entry.since) / 1000 });
+        });
+        families.push({
+            name: 'loadbalancer_muppet_state_seconds_total',
+            type: 'counter',
+            desc: 'Total time spent in each state.',
+            metrics: stateMetrics
+        });
+        families.push({
+            name: 'loadbalancer_muppet_state_transitions_total',
+            type: 'counter',
+            desc: 'Total number of transitions into each state.',
+            metrics: transitionMetrics
+        });
+        families.push({
+            name: 'loadbalancer_muppet_current_state_seconds',
+            type: 'gauge',
+            desc: 'Time spent in the current state so far.',
+            metrics: currentMetrics
+        });
+
+        Object.keys(COUNTERS).forEach(function (counter) {
+            var values = self.sm_counters[counter];
+            var label = COUNTERS[counter].label;
+            families.push({
+                name: COUNTERS[counter].name,
+                type: 'counter',
+                desc: COUNTERS[counter].desc,
+                metrics: Object.keys(values).map(function (value) {
+                    var labels = {};
+                    labels[label] = value;
+                    return ({ labels: labels, value: values[value] });
+                })
+            });
+        });
+
+        families.push({
+            name: 'loadbalancer_muppet_queue_depth',
+            type: 'gauge',
+            desc: 'Operations running or waiting in each queue.',
+            metrics: Object.keys(self.sm_queues).map(function (queue) {
+                return ({ labels: { queue: queue },
+                    value: self.sm_queues[queue]() });
+            })
+        });
+
+        return (families);
+    });
+};
+
+module.exports = {
+    SelfMetrics: SelfMetrics,
+    // for testing
+    stateTimes: stateTimes
+};
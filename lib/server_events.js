@@ -0,0 +1,318 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 MNX Cloud, Inc.
+ */
+
+/*
+ * Server state changes, as haproxy logs them.
+ *
+ * haproxy logs a line to its log targets whenever a server changes state,
+ * because of a health check or a "disable server"/"enable server" command:
+ *
+ *   Server secure_api/be1 is DOWN, reason: Layer4 connection problem, ...
+ *   Server secure_api/be1 is UP, reason: Layer4 check passed, ...
+ *   Server secure_api/be1 is going DOWN for maintenance. ...
+ *   Server secure_api/be1 is UP/READY (leaving forced maintenance).
+ *
+ * The access log sink (see lib/access_log.js) receives these along with the
+ * access log, and hands them to the ServerStateTracker, which keeps the last
+ * known state (up, down, maint or drain) of each server and emits a
+ * 'serverEvent' for each line, so that lib/app.js can act on a server falling
+ * out of sync right away rather than on its next periodic check.
+ *
+ * Log lines are sent over UDP and can be lost, so the tracker also looks at
+ * each stats snapshot (see lib/stats_poller.js). A transition seen there first
+ * was missed by the log, and we know from "lastchg" how long ago it happened.
+ *
+ * We export the number of transitions, by backend, new state and where we
+ * learned about them ("event" or "poll"), and how long after the transition we
+ * learned about it. For log lines, that is from the time in the syslog header,
+ * which only has whole seconds.
+ */
+
+/*jsl:ignore*/
+'use strict';
+/*jsl:end*/
+
+const mod_assert = require('assert-plus');
+const mod_events = require('events');
+const mod_util = require('util');
+
+const lib_accesslog = require('./access_log');
+
+const TYPE_SERVER = '2';
+const STATES = [ 'up', 'down', 'maint', 'drain' ];
+const SOURCES = [ 'event', 'poll' ];
+
+/* seconds */
+const DETECT_BUCKETS = [ 1, 2, 5, 10, 30, 60, 120, 300, 600 ];
+
+const MONTHS = [ 'Jan', 'Feb', 'Mar', 'Apr', 'May', 'Jun', 'Jul', 'Aug',
+    'Sep', 'Oct', 'Nov', 'Dec' ];
+const DAY = 24 * 3600 * 1000;
+
+/* "<pri>Mmm dd hh:mm:ss ", in local time (RFC 3164) */
+const SYSLOG_TIME_RE = /^<\d+>([A-Z][a-z]{2}) +(\d{1,2}) (\d\d):(\d\d):(\d\d) /;
+/* optionally "Backup ", then "Server <backend>/<server> " */
+const SERVER_EVENT_RE = /(?:^|\s)(?:Backup )?Server ([^\/\s]+)\/(\S+) (.*)$/;
+/* as in "Server b/s ('name') is UP/READY (resolves again)" */
+const RESOLVED_RE = /^\('[^']*'\) /;
+
+/*
+ * Returns the time (ms since the epoch) in the syslog header of a log line, or
+ * null if it doesn't have one. Since the header has no year, it's the one
+ * closest to "now".
+ */
+function syslogTime(str, now) {
+    mod_assert.string(str, 'str');
+    mod_assert.number(now, 'now');
+
+    var m = SYSLOG_TIME_RE.exec(str);
+    if (m === null)
+        return (null);
+    var month = MONTHS.indexOf(m[1]);
+    if (month === -1)
+        return (null);
+
+    function time(y) {
+        return (new Date(y, month, parseInt(m[2], 10), parseInt(m[3], 10),
+            parseInt(m[4], 10), parseInt(m[5], 10)).getTime());
+    }
+
+    var year = new Date(now).getFullYear();
+    var t = time(year);
+    /* A line from December, received in January. */
+    if (t > now + DAY)
+        t = time(year - 1);
+    return (t);
+}
+
+/*
+ * Returns the state of a server given the rest of its log line after the
+ * server name, or null if the line isn't about a state change.
+ */
+function eventState(rest) {
+    rest = rest.replace(RESOLVED_RE, '');
+    if (/^is UP\b/.test(rest))
+        return ('up');
+    if (/^is DOWN\b/.test(rest))
+        return ('down');
+    if (rest.indexOf('maintenance') !== -1)
+        return ('maint');
+    if (rest.indexOf('drain') !== -1)
+        return ('drain');
+    return (null);
+}
+
+/*
+ * Parses a syslog datagram into:
+ *
+ *   { backend, server, state, time }
+ *
+ * with the time from the syslog header (or null). Returns null if the datagram
+ * isn't a server state change.
+ */
+function parseServerEvent(buf, now) {
+    mod_assert.buffer(buf, 'buf');
+    mod_assert.number(now, 'now');
+
+    var str = buf.toString('latin1').replace(/\s+$/, '');
+    var m = SERVER_EVENT_RE.exec(str);
+    if (m === null)
+        return (null);
+    var state = eventState(m[3]);
+    if (state === null)
+        return (null);
+
+    return ({
+        backend: m[1],
+        server: m[2],
+        state: state,
+        time: syslogTime(str, now)
+    });
+}
+
+/*
+ * Returns the state of a server given its "status" in "show stat" output,
+ * e.g. "UP", "UP 1/3" (going down), "DOWN 1/2" (going up), "no check",
+ * "MAINT (via b/s)" or "DRAIN".
+ */
+function statusState(status) {
+    mod_assert.string(status, 'status');
+
+    if (status.indexOf('MAINT') === 0)
+        return ('maint');
+    if (status.indexOf('DRAIN') === 0)
+        return ('drain');
+    if (status.indexOf('DOWN') === 0)
+        return ('down');
+    return ('up');
+}
+
+/*
+ * Options:
+ * - log, a Bunyan logger
+ */
+function ServerStateTracker(opts) {
+    mod_assert.object(opts, 'opts');
+    mod_assert.object(opts.log, 'opts.log');
+
+    mod_events.EventEmitter.call(this);
+
+    this.st_log = opts.log;
+    /* "backend/server" => { state, time } */
+    this.st_servers = {};
+    /* "backend" => source => state => count */
+    this.st_transitions = {};
+    this.st_detect = new lib_accesslog.Histograms(DETECT_BUCKETS);
+    this.st_events = 0;
+}
+mod_util.inherits(ServerStateTracker, mod_events.EventEmitter);
+
+ServerStateTracker.prototype._transition = function (backend, server, state,
+    source, detect) {
+    var counts = this.st_transitions[backend];
+    if (counts === undefined) {
+        counts = {};
+        SOURCES.forEach(function (s) {
+            counts[s] = {};
+            STATES.forEach(function (st) {
+                counts[s][st] = 0;
+            });
+        });
+        this.st_transitions[backend] = counts;
+    }
+    counts[source][state]++;
+    this.st_detect.observe({ source: source }, Math.max(0, detect));
+
+    this.st_log.info({ backend: backend, server: server, state: state,
+        source: source, detect: detect }, 'server state changed');
+};
+
+/*
+ * Handles a datagram from the access log sink, returning true if it was a
+ * server state change.
+ */
+ServerStateTracker.prototype.message = function (buf, now) {
+    if (now === undefined)
+        now = Date.now();
+
+    var ev = parseServerEvent(buf, now);
+    if (ev === null)
+        return (false);
+    this.st_events++;
+
+    var key = ev.backend + '/' + ev.server;
+    var prev = this.st_servers[key];
+    this.st_servers[key] = { state: ev.state, time: now };
+    if (prev !== undefined && prev.state !== ev.state) {
+        this._transition(ev.backend, ev.server, ev.state, 'event',
+            (ev.time === null) ? 0 : (now - ev.time) / 1000);
+    }
+
+    this.emit('serverEvent', ev);
+    return (true);
+};
+
+/*
+ * Checks the servers' state in a stats snapshot (see lib/stats_poller.js)
+ * against what we know, and forgets servers that are gone.
+ */
+ServerStateTracker.prototype.poll = function (snapshot) {
+    mod_assert.object(snapshot, 'snapshot');
+    mod_assert.number(snapshot.time, 'snapshot.time');
+    mod_assert.arrayOfObject(snapshot.stats, 'snapshot.stats');
+
+    var self = this;
+    var servers = {};
+
+    snapshot.stats.forEach(function (stat) {
+        if (stat.type !== TYPE_SERVER)
+            return;
+
+        var key = stat.pxname + '/' + stat.svname;
+        var prev = self.st_servers[key];
+        /* We've had a log line since this snapshot was taken. */
+        if (prev !== undefined && prev.time > snapshot.time) {
+            servers[key] = prev;
+            return;
+        }
+
+        var state = statusState(stat.status);
+        servers[key] = { state: state, time: snapshot.time };
+        if (prev !== undefined && prev.state !== state) {
+            self._transition(stat.pxname, stat.svname, state, 'poll',
+                parseInt(stat.lastchg || '0', 10));
+        }
+    });
+
+    this.st_servers = servers;
+};
+
+/*
+ * Returns the last known state of a server, or undefined.
+ */
+ServerStateTracker.prototype.state = function (backend, server) {
+    var entry = this.st_servers[backend + '/' + server];
+    return ((entry === undefined) ? undefined : entry.state);
+};
+
+/*
+ * Returns a metrics exporter collector (see lib/metrics_exporter.js).
+ */
+ServerStateTracker.prototype.collector = function () {
+    var self = this;
+
+    return (function _collectServerEvents() {
+        var transitions = [];
+        Object.keys(self.st_transitions).forEach(function (backend) {
+            var counts = self.st_transitions[backend];
+            SOURCES.forEach(function (source) {
+                STATES.forEach(function (state) {
+                    transitions.push({
+                        labels: { backend: backend, to: state,
+                            source: source },
+                        value: counts[source][state]
+                    });
+                });
+            });
+        });
+
+        return ([
+            {
+                name: 'loadbalancer_server_transitions_total',
+                type: 'counter',
+                desc: 'Total number of server state changes, by new state ' +
+                    'and whether we learned of them from the log or stats.',
+                metrics: transitions
+            },
+            {
+                name: 'loadbalancer_server_transition_detect_seconds',
+                type: 'histogram',
+                desc: 'Time from a server state change to muppet learning ' +
+                    'of it.',
+                metrics: self.st_detect.metrics()
+            },
+            {
+                name: 'loadbalancer_server_events_total',
+                type: 'counter',
+                desc: 'Total number of server state change log lines ' +
+                    'received.',
+                metrics: [ { labels: {}, value: self.st_events } ]
+            }
+        ]);
+    });
+};
+
+module.exports = {
+    ServerStateTracker: ServerStateTracker,
+    // for testing
+    parseServerEvent: parseServerEvent,
+    statusState: statusState,
+    syslogTime: syslogTime
+};
@@ -0,0 +1,279 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 MNX Cloud, Inc.
+ */
+
+/*
+ * A single source of haproxy stats for everything in muppet that needs them.
+ *
+ * The periodic server double-check, control socket syncs, the metrics
+ * exporter, admission control, draining and load reporting all used to run
+ * their own "show stat" or "show info" commands, so the load on the stats
+ * socket grew with each feature. Instead, the StatsPollerFSM fetches both
+ * ("show info" and all of "show stat", in one round trip) when asked to, and
+ * keeps the latest snapshot:
+ *
+ *   { time, info, stats }
+ *
+ * where time is when the fetch started, and info and stats are as returned by
+ * lib_hasock.infoAndStats().
+ *
+ * Consumers either listen for the 'stats' event, emitted with each new
+ * snapshot, or ask for a snapshot no older than some bound with snapshot().
+ * If the latest snapshot is too old, a fetch is started right away, and every
+ * request made before it started is answered by it, however many there are.
+ *
+ * Each fetch dumps every row of "show stat", which costs the stats socket
+ * (and haproxy) more than the narrower commands it replaced. So we only fetch
+ * every interval ms while someone listens for 'stats'; otherwise we fetch
+ * only when snapshot() needs a newer snapshot than we have.
+ *
+ * After changing haproxy's state (a reload or a control socket sync), callers
+ * invalidate() the current snapshot so that nobody acts on the old state.
+ *
+ *      +---------+  timeout (interval)  +----------+
+ *      |         | -------------------> |          |
+ *      | waiting |  or fetch requested  | fetching |
+ *      |         | <------------------- |          |
+ *      +---------+    done or error     +----------+
+ */
+
+/*jsl:ignore*/
+'use strict';
+/*jsl:end*/
+
+const mod_assert = require('assert-plus');
+const mod_util = require('util');
+const FSM = require('mooremachine').FSM;
+
+const TYPE_SERVER = '2';
+
+const DEFAULTS = {
+    interval: 5000                  /* ms */
+};
+
+/*
+ * Returns the server rows of "show stat" output, i.e. what
+ * lib_hasock.serverStats() returns.
+ */
+function serverStats(stats) {
+    mod_assert.arrayOfObject(stats, 'stats');
+    return (stats.filter(function (stat) {
+        return (stat.type === TYPE_SERVER);
+    }));
+}
+
+/*
+ * Options:
+ * - haSock, the lib/haproxy_sock.js module
+ * - log, a Bunyan logger
+ * - config (optional), the "statsPoller" section of the muppet configuration;
+ *   see DEFAULTS above for the settings and their defaults
+ */
+function StatsPollerFSM(opts) {
+    mod_assert.object(opts, 'opts');
+    mod_assert.object(opts.haSock, 'opts.haSock');
+    mod_assert.object(opts.log, 'opts.log');
+    mod_assert.optionalObject(opts.config, 'opts.config');
+
+    var config = opts.config || {};
+    var cfg = {};
+    Object.keys(DEFAULTS).forEach(function (key) {
+        cfg[key] = (config[key] !== undefined) ? config[key] : DEFAULTS[key];
+    });
+    mod_assert.number(cfg.interval, 'config.interval');
+
+    this.sp_cfg = cfg;
+    this.sp_haSock = opts.haSock;
+    this.sp_log = opts.log;
+
+    this.sp_snapshot = null;
+    /* Bumped by invalidate(), so that fetches in flight are thrown away. */
+    this.sp_generation = 0;
+    this.sp_waiters = [];
+
+    this.sp_fetches = { scheduled: 0, requested: 0 };
+    this.sp_reads = { cached: 0, fetched: 0 };
+    this.sp_errors = 0;
+
+    FSM.call(this, 'waiting');
+}
+mod_util.inherits(StatsPollerFSM, FSM);
+
+StatsPollerFSM.prototype.state_waiting = function (S) {
+    var self = this;
+
+    if (this.sp_waiters.length > 0) {
+        S.gotoState('fetching');
+        return;
+    }
+
+    S.on(this, 'fetchAsserted', function () {
+        /* Let any other requests made in the meantime share this fetch. */
+        S.immediate(function () {
+            S.gotoState('fetching');
+        });
+    });
+
+    /* Nobody needs stats on schedule (yet). */
+    if (this.listenerCount('stats') === 0) {
+        S.on(this, 'newListener', function (event) {
+            if (event === 'stats')
+                S.gotoStateTimeout(self.sp_cfg.interval, 'fetching');
+        });
+        return;
+    }
+    S.gotoStateTimeout(this.sp_cfg.interval, 'fetching');
+};
+
+StatsPollerFSM.prototype.state_fetching = function (S) {
+    var self = this;
+    var log = this.sp_log;
+    var start = Date.now();
+    var generation = this.sp_generation;
+
+    /*
+     * Requests made from here on want a snapshot newer than this one; they'll
+     * be answered by the next fetch.
+     */
+    var waiters = this.sp_waiters;
+    this.sp_waiters = [];
+    if (waiters.length > 0)
+        this.sp_fetches.requested++;
+    else
+        this.sp_fetches.scheduled++;
+
+    self.sp_haSock.infoAndStats({ log: log },
+        S.callback(function (err, info, stats) {
+        if (err) {
+            log.warn(err, 'failed to fetch haproxy stats');
+            self.sp_errors++;
+            waiters.forEach(function (w) {
+                w.cb(err);
+            });
+            S.gotoState('waiting');
+            return;
+        }
+
+        /* Invalidated while we were fetching: try again. */
+        if (generation !== self.sp_generation) {
+            self.sp_waiters = waiters.concat(self.sp_waiters);
+            S.gotoState('waiting');
+            return;
+        }
+
+        var snapshot = { time: start, info: info, stats: stats };
+        self.sp_snapshot = snapshot;
+        waiters.forEach(function (w) {
+            self.sp_reads.fetched++;
+            w.cb(null, snapshot);
+        });
+        self.emit('stats', snapshot);
+        S.gotoState('waiting');
+    }));
+};
+
+/*
+ * Calls back with (err, snapshot), with a snapshot started at most maxAge ms
+ * ago (and after the last invalidate()). A maxAge of 0 always waits for a new
+ * fetch.
+ */
+StatsPollerFSM.prototype.snapshot = function (opts, cb) {
+    mod_assert.object(opts, 'opts');
+    mod_assert.number(opts.maxAge, 'opts.maxAge');
+    mod_assert.func(cb, 'callback');
+
+    var now = Date.now();
+    var snapshot = this.sp_snapshot;
+
+    if (opts.maxAge > 0 && snapshot !== null &&
+        snapshot.time >= now - opts.maxAge) {
+        this.sp_reads.cached++;
+        setImmediate(function () {
+            cb(null, snapshot);
+        });
+        return;
+    }
+
+    this.sp_waiters.push({ cb: cb });
+    /* Otherwise, we'll fetch again as soon as the current fetch is done. */
+    if (this.sp_waiters.length === 1 && this.isInState('waiting'))
+        this.emit('fetchAsserted');
+};
+
+/*
+ * How often we fetch stats on schedule (while someone listens for 'stats'),
+ * in ms.
+ */
+StatsPollerFSM.prototype.interval = function () {
+    return (this.sp_cfg.interval);
+};
+
+/*
+ * Drops the current snapshot, and any fetch in flight, e.g. because haproxy
+ * has just been reloaded.
+ */
+StatsPollerFSM.prototype.invalidate = function () {
+    this.sp_generation++;
+    this.sp_snapshot = null;
+};
+
+/*
+ * Returns a metrics exporter collector (see lib/metrics_exporter.js).
+ */
+StatsPollerFSM.prototype.collector = function () {
+    var self = this;
+
+    return (function _collectStatsPoller() {
+        var families = [
+            {
+                name: 'loadbalancer_stats_fetches_total',
+                type: 'counter',
+                desc: 'Total number of stats fetched from haproxy, on ' +
+                    'schedule or because a consumer needed newer stats.',
+                metrics: Object.keys(self.sp_fetches).map(function (t) {
+                    return ({ labels: { trigger: t },
+                        value: self.sp_fetches[t] });
+                })
+            },
+            {
+                name: 'loadbalancer_stats_reads_total',
+                type: 'counter',
+                desc: 'Total number of stats snapshots handed to consumers, ' +
+                    'from the cache or a new fetch.',
+                metrics: Object.keys(self.sp_reads).map(function (s) {
+                    return ({ labels: { source: s },
+                        value: self.sp_reads[s] });
+                })
+            },
+            {
+                name: 'loadbalancer_stats_fetch_errors_total',
+                type: 'counter',
+                desc: 'Total number of failed stats fetches.',
+                metrics: [ { labels: {}, value: self.sp_errors } ]
+            }
+        ];
+
+        if (self.sp_snapshot !== null) {
+            families.push({
+                name: 'loadbalancer_stats_age_seconds',
+                type: 'gauge',
+                desc: 'Age of the latest stats snapshot.',
+                metrics: [ { labels: {},
+                    value: (Date.now() - self.sp_snapshot.time) / 1000 } ]
+            });
+        }
+
+        return (families);
+    });
+};
+
+module.exports = {
+    StatsPollerFSM: StatsPollerFSM,
+    serverStats: serverStats
+};
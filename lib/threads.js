@@ -0,0 +1,481 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 MNX Cloud, Inc.
+ */
+
+/*
+ * Per-thread activity and task profiling.
+ *
+ * With nbthread at 20, "show stat" can't tell us whether the work is spread
+ * evenly across haproxy's threads, or where the CPU time goes. The
+ * ThreadStatsFSM periodically collects, through the stats socket:
+ *
+ *   - "show activity": per-thread event loop counters (loops, wakeups, poll
+ *     results, accepted connections, run queue hits, stolen CPU time)
+ *   - "show threads": per-thread run queue and tasklet queue sizes, and
+ *     whether the watchdog considers the thread stuck
+ *   - "show profiling": whether per-task profiling is on and, on haproxy
+ *     versions that report it, per-task-function call counts, CPU time and
+ *     latency (enable "haproxy.profiling" to turn on profiling.tasks)
+ *
+ * These are sampled on their own interval rather than on every scrape, since
+ * they are diagnostic and somewhat more expensive for haproxy to produce. The
+ * collector exports the last sample. Cardinality is bounded by the number of
+ * threads and, for tasks, by MAX_TASKS task functions (by CPU time).
+ *
+ *      +---------+  timeout (interval)  +----------+
+ *      |         | -------------------> |          |
+ *      | waiting |                      | sampling |
+ *      |         | <------------------- |          |
+ *      +---------+    done or error     +----------+
+ */
+
+/*jsl:ignore*/
+'use strict';
+/*jsl:end*/
+
+const mod_assert = require('assert-plus');
+const mod_util = require('util');
+const mod_vasync = require('vasync');
+const FSM = require('mooremachine').FSM;
+
+const DEFAULT_INTERVAL = 15000;     /* ms */
+const MAX_TASKS = 20;
+
+/*
+ * "show activity" counters we export, in the same form as HAPROXY_METRICS in
+ * lib/metrics_exporter.js: each field is one per-thread row of the output.
+ */
+const ACTIVITY_METRICS = [
+    {
+        name: 'loadbalancer_thread_loops_total',
+        type: 'counter',
+        desc: 'Total number of event loop iterations.',
+        fields: [ { field: 'loops' } ]
+    },
+    {
+        name: 'loadbalancer_thread_wakeups_total',
+        type: 'counter',
+        desc: 'Total number of event loop wakeups, by reason.',
+        fields: [
+            { field: 'wake_cache', labels: { reason: 'cache' } },
+            { field: 'wake_tasks', labels: { reason: 'tasks' } },
+            { field: 'wake_signal', labels: { reason: 'signal' } }
+        ]
+    },
+    {
+        name: 'loadbalancer_thread_polls_total',
+        type: 'counter',
+        desc: 'Total number of poller calls, by outcome.',
+        fields: [
+            { field: 'poll_exp', labels: { result: 'expired' } },
+            { field: 'poll_drop', labels: { result: 'dropped' } },
+            { field: 'poll_dead', labels: { result: 'dead' } },
+            { field: 'poll_skip', labels: { result: 'skipped' } }
+        ]
+    },
+    {
+        name: 'loadbalancer_thread_accepted_total',
+        type: 'counter',
+        desc: 'Total number of connections accepted.',
+        fields: [ { field: 'accepted' } ]
+    },
+    {
+        name: 'loadbalancer_thread_streams_total',
+        type: 'counter',
+        desc: 'Total number of streams processed.',
+        fields: [ { field: 'stream' } ]
+    },
+    {
+        name: 'loadbalancer_thread_run_queue_empty_total',
+        type: 'counter',
+        desc: 'Total number of loops which found the run queue empty.',
+        fields: [ { field: 'empty_rq' } ]
+    },
+    {
+        name: 'loadbalancer_thread_run_queue_long_total',
+        type: 'counter',
+        desc: 'Total number of loops which found a long run queue.',
+        fields: [ { field: 'long_rq' } ]
+    },
+    {
+        name: 'loadbalancer_thread_cpu_stolen_milliseconds_total',
+        type: 'counter',
+        desc: 'Total CPU time stolen from the thread, in milliseconds.',
+        fields: [ { field: 'cpust_ms_tot' } ]
+    },
+    {
+        name: 'loadbalancer_thread_average_loop_microseconds',
+        type: 'gauge',
+        desc: 'Average event loop duration, in microseconds.',
+        fields: [ { field: 'avg_loop_us' } ]
+    }
+];
+
+/* "show threads" fields we export. */
+const THREAD_METRICS = [
+    {
+        name: 'loadbalancer_thread_run_queue_size',
+        type: 'gauge',
+        desc: 'Number of tasks in the thread\'s run queue.',
+        field: 'rqsz'
+    },
+    {
+        name: 'loadbalancer_thread_tasklets',
+        type: 'gauge',
+        desc: 'Number of tasklets queued on the thread.',
+        field: 'tlsz'
+    },
+    {
+        name: 'loadbalancer_thread_stuck',
+        type: 'gauge',
+        desc: 'Whether the watchdog considers the thread stuck (1 = stuck).',
+        field: 'stuck'
+    }
+];
+
+const DURATION_UNITS = {
+    'd': 86400,
+    'h': 3600,
+    'm': 60,
+    's': 1,
+    'ms': 1e-3,
+    'us': 1e-6,
+    'ns': 1e-9
+};
+
+/*
+ * Parses a duration as printed by haproxy ("631.0ns", "2.113s", "18.45m",
+ * "1h02m") into seconds. Returns NaN if it can't be parsed.
+ */
+function parseDuration(str) {
+    var re = /([0-9]+(?:\.[0-9]+)?)(ms|us|ns|d|h|m|s)/g;
+    var total = 0;
+    var matched = '';
+    var m;
+
+    while ((m = re.exec(str)) !== null) {
+        total += parseFloat(m[1]) * DURATION_UNITS[m[2]];
+        matched += m[0];
+    }
+    return ((matched.length > 0 && matched === str) ? total : NaN);
+}
+
+/*
+ * Parses "show activity" into an object mapping each counter name to an
+ * array of per-thread values (thread 1 first). Lines that don't have one
+ * numeric value per thread (e.g. "thread_id" and "date_now") are dropped.
+ * Newer haproxy versions print a total before the per-thread values in
+ * brackets; we only keep the latter.
+ */
+function parseActivity(output) {
+    mod_assert.string(output, 'output');
+
+    var rows = {};
+    var nthreads = 0;
+
+    output.split('\n').forEach(function (line) {
+        var idx = line.indexOf(':');
+        if (idx <= 0)
+            return;
+        var name = line.slice(0, idx).trim();
+        var rest = line.slice(idx + 1).trim();
+
+        if (name === 'thread_id') {
+            var m = /\(1\.\.([0-9]+)\)/.exec(rest);
+            if (m !== null)
+                nthreads = parseInt(m[1], 10);
+            return;
+        }
+
+        var open = rest.indexOf('[');
+        if (open !== -1)
+            rest = rest.slice(open + 1, rest.lastIndexOf(']')).trim();
+        if (rest.length === 0)
+            return;
+
+        var values = rest.split(/\s+/).map(Number);
+        if (values.some(isNaN))
+            return;
+        rows[name] = values;
+    });
+
+    if (nthreads > 0) {
+        Object.keys(rows).forEach(function (name) {
+            if (rows[name].length !== nthreads)
+                delete rows[name];
+        });
+    }
+
+    return (rows);
+}
+
+/*
+ * Parses "show threads" into an array of objects, one per thread, holding the
+ * thread number ("thread") and the numeric key=value fields shown for it.
+ */
+function parseThreads(output) {
+    mod_assert.string(output, 'output');
+
+    var threads = [];
+    var cur = null;
+
+    output.split('\n').forEach(function (line) {
+        var m = /^[\s*>]*Thread\s+([0-9]+)\s*:(.*)$/.exec(line);
+        if (m !== null) {
+            cur = { thread: parseInt(m[1], 10) };
+            threads.push(cur);
+            line = m[2];
+        }
+        if (cur === null)
+            return;
+
+        var re = /([a-z_]+)=([0-9]+)/g;
+        var kv;
+        while ((kv = re.exec(line)) !== null) {
+            if (!cur.hasOwnProperty(kv[1]))
+                cur[kv[1]] = parseInt(kv[2], 10);
+        }
+    });
+
+    return (threads);
+}
+
+/*
+ * Parses "show profiling" into:
+ *
+ *   {
+ *       enabled: <whether per-task profiling is on>,
+ *       tasks: [ { func, calls, cpu, latency } ]     (times in seconds)
+ *   }
+ *
+ * haproxy 2.0 only reports whether profiling is on; the per-task table
+ * ("Tasks activity:") appears in later versions.
+ */
+function parseProfiling(output) {
+    mod_assert.string(output, 'output');
+
+    var res = { enabled: false, tasks: [] };
+    var inTasks = false;
+
+    output.split('\n').forEach(function (line) {
+        var m = /^Per-task CPU profiling\s*:\s*([a-z]+)/.exec(line);
+        if (m !== null) {
+            res.enabled = (m[1] !== 'off');
+            return;
+        }
+        if (/^Tasks activity:/.test(line)) {
+            inTasks = true;
+            return;
+        }
+        if (!inTasks)
+            return;
+        if (!/^\s/.test(line)) {
+            inTasks = false;
+            return;
+        }
+
+        var parts = line.trim().split(/\s+/);
+        if (parts.length < 6 || parts[0] === 'function')
+            return;
+        var task = {
+            func: parts[0],
+            calls: parseInt(parts[1], 10),
+            cpu: parseDuration(parts[2]),
+            latency: parseDuration(parts[4])
+        };
+        if (isNaN(task.calls) || isNaN(task.cpu) || isNaN(task.latency))
+            return;
+        res.tasks.push(task);
+    });
+
+    return (res);
+}
+
+/*
+ * Options:
+ * - haSock, the lib/haproxy_sock.js module
+ * - log, a Bunyan logger
+ * - interval (optional), the sampling interval in ms
+ */
+function ThreadStatsFSM(opts) {
+    mod_assert.object(opts, 'opts');
+    mod_assert.object(opts.haSock, 'opts.haSock');
+    mod_assert.object(opts.log, 'opts.log');
+    mod_assert.optionalNumber(opts.interval, 'opts.interval');
+
+    this.ts_haSock = opts.haSock;
+    this.ts_log = opts.log;
+    this.ts_interval = opts.interval || DEFAULT_INTERVAL;
+
+    this.ts_activity = null;
+    this.ts_threads = null;
+    this.ts_profiling = null;
+    this.ts_errors = 0;
+
+    FSM.call(this, 'waiting');
+}
+mod_util.inherits(ThreadStatsFSM, FSM);
+
+ThreadStatsFSM.prototype.state_waiting = function (S) {
+    S.gotoStateTimeout(this.ts_interval, 'sampling');
+};
+
+ThreadStatsFSM.prototype.state_sampling = function (S) {
+    var self = this;
+    var log = this.ts_log;
+
+    function show(what, parse, cb) {
+        self.ts_haSock.showRaw({ log: log, what: what },
+            function (err, output) {
+            if (err) {
+                cb(err);
+                return;
+            }
+            cb(null, parse(output));
+        });
+    }
+
+    mod_vasync.pipeline({ funcs: [
+        function activity(_, cb) {
+            show('activity', parseActivity, function (err, res) {
+                self.ts_activity = err ? null : res;
+                cb(err);
+            });
+        },
+        function threads(_, cb) {
+            show('threads', parseThreads, function (err, res) {
+                self.ts_threads = err ? null : res;
+                cb(err);
+            });
+        },
+        function profiling(_, cb) {
+            show('profiling', parseProfiling, function (err, res) {
+                self.ts_profiling = err ? null : res;
+                cb(err);
+            });
+        }
+    ]}, S.callback(function (err) {
+        if (err) {
+            log.warn(err, 'failed to sample haproxy thread activity');
+            self.ts_errors++;
+        }
+        S.gotoState('waiting');
+    }));
+};
+
+function threadLabel(i) {
+    return ({ thread: String(i + 1) });
+}
+
+/*
+ * Returns a metrics exporter collector (see lib/metrics_exporter.js) for the
+ * last sample.
+ */
+ThreadStatsFSM.prototype.collector = function () {
+    var self = this;
+
+    return (function _collectThreads() {
+        var families = [];
+
+        var activity = self.ts_activity;
+        if (activity !== null) {
+            ACTIVITY_METRICS.forEach(function (metric) {
+                var metrics = [];
+                metric.fields.forEach(function (f) {
+                    var values = activity[f.field];
+                    if (values === undefined)
+                        return;
+                    values.forEach(function (v, i) {
+                        var labels = threadLabel(i);
+                        for (var k in f.labels)
+                            labels[k] = f.labels[k];
+                        metrics.push({ labels: labels, value: v });
+                    });
+                });
+                families.push({ name: metric.name, type: metric.type,
+                    desc: metric.desc, metrics: metrics });
+            });
+        }
+
+        var threads = self.ts_threads;
+        if (threads !== null) {
+            THREAD_METRICS.forEach(function (metric) {
+                families.push({
+                    name: metric.name,
+                    type: metric.type,
+                    desc: metric.desc,
+                    metrics: threads.filter(function (t) {
+                        return (t[metric.field] !== undefined);
+                    }).map(function (t) {
+                        return ({ labels: { thread: String(t.thread) },
+                            value: t[metric.field] });
+                    })
+                });
+            });
+        }
+
+        var prof = self.ts_profiling;
+        if (prof !== null) {
+            var tasks = prof.tasks.slice().sort(function (a, b) {
+                return (b.cpu - a.cpu);
+            }).slice(0, MAX_TASKS);
+
+            families.push({
+                name: 'loadbalancer_profiling_enabled',
+                type: 'gauge',
+                desc: 'Whether per-task CPU profiling is on (1 = on).',
+                metrics: [ { labels: {}, value: prof.enabled ? 1 : 0 } ]
+            });
+            families.push({
+                name: 'loadbalancer_task_calls_total',
+                type: 'counter',
+                desc: 'Total number of calls, by task function.',
+                metrics: tasks.map(function (t) {
+                    return ({ labels: { function: t.func },
+                        value: t.calls });
+                })
+            });
+            families.push({
+                name: 'loadbalancer_task_cpu_seconds_total',
+                type: 'counter',
+                desc: 'Total CPU time, by task function.',
+                metrics: tasks.map(function (t) {
+                    return ({ labels: { function: t.func }, value: t.cpu });
+                })
+            });
+            families.push({
+                name: 'loadbalancer_task_latency_seconds_total',
+                type: 'counter',
+                desc: 'Total time spent waiting to run, by task function.',
+                metrics: tasks.map(function (t) {
+                    return ({ labels: { function: t.func },
+                        value: t.latency });
+                })
+            });
+        }
+
+        families.push({
+            name: 'loadbalancer_thread_sample_errors_total',
+            type: 'counter',
+            desc: 'Total number of failed thread activity samples.',
+            metrics: [ { labels: {}, value: self.ts_errors } ]
+        });
+
+        return (families);
+    });
+};
+
+module.exports = {
+    ThreadStatsFSM: ThreadStatsFSM,
+    // for testing
+    parseActivity: parseActivity,
+    parseDuration: parseDuration,
+    parseProfiling: parseProfiling,
+    parseThreads: parseThreads
+};
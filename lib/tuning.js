@@ -0,0 +1,244 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 MNX Cloud, Inc.
+ */
+
+/*
+ * Sizing of haproxy's connection limits and buffers.
+ *
+ * Rather than a fixed "maxconn 65535", we derive the connection budget from
+ * the memory and file descriptors available to the zone. The model is:
+ *
+ *   per_conn    = 2 * bufsize + CONN_OVERHEAD
+ *   mem_maxconn = (memory * MEM_FRACTION) / per_conn
+ *   fd_maxconn  = (maxFiles - FD_RESERVE) / 2
+ *   maxconn     = min(mem_maxconn, fd_maxconn, MAXCONN_CEILING)
+ *
+ * Each proxied connection holds a request and a response buffer of
+ * tune.bufsize bytes, plus session, TLS and socket state which we lump
+ * together as CONN_OVERHEAD. Each one also uses two file descriptors: one
+ * towards the client and one towards the backend server. Only MEM_FRACTION
+ * of the zone's memory is handed to connections, leaving the rest for the
+ * haproxy process itself, old workers lingering after a reload, muppet and
+ * the rest of the zone.
+ *
+ * We start with haproxy's default 16k buffers. If the zone has enough memory
+ * to sustain MAXCONN_CEILING connections with larger buffers, we double the
+ * buffer size (up to MAX_BUFSIZE), since larger buffers mean fewer syscalls
+ * per byte on large transfers. tune.maxrewrite scales with the buffer.
+ *
+ * Finally, each frontend is limited to FRONTEND_FRACTION of the global
+ * budget, so that no single frontend can consume all of it and starve the
+ * others (notably http_internal and stats_http).
+ *
+ * On SmartOS, os.totalmem() already reflects the zone's physical memory cap,
+ * but "memoryLimitMB" in the haproxy configuration overrides it. Likewise,
+ * maxFiles is the hard limit on open files that haproxy runs with (see
+ * fileLimit()), unless "maxFiles" is set. Explicit "maxconn" and "bufsize"
+ * settings override the model entirely.
+ */
+
+/*jsl:ignore*/
+'use strict';
+/*jsl:end*/
+
+const mod_assert = require('assert-plus');
+const mod_child = require('child_process');
+const mod_os = require('os');
+
+const DEFAULT_BUFSIZE = 16384;      /* bytes */
+const MAX_BUFSIZE = 65536;          /* bytes */
+const CONN_OVERHEAD = 32768;        /* bytes */
+const MEM_FRACTION = 0.5;
+const DEFAULT_MAX_FILES = 262144;
+const FD_RESERVE = 1024;
+const MIN_MAXCONN = 1024;
+const MAXCONN_CEILING = 262144;
+const FRONTEND_FRACTION = 0.9;
+
+/* The result of fileLimit(), once we've looked. */
+var cachedFileLimit;
+
+function maxconnForBufsize(memory, bufsize) {
+    return (Math.floor((memory * MEM_FRACTION) /
+        (2 * bufsize + CONN_OVERHEAD)));
+}
+
+/*
+ * Parses the output of "ulimit -Hn" into a number of file descriptors, or null
+ * if it can't be parsed. With no limit, file descriptors never limit maxconn.
+ */
+function parseFileLimit(str) {
+    mod_assert.string(str, 'str');
+
+    str = str.trim();
+    if (str === 'unlimited')
+        return (2 * MAXCONN_CEILING + FD_RESERVE);
+    if (!/^[0-9]+$/.test(str))
+        return (null);
+    return (parseInt(str, 10));
+}
+
+/*
+ * Returns the hard limit on open files that haproxy will run with, or null if
+ * we can't tell. haproxy raises its own soft limit to what its maxconn needs,
+ * but it can't go past the hard limit, which on SmartOS is the privileged
+ * value of the process.max-file-descriptor resource control. The haproxy SMF
+ * service doesn't set one of its own, so haproxy and muppet (both started by
+ * SMF in the same zone) run under the same limit, and we can ask a shell for
+ * ours.
+ */
+function fileLimit() {
+    if (cachedFileLimit !== undefined)
+        return (cachedFileLimit);
+
+    cachedFileLimit = null;
+    try {
+        cachedFileLimit = parseFileLimit(mod_child.execFileSync('/bin/sh',
+            [ '-c', 'ulimit -Hn' ], { encoding: 'utf8' }));
+    } catch (err) {
+        /* Fall back to DEFAULT_MAX_FILES. */
+    }
+    return (cachedFileLimit);
+}
+
+/*
+ * Computes the connection and buffer budget for haproxy from the "haproxy"
+ * section of the muppet configuration. Returns an object of the form:
+ *
+ *   {
+ *       memory: <bytes of memory the model was based on>,
+ *       maxFiles: <file descriptors the model was based on>,
+ *       maxFilesSource: 'config' | 'limit' | 'default',
+ *       maxconn: <global maxconn>,
+ *       frontendMaxconn: <per-frontend maxconn>,
+ *       bufsize: <tune.bufsize>,
+ *       maxrewrite: <tune.maxrewrite>,
+ *       limitedBy: 'memory' | 'fds' | 'ceiling' | 'config'
+ *   }
+ */
+function computeTuning(hacfg) {
+    mod_assert.object(hacfg, 'hacfg');
+    mod_assert.optionalNumber(hacfg.memoryLimitMB, 'hacfg.memoryLimitMB');
+    mod_assert.optionalNumber(hacfg.maxFiles, 'hacfg.maxFiles');
+    mod_assert.optionalNumber(hacfg.maxconn, 'hacfg.maxconn');
+    mod_assert.optionalNumber(hacfg.bufsize, 'hacfg.bufsize');
+
+    var memory = (hacfg.memoryLimitMB !== undefined) ?
+        hacfg.memoryLimitMB * 1024 * 1024 : mod_os.totalmem();
+    var maxFiles = hacfg.maxFiles;
+    var maxFilesSource = 'config';
+    if (maxFiles === undefined) {
+        maxFiles = fileLimit();
+        maxFilesSource = 'limit';
+    }
+    if (maxFiles === null) {
+        maxFiles = DEFAULT_MAX_FILES;
+        maxFilesSource = 'default';
+    }
+
+    var bufsize = DEFAULT_BUFSIZE;
+    if (hacfg.bufsize !== undefined) {
+        bufsize = hacfg.bufsize;
+    } else {
+        while (bufsize < MAX_BUFSIZE &&
+            maxconnForBufsize(memory, bufsize * 2) >= MAXCONN_CEILING) {
+            bufsize *= 2;
+        }
+    }
+
+    var maxconn;
+    var limitedBy;
+    if (hacfg.maxconn !== undefined) {
+        maxconn = hacfg.maxconn;
+        limitedBy = 'config';
+    } else {
+        var memMaxconn = maxconnForBufsize(memory, bufsize);
+        var fdMaxconn = Math.floor((maxFiles - FD_RESERVE) / 2);
+
+        maxconn = MAXCONN_CEILING;
+        limitedBy = 'ceiling';
+        if (memMaxconn < maxconn) {
+            maxconn = memMaxconn;
+            limitedBy = 'memory';
+        }
+        if (fdMaxconn < maxconn) {
+            maxconn = fdMaxconn;
+            limitedBy = 'fds';
+        }
+        maxconn = Math.max(maxconn, MIN_MAXCONN);
+    }
+
+    return ({
+        memory: memory,
+        maxFiles: maxFiles,
+        maxFilesSource: maxFilesSource,
+        maxconn: maxconn,
+        frontendMaxconn: Math.max(1, Math.floor(maxconn * FRONTEND_FRACTION)),
+        bufsize: bufsize,
+        maxrewrite: Math.floor(Math.min(bufsize / 2,
+            Math.max(1024, bufsize / 16))),
+        limitedBy: limitedBy
+    });
+}
+
+/*
+ * Returns a metrics exporter collector (see lib/metrics_exporter.js) for the
+ * given budget, so that it can be graphed next to live session counts.
+ */
+function tuningCollector(tuning) {
+    mod_assert.object(tuning, 'tuning');
+
+    return (function _collectTuning() {
+        return ([
+            {
+                name: 'loadbalancer_budget_memory_bytes',
+                type: 'gauge',
+                desc: 'Memory the connection budget was computed from.',
+                metrics: [ { labels: {}, value: tuning.memory } ]
+            },
+            {
+                name: 'loadbalancer_budget_file_descriptors',
+                type: 'gauge',
+                desc: 'File descriptors the connection budget was ' +
+                    'computed from.',
+                metrics: [ { labels: {}, value: tuning.maxFiles } ]
+            },
+            {
+                name: 'loadbalancer_budget_max_connections',
+                type: 'gauge',
+                desc: 'Computed connection limit, globally and per frontend.',
+                metrics: [
+                    {
+                        labels: { scope: 'global',
+                            limited_by: tuning.limitedBy },
+                        value: tuning.maxconn
+                    },
+                    {
+                        labels: { scope: 'frontend',
+                            limited_by: tuning.limitedBy },
+                        value: tuning.frontendMaxconn
+                    }
+                ]
+            },
+            {
+                name: 'loadbalancer_budget_buffer_size_bytes',
+                type: 'gauge',
+                desc: 'Computed haproxy buffer size (tune.bufsize).',
+                metrics: [ { labels: {}, value: tuning.bufsize } ]
+            }
+        ]);
+    });
+}
+
+module.exports = {
+    computeTuning: computeTuning,
+    tuningCollector: tuningCollector,
+    // for testing
+    parseFileLimit: parseFileLimit
+};
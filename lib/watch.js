@@ -6,6 +6,7 @@
 
 /*
  * Copyright 2019 Joyent, Inc.
+ * Copyright 2026 MNX Cloud, Inc.
  */
 
 /*jsl:ignore*/
@@ -23,6 +24,8 @@ const mod_zkstream = require('zkstream');
 const VError = require('verror');
 const FSM = require('mooremachine').FSM;
 
+const lib_srvevents = require('./server_events');
+
 /*
  * Timing parameters for our heuristic rules below (see the FSM state diagram
  * and explanation above ServerWatcherFSM).
@@ -34,6 +37,22 @@ const RETRY_TIMEOUT = 15000;        /* ms */
 const SMEAR = 5000;                 /* ms */
 const FETCH_CONCURRENCY = 4;
 
+/*
+ * Capacity-aware removal (see _processRemovals()): by default, we keep at
+ * least minHealthy of each kind's servers haproxy had up when we started
+ * removing them, and if maxServerSessions is set, enough of them to carry the
+ * current sessions at no more than that many each.
+ */
+const REMOVAL_MODES = [ 'throttle', 'capacity' ];
+const REMOVAL_DEFAULTS = {
+    mode: 'throttle',
+    minHealthy: 0.8,
+    maxServerSessions: undefined
+};
+const REMOVAL_DECISIONS = [ 'removed', 'removed_down', 'held_time',
+    'held_throttle', 'held_capacity' ];
+const TYPE_SERVER = '2';
+
 /* Debugging: how many previous diffs to keep in memory */
 const HISTORY_LENGTH = 32;
 
@@ -54,6 +73,110 @@ function diffObjects(o1, o2) {
     return (out);
 }
 
+/*
+ * Returns the health of each server (by name) from "show stat" output:
+ *
+ *   { up: <all its haproxy servers are up>, sessions: <their total scur> }
+ *
+ * A server has a haproxy server in each backend for its kind, named
+ * "<name>:<port>" (see lib_lbman.lookupSvname()).
+ */
+function serverHealth(stats) {
+    mod_assert.arrayOfObject(stats, 'stats');
+
+    var health = {};
+    stats.forEach(function (stat) {
+        if (stat.type !== TYPE_SERVER)
+            return;
+        var name = stat.svname.split(':', 1)[0];
+        var h = health[name];
+        if (h === undefined) {
+            h = { up: true, sessions: 0 };
+            health[name] = h;
+        }
+        if (lib_srvevents.statusState(stat.status) !== 'up')
+            h.up = false;
+        h.sessions += parseInt(stat.scur || '0', 10);
+    });
+    return (health);
+}
+
+/*
+ * Given the names of our current servers of one kind and their health (see
+ * serverHealth()), returns how many of those haproxy has up we can remove
+ * while staying above the floor set by the removal config.
+ *
+ * The floor is the minHealthy share of "base", the number of up servers when
+ * we started holding removals of this kind (by default, the number up now),
+ * so that it doesn't shrink as servers go. It is rounded down, so that unless
+ * minHealthy is 1 a small fleet can still lose one server (rounding up would
+ * keep all of e.g. 4 of 4 at 0.8 forever), but it never lets the last up
+ * server go unless minHealthy is 0. The sessions, if we're set to carry them,
+ * can raise it further.
+ */
+function removalBudget(names, health, cfg, base) {
+    mod_assert.arrayOfString(names, 'names');
+    mod_assert.object(health, 'health');
+    mod_assert.object(cfg, 'cfg');
+    mod_assert.optionalNumber(base, 'base');
+
+    var healthy = names.filter(function (name) {
+        return (health[name] !== undefined && health[name].up);
+    });
+    var sessions = 0;
+    healthy.forEach(function (name) {
+        sessions += health[name].sessions;
+    });
+    if (base === undefined)
+        base = healthy.length;
+
+    var floor = Math.floor(cfg.minHealthy * base);
+    if (cfg.minHealthy > 0 && base > 0)
+        floor = Math.max(floor, 1);
+    if (cfg.maxServerSessions !== undefined) {
+        floor = Math.max(floor,
+            Math.ceil(sessions / cfg.maxServerSessions));
+    }
+
+    return ({
+        healthy: healthy.length,
+        sessions: sessions,
+        floor: floor,
+        allowed: Math.max(0, healthy.length - floor)
+    });
+}
+
+/*
+ * Returns a metrics exporter collector (see lib/metrics_exporter.js) for the
+ * removal decisions counted in "counts" (see the "removals" option of
+ * ServerWatcherFSM).
+ */
+function removalCollector(counts) {
+    mod_assert.object(counts, 'counts');
+
+    return (function _collectRemovals() {
+        return ([ {
+            name: 'loadbalancer_server_removal_decisions_total',
+            type: 'counter',
+            desc: 'Total number of decisions to remove or hold on to a ' +
+                'server removed in ZooKeeper, by decision.',
+            metrics: REMOVAL_DECISIONS.map(function (decision) {
+                return ({ labels: { decision: decision },
+                    value: counts[decision] || 0 });
+            })
+        } ]);
+    });
+}
+
+/*
+ * Copies the agent port advertised in a registration, if any and valid.
+ */
+function addAgentPort(server, reg) {
+    var port = Number(reg.agentPort);
+    if (Number.isInteger(port) && port > 0 && port < 65536)
+        server.agentPort = port;
+}
+
 /*
  * The ServerWatcherFSM manages turning the nodesChanged watch events into
  * a list of servers, emitted whenever we should update haproxy.
@@ -65,6 +188,7 @@ function diffObjects(o1, o2) {
  *         'kind': webapi|buckets-api
  *         'address': <ip-address>
  *         'ports': [...]
+ *         'agentPort': <port> (optional)
  *     },
  *     ...
  * ]
@@ -94,6 +218,13 @@ function diffObjects(o1, o2) {
  *     wait HOLD_TIME before looking again. This protects us against DC-wide
  *     ZK glitches where everything gets cut-off and has to re-register.
  *
+ *   - Optionally ("capacity" removal mode), we ask haproxy instead: servers it
+ *     has down (or doesn't know about) aren't taking any load, so they are
+ *     removed right away, regardless of the throttle or HOLD_TIME. Servers
+ *     that are up are only removed as long as enough of them remain (see
+ *     removalBudget()). If we can't get the stats, we fall back to the
+ *     throttle.
+ *
  *
  *                  +
  *                  |
@@ -141,12 +272,49 @@ function diffObjects(o1, o2) {
  *                                    |         |
  *                                    +---------+
  */
+/*
+ * Options:
+ * - zk, a zkstream client
+ * - log, a Bunyan logger
+ * - stats (optional), the StatsPollerFSM (see lib/stats_poller.js), needed
+ *   for the "capacity" removal mode
+ * - removal (optional), the "removal" section of the muppet configuration;
+ *   see REMOVAL_DEFAULTS above for the settings and their defaults
+ * - removals (optional), an object in which to count removal decisions, which
+ *   carries over to the next ServerWatcherFSM (see removalCollector())
+ */
 function ServerWatcherFSM(opts) {
+    mod_assert.object(opts, 'opts');
+    mod_assert.object(opts.log, 'opts.log');
+    mod_assert.optionalObject(opts.stats, 'opts.stats');
+    mod_assert.optionalObject(opts.removal, 'opts.removal');
+    mod_assert.optionalObject(opts.removals, 'opts.removals');
+
+    var config = opts.removal || {};
+    var removal = {};
+    Object.keys(REMOVAL_DEFAULTS).forEach(function (key) {
+        removal[key] = (config[key] !== undefined) ?
+            config[key] : REMOVAL_DEFAULTS[key];
+    });
+    mod_assert.ok(REMOVAL_MODES.indexOf(removal.mode) !== -1,
+        'removal.mode must be one of: ' + REMOVAL_MODES.join(', '));
+    mod_assert.ok(removal.minHealthy >= 0 && removal.minHealthy <= 1,
+        'removal.minHealthy must be in [0, 1]');
+    mod_assert.optionalNumber(removal.maxServerSessions,
+        'removal.maxServerSessions');
+    if (removal.mode === 'capacity')
+        mod_assert.object(opts.stats, 'opts.stats');
+
     this.sw_zk = opts.zk;
     this.sw_log = opts.log;
+    this.sw_stats = opts.stats || null;
+    this.sw_removal = removal;
+    this.sw_removals = opts.removals || {};
 
     this.sw_lastSeen = {};
     this.sw_lastServers = {};
+    /* kind => up servers when we started holding removals of that kind */
+    this.sw_removalBase = {};
     this.sw_nodes = [];
     this.sw_serverHistory = [];
     this.sw_nextExpiry = null;
@@ -260,11 +428,18 @@ ServerWatcherFSM.prototype.state_collecting = function (S) {
     S.gotoStateTimeout(timeout, 'fetch');
 };
 
+ServerWatcherFSM.prototype._decided = function (decision, n) {
+    this.sw_removals[decision] = (this.sw_removals[decision] || 0) + n;
+};
+
 /*
  * We have a new set of backend servers. Process them against our last known
  * state, potentially keeping hold of some removed servers.
+ *
+ * In "capacity" removal mode, health is the servers' health according to
+ * haproxy (see serverHealth()), or null if we couldn't get it.
  */
-ServerWatcherFSM.prototype._processRemovals = function (servers) {
+ServerWatcherFSM.prototype._processRemovals = function (servers, health) {
     var self = this;
     var log = this.sw_log;
 
@@ -305,6 +480,72 @@ ServerWatcherFSM.prototype._processRemovals = function (servers) {
 
     var nextExpiry = null;
 
+    if (health !== undefined && health !== null) {
+        var down = removed.filter(function (s) {
+            return (health[s] === undefined || !health[s].up);
+        });
+        if (down.length > 0) {
+            log.info({ down: down }, 'removing servers that are down in ' +
+                'haproxy right away');
+            self._decided('removed_down', down.length);
+        }
+        removed = removed.filter(function (s) {
+            return (health[s] !== undefined && health[s].up);
+        });
+
+        /*
+         * Each kind of server has its own floor, and keeps it until none of
+         * its up servers are waiting to be removed any more.
+         */
+        var byKind = {};
+        removed.forEach(function (s) {
+            var kind = self.sw_lastServers[s].kind;
+            if (byKind[kind] === undefined)
+                byKind[kind] = [];
+            byKind[kind].push(s);
+        });
+        Object.keys(self.sw_removalBase).forEach(function (kind) {
+            if (byKind[kind] === undefined)
+                delete (self.sw_removalBase[kind]);
+        });
+
+        var allowed = {};
+        Object.keys(byKind).forEach(function (kind) {
+            var names = Object.keys(self.sw_lastServers).filter(function (s) {
+                return (self.sw_lastServers[s].kind === kind);
+            });
+            var budget = removalBudget(names, health, self.sw_removal,
+                self.sw_removalBase[kind]);
+            if (self.sw_removalBase[kind] === undefined)
+                self.sw_removalBase[kind] = budget.healthy;
+            log.trace({ kind: kind, budget: budget }, 'checking removal ' +
+                'capacity (removing %d healthy)', byKind[kind].length);
+
+            allowed[kind] = budget.allowed;
+            var held = byKind[kind].length - budget.allowed;
+            if (held > 0) {
+                log.warn({ kind: kind, budget: budget }, 'holding %d ' +
+                    'healthy servers to keep capacity (removing %d)', held,
+                    budget.allowed);
+                self._decided('held_capacity', held);
+                nextExpiry = self.smear(now + self.sw_holdTime);
+            }
+        });
+
+        /* Of each kind, we remove those we've seen least recently. */
+        removed = removed.filter(function (s) {
+            var kind = self.sw_lastServers[s].kind;
+            if (allowed[kind] > 0) {
+                allowed[kind]--;
+                return (true);
+            }
+            servers[s] = self.sw_lastServers[s];
+            return (false);
+        });
+
+        return (self._holdRemovals(servers, removed, now, nextExpiry));
+    }
+
     var rmThresh = Math.ceil(REMOVAL_THROTTLE *
         Object.keys(self.sw_lastServers).length);
 
@@ -325,6 +566,7 @@ ServerWatcherFSM.prototype._processRemovals = function (servers) {
         toRestore.forEach(function (s) {
             servers[s] = self.sw_lastServers[s];
         });
+        self._decided('held_throttle', toRestore.length);
         /* Those first entries are the ones actually removed now. */
         removed = removed.slice(0, rmThresh);
         /*
@@ -334,6 +576,19 @@ ServerWatcherFSM.prototype._processRemovals = function (servers) {
         nextExpiry = self.smear(now + self.sw_holdTime);
     }
 
+    return (self._holdRemovals(servers, removed, now, nextExpiry));
+};
+
+/*
+ * The rest of _processRemovals(): keeps hold of the servers we'd remove that
+ * were seen less than HOLD_TIME ago.
+ */
+ServerWatcherFSM.prototype._holdRemovals = function (servers, removed, now,
+    nextExpiry) {
+    var self = this;
+    var log = this.sw_log;
+    var removing = removed.length;
+
     /*
      * Now check for HOLD_TIMEs on individual servers. The 'removed' array
      * is sorted so that the most recently seen entries are *last*, so we
@@ -350,10 +605,13 @@ ServerWatcherFSM.prototype._processRemovals = function (servers) {
         log.info('keeping removed server %s around for hold time (%d s)',
             sname, self.sw_holdTime / 1000);
         servers[sname] = self.sw_lastServers[sname];
+        removing--;
+        self._decided('held_time', 1);
         var exp = self.smear(lastSeen + self.sw_holdTime);
         if (nextExpiry === null || exp < nextExpiry)
             nextExpiry = exp;
     }
+    self._decided('removed', removing);
 
     /*
      * Always set sw_nextExpiry: if we didn't encounter anything that needs
@@ -412,7 +670,24 @@ ServerWatcherFSM.prototype.state_fetch = function (S) {
             return;
         }
 
-        servers = self._processRemovals(servers);
+        if (self.sw_removal.mode !== 'capacity') {
+            done();
+            return;
+        }
+        var statopts = { maxAge: self.sw_stats.interval() };
+        self.sw_stats.snapshot(statopts, S.callback(function (err, snap) {
+            if (err) {
+                log.warn(err, 'failed to get server health from haproxy; ' +
+                    'throttling removals instead');
+                done(null);
+                return;
+            }
+            done(serverHealth(snap.stats));
+        }));
+    }));
+
+    function done(health) {
+        servers = self._processRemovals(servers, health);
 
         var serverDiff = diffObjects(self.sw_lastServers, servers);
         self._newServerDiff(serverDiff);
@@ -433,7 +708,8 @@ ServerWatcherFSM.prototype.state_fetch = function (S) {
         } else {
             S.gotoState('idle');
         }
-    }));
+    }
+
     nodes.forEach(function (node) {
         self.sw_nodeq.push(node);
     });
@@ -501,6 +777,10 @@ ServerWatcherFSM.prototype.state_fetch = function (S) {
              * 'buckets-api' backend servers are of the 'load_balancer' kind:
              * note this refers to the registration type given to registrar,
              * not anything haproxy-related.
+             *
+             * Either can advertise the port of an haproxy agent (see
+             * agentParams() in lib/lb_manager.js) as "agentPort" alongside
+             * the address.
              */
 
             const name = mod_path.basename(path);
@@ -520,6 +800,7 @@ ServerWatcherFSM.prototype.state_fetch = function (S) {
                     kind: kind,
                     address: obj.host.address
                 };
+                addAgentPort(servers[name], obj.host);
             } else {
                 mod_assert.equal(kind, 'buckets-api');
                 if (obj.type !== 'load_balancer') {
@@ -536,6 +817,7 @@ ServerWatcherFSM.prototype.state_fetch = function (S) {
                     address: obj.load_balancer.address,
                     ports: obj.load_balancer.ports
                 };
+                addAgentPort(servers[name], obj.load_balancer);
             }
 
             cb();
@@ -559,5 +841,9 @@ ServerWatcherFSM.prototype.state_retry = function (S) {
 };
 
 module.exports = {
-    ServerWatcherFSM: ServerWatcherFSM
+    ServerWatcherFSM: ServerWatcherFSM,
+    removalCollector: removalCollector,
+    // for testing
+    removalBudget: removalBudget,
+    serverHealth: serverHealth
 };
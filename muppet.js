@@ -6,6 +6,7 @@
 
 /*
  * Copyright 2019 Joyent, Inc.
+ * Copyright 2026 MNX Cloud, Inc.
  */
 
 /*
@@ -89,6 +90,27 @@ function configure() {
         if (cfg.mantaIPS && typeof (cfg.mantaIPS) === 'string') {
             cfg.mantaIPS = cfg.mantaIPS.split(',');
         }
+        if (cfg.metrics) {
+            [ 'allow', 'deny' ].forEach(function (key) {
+                if (typeof (cfg.metrics[key]) === 'string')
+                    cfg.metrics[key] = cfg.metrics[key].split(',');
+            });
+        }
+        /* "GET:-10,HEAD:-10" */
+        if (cfg.haproxy && cfg.haproxy.priority &&
+            typeof (cfg.haproxy.priority.methods) === 'string') {
+            var methods = {};
+            cfg.haproxy.priority.methods.split(',').forEach(function (m) {
+                var kv = m.split(':');
+                methods[kv[0].trim()] = Number(kv[1]);
+            });
+            cfg.haproxy.priority.methods = methods;
+        }
+        if (cfg.haproxy && cfg.haproxy.streaming &&
+            typeof (cfg.haproxy.streaming.downloadPaths) === 'string') {
+            cfg.haproxy.streaming.downloadPaths =
+                cfg.haproxy.streaming.downloadPaths.split(',');
+        }
     } catch (e) {
         log.fatal(e, 'unable to parse %s', _f);
         process.exit(1);
@@ -103,6 +125,17 @@ function configure() {
     if (cfg.logLevel)
         log.level(cfg.logLevel);
 
+    /*
+     * A bad listener profile (e.g. more shards than threads) would fail every
+     * reload, so refuse to start with one.
+     */
+    const listenerErr = lib_lbman.checkListenerProfile(
+        cfg.haproxy.listener || {}, cfg.haproxy.nbthread);
+    if (listenerErr !== null) {
+        log.fatal(listenerErr, 'invalid haproxy listener profile');
+        process.exit(1);
+    }
+
     var MIN_USER_PORT = 1024;
     var MAX_USER_PORT = 49151;
 
@@ -150,3 +183,23 @@ function usage(msg) {
 
 var config = configure();
 var app = new lib_app.AppFSM(config);
+
+/*
+ * SIGHUP drains this instance before exiting (see lib/drain.js), so that
+ * haproxy can then be stopped without resetting client connections. Our SMF
+ * stop method (smf/method/muppet-stop) only sends it when the instance is
+ * going out of service; otherwise it sends SIGTERM, which exits right away
+ * (cutting short a drain in progress, too).
+ */
+process.on('SIGHUP', function () {
+    app.drain(function () {
+        process.exit(0);
+    });
+});
+
+/*
+ * SIGUSR2 dumps the flight recorder to disk (see lib/recorder.js).
+ */
+process.on('SIGUSR2', function () {
+    app.dumpRecorder({ reason: 'signal' });
+});
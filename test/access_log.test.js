@@ -0,0 +1,129 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 MNX Cloud, Inc.
+ */
+
+/*jsl:ignore*/
+'use strict';
+/*jsl:end*/
+
+const lib_accesslog = require('../lib/access_log.js');
+const tap = require('tap');
+
+const LINE = '<134>Oct 17 19:45:04 haproxy[123]: ' + JSON.stringify({
+    msg: 'handled: 200',
+    req: {
+        method: 'GET',
+        url: '/poseidon/stor/foo?x=1',
+        headers: { 'x-request-id': 'abc' }
+    },
+    res: { statusCode: 200 },
+    timers: { req: 0, queued: 0, server_conn: 1, res: 12, total: 15 },
+    client_ip: '10.0.0.1',
+    client_port: 4567,
+    time: '17/Oct/2026:19:45:04.123',
+    frontend: 'https',
+    backend: 'secure_api',
+    server: 'be1:80',
+    retries: 0,
+    res_bytes_read: 100,
+    termination_state: '----',
+    pid: 123,
+    hostname: 'lb',
+    name: 'haproxy',
+    level: 30,
+    v: 0
+});
+
+tap.test('parse access log lines', function (t) {
+    const expected = {
+        backend: 'secure_api',
+        route: 'stor',
+        status: 200,
+        queued: 0,
+        connect: 1,
+        response: 12,
+        total: 15,
+        priorityClass: null,
+        weight: 1
+    };
+    t.deepEqual(lib_accesslog.parseLine(Buffer.from(LINE)), expected,
+        'fast path');
+
+    const reordered = LINE.replace('"req":0,', '"req":0, ');
+    t.deepEqual(lib_accesslog.parseLine(Buffer.from(reordered)), expected,
+        'falls back to JSON');
+
+    const aborted = lib_accesslog.parseLine(Buffer.from(
+        LINE.replace('"server_conn":1,"res":12', '"server_conn":-1,"res":-1')
+        .replace('/poseidon/stor/foo?x=1', '/ping')));
+    t.equal(aborted.connect, -1, 'negative timer');
+    t.equal(aborted.response, -1, 'negative timer');
+    t.equal(aborted.route, 'other', 'other route');
+
+    const sampled = LINE.replace(/}$/, ',"sample_rate":"100"}');
+    t.equal(lib_accesslog.parseLine(Buffer.from(sampled)).weight, 100,
+        'sample rate');
+    t.equal(lib_accesslog.parseLine(Buffer.from(
+        sampled.replace('"req":0,', '"req":0, '))).weight, 100,
+        'sample rate from JSON');
+    t.equal(lib_accesslog.parseLine(Buffer.from(
+        LINE.replace(/}$/, ',"sample_rate":"-"}'))).weight, 1,
+        'rejected before sampling');
+
+    const prioritized = LINE.replace(/}$/,
+        ',"priority_class":"-100","sample_rate":"10"}');
+    var line = lib_accesslog.parseLine(Buffer.from(prioritized));
+    t.equal(line.priorityClass, '-100', 'priority class');
+    t.equal(line.weight, 10, 'sample rate after the priority class');
+    t.equal(lib_accesslog.parseLine(Buffer.from(
+        prioritized.replace('"req":0,', '"req":0, '))).priorityClass, '-100',
+        'priority class from JSON');
+
+    t.equal(lib_accesslog.parseLine(Buffer.from('<134>not json')), null,
+        'not an access log line');
+    t.equal(lib_accesslog.parseLine(Buffer.from('<134>{"a":1}')), null,
+        'not our format');
+    t.done();
+});
+
+tap.test('routes and status classes', function (t) {
+    t.equal(lib_accesslog.routeOf('/poseidon/public/x'), 'public', 'public');
+    t.equal(lib_accesslog.routeOf('/poseidon/buckets?limit=1'), 'buckets',
+        'query string');
+    t.equal(lib_accesslog.routeOf('/poseidon/secret'), 'other', 'other');
+    t.equal(lib_accesslog.codeClass(503), '5xx', '5xx');
+    t.equal(lib_accesslog.codeClass(-1), 'other', 'no status');
+    t.done();
+});
+
+tap.test('histograms', function (t) {
+    const h = new lib_accesslog.Histograms([ 0.1, 1 ]);
+    h.observe({ backend: 'b' }, 0.05);
+    h.observe({ backend: 'b' }, 0.5);
+    h.observe({ backend: 'b' }, 5);
+
+    t.deepEqual(h.metrics(), [
+        { suffix: '_bucket', labels: { backend: 'b', le: '0.1' }, value: 1 },
+        { suffix: '_bucket', labels: { backend: 'b', le: '1' }, value: 2 },
+        { suffix: '_bucket', labels: { backend: 'b', le: '+Inf' }, value: 3 },
+        { suffix: '_sum', labels: { backend: 'b' }, value: 5.55 },
+        { suffix: '_count', labels: { backend: 'b' }, value: 3 }
+    ], 'cumulative buckets, sum and count');
+
+    const weighted = new lib_accesslog.Histograms([ 1 ]);
+    weighted.observe({}, 0.5, 10);
+    weighted.observe({}, 2);
+    t.deepEqual(weighted.metrics(), [
+        { suffix: '_bucket', labels: { le: '1' }, value: 10 },
+        { suffix: '_bucket', labels: { le: '+Inf' }, value: 11 },
+        { suffix: '_sum', labels: {}, value: 7 },
+        { suffix: '_count', labels: {}, value: 11 }
+    ], 'weighted observations');
+    t.done();
+});
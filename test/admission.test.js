@@ -0,0 +1,222 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 MNX Cloud, Inc.
+ */
+
+/*jsl:ignore*/
+'use strict';
+/*jsl:end*/
+
+const mod_bunyan = require('bunyan');
+const lib_admission = require('../lib/admission.js');
+const tap = require('tap');
+
+const log = mod_bunyan.createLogger({
+    name: 'admission_test',
+    level: process.env['LOG_LEVEL'] || 'fatal'
+});
+
+const OPTS = {
+    queueThreshold: 100,
+    qtimeThreshold: 500,
+    minLevel: 0.1,
+    decrease: 0.75,
+    increase: 0.1
+};
+
+function backend(name, qcur, qtime) {
+    return ({ pxname: name, svname: 'BACKEND', type: '1',
+        qcur: String(qcur), qtime: String(qtime) });
+}
+
+function server(name, svname, status) {
+    return ({ pxname: name, svname: svname, type: '2', status: status });
+}
+
+tap.test('idle backends restore admission', function (t) {
+    const stats = [
+        backend('secure_api', 0, 0),
+        server('secure_api', 'be0', 'UP'),
+        server('secure_api', 'be1', 'UP')
+    ];
+
+    var res = lib_admission.evaluate(stats, 0.5, OPTS);
+    t.notOk(res.overloaded, 'not overloaded');
+    t.equal(res.level, 0.6, 'level increased additively');
+
+    res = lib_admission.evaluate(stats, 1, OPTS);
+    t.equal(res.level, 1, 'level capped at 1');
+    t.done();
+});
+
+tap.test('queue depth sheds load', function (t) {
+    const stats = [
+        backend('secure_api', 150, 20),
+        server('secure_api', 'be0', 'UP')
+    ];
+
+    var res = lib_admission.evaluate(stats, 1, OPTS);
+    t.ok(res.overloaded, 'overloaded');
+    t.equal(res.level, 0.75, 'level decreased multiplicatively');
+    t.equal(res.reasons[0].reason, 'queue', 'reason');
+
+    res = lib_admission.evaluate(stats, 0.11, OPTS);
+    t.equal(res.level, 0.1, 'level floored at minLevel');
+    t.done();
+});
+
+tap.test('queue time sheds load', function (t) {
+    const stats = [
+        backend('insecure_api', 5, 800),
+        server('insecure_api', 'be0', 'UP')
+    ];
+
+    const res = lib_admission.evaluate(stats, 1, OPTS);
+    t.ok(res.overloaded, 'overloaded');
+    t.equal(res.reasons[0].reason, 'qtime', 'reason');
+    t.done();
+});
+
+tap.test('lost servers cap admission', function (t) {
+    const stats = [
+        backend('secure_api', 0, 0),
+        server('secure_api', 'be0', 'UP'),
+        server('secure_api', 'be1', 'DOWN'),
+        server('secure_api', 'be2', 'MAINT'),
+        server('secure_api', 'be3', 'DOWN'),
+        server('secure_api', 'be4', 'UP 1/3')
+    ];
+
+    const res = lib_admission.evaluate(stats, 1, OPTS);
+    t.notOk(res.overloaded, 'not overloaded');
+    t.equal(res.capacity, 0.5, 'maintenance servers are ignored');
+    t.equal(res.level, 0.5, 'level capped at capacity');
+    t.done();
+});
+
+tap.test('frontends only look at their own backends', function (t) {
+    const stats = [
+        backend('secure_api', 0, 0),
+        server('secure_api', 'be0', 'UP'),
+        backend('secure_api_stream', 0, 0),
+        server('secure_api_stream', 'be0', 'UP'),
+        backend('insecure_api', 0, 0),
+        server('insecure_api', 'be0', 'UP'),
+        backend('buckets_api', 150, 20),
+        server('buckets_api', 'bu0', 'UP'),
+        server('buckets_api', 'bu1', 'DOWN'),
+        backend('buckets_api_stream', 0, 0),
+        server('buckets_api_stream', 'bu0', 'UP'),
+        server('buckets_api_stream', 'bu1', 'DOWN')
+    ];
+
+    function opts(fe) {
+        var res = {};
+        Object.keys(OPTS).forEach(function (key) {
+            res[key] = OPTS[key];
+        });
+        res.backends = lib_admission.FRONTEND_BACKENDS[fe];
+        return (res);
+    }
+
+    var res = lib_admission.evaluate(stats, 1, opts('https'));
+    t.ok(res.overloaded, 'https overloaded');
+    t.equal(res.capacity, 0.5, 'https capacity');
+    t.equal(res.level, 0.5, 'https level');
+
+    res = lib_admission.evaluate(stats, 1, opts('http_external'));
+    t.notOk(res.overloaded, 'http_external not overloaded');
+    t.equal(res.capacity, 1, 'http_external capacity');
+    t.equal(res.level, 1, 'http_external level');
+    t.deepEqual(res.reasons, [], 'no reasons');
+    t.done();
+});
+
+/*
+ * Stands in for lib/haproxy_sock.js, keeping the limits we set.
+ */
+function FakeSock() {
+    this.maxconn = {};
+    this.rates = {};
+}
+FakeSock.prototype.setFrontendMaxconn = function (opts, cb) {
+    this.maxconn[opts.frontend] = opts.maxconn;
+    setImmediate(cb);
+};
+FakeSock.prototype.setMapEntry = function (opts, cb) {
+    this.rates[opts.key] = parseInt(opts.value, 10);
+    setImmediate(cb);
+};
+
+tap.test('session rate limits hold at a steady level', function (t) {
+    const sock = new FakeSock();
+    const fsm = new lib_admission.AdmissionControllerFSM({
+        haSock: sock,
+        /* Never answers, so that the FSM only runs the cycles below. */
+        stats: { snapshot: function () {} },
+        log: log,
+        maxconn: 1000,
+        mapFile: '/tmp/admission.map',
+        config: { interval: 10 }
+    });
+    t.equal(fsm.mapLimits(), 'https 0\nhttp_external 0\n',
+        'unrestricted map file');
+
+    /* Half the servers are down, and 1000 new sessions/sec arrive. */
+    var incoming = { 'https': 1000, 'http_external': 400,
+        'http_internal': 2000 };
+    function stats() {
+        var res = [
+            backend('secure_api', 0, 0),
+            server('secure_api', 'be0', 'UP'),
+            server('secure_api', 'be1', 'DOWN')
+        ];
+        Object.keys(incoming).forEach(function (fe) {
+            var limit = sock.rates[fe];
+            var rate = (limit > 0) ? Math.min(incoming[fe], limit) :
+                incoming[fe];
+            res.push({ pxname: fe, svname: 'FRONTEND', type: '0',
+                rate: String(rate), slim: String(sock.maxconn[fe]) });
+        });
+        return (res);
+    }
+
+    var cycles = 0;
+    function cycle() {
+        var snap = stats();
+        var res = lib_admission.evaluate(snap, fsm.ac_levels['https'], OPTS);
+        fsm.ac_levels['https'] = res.level;
+        fsm.ac_levels['http_external'] = res.level;
+        fsm._apply(snap, function (err) {
+            t.error(err, 'applied');
+            if (++cycles < 5) {
+                cycle();
+                return;
+            }
+            t.equal(fsm.ac_levels['https'], 0.5, 'level held at capacity');
+            t.deepEqual(sock.rates, { 'https': 500, 'http_external': 200 },
+                'rates held at half the rate before shedding');
+            t.deepEqual(sock.maxconn, { 'https': 500,
+                'http_external': 500 }, 'maxconn');
+            t.equal(sock.rates['http_internal'], undefined,
+                'http_internal left alone');
+
+            /* Recovered: back to no limit, and a new base next time. */
+            fsm.ac_levels['https'] = 1;
+            fsm.ac_levels['http_external'] = 1;
+            fsm._apply(stats(), function (err2) {
+                t.error(err2, 'applied');
+                t.deepEqual(sock.rates, { 'https': 0, 'http_external': 0 },
+                    'limits lifted');
+                t.deepEqual(fsm.ac_baseRate, {}, 'base rates forgotten');
+                t.done();
+            });
+        });
+    }
+    cycle();
+});
@@ -0,0 +1,117 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 MNX Cloud, Inc.
+ */
+
+/*jsl:ignore*/
+'use strict';
+/*jsl:end*/
+
+const mod_bunyan = require('bunyan');
+const lib_agentweights = require('../lib/agent_weights.js');
+const tap = require('tap');
+
+const log = mod_bunyan.createLogger({
+    name: 'agent_weights_test',
+    level: process.env['LOG_LEVEL'] || 'fatal'
+});
+
+function stat(svname, weight, agentStatus) {
+    return ({ pxname: 'secure_api', svname: svname, type: '2',
+        weight: String(weight), agent_status: agentStatus });
+}
+
+tap.test('agent status', function (t) {
+    t.ok(lib_agentweights.agentOk('L7OK'), 'ok');
+    t.ok(lib_agentweights.agentOk('* L7OK'), 'ok, checking');
+    t.ok(lib_agentweights.agentOk('L4OK'), 'layer 4 ok');
+    t.notOk(lib_agentweights.agentOk('L4CON'), 'connection refused');
+    t.notOk(lib_agentweights.agentOk('L7TOUT'), 'timeout');
+    t.notOk(lib_agentweights.agentOk(''), 'no agent');
+    t.done();
+});
+
+tap.test('agent weights from stats', function (t) {
+    var weights = new lib_agentweights.AgentWeights({ log: log });
+
+    t.deepEqual(weights.collector()()[0].metrics, [], 'nothing yet');
+
+    weights.poll({ time: Date.now(), stats: [
+        { pxname: 'secure_api', svname: 'BACKEND', type: '1', weight: '150',
+            agent_status: '' },
+        stat('be1:80', 100, 'L7OK'),
+        stat('be2:80', 50, '* L7OK'),
+        stat('be3:80', 100, 'L4CON'),
+        stat('be4:80', 1, '')
+    ] });
+
+    var families = weights.collector()();
+    t.deepEqual(families[0].metrics, [
+        { labels: { backend: 'secure_api', server: 'be1:80' }, value: 100 },
+        { labels: { backend: 'secure_api', server: 'be2:80' }, value: 50 },
+        { labels: { backend: 'secure_api', server: 'be3:80' }, value: 100 }
+    ], 'weights of servers with an agent');
+    t.deepEqual(families[1].metrics.map(function (m) {
+        return (m.value);
+    }), [ 1, 1, 0 ], 'agents up');
+
+    weights.poll({ time: Date.now(), stats: [ stat('be1:80', 0, 'L7OK') ] });
+    t.deepEqual(weights.collector()()[0].metrics, [
+        { labels: { backend: 'secure_api', server: 'be1:80' }, value: 0 }
+    ], 'replaced by the next snapshot');
+    t.done();
+});
+
+tap.test('streaming servers follow the agents\' weights', function (t) {
+    function streamStat(svname, weight) {
+        return ({ pxname: 'secure_api_stream', svname: svname, type: '2',
+            weight: String(weight), agent_status: '' });
+    }
+    var stats = [
+        stat('be1:80', 100, 'L7OK'),
+        stat('be2:80', 50, 'L7OK'),
+        stat('be3:80', 0, 'L7OK'),
+        stat('be4:80', 1, ''),
+        streamStat('be1:80', 100),
+        streamStat('be2:80', 100),
+        streamStat('be3:80', 100),
+        streamStat('be4:80', 1)
+    ];
+
+    t.deepEqual(lib_agentweights.streamWeights(stats), [
+        { backend: 'secure_api_stream', server: 'be2:80', weight: 50 },
+        { backend: 'secure_api_stream', server: 'be3:80', weight: 0 }
+    ], 'changed weights, not those without an agent');
+
+    var commands = [];
+    var weights = new lib_agentweights.AgentWeights({
+        log: log,
+        haSock: {
+            setServerWeight: function (opts, cb) {
+                commands.push(opts.backend + '/' + opts.server + ' ' +
+                    opts.weight);
+                setImmediate(cb, null);
+            }
+        }
+    });
+    weights.poll({ time: Date.now(), stats: stats });
+    /* Still applying the first snapshot: this one is skipped. */
+    weights.poll({ time: Date.now(), stats: stats });
+    t.ok(weights.aw_updating, 'updating');
+
+    function check() {
+        if (weights.aw_updating) {
+            setImmediate(check);
+            return;
+        }
+        t.deepEqual(commands, [ 'secure_api_stream/be2:80 50',
+            'secure_api_stream/be3:80 0' ], 'weights set, once');
+        t.done();
+    }
+    check();
+});
@@ -178,3 +178,82 @@ tap.test('app.checkStats want-enabled', function (t) {
         });
     });
 });
+
+tap.test('app.checkStats streaming backends', function (t) {
+    const servers = {
+        '4afa9ff4-d918-42ed-9972-9ac20b7cf869': {
+            'kind': 'webapi',
+            'enabled': true,
+            'address': '127.0.0.1'
+        },
+        '5c679a71-9ef7-4079-9a4c-45c9f5b97d45': {
+            'kind': 'webapi',
+            'enabled': false,
+            'address': '127.0.0.1'
+        }
+    };
+    const stats = [
+        { pxname: 'secure_api', svname:
+            '4afa9ff4-d918-42ed-9972-9ac20b7cf869:6780', status: 'UP',
+            addr: '127.0.0.1:6780' },
+        { pxname: 'secure_api', svname:
+            '5c679a71-9ef7-4079-9a4c-45c9f5b97d45:6780', status: 'MAINT',
+            addr: '127.0.0.1:6780' },
+        { pxname: 'secure_api_stream', svname:
+            '4afa9ff4-d918-42ed-9972-9ac20b7cf869:6780', status: 'UP',
+            addr: '127.0.0.1:6780' },
+        { pxname: 'secure_api_stream', svname:
+            '5c679a71-9ef7-4079-9a4c-45c9f5b97d45:6780',
+            status: 'MAINT (via secure_api/' +
+            '5c679a71-9ef7-4079-9a4c-45c9f5b97d45:6780)',
+            addr: '127.0.0.1:6780' }
+    ];
+
+    var res = app.checkStats(servers, stats);
+    t.equal(res.reload, false, 'must reload is false');
+    t.deepEqual(res.wrong, [], 'tracking servers follow secure_api');
+
+    /* Only the tracked server is flagged, not its tracking one. */
+    servers['5c679a71-9ef7-4079-9a4c-45c9f5b97d45'].enabled = true;
+    res = app.checkStats(servers, stats);
+    t.equal(res.wrong.length, 1, 'one want-enabled');
+    t.equal(res.wrong[0].pxname, 'secure_api', 'in secure_api');
+    t.equal(res.wrong[0].reason, 'want-enabled', 'correct reason');
+
+    stats[3].addr = '127.0.0.2:6780';
+    res = app.checkStats(servers, stats);
+    t.equal(res.reload, true, 'tracking server addresses are checked');
+    t.done();
+});
+
+tap.test('app.checkEvent', function (t) {
+    const servers = {
+        '4afa9ff4-d918-42ed-9972-9ac20b7cf869': {
+            'kind': 'webapi',
+            'enabled': true,
+            'address': '127.0.0.1'
+        },
+        'cdf37eb6-090a-4e68-8282-90e99c6bb04d': {
+            'kind': 'buckets-api',
+            'enabled': false,
+            'address': '127.0.0.1'
+        }
+    };
+
+    function check(server, state) {
+        return (app.checkEvent(servers, { backend: 'secure_api',
+            server: server, state: state }));
+    }
+
+    t.equal(check('4afa9ff4-d918-42ed-9972-9ac20b7cf869:6781', 'down'), null,
+        'health check failure');
+    t.equal(check('4afa9ff4-d918-42ed-9972-9ac20b7cf869:6781', 'maint'),
+        'want-enabled', 'enabled server in maintenance');
+    t.equal(check('cdf37eb6-090a-4e68-8282-90e99c6bb04d:6781', 'maint'), null,
+        'disabled server in maintenance');
+    t.equal(check('cdf37eb6-090a-4e68-8282-90e99c6bb04d:6781', 'up'),
+        'want-disabled', 'disabled server up');
+    t.equal(check('5c679a71-9ef7-4079-9a4c-45c9f5b97d45:6781', 'up'),
+        'no-server', 'unknown server');
+    t.done();
+});
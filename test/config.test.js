@@ -6,6 +6,7 @@
 
 /*
  * Copyright 2019 Joyent, Inc.
+ * Copyright 2026 MNX Cloud, Inc.
  */
 var fs = require('fs');
 var helper = require('./helper.js');
@@ -37,6 +38,34 @@ var haproxy_file = path.resolve(__dirname, 'haproxy.cfg');
 
 var haproxy_exec = path.resolve(__dirname, '../build/haproxy/sbin/haproxy');
 
+/*
+ * Returns writeHaproxyConfig() options for the feature tests: one thread and
+ * the given haproxy settings, one webapi server, and any other options (e.g.
+ * different servers, or logSink) from extra.
+ */
+function featureOpts(haproxy, extra) {
+    var opts = {
+        trustedIP: '127.0.0.1',
+        untrustedIPs: ['::1'],
+        haproxy: { 'nbthread': 1 },
+        servers: {
+            'foo.joyent.us': { kind: 'webapi', address: '127.0.0.1' }
+        },
+        configFile: updConfig_out,
+        haproxyExec: haproxy_exec,
+        configTemplate: haproxy_template,
+        sslCertFile: '',
+        log: helper.createLogger()
+    };
+    Object.keys(haproxy).forEach(function (k) {
+        opts.haproxy[k] = haproxy[k];
+    });
+    Object.keys(extra || {}).forEach(function (k) {
+        opts[k] = extra[k];
+    });
+    return (opts);
+}
+
 
 ///--- Tests
 
@@ -84,7 +113,7 @@ tap.test('test writeHaproxyConfig', function (t) {
     var opts = {
         trustedIP: '127.0.0.1',
         untrustedIPs: ['::1', '255.255.255.255'],
-        haproxy: { 'nbthread': 1 },
+        haproxy: { 'nbthread': 1, 'maxconn': 65535 },
         servers: {
             'foo.joyent.us': {
                 kind: 'webapi',
@@ -103,6 +132,7 @@ tap.test('test writeHaproxyConfig', function (t) {
         configFile: updConfig_out,
         haproxyExec: haproxy_exec,
         configTemplate: haproxy_template,
+        sslCertFile: '',
         log: helper.createLogger()
     };
     lbm.writeHaproxyConfig(opts, function (err, data) {
@@ -127,6 +157,581 @@ tap.test('test writeHaproxyConfig', function (t) {
     });
 });
 
+tap.test('test writeHaproxyConfig listener profile', function (t) {
+    var opts = {
+        trustedIP: '127.0.0.1',
+        untrustedIPs: ['::1'],
+        haproxy: {
+            'nbthread': 4,
+            'listener': {
+                'backlog': 4096,
+                'deferAccept': true,
+                'shards': 2,
+                'maxaccept': 16
+            }
+        },
+        servers: {
+            'foo.joyent.us': { kind: 'webapi', address: '127.0.0.1' }
+        },
+        configFile: updConfig_out,
+        configTemplate: haproxy_template,
+        sslCertFile: '',
+        log: helper.createLogger()
+    };
+    lbm.writeHaproxyConfig(opts, function (err) {
+        t.equal(null, err);
+        var txt = fs.readFileSync(updConfig_out, 'utf8');
+        t.match(txt, /tune\.maxaccept 16\n/, 'maxaccept');
+        t.ok(txt.indexOf('bind *:443 name https-0 backlog 4096 ' +
+            'defer-accept process 1/1-2\n') !== -1, 'first https shard');
+        t.ok(txt.indexOf('bind *:443 name https-1 backlog 4096 ' +
+            'defer-accept process 1/3-4\n') !== -1, 'second https shard');
+        t.match(txt, /bind ::1:80 name http_external-0-1 /, 'external shard');
+        t.match(txt, /bind 127\.0\.0\.1:80 name http_internal-1 /,
+            'internal shard');
+        fs.unlinkSync(updConfig_out);
+        t.done();
+    });
+});
+
+tap.test('test listener profile validation', function (t) {
+    t.equal(null, lbm.checkListenerProfile({}, 1), 'empty profile');
+    t.ok(lbm.checkListenerProfile({ shards: 2 }, 1), 'too many shards');
+    t.ok(lbm.checkListenerProfile({ backlog: 0 }, 1), 'bad backlog');
+    t.ok(lbm.checkListenerProfile({ tfo: 'yes' }, 1), 'bad tfo');
+    t.ok(lbm.checkListenerProfile({ maxaccept: 0 }, 1), 'bad maxaccept');
+    t.done();
+});
+
+tap.test('test writeHaproxyConfig protection profile', function (t) {
+    var opts = featureOpts({
+        'protection': {
+            'httpRequestTimeout': 10000,
+            'keepAliveTimeout': 5000,
+            'connLimit': 100,
+            'connRateLimit': 300
+        }
+    });
+    lbm.writeHaproxyConfig(opts, function (err) {
+        t.equal(null, err);
+        var txt = fs.readFileSync(updConfig_out, 'utf8');
+        /* both https and http_external are protected, http_internal isn't */
+        t.equal(txt.match(/timeout http-request 10000ms\n/g).length, 2,
+            'request timeout');
+        t.equal(txt.match(/timeout http-keep-alive 5000ms\n/g).length, 2,
+            'keep-alive timeout');
+        t.equal(txt.match(/track-sc0 src\n/g).length, 2, 'tracking');
+        t.match(txt, /reject if { sc0_conn_cur gt 100 }\n/, 'conn limit');
+        t.match(txt, /reject if { sc0_conn_rate gt 300 }\n/, 'rate limit');
+        t.match(txt, /store conn_cur,conn_rate\(10000ms\)\n/, 'period');
+        fs.unlinkSync(updConfig_out);
+        t.done();
+    });
+});
+
+tap.test('test writeHaproxyConfig access log sink', function (t) {
+    var opts = {
+        trustedIP: '127.0.0.1',
+        untrustedIPs: ['::1'],
+        haproxy: { 'nbthread': 1 },
+        servers: {
+            'foo.joyent.us': { kind: 'webapi', address: '127.0.0.1' }
+        },
+        logSink: '127.0.0.1:10514',
+        configFile: updConfig_out,
+        configTemplate: haproxy_template,
+        sslCertFile: '',
+        log: helper.createLogger()
+    };
+    lbm.writeHaproxyConfig(opts, function (err) {
+        t.equal(null, err);
+        var txt = fs.readFileSync(updConfig_out, 'utf8');
+        t.match(txt, /log 127\.0\.0\.1:10514 len 4096 local0\n/, 'log sink');
+        fs.unlinkSync(updConfig_out);
+        t.done();
+    });
+});
+
+tap.test('test writeHaproxyConfig prometheus exporter', function (t) {
+    var opts = {
+        trustedIP: '127.0.0.1',
+        untrustedIPs: ['::1'],
+        haproxy: { 'nbthread': 1 },
+        servers: {
+            'foo.joyent.us': { kind: 'webapi', address: '127.0.0.1' }
+        },
+        prometheusBind: '10.0.0.5:8405',
+        configFile: updConfig_out,
+        configTemplate: haproxy_template,
+        sslCertFile: '',
+        log: helper.createLogger()
+    };
+    lbm.writeHaproxyConfig(opts, function (err) {
+        t.equal(null, err);
+        var txt = fs.readFileSync(updConfig_out, 'utf8');
+        t.match(txt, /\nfrontend prometheus\n/, 'exporter frontend');
+        t.match(txt, /use-service prometheus-exporter if { path \/metrics }\n/,
+            'exporter service');
+        t.match(txt, /bind 10\.0\.0\.5:8405\n/, 'exporter bind');
+        fs.unlinkSync(updConfig_out);
+        t.done();
+    });
+});
+
+tap.test('test writeHaproxyConfig log sampling', function (t) {
+    var opts = {
+        trustedIP: '127.0.0.1',
+        untrustedIPs: ['::1'],
+        haproxy: {
+            'nbthread': 1,
+            'logSampling': { 'rate': 100, 'slowThreshold': 500 }
+        },
+        servers: {
+            'foo.joyent.us': { kind: 'webapi', address: '127.0.0.1' }
+        },
+        configFile: updConfig_out,
+        configTemplate: haproxy_template,
+        sslCertFile: '',
+        log: helper.createLogger()
+    };
+    lbm.writeHaproxyConfig(opts, function (err) {
+        t.equal(null, err);
+        var txt = fs.readFileSync(updConfig_out, 'utf8');
+        /* https, http_external and http_internal are all sampled */
+        t.equal(txt.split('set-var(txn.log_rate) int(100) if ' +
+            '{ status lt 400 } { var(txn.log_elapsed) -m int lt 500000 }\n')
+            .length - 1, 3, 'sampled class');
+        t.equal(txt.split('set-log-level silent if ' +
+            '{ var(txn.log_rate) -m int gt 1 } !{ rand(100) eq 0 }\n')
+            .length - 1, 3, 'sampling');
+        fs.unlinkSync(updConfig_out);
+        t.done();
+    });
+});
+
+tap.test('test log sampling validation', function (t) {
+    t.equal(null, lbm.checkLogSampling({}), 'no sampling');
+    t.equal(null, lbm.checkLogSampling({ rate: 10, slowThreshold: 1000 }),
+        'valid sampling');
+    t.ok(lbm.checkLogSampling({ rate: 0 }), 'bad rate');
+    t.ok(lbm.checkLogSampling({ slowThreshold: 0.5 }), 'bad slowThreshold');
+    t.done();
+});
+
+tap.test('test writeHaproxyConfig priority classes', function (t) {
+    var opts = {
+        trustedIP: '127.0.0.1',
+        untrustedIPs: ['::1'],
+        haproxy: {
+            'nbthread': 1,
+            'priority': {
+                'internal': -100,
+                'methods': { 'GET': -10, 'HEAD': -10 },
+                'serverMaxconn': 50,
+                'queueTimeout': 10000
+            }
+        },
+        servers: {
+            'foo.joyent.us': { kind: 'webapi', address: '127.0.0.1' }
+        },
+        configFile: updConfig_out,
+        configTemplate: haproxy_template,
+        sslCertFile: '',
+        log: helper.createLogger()
+    };
+    lbm.writeHaproxyConfig(opts, function (err) {
+        t.equal(null, err);
+        var txt = fs.readFileSync(updConfig_out, 'utf8');
+        var internal = txt.slice(txt.indexOf('frontend http_internal'));
+        internal = internal.slice(0, internal.indexOf('\n\n'));
+        t.match(internal, /\n {8}http-request set-priority-class int\(-100\)\n/,
+            'internal class');
+        t.match(internal, /set-priority-class int\(-110\) if { method GET }\n/,
+            'internal method class');
+        /* https and http_external only get the method classes */
+        t.equal(txt.split('set-priority-class int(-10) if { method HEAD }\n')
+            .length - 1, 2, 'external method class');
+        t.equal(txt.split('set-priority-class int(0)').length - 1, 0,
+            'no default class');
+        t.match(txt, / check inter 30s slowstart 10s maxconn 50\n/,
+            'server maxconn');
+        t.match(txt, /\n        timeout queue 10000ms\n/, 'queue timeout');
+        fs.unlinkSync(updConfig_out);
+        t.done();
+    });
+});
+
+tap.test('test priority validation', function (t) {
+    t.equal(null, lbm.checkPriority({}), 'no priorities');
+    t.equal(null, lbm.checkPriority({ internal: -100, external: 10,
+        methods: { GET: -5 }, serverMaxconn: 100, queueTimeout: 5000 }),
+        'valid priorities');
+    t.ok(lbm.checkPriority({ internal: 5000 }), 'class out of range');
+    t.ok(lbm.checkPriority({ external: 'high' }), 'bad class');
+    t.ok(lbm.checkPriority({ internal: -2000, methods: { GET: -100 } }),
+        'method class out of range');
+    t.ok(lbm.checkPriority({ methods: { 'get /': -1 } }), 'bad method');
+    t.ok(lbm.checkPriority({ methods: [ 'GET' ] }), 'bad methods');
+    t.ok(lbm.checkPriority({ serverMaxconn: 0 }), 'bad serverMaxconn');
+    t.done();
+});
+
+tap.test('test writeHaproxyConfig streaming backends', function (t) {
+    var opts = {
+        trustedIP: '127.0.0.1',
+        untrustedIPs: ['::1'],
+        haproxy: {
+            'nbthread': 1,
+            'streaming': {
+                'enabled': true,
+                'uploadSize': 65536,
+                'downloadPaths': [ '^/[^/]+/stor/', '^/[^/]+/public/' ],
+                'maxconn': 20
+            }
+        },
+        servers: {
+            'foo.joyent.us': { kind: 'webapi', address: '127.0.0.1' },
+            'bar.joyent.us': { kind: 'buckets-api', address: '127.0.0.2',
+                ports: [ 8081 ] }
+        },
+        configFile: updConfig_out,
+        configTemplate: haproxy_template,
+        sslCertFile: '',
+        log: helper.createLogger()
+    };
+    lbm.writeHaproxyConfig(opts, function (err) {
+        t.equal(null, err);
+        var txt = fs.readFileSync(updConfig_out, 'utf8');
+        t.match(txt, '\nbackend secure_api_stream\n        server ' +
+            'foo.joyent.us:80 127.0.0.1:80 track secure_api/foo.joyent.us:80 ' +
+            'maxconn 20\n', 'secure streaming backend');
+        t.match(txt, '\nbackend insecure_api_stream\n        server ' +
+            'foo.joyent.us:81 127.0.0.1:81 track ' +
+            'insecure_api/foo.joyent.us:81 maxconn 20\n',
+            'insecure streaming backend');
+        t.equal(txt.indexOf('bar.joyent.us:8081 127.0.0.2:8081 track'), -1,
+            'no buckets-api streaming backend');
+        t.equal(txt.split('req.hdr_val(content-length) ge 65536\n')
+            .length - 1, 3, 'upload size');
+        t.equal(txt.split('path_reg ^/[^/]+/stor/ ^/[^/]+/public/\n')
+            .length - 1, 3, 'download paths');
+        t.equal(txt.split('use_backend secure_api_stream if ').length - 1, 2,
+            'https and http_internal');
+        t.equal(txt.split('use_backend insecure_api_stream if ').length - 1,
+            1, 'http_external');
+        t.ok(txt.indexOf('use_backend buckets_api') <
+            txt.indexOf('use_backend secure_api_stream'),
+            'buckets-api first');
+        fs.unlinkSync(updConfig_out);
+        t.done();
+    });
+});
+
+tap.test('test streaming validation', function (t) {
+    t.equal(null, lbm.checkStreaming({}), 'no streaming');
+    t.equal(null, lbm.checkStreaming({ enabled: true, uploadSize: 1024,
+        downloadPaths: [ '^/[^/]+/stor/' ], maxconn: 10 }),
+        'valid streaming');
+    t.ok(lbm.checkStreaming({ uploadSize: 0 }), 'bad uploadSize');
+    t.ok(lbm.checkStreaming({ maxconn: 1.5 }), 'bad maxconn');
+    t.ok(lbm.checkStreaming({ downloadPaths: '^/stor' }), 'not an array');
+    t.ok(lbm.checkStreaming({ downloadPaths: [ '^/a b' ] }), 'whitespace');
+    t.ok(lbm.checkStreaming({ downloadPaths: [ '(' ] }), 'bad regex');
+    t.done();
+});
+
+tap.test('test writeHaproxyConfig request tracing', function (t) {
+    var opts = {
+        trustedIP: '127.0.0.1',
+        untrustedIPs: ['::1'],
+        haproxy: {
+            'nbthread': 1,
+            'tracing': { 'requestId': true, 'serverTiming': 'internal' }
+        },
+        servers: {
+            'foo.joyent.us': { kind: 'webapi', address: '127.0.0.1' }
+        },
+        configFile: updConfig_out,
+        configTemplate: haproxy_template,
+        sslCertFile: '',
+        log: helper.createLogger()
+    };
+    lbm.writeHaproxyConfig(opts, function (err) {
+        t.equal(null, err);
+        var txt = fs.readFileSync(updConfig_out, 'utf8');
+        t.match(txt, '\n        unique-id-format %{+X}o\\ %ci:%cp_%fi:%fp_' +
+            '%Ts_%rt:%pid\n', 'unique id format');
+        t.equal(txt.split('http-request set-header x-request-id ' +
+            '%[unique-id] unless { req.hdr(x-request-id) -m found }\n')
+            .length - 1, 3, 'request id on every frontend');
+        t.match(txt, 'x-request-id) -m found }\n        http-request ' +
+            'capture req.hdr(x-request-id) len 128\n',
+            'generated id is captured');
+        var timing = 'http-response add-header Server-Timing ' +
+            'lb-queue;dur=%Tw,lb-connect;dur=%Tc,backend;dur=%Tr\n';
+        t.equal(txt.split(timing).length - 1, 1,
+            'one frontend with Server-Timing');
+        t.ok(txt.indexOf(timing) > txt.indexOf('\nfrontend http_internal\n'),
+            'on http_internal');
+        fs.unlinkSync(updConfig_out);
+        t.done();
+    });
+});
+
+tap.test('test tracing validation', function (t) {
+    t.equal(null, lbm.checkTracing({}), 'no tracing');
+    t.equal(null, lbm.checkTracing({ requestId: true, serverTiming: 'all' }),
+        'valid tracing');
+    t.ok(lbm.checkTracing({ requestId: 'yes' }), 'bad requestId');
+    t.ok(lbm.checkTracing({ serverTiming: 'external' }), 'bad serverTiming');
+    t.done();
+});
+
+tap.test('test writeHaproxyConfig agent checks', function (t) {
+    var opts = {
+        trustedIP: '127.0.0.1',
+        untrustedIPs: ['::1'],
+        haproxy: {
+            'nbthread': 1,
+            'agentCheck': {
+                'webapi': { 'enabled': true, 'interval': 2000 },
+                'buckets-api': { 'enabled': true, 'port': 9000 }
+            },
+            'streaming': { 'enabled': true }
+        },
+        servers: {
+            'foo.joyent.us': { kind: 'webapi', address: '127.0.0.1',
+                agentPort: 5000 },
+            'baz.joyent.us': { kind: 'webapi', address: '127.0.0.3' },
+            'bar.joyent.us': { kind: 'buckets-api', address: '127.0.0.2',
+                ports: [ 8081 ] }
+        },
+        configFile: updConfig_out,
+        configTemplate: haproxy_template,
+        sslCertFile: '',
+        log: helper.createLogger()
+    };
+    lbm.writeHaproxyConfig(opts, function (err) {
+        t.equal(null, err);
+        var txt = fs.readFileSync(updConfig_out, 'utf8');
+        t.equal(txt.split('foo.joyent.us:80 127.0.0.1:80 check inter 30s ' +
+            'slowstart 10s weight 100 agent-check agent-port 5000 ' +
+            'agent-inter 2000ms\n').length - 1, 1, 'advertised port');
+        t.match(txt, 'foo.joyent.us:81 127.0.0.1:81 check inter 30s ' +
+            'slowstart 10s weight 100 agent-check', 'insecure_api too');
+        t.match(txt, 'baz.joyent.us:80 127.0.0.3:80 check inter 30s ' +
+            'slowstart 10s weight 100\n', 'no port, no agent, same weight');
+        t.match(txt, 'bar.joyent.us:8081 127.0.0.2:8081 check inter 30s ' +
+            'slowstart 10s weight 100 agent-check agent-port 9000 ' +
+            'agent-inter 5000ms\n', 'configured port');
+        t.match(txt, 'server foo.joyent.us:80 127.0.0.1:80 track ' +
+            'secure_api/foo.joyent.us:80 weight 100\n',
+            'streaming servers on the same weight scale');
+        t.match(txt, 'server baz.joyent.us:80 127.0.0.3:80 track ' +
+            'secure_api/baz.joyent.us:80 weight 100\n',
+            'with or without an agent');
+        fs.unlinkSync(updConfig_out);
+        t.done();
+    });
+});
+
+tap.test('test writeHaproxyConfig agent checks, mixed registrations',
+    function (t) {
+    var opts = featureOpts({
+        'agentCheck': { 'webapi': { 'enabled': true } }
+    }, {
+        servers: {
+            'foo.joyent.us': { kind: 'webapi', address: '127.0.0.1',
+                agentPort: 5000 },
+            'baz.joyent.us': { kind: 'webapi', address: '127.0.0.3' },
+            'bar.joyent.us': { kind: 'buckets-api', address: '127.0.0.2',
+                ports: [ 8081 ] }
+        }
+    });
+    lbm.writeHaproxyConfig(opts, function (err) {
+        t.equal(null, err);
+        var txt = fs.readFileSync(updConfig_out, 'utf8');
+        var weights = {};
+        txt.split('\n').forEach(function (line) {
+            var m = /^\s+server (\S+) \S+ check /.exec(line);
+            if (m === null)
+                return;
+            var w = / weight (\d+)/.exec(line);
+            weights[m[1]] = (w === null) ? null : w[1];
+        });
+        t.deepEqual(weights, {
+            'foo.joyent.us:80': '100',
+            'foo.joyent.us:81': '100',
+            'baz.joyent.us:80': '100',
+            'baz.joyent.us:81': '100',
+            'bar.joyent.us:8081': null
+        }, 'webapi servers all on the same weight scale');
+        fs.unlinkSync(updConfig_out);
+        t.done();
+    });
+});
+
+tap.test('test agent check validation', function (t) {
+    t.equal(null, lbm.checkAgentCheck({}), 'no agent checks');
+    t.equal(null, lbm.checkAgentCheck({
+        'webapi': { enabled: true, port: 5000, interval: 1000 },
+        'buckets-api': { enabled: false }
+    }), 'valid agent checks');
+    t.ok(lbm.checkAgentCheck({ 'moray': { enabled: true } }), 'bad kind');
+    t.ok(lbm.checkAgentCheck({ 'webapi': true }), 'not an object');
+    t.ok(lbm.checkAgentCheck({ 'webapi': { port: 70000 } }), 'bad port');
+    t.ok(lbm.checkAgentCheck({ 'webapi': { interval: 0 } }), 'bad interval');
+    t.done();
+});
+
+tap.test('test writeHaproxyConfig deny list', function (t) {
+    var opts = {
+        trustedIP: '127.0.0.1',
+        untrustedIPs: ['::1'],
+        haproxy: { 'nbthread': 1 },
+        servers: {
+            'foo.joyent.us': { kind: 'webapi', address: '127.0.0.1' }
+        },
+        denyMap: '/tmp/deny.map',
+        configFile: updConfig_out,
+        configTemplate: haproxy_template,
+        sslCertFile: '',
+        log: helper.createLogger()
+    };
+    lbm.writeHaproxyConfig(opts, function (err) {
+        t.equal(null, err);
+        var txt = fs.readFileSync(updConfig_out, 'utf8');
+        var reject = '        tcp-request connection reject if acl_denied\n';
+        /* https, and http on each untrusted IP */
+        t.equal(txt.split(reject).length - 1, 2, 'public frontends');
+        t.match(txt, '        acl acl_denied src,map_ip(/tmp/deny.map) ' +
+            '-m found\n', 'map lookup');
+        t.match(txt, 'track-sc1 src,map_ip(/tmp/deny.map) table deny_list ' +
+            'if acl_denied\n', 'hits counted');
+        t.match(txt, '\nbackend deny_list\n        stick-table type string',
+            'hit table');
+        t.equal(txt.split('\nfrontend http_internal\n')[1].indexOf(
+            'acl_denied'), -1, 'not internal');
+        fs.unlinkSync(updConfig_out);
+
+        delete (opts.denyMap);
+        lbm.writeHaproxyConfig(opts, function (err2) {
+            t.equal(null, err2);
+            txt = fs.readFileSync(updConfig_out, 'utf8');
+            t.equal(txt.indexOf('acl_denied'), -1, 'no deny list');
+            fs.unlinkSync(updConfig_out);
+            t.done();
+        });
+    });
+});
+
+tap.test('test writeHaproxyConfig admission control', function (t) {
+    var opts = featureOpts({}, { admissionMap: '/tmp/admission.map' });
+    lbm.writeHaproxyConfig(opts, function (err) {
+        t.equal(null, err);
+        var txt = fs.readFileSync(updConfig_out, 'utf8');
+        /* https and http_external */
+        t.equal(txt.split('        tcp-request session set-var(' +
+            'sess.adm_limit) fe_name,map_str_int(/tmp/admission.map,0)\n')
+            .length - 1, 2, 'limit lookup');
+        t.equal(txt.split('reject if { var(sess.adm_limit) -m int gt 0 } ' +
+            '{ sc2_gpc0_rate,sub(sess.adm_limit) ge 0 }\n').length - 1, 2,
+            'over the limit');
+        t.equal(txt.split('sc-inc-gpc0(2) if ').length - 1, 2,
+            'admitted sessions counted');
+        t.match(txt, '\nbackend admission\n        stick-table type string ' +
+            'len 32 size 16 expire 10s store gpc0_rate(1s)\n', 'rate table');
+        t.equal(txt.split('\nfrontend http_internal\n')[1].indexOf(
+            'adm_limit'), -1, 'not internal');
+        fs.unlinkSync(updConfig_out);
+        t.done();
+    });
+});
+
+tap.test('test writeAdmissionMap', function (t) {
+    var admissionMap = path.resolve(__dirname, 'admission.map.tmp');
+    var opts = {
+        admissionMap: admissionMap,
+        admissionLimits: 'https 0\nhttp_external 0\n',
+        log: log
+    };
+    lbm.writeAdmissionMap(opts, function (err) {
+        t.error(err, 'written');
+        t.equal(fs.readFileSync(admissionMap, 'utf8'),
+            'https 0\nhttp_external 0\n', 'unrestricted limits');
+        fs.unlinkSync(admissionMap);
+        lbm.writeAdmissionMap({ log: log }, function (err2) {
+            t.error(err2, 'nothing to write');
+            t.notOk(fs.existsSync(admissionMap), 'no map without admission');
+            t.done();
+        });
+    });
+});
+
+tap.test('test writeHaproxyConfig all features (haproxy -c)', function (t) {
+    var denyMap = path.resolve(__dirname, 'deny.map.tmp');
+    fs.writeFileSync(denyMap, '192.0.2.10 192.0.2.10\n');
+    var admissionMap = path.resolve(__dirname, 'admission.map.tmp');
+    fs.writeFileSync(admissionMap, 'https 0\nhttp_external 100\n');
+
+    var opts = featureOpts({
+        'listener': { 'backlog': 4096, 'deferAccept': true, 'maxaccept': 16 },
+        'protection': { 'httpRequestTimeout': 10000, 'connLimit': 100,
+            'connRateLimit': 300 },
+        'profiling': true,
+        'logSampling': { 'rate': 100, 'slowThreshold': 500 },
+        'priority': { 'internal': -100, 'methods': { 'GET': -10 },
+            'serverMaxconn': 50, 'queueTimeout': 10000 },
+        'streaming': { 'enabled': true, 'uploadSize': 65536,
+            'downloadPaths': [ '^/[^/]+/stor/' ], 'maxconn': 20 },
+        'tracing': { 'requestId': true, 'serverTiming': 'all' },
+        'agentCheck': { 'webapi': { 'enabled': true, 'port': 5000 } },
+        'splice': 'all',
+        'maxpipes': 1024,
+        'pipesize': 65536
+    }, {
+        servers: {
+            'foo.joyent.us': { kind: 'webapi', address: '127.0.0.1' },
+            'bar.joyent.us': { kind: 'buckets-api', address: '127.0.0.2',
+                ports: [ 8081 ] }
+        },
+        logSink: '127.0.0.1:10514',
+        prometheusBind: '127.0.0.1:8405',
+        denyMap: denyMap,
+        admissionMap: admissionMap
+    });
+
+    vasync.pipeline({ arg: opts, funcs: [
+        lbm.writeHaproxyConfig,
+        lbm.checkHaproxyConfig
+    ]}, function (err) {
+        t.equal(null, err, 'haproxy accepts the config');
+        fs.unlinkSync(updConfig_out);
+        fs.unlinkSync(denyMap);
+        fs.unlinkSync(admissionMap);
+        t.done();
+    });
+});
+
+tap.test('test protection profile validation', function (t) {
+    t.equal(null, lbm.checkProtectionProfile({}), 'empty profile');
+    t.ok(lbm.checkProtectionProfile({ connLimit: 0 }), 'bad connLimit');
+    t.ok(lbm.checkProtectionProfile({ httpRequestTimeout: '10s' }),
+        'bad timeout');
+    t.ok(lbm.checkProtectionProfile({ tableSize: 'lots' }), 'bad tableSize');
+    t.done();
+});
+
+tap.test('test splice option validation', function (t) {
+    t.equal(null, lbm.checkSpliceOptions({}), 'no splice options');
+    t.equal(null, lbm.checkSpliceOptions({ splice: 'auto', maxpipes: 1024,
+        pipesize: 65536 }), 'valid splice options');
+    t.ok(lbm.checkSpliceOptions({ splice: 'sometimes' }), 'bad splice');
+    t.ok(lbm.checkSpliceOptions({ maxpipes: -1 }), 'bad maxpipes');
+    t.ok(lbm.checkSpliceOptions({ pipesize: 100 }), 'bad pipesize');
+    t.done();
+});
+
 tap.test('test writeHaproxyConfig bad config (should error)', function (t) {
     // haproxy shouldn't like empty servers
     var opts = {
@@ -137,6 +742,7 @@ tap.test('test writeHaproxyConfig bad config (should error)', function (t) {
         configFile: updConfig_out,
         haproxyExec: haproxy_exec,
         configTemplate: haproxy_template,
+        sslCertFile: '',
         log: helper.createLogger()
     };
 
@@ -159,6 +765,7 @@ tap.test('test reload', function (t) {
         haproxyExec: haproxy_exec,
         configFile: haproxy_file,
         configTemplate: haproxy_template,
+        sslCertFile: '',
         log: helper.createLogger()
     };
 
@@ -186,6 +793,7 @@ tap.test('test reload bad config (should error)', function (t) {
         haproxyExec: haproxy_exec,
         configFile: haproxy_file,
         configTemplate: haproxy_template,
+        sslCertFile: '',
         log: helper.createLogger()
     };
 
@@ -212,6 +820,7 @@ tap.test('test dueling reloads', function (t) {
         haproxyExec: haproxy_exec,
         configFile: haproxy_file,
         configTemplate: haproxy_template,
+        sslCertFile: '',
         log: helper.createLogger()
     };
 
@@ -224,6 +833,7 @@ tap.test('test dueling reloads', function (t) {
         haproxyExec: haproxy_exec,
         configFile: haproxy_file,
         configTemplate: haproxy_template,
+        sslCertFile: '',
         log: helper.createLogger()
     };
 
@@ -0,0 +1,148 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 MNX Cloud, Inc.
+ */
+
+/*jsl:ignore*/
+'use strict';
+/*jsl:end*/
+
+const mod_bunyan = require('bunyan');
+const mod_fs = require('fs');
+const mod_os = require('os');
+const mod_path = require('path');
+const lib_denylist = require('../lib/deny_list.js');
+const lib_hasock = require('../lib/haproxy_sock.js');
+const tap = require('tap');
+
+const log = mod_bunyan.createLogger({
+    name: 'deny_list_test',
+    level: process.env['LOG_LEVEL'] || 'fatal'
+});
+
+/*
+ * Stands in for lib/haproxy_sock.js, with one map and the deny list stick
+ * table. "show map" goes through the real parser, from output in haproxy's
+ * format.
+ */
+function FakeSock() {
+    this.map = {};
+    this.table = [];
+    this.commands = [];
+}
+FakeSock.prototype.showMap = function (opts, cb) {
+    var self = this;
+    var output = Object.keys(self.map).map(function (k, i) {
+        return ('0x' + (0x55d6e9d4a1c0 + i * 0x70).toString(16) + ' ' + k +
+            ' ' + self.map[k] + '\n');
+    }).join('');
+    setImmediate(cb, null, lib_hasock.parseMap(output + '\n'));
+};
+FakeSock.prototype.addMapEntry = function (opts, cb) {
+    this.commands.push('add ' + opts.key);
+    this.map[opts.key] = opts.value;
+    setImmediate(cb);
+};
+FakeSock.prototype.delMapEntry = function (opts, cb) {
+    this.commands.push('del ' + opts.key);
+    delete (this.map[opts.key]);
+    setImmediate(cb);
+};
+FakeSock.prototype.showTable = function (opts, cb) {
+    setImmediate(cb, null, this.table);
+};
+
+tap.test('parse deny list', function (t) {
+    var res = lib_denylist.parseDenyList([
+        '# abusive clients',
+        '192.0.2.10',
+        '  198.51.100.0/24   # a whole network',
+        '',
+        '2001:db8::/32',
+        '192.0.2.10',
+        '192.0.2.300',
+        '10.0.0.0/33',
+        '10.0.0.0/8/8',
+        'example.com'
+    ].join('\n'));
+    t.deepEqual(res.entries, [ '192.0.2.10', '198.51.100.0/24',
+        '2001:db8::/32' ], 'valid entries, once each');
+    t.equal(res.errors.length, 4, 'invalid entries');
+
+    t.equal(lib_denylist.mapContents([ '192.0.2.10', '2001:db8::/32' ]),
+        '192.0.2.10 192.0.2.10\n2001:db8::/32 2001:db8::/32\n', 'map file');
+    t.done();
+});
+
+tap.test('apply deny list changes', function (t) {
+    var dir = mod_fs.mkdtempSync(mod_path.join(mod_os.tmpdir(), 'deny-'));
+    var file = mod_path.join(dir, 'deny.list');
+    var mapFile = mod_path.join(dir, 'deny.map');
+    var sock = new FakeSock();
+    sock.map = { '203.0.113.1': '203.0.113.1' };
+
+    mod_fs.writeFileSync(file, '192.0.2.10\n198.51.100.0/24\n');
+    var fsm = new lib_denylist.DenyListFSM({
+        haSock: sock,
+        log: log,
+        mapFile: mapFile,
+        config: { file: file, interval: 10 }
+    });
+
+    function onceWaiting(cb) {
+        fsm.on('stateChanged', function onState(st) {
+            if (st !== 'waiting')
+                return;
+            fsm.removeListener('stateChanged', onState);
+            cb();
+        });
+    }
+
+    onceWaiting(function () {
+        t.deepEqual(sock.commands, [ 'del 203.0.113.1', 'add 192.0.2.10',
+            'add 198.51.100.0/24' ], 'haproxy map updated');
+        t.equal(mod_fs.readFileSync(mapFile, 'utf8'),
+            '192.0.2.10 192.0.2.10\n198.51.100.0/24 198.51.100.0/24\n',
+            'map file written');
+
+        sock.commands = [];
+        onceWaiting(function () {
+            t.deepEqual(sock.commands, [], 'nothing to do the second time');
+            removed();
+        });
+    });
+
+    function removed() {
+        sock.table = [ { key: '192.0.2.10', data: { conn_cnt: 7 } } ];
+        mod_fs.unlinkSync(file);
+
+        onceWaiting(function () {
+            t.deepEqual(sock.commands, [ 'del 192.0.2.10',
+                'del 198.51.100.0/24' ], 'missing deny list is empty');
+            t.equal(mod_fs.readFileSync(mapFile, 'utf8'), '',
+                'map file emptied');
+
+            var families = fsm.collector()();
+            t.equal(families[0].metrics[0].value, 0, 'no entries');
+            t.deepEqual(families[1].metrics, [
+                { labels: { entry: '192.0.2.10' }, value: 7 }
+            ], 'hits by entry');
+            t.deepEqual(families[2].metrics, [
+                { labels: { op: 'add' }, value: 2 },
+                { labels: { op: 'del' }, value: 3 }
+            ], 'updates');
+            t.equal(families[3].metrics[0].value, 0, 'no errors');
+
+            /* Leave the FSM stuck on haproxy, so that it lets us exit. */
+            sock.showMap = function () {};
+            mod_fs.unlinkSync(mapFile);
+            mod_fs.rmdirSync(dir);
+            t.done();
+        });
+    }
+});
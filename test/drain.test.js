@@ -0,0 +1,115 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 MNX Cloud, Inc.
+ */
+
+/*jsl:ignore*/
+'use strict';
+/*jsl:end*/
+
+const mod_bunyan = require('bunyan');
+const mod_fs = require('fs');
+const mod_os = require('os');
+const mod_path = require('path');
+const lib_drain = require('../lib/drain.js');
+const helper = require('./helper.js');
+const tap = require('tap');
+
+const log = mod_bunyan.createLogger({
+    name: 'drain_test',
+    level: process.env['LOG_LEVEL'] || 'fatal'
+});
+
+tap.test('frontends to drain and their connections', function (t) {
+    const stats = [
+        { pxname: 'https', svname: 'FRONTEND', type: '0', scur: '12' },
+        { pxname: 'http_external', svname: 'FRONTEND', type: '0',
+            scur: '3' },
+        { pxname: 'http_external', svname: 'FRONTEND', type: '0',
+            scur: '1' },
+        { pxname: 'http_internal', svname: 'FRONTEND', type: '0',
+            scur: '0' },
+        { pxname: 'stats_http', svname: 'FRONTEND', type: '0', scur: '1' },
+        { pxname: 'secure_api', svname: 'BACKEND', type: '1', scur: '12' },
+        { pxname: 'https', svname: 'https-0', type: '3', scur: '12' }
+    ];
+
+    const res = lib_drain.frontendConns(stats);
+    t.deepEqual(res.frontends, [ 'https', 'http_external', 'http_internal' ],
+        'frontends, without stats_http');
+    t.equal(res.conns, 16, 'in-flight connections');
+    t.done();
+});
+
+tap.test('restart after a drain', function (t) {
+    var dir = mod_fs.mkdtempSync(mod_path.join(mod_os.tmpdir(), 'drain-'));
+    var marker = mod_path.join(dir, 'drain-withdrawn');
+    var registrar = helper.fakeRegistrar('online');
+    var disabled = [];
+
+    const stats = [
+        { pxname: 'https', svname: 'FRONTEND', type: '0', scur: '0' }
+    ];
+    const opts = {
+        haSock: {
+            disableFrontend: function (dopts, cb) {
+                disabled.push(dopts.frontend);
+                setImmediate(cb, null);
+            }
+        },
+        stats: {
+            snapshot: function (sopts, cb) {
+                setImmediate(cb, null, { stats: stats });
+            }
+        },
+        log: log,
+        config: { dnsTtl: 10, deadline: 5000, markerFile: marker }
+    };
+
+    function onceIdle(fsm, cb) {
+        fsm.on('stateChanged', function onState(st) {
+            if (st !== 'idle')
+                return;
+            fsm.removeListener('stateChanged', onState);
+            cb();
+        });
+    }
+
+    var fsm = new lib_drain.DrainFSM(opts);
+    t.notOk(fsm.isDraining(), 'not draining while restoring');
+    fsm.drain();
+    fsm.on('done', function () {
+        t.deepEqual(registrar.commands, [ 'svcadm disable' ],
+            'registration withdrawn, and nothing to restore at start');
+        t.equal(registrar.state, 'disabled', 'registrar disabled');
+        t.ok(mod_fs.existsSync(marker), 'withdrawal recorded');
+        t.deepEqual(disabled, [ 'https' ], 'frontends disabled');
+
+        /* muppet starts again, without the zone rebooting */
+        registrar.commands = [];
+        var next = new lib_drain.DrainFSM(opts);
+        onceIdle(next, function () {
+            t.deepEqual(registrar.commands, [ 'svcadm enable' ],
+                'registration restored');
+            t.equal(registrar.state, 'online', 'registrar enabled');
+            t.notOk(mod_fs.existsSync(marker), 'marker removed');
+            t.notOk(next.isDraining(), 'not draining');
+
+            /* An operator disables registrar: we leave it alone. */
+            registrar.state = 'disabled';
+            registrar.commands = [];
+            var again = new lib_drain.DrainFSM(opts);
+            onceIdle(again, function () {
+                t.deepEqual(registrar.commands, [], 'not restored');
+                registrar.restore();
+                mod_fs.rmdirSync(dir);
+                t.done();
+            });
+        });
+    });
+});
@@ -6,6 +6,7 @@
 
 /*
  * Copyright 2019 Joyent, Inc.
+ * Copyright 2026 MNX Cloud, Inc.
  */
 
 /*jsl:ignore*/
@@ -43,6 +44,27 @@ tap.test('haproxy_sock.serverStats', function (t) {
     });
 });
 
+tap.test('haproxy_sock.showInfo', function (t) {
+    haproxy_sock.showInfo({log: log}, function (err, info) {
+        t.notOk(err);
+        t.match(info.Pid, /^[0-9]+$/, 'Pid is valid');
+        t.match(info.Idle_pct, /^[0-9]+$/, 'Idle_pct is valid');
+        t.match(info.CurrConns, /^[0-9]+$/, 'CurrConns is valid');
+        t.done();
+    });
+});
+
+tap.test('haproxy_sock.infoAndStats', function (t) {
+    haproxy_sock.infoAndStats({log: log}, function (err, info, stats) {
+        t.notOk(err);
+        t.match(info.Idle_pct, /^[0-9]+$/, 'Idle_pct is valid');
+        t.ok(stats.some(function (stat) {
+            return (stat.svname === 'FRONTEND');
+        }), 'frontend stats present');
+        t.done();
+    });
+});
+
 tap.test('haproxy_sock.syncServerState 1', function (t) {
     const servers = {
         '4afa9ff4-d918-42ed-9972-9ac20b7cf869': {
@@ -196,3 +218,19 @@ function reEnableServer(t, servers) {
         });
     });
 }
+
+tap.test('haproxy_sock.parseMap and parseTable', function (t) {
+    /* As printed by haproxy 2.0 for "show map <file>". */
+    t.deepEqual(haproxy_sock.parseMap('0x55d6e9d4a1c0 192.0.2.10 ' +
+        '192.0.2.10\n0x55d6e9d4a230 2001:db8::/32 2001:db8::/32\n\n'), [
+        { key: '192.0.2.10', value: '192.0.2.10' },
+        { key: '2001:db8::/32', value: '2001:db8::/32' }
+    ], 'map entries');
+    t.deepEqual(haproxy_sock.parseMap('\n'), [], 'empty map');
+    t.deepEqual(haproxy_sock.parseTable('# table: deny_list, type: ' +
+        'string, size:102400, used:1\n0x55d6e9d4b000: key=192.0.2.10 use=0 ' +
+        'exp=86399000 conn_cnt=7\n\n'), [
+        { key: '192.0.2.10', data: { conn_cnt: 7 } }
+    ], 'table entries');
+    t.done();
+});
@@ -6,6 +6,7 @@
 
 /*
  * Copyright 2019 Joyent, Inc.
+ * Copyright 2026 MNX Cloud, Inc.
  */
 
 /*jsl:ignore*/
@@ -19,6 +20,11 @@ const path = require('path');
 
 const haproxy_exec = path.resolve(__dirname, '../build/haproxy/sbin/haproxy');
 
+/* pkgsrc openssl on SmartOS, or whatever is on the PATH elsewhere (Linux) */
+const openssl_exec = process.env.OPENSSL ||
+    (fs.existsSync('/opt/local/bin/openssl') ?
+    '/opt/local/bin/openssl' : 'openssl');
+
 const haproxy_cfgfile = path.resolve(__dirname, './haproxy.cfg.test');
 const haproxy_pidfile = '/tmp/haproxy.pid.test';
 const haproxy_pemfile = '/tmp/haproxy.test.pem';
@@ -41,7 +47,7 @@ function createLogger(name, stream) {
 
 
 function startHaproxy(cb) {
-    child_process.execFile('/opt/local/bin/openssl', [ 'req', '-x509',
+    child_process.execFile(openssl_exec, [ 'req', '-x509',
         '-nodes', '-days', '365', '-newkey', 'rsa:2048', '-keyout',
         haproxy_pemfile, '-out', haproxy_pemfile, '-subj',
         '/C=US/ST=CA/O=Joyent/OU=manta/CN=localhost' ],
@@ -77,10 +83,42 @@ function killHaproxy(cb) {
     });
 }
 
+/*
+ * Stands in for registrar's SMF service, by replacing forkexec's
+ * forkExecWait() with one that answers "svcadm enable/disable" and "svcs"
+ * from registrar.state. Every command is recorded in registrar.commands.
+ * Call registrar.restore() when done.
+ */
+function fakeRegistrar(state) {
+    const forkexec = require('forkexec');
+    const forkExecWait = forkexec.forkExecWait;
+    var registrar = {
+        state: state,
+        commands: [],
+        restore: function () {
+            forkexec.forkExecWait = forkExecWait;
+        }
+    };
+
+    forkexec.forkExecWait = function (opts, cb) {
+        var argv = opts.argv;
+        registrar.commands.push(path.basename(argv[0]) + ' ' + argv[1]);
+        if (path.basename(argv[0]) === 'svcadm') {
+            registrar.state = (argv[1] === 'enable') ? 'online' : 'disabled';
+            setImmediate(cb, null, { stdout: '', stderr: '' });
+        } else {
+            setImmediate(cb, null, { stdout: registrar.state + ' -\n',
+                stderr: '' });
+        }
+    };
+    return (registrar);
+}
+
 ///--- Exports
 
 module.exports = {
         createLogger: createLogger,
         startHaproxy: startHaproxy,
-        killHaproxy: killHaproxy
+        killHaproxy: killHaproxy,
+        fakeRegistrar: fakeRegistrar
 };
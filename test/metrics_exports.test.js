@@ -6,6 +6,7 @@
 
 /*
  * Copyright 2019 Joyent, Inc.
+ * Copyright 2026 MNX Cloud, Inc.
  */
 
 /*jsl:ignore*/
@@ -18,7 +19,9 @@ const bunyan = require('bunyan');
 
 const helper = require('./helper.js');
 const http = require('http');
+const os = require('os');
 const tap = require('tap');
+const zlib = require('zlib');
 
 var log = helper.createLogger();
 
@@ -126,3 +129,379 @@ tap.test('metrics server is producing valid metrics', function (t) {
         req.end();
     });
 });
+
+tap.test('metrics server exports process metrics', function (t) {
+    var opts = {
+        log: bunyan.createLogger({ name: 'dummy' }),
+        adminIPS: ['127.0.0.1'],
+        metricsPort: 12421,
+        haSock: lib_hasock
+    };
+
+    var me = metrics_exporter.createMetricsExporter(opts);
+    me.start(function (err1) {
+        if (err1) {
+            t.fail(err1);
+            return;
+        }
+
+        http.get({
+            host: opts.adminIPS[0],
+            port: opts.metricsPort,
+            path: '/metrics'
+        }, function (res) {
+            var body = '';
+            res.on('data', function (chunk) {
+                body += chunk;
+            });
+            res.on('end', function () {
+                me.close(function () {
+                    t.match(body, /^loadbalancer_process_idle_time_percent\{/m,
+                        'idle time exported');
+                    t.match(body,
+                        /^loadbalancer_process_current_connections\{/m,
+                        'current connections exported');
+                    t.match(body, /^loadbalancer_frontend_current_sessions\{/m,
+                        'stats still exported');
+                    t.done();
+                });
+            });
+        }).on('error', function (err2) {
+            me.close(function () { t.fail(err2); });
+        });
+    });
+});
+
+function scrape(opts, path, cb) {
+    var me = metrics_exporter.createMetricsExporter(opts);
+    me.start(function (err1) {
+        if (err1) {
+            cb(err1);
+            return;
+        }
+
+        http.get({
+            host: opts.adminIPS[0],
+            port: opts.metricsPort,
+            path: path
+        }, function (res) {
+            var body = '';
+            res.on('data', function (chunk) {
+                body += chunk;
+            });
+            res.on('end', function () {
+                me.close(function () {
+                    cb(null, body);
+                });
+            });
+        }).on('error', function (err2) {
+            me.close(function () { cb(err2); });
+        });
+    });
+}
+
+function familyNames(body) {
+    return (body.split('\n').filter(function (line) {
+        return (line.startsWith('# TYPE '));
+    }).map(function (line) {
+        return (line.split(' ')[2]);
+    }));
+}
+
+tap.test('metrics server filters families by collect[]', function (t) {
+    var opts = {
+        log: bunyan.createLogger({ name: 'dummy' }),
+        adminIPS: ['127.0.0.1'],
+        metricsPort: 12421,
+        haSock: lib_hasock
+    };
+
+    scrape(opts, '/metrics?collect[]=frontend&collect[]=process',
+        function (err, body) {
+        if (err) {
+            t.fail(err);
+            return;
+        }
+        var names = familyNames(body);
+        t.ok(names.length > 0, 'some families exported');
+        t.ok(names.every(function (name) {
+            return (/^loadbalancer_(frontend|process)_/.test(name));
+        }), 'only frontend and process families');
+        t.ok(names.indexOf('loadbalancer_frontend_current_sessions') !== -1,
+            'frontend sessions exported');
+        t.done();
+    });
+});
+
+tap.test('frontend-only scrapes skip the server rows', function (t) {
+    var calls = [];
+    var haSock = {};
+    [ 'infoAndStats', 'proxyStats', 'showInfo' ].forEach(function (name) {
+        haSock[name] = function (opts, cb) {
+            calls.push(name);
+            lib_hasock[name](opts, cb);
+        };
+    });
+    var opts = {
+        log: bunyan.createLogger({ name: 'dummy' }),
+        adminIPS: ['127.0.0.1'],
+        metricsPort: 12421,
+        haSock: haSock
+    };
+
+    scrape(opts, '/metrics?collect[]=frontend', function (err, body) {
+        t.error(err, 'scraped');
+        t.deepEqual(calls, [ 'proxyStats' ], 'frontends and backends only');
+        t.match(body, /^loadbalancer_frontend_current_sessions\{/m,
+            'frontend sessions exported');
+
+        calls = [];
+        scrape(opts, '/metrics?collect[]=backend&collect[]=process',
+            function (err2, body2) {
+            t.error(err2, 'scraped');
+            t.deepEqual(calls, [ 'proxyStats', 'showInfo' ],
+                'with show info for the process families');
+            t.match(body2, /^loadbalancer_process_current_connections\{/m,
+                'process families exported');
+
+            calls = [];
+            scrape(opts, '/metrics?collect[]=server', function (err3) {
+                t.error(err3, 'scraped');
+                t.deepEqual(calls, [ 'infoAndStats' ], 'everything');
+                t.done();
+            });
+        });
+    });
+});
+
+tap.test('metrics server applies deny list and aggregation', function (t) {
+    var opts = {
+        log: bunyan.createLogger({ name: 'dummy' }),
+        adminIPS: ['127.0.0.1'],
+        metricsPort: 12421,
+        haSock: lib_hasock,
+        metrics: {
+            deny: [ 'loadbalancer_process_*', 'loadbalancer_server_weight' ],
+            aggregateServers: true
+        }
+    };
+
+    scrape(opts, '/metrics', function (err, body) {
+        if (err) {
+            t.fail(err);
+            return;
+        }
+        var names = familyNames(body);
+        t.notOk(names.some(function (name) {
+            return (name.startsWith('loadbalancer_process_'));
+        }), 'process families denied');
+        t.equal(names.indexOf('loadbalancer_server_weight'), -1,
+            'server weight denied');
+        t.match(body, /^loadbalancer_server_up\{/m, 'server metrics exported');
+        t.notMatch(body, /^loadbalancer_server_\w+\{[^}]*address=/m,
+            'server metrics aggregated');
+        t.equal(body.split('\n').filter(function (line) {
+            return (/^loadbalancer_server_up\{.*name="secure_api"/.test(line));
+        }).length, 1, 'one series for both secure_api servers');
+        t.done();
+    });
+});
+
+tap.test('aggregate server series', function (t) {
+    var labels = [
+        { name: 'a', address: '10.0.0.1:80' },
+        { name: 'a', address: '10.0.0.2:80' },
+        { name: 'b', address: '10.0.0.3:80' }
+    ];
+    var values = [ '3', '5', '7' ];
+
+    t.deepEqual(metrics_exporter.aggregateServers(labels, values), {
+        labels: [ { name: 'a' }, { name: 'b' } ],
+        values: [ '8', '7' ]
+    }, 'summed');
+    t.deepEqual(metrics_exporter.aggregateServers(labels, values, 'max'), {
+        labels: [ { name: 'a' }, { name: 'b' } ],
+        values: [ '5', '7' ]
+    }, 'maximum');
+
+    var selected = metrics_exporter.familyFilter([ 'server' ],
+        [], [ 'loadbalancer_server_check_*' ]);
+    t.ok(selected('loadbalancer_server_up'), 'collected');
+    t.notOk(selected('loadbalancer_backend_up'), 'not collected');
+    t.notOk(selected('loadbalancer_server_check_failures_total'), 'denied');
+    t.done();
+});
+
+const PROMEX_TEXT = [
+    '# HELP haproxy_frontend_current_sessions Number of current sessions.',
+    '# TYPE haproxy_frontend_current_sessions gauge',
+    'haproxy_frontend_current_sessions{proxy="https"} 12',
+    '# TYPE haproxy_frontend_http_responses_total counter',
+    'haproxy_frontend_http_responses_total{proxy="https",code="2xx"} 40',
+    'haproxy_frontend_http_responses_total{proxy="https",code="5xx"} 2',
+    '# TYPE haproxy_server_status gauge',
+    'haproxy_server_status{proxy="secure_api",server="a:80"} 1',
+    'haproxy_server_status{proxy="secure_api",server="b:80"} 3',
+    '# TYPE haproxy_server_max_queue gauge',
+    'haproxy_server_max_queue{proxy="secure_api",server="a:80"} 4',
+    'haproxy_server_max_queue{proxy="secure_api",server="b:80"} 9',
+    '# TYPE haproxy_process_nbthread gauge',
+    'haproxy_process_nbthread 4',
+    '# TYPE haproxy_frontend_unknown_total counter',
+    'haproxy_frontend_unknown_total{proxy="https"} 1',
+    ''
+].join('\n');
+
+tap.test('translate haproxy exporter metrics', function (t) {
+    function serverAddress(svname) {
+        return ((svname === 'a:80') ? '10.0.0.1:80' : undefined);
+    }
+
+    var text = metrics_exporter.translatePromex(PROMEX_TEXT, {
+        selected: metrics_exporter.familyFilter([], [], []),
+        aggregateServers: false,
+        serverAddress: serverAddress
+    });
+    t.deepEqual(familyNames(text), [
+        'loadbalancer_frontend_current_sessions',
+        'loadbalancer_frontend_http_responses_total',
+        'loadbalancer_server_up',
+        'loadbalancer_server_max_queue',
+        'loadbalancer_process_nbthread'
+    ], 'renamed families, unknown ones left out');
+    var lines = text.split('\n');
+    var inst = 'inst_id="' + os.hostname() + '"';
+    t.ok(lines.indexOf('loadbalancer_frontend_current_sessions{' +
+        'component="frontend",' + inst + ',name="https"} 12') !== -1,
+        'frontend labels');
+    t.ok(lines.indexOf('loadbalancer_frontend_http_responses_total{' +
+        'component="frontend",' + inst + ',name="https",code="5xx"} 2') !== -1,
+        'extra labels kept');
+    t.ok(lines.indexOf('loadbalancer_server_up{component="server",' + inst +
+        ',name="secure_api",address="10.0.0.1:80"} 1') !== -1, 'up server');
+    t.ok(lines.indexOf('loadbalancer_server_up{component="server",' + inst +
+        ',name="secure_api",address="b:80"} 0') !== -1,
+        'drained server, unknown address');
+    t.ok(lines.indexOf('loadbalancer_process_nbthread{' +
+        'component="process",' + inst + '} 4') !== -1, 'process metrics');
+
+    var agg = metrics_exporter.translatePromex(PROMEX_TEXT, {
+        selected: metrics_exporter.familyFilter([ 'server' ], [], []),
+        aggregateServers: true,
+        serverAddress: serverAddress
+    });
+    t.deepEqual(familyNames(agg), [
+        'loadbalancer_server_up',
+        'loadbalancer_server_max_queue'
+    ], 'selected families');
+    t.match(agg, /^loadbalancer_server_up\{.*"secure_api"\} 1$/m,
+        'aggregated by sum');
+    t.match(agg, /^loadbalancer_server_max_queue\{.*"secure_api"\} 9$/m,
+        'aggregated by max');
+    t.done();
+});
+
+tap.test('metrics server proxies haproxy exporter', function (t) {
+    var opts = {
+        log: bunyan.createLogger({ name: 'dummy' }),
+        adminIPS: ['127.0.0.1'],
+        metricsPort: 12421,
+        haSock: lib_hasock,
+        metrics: {
+            haproxyExporter: 'proxy',
+            haproxyExporterPort: 12422
+        }
+    };
+
+    var promex = http.createServer(function (req, res) {
+        t.equal(req.url, '/metrics', 'exporter path');
+        res.end(PROMEX_TEXT);
+    });
+    promex.listen(12422, '127.0.0.1', function () {
+        var me = metrics_exporter.createMetricsExporter(opts);
+        t.equal(me.haproxyExporterAddress(), '127.0.0.1:12422',
+            'exporter address');
+        me.addCollector(function () {
+            return ([ { name: 'loadbalancer_test_total', type: 'counter',
+                desc: 'Test.', metrics: [ { labels: {}, value: 1 } ] } ]);
+        });
+        me.start(function (err1) {
+            if (err1) {
+                t.fail(err1);
+                return;
+            }
+            http.get({
+                host: opts.adminIPS[0],
+                port: opts.metricsPort,
+                path: '/metrics'
+            }, function (res) {
+                var body = '';
+                res.on('data', function (chunk) {
+                    body += chunk;
+                });
+                res.on('end', function () {
+                    me.close(function () {
+                        promex.close();
+                        t.ok(body.startsWith(PROMEX_TEXT), 'passed through');
+                        t.match(body, /^loadbalancer_test_total\{/m,
+                            'collectors appended');
+                        t.done();
+                    });
+                });
+            }).on('error', function (err2) {
+                me.close(function () { t.fail(err2); });
+            });
+        });
+    });
+});
+
+tap.test('metrics server compresses metrics', function (t) {
+    var opts = {
+        log: bunyan.createLogger({ name: 'dummy' }),
+        adminIPS: ['127.0.0.1'],
+        metricsPort: 12421,
+        haSock: lib_hasock
+    };
+
+    var me = metrics_exporter.createMetricsExporter(opts);
+    me.start(function (err1) {
+        if (err1) {
+            t.fail(err1);
+            return;
+        }
+
+        http.get({
+            host: opts.adminIPS[0],
+            port: opts.metricsPort,
+            path: '/metrics',
+            headers: { 'accept-encoding': 'gzip' }
+        }, function (res) {
+            var bufs = [];
+            res.on('data', function (chunk) {
+                bufs.push(chunk);
+            });
+            res.on('end', function () {
+                me.close(function () {
+                    t.equal(res.headers['content-encoding'], 'gzip',
+                        'gzip encoding');
+                    var body = zlib.gunzipSync(Buffer.concat(bufs));
+                    t.match(body.toString(),
+                        /^loadbalancer_frontend_current_sessions\{/m,
+                        'metrics in the body');
+                    t.done();
+                });
+            });
+        }).on('error', function (err2) {
+            me.close(function () { t.fail(err2); });
+        });
+    });
+});
+
+tap.test('gzip negotiation', function (t) {
+    t.ok(metrics_exporter.acceptsGzip('gzip, deflate'), 'gzip');
+    t.ok(metrics_exporter.acceptsGzip('deflate, GZIP;q=0.5'), 'weighted');
+    t.notOk(metrics_exporter.acceptsGzip('gzip;q=0'), 'refused');
+    t.notOk(metrics_exporter.acceptsGzip('identity'), 'not offered');
+    t.notOk(metrics_exporter.acceptsGzip(undefined), 'no header');
+    t.done();
+});
@@ -0,0 +1,58 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 MNX Cloud, Inc.
+ */
+
+/*jsl:ignore*/
+'use strict';
+/*jsl:end*/
+
+const lib_pools = require('../lib/pools.js');
+const tap = require('tap');
+
+const OUTPUT = [
+    'Dumping pools usage. Use SIGQUIT to flush them.',
+    '  - Pool buffer (16384 bytes) : 10 allocated (163840 bytes), 4 used, ' +
+        '0 failures, 1 users, @0x5c5900 [SHARED]',
+    '  - Pool stream (928 bytes) : 20 allocated (18560 bytes), 12 used, ' +
+        'needed_avg 11, 2 failures, 1 users, @0x5c5a00 [SHARED]',
+    '  - Pool filter (64 bytes) : 1 allocated (64 bytes), 0 used, ' +
+        '0 failures, 1 users, @0x5c5b00 [SHARED]',
+    'Total: 3 pools, 182464 bytes allocated, 76672 used.',
+    ''
+].join('\n');
+
+tap.test('parse show pools', function (t) {
+    const res = lib_pools.parsePools(OUTPUT);
+
+    t.equal(res.pools.length, 3, 'three pools');
+    t.deepEqual(res.pools[0], {
+        name: 'buffer',
+        size: 16384,
+        allocated: 10,
+        allocatedBytes: 163840,
+        used: 4,
+        failures: 0
+    }, 'buffer pool');
+    t.equal(res.pools[1].failures, 2, 'failures after extra fields');
+    t.equal(res.allocatedBytes, 182464, 'total allocated');
+    t.equal(res.usedBytes, 76672, 'total used');
+    t.done();
+});
+
+tap.test('only the largest pools are kept by name', function (t) {
+    const pools = lib_pools.topPools(lib_pools.parsePools(OUTPUT).pools, 1);
+
+    t.equal(pools.length, 2, 'one pool plus other');
+    t.equal(pools[0].name, 'buffer', 'largest pool');
+    t.equal(pools[1].name, 'other', 'other');
+    t.equal(pools[1].allocatedBytes, 18624, 'other allocated');
+    t.equal(pools[1].usedBytes, 11136, 'other used');
+    t.equal(pools[1].failures, 2, 'other failures');
+    t.done();
+});
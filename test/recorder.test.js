@@ -0,0 +1,125 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 MNX Cloud, Inc.
+ */
+
+/*jsl:ignore*/
+'use strict';
+/*jsl:end*/
+
+const mod_bunyan = require('bunyan');
+const mod_fs = require('fs');
+const mod_os = require('os');
+const mod_path = require('path');
+const lib_recorder = require('../lib/recorder.js');
+const tap = require('tap');
+
+const log = mod_bunyan.createLogger({
+    name: 'recorder_test',
+    level: process.env['LOG_LEVEL'] || 'fatal'
+});
+
+tap.test('ring buffer', function (t) {
+    const ring = new lib_recorder.Ring(3);
+    ring.push(1);
+    ring.push(2);
+    t.deepEqual(ring.toArray(), [ 1, 2 ], 'not yet full');
+    ring.push(3);
+    ring.push(4);
+    ring.push(5);
+    t.equal(ring.length(), 3, 'length is bounded');
+    t.deepEqual(ring.toArray(), [ 3, 4, 5 ], 'oldest first');
+    t.done();
+});
+
+tap.test('quantiles', function (t) {
+    const sorted = [ 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 ];
+    t.equal(lib_recorder.quantile(sorted, 0.5), 5, 'median');
+    t.equal(lib_recorder.quantile(sorted, 0.9), 9, '90th percentile');
+    t.equal(lib_recorder.quantile(sorted, 0.99), 10, '99th percentile');
+    t.equal(lib_recorder.quantile(sorted, 1), 10, 'max');
+    t.equal(lib_recorder.quantile([ 7 ], 0), 7, 'min of one');
+    t.ok(isNaN(lib_recorder.quantile([], 0.5)), 'empty');
+    t.done();
+});
+
+tap.test('samples and window summary', function (t) {
+    function stats(scur, qcur) {
+        return ([
+            { pxname: 'https', svname: 'FRONTEND', type: '0',
+                scur: String(scur), rate: '10', qcur: '' },
+            { pxname: 'secure_api', svname: 'BACKEND', type: '1',
+                scur: String(scur), rate: '5', qcur: String(qcur) },
+            { pxname: 'secure_api', svname: 'be1', type: '2',
+                scur: '1', rate: '1', qcur: '0' }
+        ]);
+    }
+
+    const s1 = lib_recorder.sampleFromStats(stats(10, 0), 1000);
+    t.deepEqual(s1, {
+        time: 1000,
+        frontend: { https: { scur: 10, rate: 10 } },
+        backend: { secure_api: { scur: 10, rate: 5, qcur: 0 } }
+    }, 'sample');
+
+    const samples = [
+        s1,
+        lib_recorder.sampleFromStats(stats(50, 4), 2000),
+        lib_recorder.sampleFromStats(stats(20, 1), 3000),
+        lib_recorder.sampleFromStats(stats(30, 2), 4000)
+    ];
+
+    const all = lib_recorder.windowSummary(samples, 0);
+    t.equal(all.frontend.https.scur['1'], 50, 'max sessions');
+    t.equal(all.frontend.https.scur['0.5'], 20, 'median sessions');
+    t.equal(all.backend.secure_api.qcur['1'], 4, 'max queue');
+    t.notOk(all.frontend.https.qcur, 'no frontend queue');
+
+    const recent = lib_recorder.windowSummary(samples, 2000);
+    t.equal(recent.frontend.https.scur['1'], 30, 'max within window');
+    t.equal(recent.backend.secure_api.qcur['0.5'], 1, 'median within window');
+
+    t.deepEqual(lib_recorder.windowSummary(samples, 4000), {}, 'empty window');
+    t.done();
+});
+
+tap.test('old dumps are removed', function (t) {
+    const dir = mod_fs.mkdtempSync(mod_path.join(mod_os.tmpdir(), 'rec-'));
+    mod_fs.writeFileSync(mod_path.join(dir, 'unrelated.json'), '{}');
+    const fsm = new lib_recorder.FlightRecorderFSM({
+        /* Never answers, so that no samples are taken. */
+        haSock: { proxyStats: function () {} },
+        log: log,
+        config: { dumpDir: dir, maxDumps: 2 }
+    });
+
+    var written = [];
+    function dump(n) {
+        if (n === 0) {
+            var left = mod_fs.readdirSync(dir).sort();
+            t.deepEqual(left, [ mod_path.basename(written[1]),
+                mod_path.basename(written[2]), 'unrelated.json' ],
+                'newest dumps kept');
+            left.forEach(function (name) {
+                mod_fs.unlinkSync(mod_path.join(dir, name));
+            });
+            mod_fs.rmdirSync(dir);
+            t.done();
+            return;
+        }
+        /* One dump per millisecond at most, as their names tell apart. */
+        setTimeout(function () {
+            fsm.dump({ reason: 'test' }, function (err, file) {
+                t.error(err, 'dumped');
+                written.push(file);
+                dump(n - 1);
+            });
+        }, 2);
+    }
+    dump(3);
+});
@@ -0,0 +1,183 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 MNX Cloud, Inc.
+ */
+
+/*jsl:ignore*/
+'use strict';
+/*jsl:end*/
+
+const mod_bunyan = require('bunyan');
+const mod_fs = require('fs');
+const mod_os = require('os');
+const mod_path = require('path');
+const lib_drain = require('../lib/drain.js');
+const lib_registration = require('../lib/registration.js');
+const helper = require('./helper.js');
+const tap = require('tap');
+
+const log = mod_bunyan.createLogger({
+    name: 'registration_test',
+    level: process.env['LOG_LEVEL'] || 'fatal'
+});
+
+const CFG = {
+    withdrawIdlePct: 10,
+    rejoinIdlePct: 30,
+    withdrawUtilization: 0.9,
+    rejoinUtilization: 0.7,
+    holdChecks: 3
+};
+
+function load(idle, sessions) {
+    return (lib_registration.loadFromInfo({
+        Idle_pct: String(idle),
+        CurrConns: String(sessions),
+        Maxconn: '1000'
+    }));
+}
+
+tap.test('load from show info', function (t) {
+    var l = load(80, 100);
+    t.equal(l.sessions, 100, 'sessions');
+    t.equal(l.maxconn, 1000, 'maxconn');
+    t.equal(l.utilization, 0.1, 'utilization');
+    t.equal(l.weight, 80, 'weight from idle time');
+
+    l = load(80, 950);
+    t.equal(l.weight, 5, 'weight from connections');
+
+    l = load(0, 1000);
+    t.equal(l.weight, 1, 'weight is at least 1');
+    t.done();
+});
+
+tap.test('withdraw after holdChecks overloaded checks', function (t) {
+    var st = { withdrawn: false, streak: 0 };
+
+    st = lib_registration.nextState(load(5, 100), st, CFG);
+    st = lib_registration.nextState(load(5, 100), st, CFG);
+    t.notOk(st.withdrawn, 'not withdrawn yet');
+    st = lib_registration.nextState(load(50, 100), st, CFG);
+    t.equal(st.streak, 0, 'streak reset by a good check');
+
+    st = lib_registration.nextState(load(50, 950), st, CFG);
+    st = lib_registration.nextState(load(50, 950), st, CFG);
+    st = lib_registration.nextState(load(50, 950), st, CFG);
+    t.ok(st.withdrawn, 'withdrawn on connections');
+    t.done();
+});
+
+tap.test('rejoin only once recovered past the rejoin thresholds',
+    function (t) {
+    var st = { withdrawn: true, streak: 0 };
+
+    /* Between the thresholds: neither overloaded nor recovered. */
+    for (var i = 0; i < 5; i++)
+        st = lib_registration.nextState(load(20, 100), st, CFG);
+    t.ok(st.withdrawn, 'still withdrawn');
+
+    for (i = 0; i < 3; i++)
+        st = lib_registration.nextState(load(40, 100), st, CFG);
+    t.notOk(st.withdrawn, 'rejoined');
+    t.done();
+});
+
+tap.test('pick up from registrar\'s state at startup', function (t) {
+    var parse = lib_registration.parseRegistrarState;
+    t.equal(parse('online -\n'), true, 'online');
+    t.equal(parse('offline -\n'), true, 'offline, waiting on dependencies');
+    t.equal(parse('disabled -\n'), false, 'disabled');
+    t.equal(parse('disabled online\n'), true, 'being enabled');
+    t.equal(parse('online disabled\n'), false, 'being disabled');
+    t.equal(parse(''), null, 'no output');
+
+    t.deepEqual(lib_registration.initialState(false, true),
+        { withdrawn: true, streak: 0 }, 'disabled by us: withdrawn');
+    t.deepEqual(lib_registration.initialState(true, false),
+        { withdrawn: false, streak: 0 }, 'enabled: registered');
+    t.equal(lib_registration.initialState(false, false), null,
+        'disabled by someone else: left alone');
+
+    /* A previously withdrawn instance rejoins once the load allows it. */
+    var st = lib_registration.initialState(false, true);
+    for (var i = 0; i < 3; i++)
+        st = lib_registration.nextState(load(40, 100), st, CFG);
+    t.notOk(st.withdrawn, 'rejoined');
+    t.done();
+});
+
+/*
+ * Starts a DrainFSM and a LoadReporterFSM as muppet does, with registrar
+ * disabled, and calls cb with the reporter once it has looked at registrar.
+ */
+function startup(markers, cb) {
+    var drain = new lib_drain.DrainFSM({
+        haSock: {},
+        stats: {},
+        log: log,
+        config: { markerFile: markers.drain }
+    });
+    var reporter = new lib_registration.LoadReporterFSM({
+        stats: {},
+        zk: {},
+        log: log,
+        config: { serviceName: 'lb.example.com', withdraw: true,
+            markerFile: markers.load },
+        drain: drain
+    });
+    reporter.on('stateChanged', function (st) {
+        if (st !== 'waiting')
+            return;
+        reporter.stop();
+        cb(reporter);
+    });
+}
+
+tap.test('startup with registrar disabled', function (t) {
+    var dir = mod_fs.mkdtempSync(mod_path.join(mod_os.tmpdir(), 'reg-'));
+    var markers = {
+        drain: mod_path.join(dir, 'drain-withdrawn'),
+        load: mod_path.join(dir, 'load-withdrawn')
+    };
+    var registrar = helper.fakeRegistrar('disabled');
+
+    /* A drain withdrew: it restores the registration before we look. */
+    mod_fs.writeFileSync(markers.drain, '');
+    startup(markers, function (reporter) {
+        t.deepEqual(registrar.commands, [ 'svcadm enable', 'svcs -H' ],
+            'restored by the drain, then read');
+        t.notOk(reporter.lr_state.withdrawn, 'registered');
+        t.ok(reporter.lr_managed, 'managed');
+
+        /* We withdrew for load: we'll rejoin when it allows. */
+        registrar.state = 'disabled';
+        registrar.commands = [];
+        mod_fs.writeFileSync(markers.load, '');
+        startup(markers, function (reporter2) {
+            t.deepEqual(registrar.commands, [ 'svcs -H' ], 'only read');
+            t.ok(reporter2.lr_state.withdrawn, 'withdrawn for load');
+            t.ok(reporter2.lr_managed, 'managed');
+
+            /* An operator disabled it: hands off. */
+            registrar.commands = [];
+            mod_fs.unlinkSync(markers.load);
+            startup(markers, function (reporter3) {
+                t.deepEqual(registrar.commands, [ 'svcs -H' ],
+                    'only read');
+                t.equal(registrar.state, 'disabled', 'still disabled');
+                t.notOk(reporter3.lr_state.withdrawn, 'not withdrawn');
+                t.notOk(reporter3.lr_managed, 'left alone');
+
+                registrar.restore();
+                mod_fs.rmdirSync(dir);
+                t.done();
+            });
+        });
+    });
+});
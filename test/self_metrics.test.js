@@ -0,0 +1,74 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 MNX Cloud, Inc.
+ */
+
+/*jsl:ignore*/
+'use strict';
+/*jsl:end*/
+
+const lib_self = require('../lib/self_metrics.js');
+const helper = require('./helper.js');
+const mod_events = require('events');
+const tap = require('tap');
+
+function family(families, name) {
+    return (families.filter(function (f) {
+        return (f.name === name);
+    })[0]);
+}
+
+tap.test('state times', function (t) {
+    const times = lib_self.stateTimes({ idle: 100, running: 50 },
+        'running', 1000, 1500);
+    t.deepEqual(times, { idle: 100, running: 550 }, 'current state added');
+
+    const first = lib_self.stateTimes({}, 'idle', 1000, 1200);
+    t.deepEqual(first, { idle: 200 }, 'first state');
+    t.done();
+});
+
+tap.test('collector', function (t) {
+    const sm = new lib_self.SelfMetrics({
+        log: helper.createLogger(),
+        queues: { reload: function () { return (2); } }
+    });
+
+    const fsm = new mod_events.EventEmitter();
+    fsm.getState = function () { return ('idle'); };
+    sm.trackState('TestFSM', fsm);
+    fsm.emit('stateChanged', 'running');
+    fsm.emit('stateChanged', 'idle');
+
+    sm.incr('reloads', 'ok');
+    sm.incr('reloads', 'ok');
+    sm.incr('outOfSync', 'want-enabled');
+    t.throws(function () { sm.incr('nonesuch', 'ok'); }, 'unknown counter');
+
+    const families = sm.collector()();
+    t.deepEqual(family(families,
+        'loadbalancer_muppet_reloads_total').metrics,
+        [ { labels: { result: 'ok' }, value: 2 } ], 'reloads');
+    t.deepEqual(family(families,
+        'loadbalancer_muppet_out_of_sync_servers_total').metrics,
+        [ { labels: { reason: 'want-enabled' }, value: 1 } ], 'out of sync');
+    t.deepEqual(family(families,
+        'loadbalancer_muppet_state_transitions_total').metrics, [
+        { labels: { fsm: 'TestFSM', state: 'running' }, value: 1 },
+        { labels: { fsm: 'TestFSM', state: 'idle' }, value: 1 }
+    ], 'transitions');
+    t.deepEqual(family(families,
+        'loadbalancer_muppet_current_state_seconds').metrics[0].labels,
+        { fsm: 'TestFSM', state: 'idle' }, 'current state');
+    t.deepEqual(family(families, 'loadbalancer_muppet_queue_depth').metrics,
+        [ { labels: { queue: 'reload' }, value: 2 } ], 'queue depth');
+    t.ok(family(families,
+        'loadbalancer_muppet_resident_memory_bytes').metrics[0].value > 0,
+        'rss');
+    t.done();
+});
@@ -0,0 +1,154 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 MNX Cloud, Inc.
+ */
+
+/*jsl:ignore*/
+'use strict';
+/*jsl:end*/
+
+const mod_bunyan = require('bunyan');
+const lib_srvevents = require('../lib/server_events.js');
+const tap = require('tap');
+
+const log = mod_bunyan.createLogger({
+    name: 'server_events_test',
+    level: process.env['LOG_LEVEL'] || 'fatal'
+});
+
+const HEADER = '<133>Oct 17 12:00:00 haproxy[1234]: ';
+const NOW = new Date(2026, 9, 17, 12, 0, 3).getTime();
+
+function line(msg) {
+    return (Buffer.from(HEADER + msg + '\n'));
+}
+
+function stat(svname, status, lastchg) {
+    return ({ pxname: 'secure_api', svname: svname, type: '2',
+        status: status, lastchg: String(lastchg) });
+}
+
+tap.test('parse server events', function (t) {
+    var ev = lib_srvevents.parseServerEvent(line('Server secure_api/' +
+        'be1:80 is DOWN, reason: Layer4 connection problem, info: ' +
+        '"Connection refused", check duration: 0ms. 1 active and 0 backup ' +
+        'servers left. 0 sessions active, 0 requeued, 0 remaining in queue.'),
+        NOW);
+    t.deepEqual(ev, {
+        backend: 'secure_api',
+        server: 'be1:80',
+        state: 'down',
+        time: new Date(2026, 9, 17, 12, 0, 0).getTime()
+    }, 'down');
+
+    function stateOf(msg) {
+        var res = lib_srvevents.parseServerEvent(line(msg), NOW);
+        return ((res === null) ? null : res.state);
+    }
+
+    t.equal(stateOf('Server secure_api/be1 is UP, reason: Layer4 check ' +
+        'passed, check duration: 0ms. 2 active and 0 backup servers online.'),
+        'up', 'up');
+    t.equal(stateOf('Backup Server secure_api/be2 is DOWN, reason: ' +
+        'Layer7 timeout'), 'down', 'backup server');
+    t.equal(stateOf('Server secure_api/be1 is going DOWN for maintenance. ' +
+        '1 active and 0 backup servers left.'), 'maint', 'maintenance');
+    t.equal(stateOf('Server secure_api/be1 was DOWN and now enters ' +
+        'maintenance.'), 'maint', 'down to maintenance');
+    t.equal(stateOf('Server secure_api/be1 is UP/READY (leaving forced ' +
+        'maintenance).'), 'up', 'leaving maintenance');
+    t.equal(stateOf('Server secure_api/be1 (\'be1.example.com\') is ' +
+        'UP/READY (resolves again).'), 'up', 'resolves again');
+    t.equal(stateOf('Server secure_api/be1 enters drain state.'), 'drain',
+        'drain');
+    t.equal(stateOf('Proxy secure_api started.'), null, 'not a server');
+    t.equal(stateOf('Server secure_api/be1 is stopping'), null,
+        'not a state change');
+    t.done();
+});
+
+tap.test('syslog time', function (t) {
+    t.equal(lib_srvevents.syslogTime(HEADER, NOW),
+        new Date(2026, 9, 17, 12, 0, 0).getTime(), 'this year');
+    t.equal(lib_srvevents.syslogTime('<133>Dec 31 23:59:59 haproxy[1]: ',
+        new Date(2027, 0, 1, 0, 0, 1).getTime()),
+        new Date(2026, 11, 31, 23, 59, 59).getTime(), 'last year');
+    t.equal(lib_srvevents.syslogTime('<133>Oct  7 08:00:00 haproxy[1]: ',
+        NOW), new Date(2026, 9, 7, 8, 0, 0).getTime(), 'padded day');
+    t.equal(lib_srvevents.syslogTime('Server b/s is UP', NOW), null,
+        'no header');
+    t.done();
+});
+
+tap.test('status to state', function (t) {
+    t.equal(lib_srvevents.statusState('UP'), 'up', 'up');
+    t.equal(lib_srvevents.statusState('UP 1/3'), 'up', 'going down');
+    t.equal(lib_srvevents.statusState('no check'), 'up', 'no check');
+    t.equal(lib_srvevents.statusState('DOWN'), 'down', 'down');
+    t.equal(lib_srvevents.statusState('DOWN 1/2'), 'down', 'going up');
+    t.equal(lib_srvevents.statusState('MAINT'), 'maint', 'maint');
+    t.equal(lib_srvevents.statusState('MAINT (via b/s)'), 'maint',
+        'tracked maint');
+    t.equal(lib_srvevents.statusState('DRAIN'), 'drain', 'drain');
+    t.done();
+});
+
+tap.test('transitions from events and polls', function (t) {
+    var tracker = new lib_srvevents.ServerStateTracker({ log: log });
+    var events = [];
+    tracker.on('serverEvent', function (ev) {
+        events.push(ev);
+    });
+
+    tracker.poll({ time: NOW - 5000,
+        stats: [ stat('be1', 'UP', 100), stat('be2', 'UP', 100) ] });
+    t.equal(tracker.state('secure_api', 'be1'), 'up', 'known from poll');
+
+    t.ok(tracker.message(line('Server secure_api/be1 is DOWN, reason: ' +
+        'Layer4 timeout'), NOW), 'server event');
+    t.notOk(tracker.message(line('Proxy secure_api started.'), NOW),
+        'not a server event');
+    t.equal(events.length, 1, 'one event emitted');
+    t.equal(tracker.state('secure_api', 'be1'), 'down', 'known from event');
+
+    /* Taken before the event: be1 stays down. be2 changed unseen. */
+    tracker.poll({ time: NOW - 1000,
+        stats: [ stat('be1', 'UP', 100), stat('be2', 'MAINT', 42) ] });
+    t.equal(tracker.state('secure_api', 'be1'), 'down', 'older poll ignored');
+    t.equal(tracker.state('secure_api', 'be2'), 'maint', 'missed event');
+
+    /* be2 is gone after a reload. */
+    tracker.poll({ time: NOW + 1000, stats: [ stat('be1', 'DOWN', 1) ] });
+    t.equal(tracker.state('secure_api', 'be2'), undefined, 'forgotten');
+
+    var families = tracker.collector()();
+    var transitions = families[0].metrics.filter(function (m) {
+        return (m.value > 0);
+    });
+    t.deepEqual(transitions, [
+        { labels: { backend: 'secure_api', to: 'down', source: 'event' },
+            value: 1 },
+        { labels: { backend: 'secure_api', to: 'maint', source: 'poll' },
+            value: 1 }
+    ], 'transitions counted');
+
+    var counts = families[1].metrics.filter(function (m) {
+        return (m.suffix === '_count');
+    });
+    t.deepEqual(counts, [
+        { suffix: '_count', labels: { source: 'event' }, value: 1 },
+        { suffix: '_count', labels: { source: 'poll' }, value: 1 }
+    ], 'detection times observed');
+    var sums = families[1].metrics.filter(function (m) {
+        return (m.suffix === '_sum');
+    });
+    t.equal(sums[0].value, 3, 'event detected from the syslog time');
+    t.equal(sums[1].value, 42, 'poll detected from lastchg');
+    t.equal(families[2].metrics[0].value, 1, 'events counted');
+    t.done();
+});
@@ -0,0 +1,269 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 MNX Cloud, Inc.
+ */
+
+/*jsl:ignore*/
+'use strict';
+/*jsl:end*/
+
+const mod_bunyan = require('bunyan');
+const lib_statspoller = require('../lib/stats_poller.js');
+const tap = require('tap');
+
+const log = mod_bunyan.createLogger({
+    name: 'stats_poller_test',
+    level: process.env['LOG_LEVEL'] || 'fatal'
+});
+
+const STATS = [
+    { pxname: 'https', svname: 'FRONTEND', type: '0', scur: '10' },
+    { pxname: 'secure_api', svname: 'BACKEND', type: '1', scur: '5' },
+    { pxname: 'secure_api', svname: 'be1', type: '2', scur: '3' },
+    { pxname: 'secure_api', svname: 'be2', type: '2', scur: '2' }
+];
+
+/*
+ * A stand-in for lib/haproxy_sock.js which counts the fetches, and answers
+ * them only when told to, so that we control when each one completes.
+ */
+function FakeSock() {
+    this.fetches = 0;
+    this.pending = [];
+    this.error = null;
+}
+
+FakeSock.prototype.infoAndStats = function (opts, cb) {
+    this.fetches++;
+    this.pending.push(cb);
+};
+
+/*
+ * Calls back once a fetch has started.
+ */
+FakeSock.prototype.fetching = function (cb) {
+    var self = this;
+    if (this.pending.length > 0) {
+        cb();
+        return;
+    }
+    setImmediate(function () {
+        self.fetching(cb);
+    });
+};
+
+FakeSock.prototype.reply = function () {
+    var self = this;
+    var cbs = this.pending;
+    this.pending = [];
+    cbs.forEach(function (cb) {
+        if (self.error !== null)
+            cb(self.error);
+        else
+            cb(null, { Maxconn: '100', CurrConns: String(self.fetches) },
+                STATS);
+    });
+};
+
+/*
+ * Starts a fetch that never completes, so that the poller's timer doesn't keep
+ * us from exiting.
+ */
+function hang(s) {
+    s.poller.snapshot({ maxAge: 0 }, function () {});
+}
+
+function setup(interval) {
+    var sock = new FakeSock();
+    var poller = new lib_statspoller.StatsPollerFSM({
+        haSock: sock,
+        log: log,
+        config: { interval: interval }
+    });
+    return ({ sock: sock, poller: poller });
+}
+
+tap.test('server stats', function (t) {
+    t.deepEqual(lib_statspoller.serverStats(STATS).map(function (stat) {
+        return (stat.svname);
+    }), [ 'be1', 'be2' ], 'servers only');
+    t.deepEqual(lib_statspoller.serverStats([]), [], 'empty');
+    t.done();
+});
+
+tap.test('concurrent requests share one fetch', function (t) {
+    var s = setup(60000);
+    var answers = [];
+
+    function request(maxAge) {
+        s.poller.snapshot({ maxAge: maxAge }, function (err, snap) {
+            t.error(err, 'no error');
+            answers.push(snap);
+            if (answers.length < 3)
+                return;
+            t.equal(s.sock.fetches, 1, 'one fetch');
+            t.equal(answers[0], answers[1], 'same snapshot');
+            t.equal(answers[1], answers[2], 'same snapshot');
+            t.deepEqual(answers[0].stats, STATS, 'stats');
+            t.equal(answers[0].info.CurrConns, '1', 'info');
+            hang(s);
+            t.done();
+        });
+    }
+
+    request(1000);
+    request(0);
+    request(5000);
+    s.sock.fetching(function () {
+        t.equal(s.sock.fetches, 1, 'fetch started');
+        s.sock.reply();
+    });
+});
+
+tap.test('cached and forced reads', function (t) {
+    var s = setup(60000);
+
+    s.poller.snapshot({ maxAge: 1000 }, function (err, first) {
+        t.error(err, 'no error');
+        s.poller.snapshot({ maxAge: 1000 }, function (err2, second) {
+            t.error(err2, 'no error');
+            t.equal(second, first, 'answered from the cache');
+            t.equal(s.sock.fetches, 1, 'no new fetch');
+
+            s.poller.snapshot({ maxAge: 0 }, function (err3, third) {
+                t.error(err3, 'no error');
+                t.notEqual(third, first, 'new snapshot');
+                t.equal(s.sock.fetches, 2, 'fetched again');
+                hang(s);
+                t.done();
+            });
+            s.sock.fetching(function () {
+                s.sock.reply();
+            });
+        });
+    });
+    s.sock.fetching(function () {
+        s.sock.reply();
+    });
+});
+
+tap.test('requests during a fetch wait for the next one', function (t) {
+    var s = setup(60000);
+    var first = null;
+
+    s.poller.snapshot({ maxAge: 1000 }, function (err, snap) {
+        t.error(err, 'no error');
+        first = snap;
+        s.sock.fetching(function () {
+            /* The second fetch starts as soon as the first is done. */
+            t.equal(s.sock.fetches, 2, 'fetching again');
+            s.sock.reply();
+        });
+    });
+    s.sock.fetching(function () {
+        s.poller.snapshot({ maxAge: 0 }, function (err, snap) {
+            t.error(err, 'no error');
+            t.notEqual(snap, first, 'newer snapshot');
+            t.equal(snap.info.CurrConns, '2', 'from the second fetch');
+            hang(s);
+            t.done();
+        });
+        s.sock.reply();
+    });
+});
+
+tap.test('invalidate during a fetch', function (t) {
+    var s = setup(60000);
+
+    s.poller.snapshot({ maxAge: 1000 }, function (err, snap) {
+        t.error(err, 'no error');
+        t.equal(snap.info.CurrConns, '2', 'from the second fetch');
+        hang(s);
+        t.done();
+    });
+    s.sock.fetching(function () {
+        s.poller.invalidate();
+        s.sock.reply();
+        s.sock.fetching(function () {
+            t.equal(s.sock.fetches, 2, 'fetched again');
+            s.sock.reply();
+        });
+    });
+});
+
+tap.test('invalidate', function (t) {
+    var s = setup(60000);
+
+    s.poller.snapshot({ maxAge: 60000 }, function (err, first) {
+        t.error(err, 'no error');
+        s.poller.invalidate();
+        s.poller.snapshot({ maxAge: 60000 }, function (err2, second) {
+            t.error(err2, 'no error');
+            t.notEqual(second, first, 'not answered from the cache');
+            t.equal(s.sock.fetches, 2, 'fetched again');
+            hang(s);
+            t.done();
+        });
+        s.sock.fetching(function () {
+            s.sock.reply();
+        });
+    });
+    s.sock.fetching(function () {
+        s.sock.reply();
+    });
+});
+
+tap.test('errors and scheduled fetches', function (t) {
+    var s = setup(100);
+    var stats = 0;
+
+    s.poller.on('stats', function (snap) {
+        stats++;
+    });
+
+    s.sock.error = new Error('socket went away');
+    s.poller.snapshot({ maxAge: 0 }, function (err, snap) {
+        t.ok(err, 'error passed on');
+        t.equal(snap, undefined, 'no snapshot');
+
+        s.sock.error = null;
+        setTimeout(function () {
+            t.equal(s.sock.fetches, 2, 'fetched on schedule');
+            s.sock.reply();
+            t.equal(stats, 1, 'stats emitted');
+
+            var families = s.poller.collector()();
+            var fetches = families[0].metrics;
+            t.deepEqual(fetches, [
+                { labels: { trigger: 'scheduled' }, value: 1 },
+                { labels: { trigger: 'requested' }, value: 1 }
+            ], 'fetches counted');
+            t.equal(families[2].metrics[0].value, 1, 'error counted');
+            hang(s);
+            t.done();
+        }, 150);
+    });
+    s.sock.fetching(function () {
+        s.sock.reply();
+    });
+});
+
+tap.test('scheduled fetches only with listeners', function (t) {
+    var s = setup(20);
+
+    setTimeout(function () {
+        t.equal(s.sock.fetches, 0, 'nobody listening, no fetches');
+        s.poller.on('stats', function () {});
+        s.sock.fetching(function () {
+            t.equal(s.sock.fetches, 1, 'fetched on schedule');
+            t.equal(s.poller.collector()()[0].metrics[0].value, 1,
+                'scheduled fetch counted');
+            t.done();
+        });
+    }, 100);
+});
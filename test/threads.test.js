@@ -0,0 +1,98 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 MNX Cloud, Inc.
+ */
+
+/*jsl:ignore*/
+'use strict';
+/*jsl:end*/
+
+const lib_threads = require('../lib/threads.js');
+const tap = require('tap');
+
+tap.test('parse show activity', function (t) {
+    const output = [
+        'thread_id: 1 (1..2)',
+        'date_now: 1602950000.123456',
+        'loops: 1000 2000',
+        'wake_tasks: 10 20',
+        'accepted: 5 50',
+        'avg_loop_us: 12 9',
+        ''
+    ].join('\n');
+
+    const rows = lib_threads.parseActivity(output);
+    t.deepEqual(rows.loops, [ 1000, 2000 ], 'loops');
+    t.deepEqual(rows.accepted, [ 5, 50 ], 'accepted');
+    t.notOk(rows.date_now, 'date_now dropped');
+    t.notOk(rows.thread_id, 'thread_id dropped');
+
+    const newer = lib_threads.parseActivity([
+        'thread_id: 2 (1..2)',
+        'loops: 3000 [ 1000 2000 ]',
+        ''
+    ].join('\n'));
+    t.deepEqual(newer.loops, [ 1000, 2000 ], 'bracketed per-thread values');
+    t.done();
+});
+
+tap.test('parse show threads', function (t) {
+    const output = [
+        '  Thread 1 : act=0 glob=0 wq=1 rq=0 tl=0 tlsz=0 rqsz=3',
+        '             stuck=0 prof=1 harmless=1 wantrdv=0',
+        '             cpu_ns: poll=5193418 now=5193418 diff=0',
+        '             curr_task=0',
+        '*>Thread 2 : act=1 glob=0 wq=1 rq=0 tl=1 tlsz=1 rqsz=0',
+        '             stuck=1 prof=1 harmless=0 wantrdv=0',
+        ''
+    ].join('\n');
+
+    const threads = lib_threads.parseThreads(output);
+    t.equal(threads.length, 2, 'two threads');
+    t.equal(threads[0].thread, 1, 'thread number');
+    t.equal(threads[0].rqsz, 3, 'run queue size');
+    t.equal(threads[1].tlsz, 1, 'tasklets');
+    t.equal(threads[1].stuck, 1, 'stuck');
+    t.done();
+});
+
+tap.test('parse show profiling', function (t) {
+    const old = lib_threads.parseProfiling(
+        'Per-task CPU profiling              : off      ' +
+        '# set profiling tasks {on|off}\n');
+    t.notOk(old.enabled, 'profiling off');
+    t.equal(old.tasks.length, 0, 'no tasks');
+
+    const newer = lib_threads.parseProfiling([
+        'Per-task CPU profiling              : on       ' +
+            '# set profiling tasks {on|auto|off}',
+        'Tasks activity:',
+        '  function                      calls   cpu_tot   cpu_avg   ' +
+            'lat_tot   lat_avg',
+        '  h1_io_cb                      3344170   2.113s    631.0ns   ' +
+            '18.45m    331.0us',
+        '  process_stream                1200      15.5ms    12.9us    ' +
+            '1h02m     3.1s',
+        ''
+    ].join('\n'));
+    t.ok(newer.enabled, 'profiling on');
+    t.equal(newer.tasks.length, 2, 'two tasks');
+    t.equal(newer.tasks[0].func, 'h1_io_cb', 'function');
+    t.equal(newer.tasks[0].calls, 3344170, 'calls');
+    t.equal(newer.tasks[0].cpu, 2.113, 'cpu time');
+    t.equal(newer.tasks[1].latency, 3720, 'latency');
+    t.done();
+});
+
+tap.test('parse durations', function (t) {
+    t.equal(lib_threads.parseDuration('2s'), 2, 'seconds');
+    t.equal(lib_threads.parseDuration('18m'), 1080, 'minutes');
+    t.equal(lib_threads.parseDuration('1500us'), 0.0015, 'microseconds');
+    t.ok(isNaN(lib_threads.parseDuration('-')), 'unparseable');
+    t.done();
+});
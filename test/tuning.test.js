@@ -0,0 +1,105 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+/*
+ * Copyright 2026 MNX Cloud, Inc.
+ */
+
+/*jsl:ignore*/
+'use strict';
+/*jsl:end*/
+
+const mod_child = require('child_process');
+const lib_tuning = require('../lib/tuning.js');
+const tap = require('tap');
+
+tap.test('small zone is limited by memory', function (t) {
+    const tuning = lib_tuning.computeTuning({ memoryLimitMB: 1024 });
+
+    t.equal(tuning.limitedBy, 'memory', 'limited by memory');
+    t.equal(tuning.bufsize, 16384, 'default bufsize');
+    t.equal(tuning.maxrewrite, 1024, 'default maxrewrite');
+    /* 512MB / (2 * 16k + 32k) */
+    t.equal(tuning.maxconn, 8192, 'maxconn');
+    t.equal(tuning.frontendMaxconn, 7372, 'frontend maxconn');
+    t.done();
+});
+
+tap.test('large zone gets larger buffers', function (t) {
+    const tuning = lib_tuning.computeTuning({
+        memoryLimitMB: 65536,
+        maxFiles: 1048576
+    });
+
+    t.equal(tuning.limitedBy, 'ceiling', 'limited by ceiling');
+    t.equal(tuning.bufsize, 32768, 'bufsize');
+    t.equal(tuning.maxrewrite, 2048, 'maxrewrite');
+    t.equal(tuning.maxconn, 262144, 'maxconn');
+    t.done();
+});
+
+tap.test('file descriptors limit maxconn', function (t) {
+    const tuning = lib_tuning.computeTuning({
+        memoryLimitMB: 65536,
+        maxFiles: 65536
+    });
+
+    t.equal(tuning.limitedBy, 'fds', 'limited by fds');
+    t.equal(tuning.maxconn, 32256, 'maxconn');
+    t.done();
+});
+
+tap.test('file descriptors from the open files limit', function (t) {
+    t.equal(lib_tuning.parseFileLimit('65536\n'), 65536, 'limit');
+    t.equal(lib_tuning.parseFileLimit('unlimited\n'), 525312, 'unlimited');
+    t.equal(lib_tuning.parseFileLimit(''), null, 'no output');
+
+    const tuning = lib_tuning.computeTuning({ memoryLimitMB: 1024 });
+    t.equal(tuning.maxFilesSource, 'limit', 'from the limit');
+    t.equal(tuning.maxFiles, lib_tuning.parseFileLimit(
+        mod_child.execFileSync('/bin/sh', [ '-c', 'ulimit -Hn' ],
+        { encoding: 'utf8' })), 'hard limit');
+
+    t.equal(lib_tuning.computeTuning({ memoryLimitMB: 1024,
+        maxFiles: 4096 }).maxFilesSource, 'config', 'from the config');
+    t.done();
+});
+
+tap.test('explicit settings override the model', function (t) {
+    const tuning = lib_tuning.computeTuning({
+        memoryLimitMB: 256,
+        maxconn: 65535,
+        bufsize: 32768
+    });
+
+    t.equal(tuning.limitedBy, 'config', 'limited by config');
+    t.equal(tuning.maxconn, 65535, 'maxconn');
+    t.equal(tuning.bufsize, 32768, 'bufsize');
+    t.equal(tuning.maxrewrite, 2048, 'maxrewrite');
+    t.done();
+});
+
+tap.test('maxrewrite is a whole number of bytes', function (t) {
+    var tuning = lib_tuning.computeTuning({ memoryLimitMB: 1024,
+        bufsize: 20001 });
+    t.equal(tuning.maxrewrite, 1250, 'an odd bufsize');
+
+    tuning = lib_tuning.computeTuning({ memoryLimitMB: 1024, bufsize: 1025 });
+    t.equal(tuning.maxrewrite, 512, 'a small odd bufsize');
+    t.done();
+});
+
+tap.test('tuning collector', function (t) {
+    const tuning = lib_tuning.computeTuning({ memoryLimitMB: 1024 });
+    const families = lib_tuning.tuningCollector(tuning)();
+
+    t.ok(families.length > 0, 'families returned');
+    families.forEach(function (family) {
+        t.match(family.name, /^loadbalancer_budget_/, 'name');
+        t.ok(family.metrics.length > 0, 'has metrics');
+    });
+    t.done();
+});
@@ -6,6 +6,7 @@
 
 /*
  * Copyright 2019 Joyent, Inc.
+ * Copyright 2026 MNX Cloud, Inc.
  */
 
 /*
@@ -212,7 +213,8 @@ tap.test('test buckets-api nodes', function (t) {
     });
     watcher.sw_zk.res['/p/buckets-api/c3'] = JSON.stringify({
         type: 'load_balancer', 'load_balancer': {
-            address: '127.0.0.3', ports: [ '8081', '8082' ]
+            address: '127.0.0.3', ports: [ '8081', '8082' ],
+            agentPort: 8090
         }
     });
     watcher.sw_zk.res['/p/buckets-api/c4'] = JSON.stringify({
@@ -229,6 +231,8 @@ tap.test('test buckets-api nodes', function (t) {
         t.equal(servers['c3'].kind, 'buckets-api');
         t.equal(servers['c3'].ports[0], '8081');
         t.equal(servers['c3'].ports[1], '8082');
+        t.equal(servers['c3'].agentPort, 8090);
+        t.equal(servers['c4'].agentPort, undefined);
         t.equal(servers['c4'].address, '127.0.0.4');
         t.equal(servers['c4'].kind, 'buckets-api');
         t.equal(servers['c4'].ports[0], '8081');
@@ -441,3 +445,143 @@ tap.test('test last seen removal ordering', function (t) {
         }
     ]}, function () { });
 });
+
+tap.test('server health and removal budget', function (t) {
+    const health = watch.serverHealth([
+        { svname: 'BACKEND', type: '1', status: 'UP', scur: '30' },
+        { svname: 'c1:6780', type: '2', status: 'UP', scur: '10' },
+        { svname: 'c1:6781', type: '2', status: 'UP 1/3', scur: '5' },
+        { svname: 'c2:6780', type: '2', status: 'UP', scur: '10' },
+        { svname: 'c2:6781', type: '2', status: 'DOWN', scur: '0' },
+        { svname: 'c3:6780', type: '2', status: 'MAINT', scur: '0' }
+    ]);
+    t.deepEqual(health, {
+        c1: { up: true, sessions: 15 },
+        c2: { up: false, sessions: 10 },
+        c3: { up: false, sessions: 0 }
+    }, 'health by server');
+
+    const names = [ 'c1', 'c2', 'c3', 'c4', 'c5' ];
+    const all = {};
+    names.forEach(function (name) {
+        all[name] = { up: name !== 'c5', sessions: 10 };
+    });
+    t.deepEqual(watch.removalBudget(names, all, { minHealthy: 0.5 }),
+        { healthy: 4, sessions: 40, floor: 2, allowed: 2 }, 'minHealthy');
+    t.equal(watch.removalBudget(names, all,
+        { minHealthy: 0.5, maxServerSessions: 15 }).allowed, 1,
+        'maxServerSessions');
+    t.equal(watch.removalBudget(names, all,
+        { minHealthy: 0.5, maxServerSessions: 5 }).allowed, 0,
+        'overloaded');
+
+    /* With the default minHealthy, even a small fleet makes progress. */
+    [ 2, 3, 4 ].forEach(function (n) {
+        var budget = watch.removalBudget(names.slice(0, n), all,
+            { minHealthy: 0.8 });
+        t.equal(budget.allowed, 1, n + ' up servers: remove one at a time');
+    });
+    t.equal(watch.removalBudget([ 'c1' ], all, { minHealthy: 0.8 }).allowed,
+        0, 'the last up server stays');
+    t.equal(watch.removalBudget([ 'c1' ], all, { minHealthy: 0 }).allowed,
+        1, 'unless there is no floor');
+
+    /* The floor is kept from when the hold started. */
+    t.deepEqual(watch.removalBudget(names.slice(0, 3), all,
+        { minHealthy: 0.8 }, 4),
+        { healthy: 3, sessions: 30, floor: 3, allowed: 0 }, 'base');
+    t.done();
+});
+
+tap.test('test capacity-aware removal', function (t) {
+    const removals = {};
+    const watcher = new watch.ServerWatcherFSM({
+        zk: new MockZookeeper(),
+        log: log,
+        stats: {},
+        removal: { mode: 'capacity', minHealthy: 0.5 },
+        removals: removals
+    });
+    watcher.sw_holdTime = HOLD_TIME;
+    watcher.sw_smearTime = SMEAR;
+
+    const names = [ 'c1', 'c2', 'c3', 'c4', 'c5', 'c6' ];
+    const health = {};
+    names.forEach(function (name) {
+        watcher.sw_lastServers[name] = { kind: 'webapi' };
+        watcher.sw_lastSeen[name] = Date.now() - 2 * HOLD_TIME;
+        health[name] = { up: true, sessions: 10 };
+    });
+    health.c5.up = false;
+    delete (health.c6);
+
+    /* c5 and c6 go right away, and we keep 2 of the 4 healthy servers. */
+    var servers = watcher._processRemovals({ c1: { kind: 'webapi' } },
+        health);
+    t.deepEqual(Object.keys(servers).sort(), [ 'c1', 'c4' ],
+        'held c4 for capacity');
+    t.ok(watcher.sw_nextExpiry !== null, 'will look again');
+    t.deepEqual(removals, { removed_down: 2, held_capacity: 1, removed: 2 },
+        'decisions counted');
+
+    /* Without health, we fall back to the throttle. */
+    servers = watcher._processRemovals({ c1: { kind: 'webapi' } }, null);
+    t.deepEqual(Object.keys(servers).sort(), [ 'c1', 'c4', 'c5', 'c6' ],
+        'throttled');
+    t.equal(removals.held_throttle, 3, 'throttle counted');
+
+    const families = watch.removalCollector(removals)();
+    t.equal(families[0].metrics.length, 5, 'every decision exported');
+    t.done();
+});
+
+tap.test('test capacity-aware removal by kind', function (t) {
+    const removals = {};
+    const watcher = new watch.ServerWatcherFSM({
+        zk: new MockZookeeper(),
+        log: log,
+        stats: {},
+        removal: { mode: 'capacity', minHealthy: 0.5 },
+        removals: removals
+    });
+    watcher.sw_holdTime = HOLD_TIME;
+    watcher.sw_smearTime = SMEAR;
+
+    const health = {};
+    [ 'w1', 'w2', 'w3', 'w4', 'b1', 'b2' ].forEach(function (name) {
+        watcher.sw_lastServers[name] = {
+            kind: (name[0] === 'w') ? 'webapi' : 'buckets-api'
+        };
+        watcher.sw_lastSeen[name] = Date.now() - 2 * HOLD_TIME;
+        health[name] = { up: true, sessions: 0 };
+    });
+
+    /* Every webapi server is gone from ZK: half of them stay. */
+    var servers = watcher._processRemovals({ b1: { kind: 'buckets-api' },
+        b2: { kind: 'buckets-api' } }, health);
+    t.deepEqual(Object.keys(servers).sort(), [ 'b1', 'b2', 'w3', 'w4' ],
+        'webapi floor');
+    t.deepEqual(watcher.sw_removalBase, { webapi: 4 }, 'floor base');
+
+    /* Looking again doesn't lower the floor. */
+    servers = watcher._processRemovals({ b1: { kind: 'buckets-api' },
+        b2: { kind: 'buckets-api' } }, health);
+    t.deepEqual(Object.keys(servers).sort(), [ 'b1', 'b2', 'w3', 'w4' ],
+        'webapi floor held');
+    t.equal(removals.held_capacity, 4, 'held twice');
+
+    /*
+     * Now the webapi servers we held are all that's registered. buckets-api
+     * keeps one of its own, whatever webapi has.
+     */
+    watcher.sw_lastServers = servers;
+    watcher.sw_lastSeen.b1 = watcher.sw_lastSeen.b2 = Date.now() -
+        2 * HOLD_TIME;
+    servers = watcher._processRemovals({ w3: { kind: 'webapi' },
+        w4: { kind: 'webapi' } }, health);
+    t.deepEqual(Object.keys(servers).sort(), [ 'b2', 'w3', 'w4' ],
+        'buckets-api floor');
+    t.deepEqual(watcher.sw_removalBase, { 'buckets-api': 2 },
+        'webapi floor dropped once nothing is waiting');
+    t.done();
+});